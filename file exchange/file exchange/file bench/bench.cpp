@@ -0,0 +1,531 @@
+﻿#define FILE_SERVER_NO_MAIN
+#include "../file server/server.cpp"
+
+#include <random>
+
+// Нагрузочный тест: FileServer запускается в этом же процессе на loopback, его нагружают
+// параллельные клиенты смесью операций LIST/INFO/GET/UPLOAD. Результат - пропускная
+// способность и задержки (p50/p99/p999) по каждой операции, при --json еще и файл JSON,
+// который удобно сравнивать между сборками
+
+enum BenchOperation {
+    OP_LIST,
+    OP_INFO,
+    OP_GET,
+    OP_UPLOAD,
+    OP_COUNT
+};
+
+static const char* operationNames[OP_COUNT] = { "list", "info", "get", "upload" };
+
+struct BenchOptions {
+    int clients;
+    int seconds;
+    int warmupSeconds;      // результаты первых секунд отбрасываются
+    int files;              // файлов в каталоге сервера для INFO и GET
+    int port;
+    string sizes;           // распределение размеров: размер:вес,...
+    string mix;             // доли операций: операция:вес,...
+    string jsonPath;
+    bool dedup;
+
+    BenchOptions() : clients(8), seconds(10), warmupSeconds(1), files(64), port(18888),
+        sizes("4K:60,256K:30,8M:10"), mix("list:5,info:25,get:60,upload:10"), dedup(false) {}
+};
+
+// Задержки и объем одной операции у одного клиента (сливаются после теста)
+struct OperationStats {
+    vector<long long> latenciesUs;
+    long long errors;
+    long long bytes;
+
+    OperationStats() : errors(0), bytes(0) {}
+};
+
+// Выбор по весам из строки вида "ключ:вес,ключ:вес"
+class WeightedChoice {
+private:
+    vector<pair<long long, double>> items;      // значение и накопленный вес
+    double total;
+
+public:
+    WeightedChoice() : total(0) {}
+
+    void add(long long value, double weight) {
+        total += weight;
+        items.push_back(make_pair(value, total));
+    }
+
+    bool empty() const {
+        return items.empty() || total <= 0;
+    }
+
+    long long pick(mt19937_64& random) const {
+        double point = uniform_real_distribution<double>(0, total)(random);
+        for (size_t i = 0; i < items.size(); i++) {
+            if (point < items[i].second) {
+                return items[i].first;
+            }
+        }
+        return items.back().first;
+    }
+
+    long long maxValue() const {
+        long long result = 0;
+        for (size_t i = 0; i < items.size(); i++) {
+            result = items[i].first > result ? items[i].first : result;
+        }
+        return result;
+    }
+};
+
+// Размер с суффиксом K, M или G; -1 - ошибка
+static long long parseSize(const string& text) {
+    char* end = NULL;
+    double value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || value < 0) {
+        return -1;
+    }
+    string suffix = end;
+    if (suffix == "K" || suffix == "k") {
+        value *= 1024;
+    }
+    else if (suffix == "M" || suffix == "m") {
+        value *= 1024 * 1024;
+    }
+    else if (suffix == "G" || suffix == "g") {
+        value *= 1024.0 * 1024 * 1024;
+    }
+    else if (!suffix.empty()) {
+        return -1;
+    }
+    return static_cast<long long>(value);
+}
+
+static bool parseSizes(const string& text, WeightedChoice& choice) {
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t colon = item.find(':');
+        long long size = parseSize(item.substr(0, colon));
+        double weight = colon == string::npos ? 1 : atof(item.c_str() + colon + 1);
+        if (size < 0 || weight < 0) {
+            return false;
+        }
+        choice.add(size, weight);
+    }
+    return !choice.empty();
+}
+
+static bool parseMix(const string& text, WeightedChoice& choice) {
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t colon = item.find(':');
+        string name = item.substr(0, colon);
+        double weight = colon == string::npos ? 1 : atof(item.c_str() + colon + 1);
+        int operation = 0;
+        while (operation < OP_COUNT && name != operationNames[operation]) {
+            operation++;
+        }
+        if (operation == OP_COUNT || weight < 0) {
+            return false;
+        }
+        choice.add(operation, weight);
+    }
+    return !choice.empty();
+}
+
+// Клиент теста: каждая операция - новое соединение, как у настоящего клиента
+class BenchClient {
+private:
+    int port;
+    const vector<char>& payload;        // данные для UPLOAD
+    vector<char> sink;                  // сюда читаются скачанные данные
+
+    SOCKET connectLoopback() {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<u_short>(port));
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            closesocket(sock);
+            return INVALID_SOCKET;
+        }
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+        return sock;
+    }
+
+    static bool sendAll(SOCKET sock, const char* data, size_t length) {
+        while (length > 0) {
+            int sent = send(sock, data, static_cast<int>(length < (1 << 20) ? length : (1 << 20)), 0);
+            if (sent == SOCKET_ERROR) {
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    // Ответ до закрытия соединения сервером (LIST, INFO)
+    bool readToEnd(SOCKET sock, string& response) {
+        char buffer[65536];
+        while (true) {
+            int received = recv(sock, buffer, sizeof(buffer), 0);
+            if (received == 0) {
+                return true;
+            }
+            if (received < 0) {
+                return false;
+            }
+            response.append(buffer, received);
+        }
+    }
+
+public:
+    BenchClient(int p, const vector<char>& data) : port(p), payload(data), sink(1 << 20) {}
+
+    bool list(long long& bytes) {
+        SOCKET sock = connectLoopback();
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        string command = "LIST\n";
+        string response;
+        bool ok = send(sock, command.c_str(), command.length(), 0) != SOCKET_ERROR
+            && readToEnd(sock, response) && response.find("FILES ON SERVER") == 0;
+        closesocket(sock);
+        bytes = response.length();
+        return ok;
+    }
+
+    bool info(const string& name, long long& bytes) {
+        SOCKET sock = connectLoopback();
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        string command = "INFO " + name + "\n";
+        string response;
+        bool ok = send(sock, command.c_str(), command.length(), 0) != SOCKET_ERROR
+            && readToEnd(sock, response) && !response.empty() && response.find("ERROR") != 0;
+        closesocket(sock);
+        bytes = response.length();
+        return ok;
+    }
+
+    bool get(const string& name, long long expectedSize, long long& bytes) {
+        SOCKET sock = connectLoopback();
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        string command = "GETIF - " + name + "\n";
+        SocketReader reader(sock);
+        string reply;
+        long long size = -1;
+        bool ok = send(sock, command.c_str(), command.length(), 0) != SOCKET_ERROR
+            && reader.readLine(reply) && sscanf(reply.c_str(), "OK %lld", &size) == 1 && size == expectedSize;
+        bytes = 0;
+        while (ok && bytes < size) {
+            size_t length = static_cast<size_t>(size - bytes < static_cast<long long>(sink.size()) ? size - bytes : sink.size());
+            ok = reader.readExact(sink.data(), length);
+            bytes += ok ? length : 0;
+        }
+        closesocket(sock);
+        return ok;
+    }
+
+    bool upload(const string& name, long long size, long long& bytes) {
+        SOCKET sock = connectLoopback();
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        string command = "UPLOAD " + name + "\n";
+        SocketReader reader(sock);
+        string reply;
+        bool ok = send(sock, command.c_str(), command.length(), 0) != SOCKET_ERROR
+            && reader.readLine(reply) && reply == "READY"
+            && sendAll(sock, payload.data(), static_cast<size_t>(size));
+        shutdown(sock, SD_SEND);
+
+        string confirm;
+        ok = ok && reader.readLine(confirm) && confirm == "UPLOAD_COMPLETE: " + to_string(size) + " bytes";
+        closesocket(sock);
+        bytes = ok ? size : 0;
+        return ok;
+    }
+};
+
+static string exeDirectory() {
+    char buffer[MAX_PATH];
+    GetModuleFileNameA(NULL, buffer, MAX_PATH);
+    string path = buffer;
+    size_t pos = path.find_last_of("\\/");
+    return pos == string::npos ? "." : path.substr(0, pos);
+}
+
+// Файлы для INFO и GET: создаются один раз, при повторных запусках берутся готовые
+static bool prepareFiles(const string& directory, const BenchOptions& options, const WeightedChoice& sizes,
+    const vector<char>& payload, vector<pair<string, long long>>& files) {
+    CreateDirectoryA(directory.c_str(), NULL);
+    mt19937_64 random(42);
+    for (int i = 0; i < options.files; i++) {
+        long long size = sizes.pick(random);
+        string name = "bench_" + to_string(i) + ".bin";
+        string path = directory + "\\" + name;
+
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        bool exists = GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)
+            && ((static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow) == size;
+        if (!exists) {
+            ofstream out(path, ios::binary | ios::trunc);
+            out.write(payload.data(), size);
+            if (!out) {
+                cerr << "Cannot create " << path << endl;
+                return false;
+            }
+        }
+        files.push_back(make_pair(name, size));
+    }
+    return true;
+}
+
+static long long percentile(const vector<long long>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p * sorted.size());
+    return sorted[index < sorted.size() ? index : sorted.size() - 1];
+}
+
+static void printUsage() {
+    cout << "Usage: file_bench [options]" << endl;
+    cout << "  --clients N       concurrent clients (default 8)" << endl;
+    cout << "  --seconds N       measured duration (default 10)" << endl;
+    cout << "  --warmup N        seconds discarded before measuring (default 1)" << endl;
+    cout << "  --files N         files on the server for INFO and GET (default 64)" << endl;
+    cout << "  --sizes LIST      file sizes and weights (default 4K:60,256K:30,8M:10)" << endl;
+    cout << "  --mix LIST        operation weights (default list:5,info:25,get:60,upload:10)" << endl;
+    cout << "  --port N          loopback port of the in-process server (default 18888)" << endl;
+    cout << "  --dedup           run the server with deduplicated storage" << endl;
+    cout << "  --json FILE       also write the results as JSON" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--clients" && hasValue) {
+            options.clients = atoi(argv[++i]);
+        }
+        else if (arg == "--seconds" && hasValue) {
+            options.seconds = atoi(argv[++i]);
+        }
+        else if (arg == "--warmup" && hasValue) {
+            options.warmupSeconds = atoi(argv[++i]);
+        }
+        else if (arg == "--files" && hasValue) {
+            options.files = atoi(argv[++i]);
+        }
+        else if (arg == "--sizes" && hasValue) {
+            options.sizes = argv[++i];
+        }
+        else if (arg == "--mix" && hasValue) {
+            options.mix = argv[++i];
+        }
+        else if (arg == "--port" && hasValue) {
+            options.port = atoi(argv[++i]);
+        }
+        else if (arg == "--json" && hasValue) {
+            options.jsonPath = argv[++i];
+        }
+        else if (arg == "--dedup") {
+            options.dedup = true;
+        }
+        else {
+            printUsage();
+            return arg == "-h" || arg == "--help" ? 0 : 2;
+        }
+    }
+
+    WeightedChoice sizes;
+    WeightedChoice mix;
+    if (!parseSizes(options.sizes, sizes) || !parseMix(options.mix, mix) || options.clients < 1 || options.seconds < 1
+        || options.warmupSeconds < 0 || options.files < 1 || options.port <= 0 || options.port > 65535) {
+        printUsage();
+        return 2;
+    }
+
+    // Одни и те же случайные данные для файлов и загрузок
+    vector<char> payload(static_cast<size_t>(sizes.maxValue()));
+    mt19937_64 fill(7);
+    for (size_t i = 0; i + 8 <= payload.size(); i += 8) {
+        uint64_t value = fill();
+        memcpy(payload.data() + i, &value, 8);
+    }
+
+    const string serverDirectory = "bench_files";
+    vector<pair<string, long long>> files;
+    cout << "Preparing " << options.files << " files..." << endl;
+    if (!prepareFiles(exeDirectory() + "\\" + serverDirectory, options, sizes, payload, files)) {
+        return 1;
+    }
+
+    // Сервер не удаляется: его отсоединенные потоки могут работать до конца процесса
+    FileServer* server = new FileServer(options.port, serverDirectory, options.dedup);
+    server->setQuiet(true);
+    thread serverThread(&FileServer::start, server);
+
+    BenchClient probe(options.port, payload);
+    long long probeBytes = 0;
+    bool ready = false;
+    for (int attempt = 0; attempt < 100 && !ready; attempt++) {
+        ready = probe.list(probeBytes);
+        if (!ready) {
+            Sleep(100);
+        }
+    }
+    if (!ready) {
+        cerr << "Server did not start on port " << options.port << endl;
+        server->stop();
+        serverThread.join();
+        return 1;
+    }
+
+    cout << "Running " << options.clients << " clients for " << options.seconds << " s (+"
+        << options.warmupSeconds << " s warmup)..." << endl;
+
+    auto warmupEnd = chrono::steady_clock::now() + chrono::seconds(options.warmupSeconds);
+    auto deadline = warmupEnd + chrono::seconds(options.seconds);
+    vector<vector<OperationStats>> perClient(options.clients, vector<OperationStats>(OP_COUNT));
+    vector<thread> clients;
+    for (int c = 0; c < options.clients; c++) {
+        clients.push_back(thread([&, c]() {
+            mt19937_64 random(1000 + c);
+            BenchClient client(options.port, payload);
+            vector<OperationStats>& stats = perClient[c];
+            long long uploads = 0;
+            while (true) {
+                auto start = chrono::steady_clock::now();
+                if (start >= deadline) {
+                    break;
+                }
+
+                int operation = static_cast<int>(mix.pick(random));
+                const pair<string, long long>& file = files[random() % files.size()];
+                long long bytes = 0;
+                bool ok = false;
+                if (operation == OP_LIST) {
+                    ok = client.list(bytes);
+                }
+                else if (operation == OP_INFO) {
+                    ok = client.info(file.first, bytes);
+                }
+                else if (operation == OP_GET) {
+                    ok = client.get(file.first, file.second, bytes);
+                }
+                else {
+                    // Небольшой набор имен на клиента, чтобы каталог не рос
+                    string name = "upload_" + to_string(c) + "_" + to_string(uploads++ % 4) + ".bin";
+                    ok = client.upload(name, sizes.pick(random), bytes);
+                }
+
+                auto end = chrono::steady_clock::now();
+                if (start < warmupEnd) {
+                    continue;
+                }
+                if (ok) {
+                    stats[operation].latenciesUs.push_back(chrono::duration_cast<chrono::microseconds>(end - start).count());
+                    stats[operation].bytes += bytes;
+                }
+                else {
+                    stats[operation].errors++;
+                }
+            }
+        }));
+    }
+    for (size_t c = 0; c < clients.size(); c++) {
+        clients[c].join();
+    }
+
+    server->stop();
+    serverThread.join();
+
+    // Итоги по операциям
+    double seconds = options.seconds;
+    stringstream json;
+    json << "{" << endl;
+    json << "  \"config\": {\"clients\": " << options.clients << ", \"seconds\": " << options.seconds
+        << ", \"warmup\": " << options.warmupSeconds << ", \"files\": " << options.files
+        << ", \"sizes\": \"" << options.sizes << "\", \"mix\": \"" << options.mix << "\", \"dedup\": "
+        << (options.dedup ? "true" : "false") << "}," << endl;
+    json << "  \"operations\": {";
+
+    cout << endl << left << setw(8) << "op" << right << setw(9) << "count" << setw(8) << "errors" << setw(10) << "ops/s"
+        << setw(10) << "MB/s" << setw(10) << "p50 ms" << setw(10) << "p99 ms" << setw(10) << "p999 ms" << setw(10) << "max ms" << endl;
+
+    long long totalCount = 0;
+    long long totalErrors = 0;
+    long long totalBytes = 0;
+    bool first = true;
+    for (int operation = 0; operation < OP_COUNT; operation++) {
+        OperationStats merged;
+        for (int c = 0; c < options.clients; c++) {
+            const OperationStats& stats = perClient[c][operation];
+            merged.latenciesUs.insert(merged.latenciesUs.end(), stats.latenciesUs.begin(), stats.latenciesUs.end());
+            merged.errors += stats.errors;
+            merged.bytes += stats.bytes;
+        }
+        if (merged.latenciesUs.empty() && merged.errors == 0) {
+            continue;
+        }
+        sort(merged.latenciesUs.begin(), merged.latenciesUs.end());
+
+        long long count = static_cast<long long>(merged.latenciesUs.size());
+        double opsPerSecond = count / seconds;
+        double mbPerSecond = merged.bytes / 1048576.0 / seconds;
+        double p50 = percentile(merged.latenciesUs, 0.50) / 1000.0;
+        double p99 = percentile(merged.latenciesUs, 0.99) / 1000.0;
+        double p999 = percentile(merged.latenciesUs, 0.999) / 1000.0;
+        double maxMs = merged.latenciesUs.empty() ? 0 : merged.latenciesUs.back() / 1000.0;
+        totalCount += count;
+        totalErrors += merged.errors;
+        totalBytes += merged.bytes;
+
+        cout << left << setw(8) << operationNames[operation] << right << setw(9) << count << setw(8) << merged.errors
+            << fixed << setprecision(1) << setw(10) << opsPerSecond << setw(10) << mbPerSecond
+            << setprecision(2) << setw(10) << p50 << setw(10) << p99 << setw(10) << p999 << setw(10) << maxMs << endl;
+
+        json << (first ? "" : ",") << endl << "    \"" << operationNames[operation] << "\": {\"count\": " << count
+            << ", \"errors\": " << merged.errors << fixed << setprecision(3) << ", \"ops_per_sec\": " << opsPerSecond
+            << ", \"mb_per_sec\": " << mbPerSecond << ", \"p50_ms\": " << p50 << ", \"p99_ms\": " << p99
+            << ", \"p999_ms\": " << p999 << ", \"max_ms\": " << maxMs << "}";
+        first = false;
+    }
+    json << endl << "  }," << endl;
+    json << "  \"total\": {\"count\": " << totalCount << ", \"errors\": " << totalErrors << fixed << setprecision(3)
+        << ", \"ops_per_sec\": " << totalCount / seconds << ", \"mb_per_sec\": " << totalBytes / 1048576.0 / seconds << "}" << endl;
+    json << "}" << endl;
+
+    cout << left << setw(8) << "total" << right << setw(9) << totalCount << setw(8) << totalErrors << fixed << setprecision(1)
+        << setw(10) << totalCount / seconds << setw(10) << totalBytes / 1048576.0 / seconds << endl;
+
+    if (!options.jsonPath.empty()) {
+        ofstream out(options.jsonPath, ios::trunc);
+        out << json.str();
+        if (!out) {
+            cerr << "Cannot write " << options.jsonPath << endl;
+            return 1;
+        }
+        cout << "Results written to " << options.jsonPath << endl;
+    }
+    return totalErrors == 0 ? 0 : 1;
+}
@@ -10,752 +10,5234 @@
 #include <iomanip>
 #include <sstream>
 #include <chrono>
+#include <ctime>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define BLAKE3_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 #pragma comment(lib, "ws2_32.lib")
 
-class FileClient {
-private:
-    string serverIP;
-    int port;
-
+// BLAKE3 (режим хеширования, 256 бит). Полные чанки хешируются по 4 штуки за раз
+// через SSE2, дерево собирается из поддеревьев, которые можно считать параллельно.
+class Blake3 {
 public:
-    FileClient(const string& ip, int p) : serverIP(ip), port(p) {
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            cerr << "WSAStartup failed: " << WSAGetLastError() << endl;
-            return;
-        }
+    static const size_t CHUNK_LEN = 1024;
+    static const size_t BLOCK_LEN = 64;
+    static const size_t OUT_LEN = 32;
+
+    enum Flags {
+        CHUNK_START = 1,
+        CHUNK_END = 2,
+        PARENT = 4,
+        ROOT = 8
+    };
+
+    struct Output {
+        uint32_t cv[8];
+        uint32_t block[16];
+        uint32_t blockLen;
+        uint64_t counter;
+        uint32_t flags;
+    };
+
+    static const uint32_t* iv() {
+        static const uint32_t IV[8] = {
+            0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+            0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+        };
+        return IV;
     }
 
-    ~FileClient() {
-        WSACleanup();
+    static const uint8_t* schedule(size_t round) {
+        static const uint8_t SCHEDULE[7][16] = {
+            { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+            { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+            { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+            { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+            { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+            { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+            { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+        };
+        return SCHEDULE[round];
     }
 
-    SOCKET createConnection(int timeoutMs = 2000) {
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock == INVALID_SOCKET) {
-            cerr << "Socket creation failed: " << WSAGetLastError() << endl;
-            return INVALID_SOCKET;
-        }
-
-        sockaddr_in serverAddr;
-        memset(&serverAddr, 0, sizeof(serverAddr));
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(static_cast<u_short>(port));
-
-        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
-            hostent* host = gethostbyname(serverIP.c_str());
-            if (host == NULL) {
-                cerr << "Cannot resolve server address: " << serverIP << endl;
-                closesocket(sock);
-                return INVALID_SOCKET;
-            }
-            serverAddr.sin_addr.s_addr = *((unsigned long*)host->h_addr);
-        }
-
-        DWORD timeout = timeoutMs;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
-
-        if (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            cerr << "Connection failed: " << WSAGetLastError() << endl;
-            closesocket(sock);
-            return INVALID_SOCKET;
-        }
-
-        return sock;
+    static uint32_t load32(const uint8_t* p) {
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+            | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
     }
 
-    void printSeparator(int length = 50) {
-        cout << string(length, '=') << endl;
+    static void store32(uint8_t* p, uint32_t w) {
+        p[0] = static_cast<uint8_t>(w);
+        p[1] = static_cast<uint8_t>(w >> 8);
+        p[2] = static_cast<uint8_t>(w >> 16);
+        p[3] = static_cast<uint8_t>(w >> 24);
     }
 
-    void printLine(int length = 50) {
-        cout << string(length, '-') << endl;
+    static uint32_t rotr(uint32_t w, int c) {
+        return (w >> c) | (w << (32 - c));
     }
 
-    void printHeader(const string& title) {
-        cout << endl;
-        printSeparator();
-        cout << "  " << title << endl;
-        printSeparator();
+    static void g(uint32_t* s, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+        s[a] = s[a] + s[b] + x;
+        s[d] = rotr(s[d] ^ s[a], 16);
+        s[c] = s[c] + s[d];
+        s[b] = rotr(s[b] ^ s[c], 12);
+        s[a] = s[a] + s[b] + y;
+        s[d] = rotr(s[d] ^ s[a], 8);
+        s[c] = s[c] + s[d];
+        s[b] = rotr(s[b] ^ s[c], 7);
     }
 
-    string formatFileSize(long long bytes) {
-        const char* sizes[] = { "B", "KB", "MB", "GB", "TB" };
-        int i = 0;
-        double dblBytes = static_cast<double>(bytes);
+    static void compress(const uint32_t cv[8], const uint32_t m[16], uint32_t blockLen,
+        uint64_t counter, uint32_t flags, uint32_t out[16]) {
+        const uint32_t* IV = iv();
+        uint32_t s[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            IV[0], IV[1], IV[2], IV[3],
+            static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), blockLen, flags
+        };
+
+        for (size_t r = 0; r < 7; r++) {
+            const uint8_t* sc = schedule(r);
+            g(s, 0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+            g(s, 1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+            g(s, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+            g(s, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+            g(s, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+            g(s, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+            g(s, 2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+            g(s, 3, 4, 9, 14, m[sc[14]], m[sc[15]]);
+        }
 
-        while (dblBytes >= 1024 && i < 4) {
-            dblBytes /= 1024;
-            i++;
+        for (int i = 0; i < 8; i++) {
+            out[i] = s[i] ^ s[i + 8];
+            out[i + 8] = s[i + 8] ^ cv[i];
         }
+    }
 
-        char buffer[32];
-        if (i == 0) {
-            sprintf(buffer, "%lld %s", bytes, sizes[i]);
+    static void loadBlock(const uint8_t* p, size_t len, uint32_t m[16]) {
+        uint8_t padded[BLOCK_LEN];
+        if (len < BLOCK_LEN) {
+            memset(padded, 0, sizeof(padded));
+            if (len > 0) {
+                memcpy(padded, p, len);
+            }
+            p = padded;
         }
-        else {
-            sprintf(buffer, "%.2f %s", dblBytes, sizes[i]);
+        for (int i = 0; i < 16; i++) {
+            m[i] = load32(p + i * 4);
         }
-        return string(buffer);
     }
 
-    void showLocalFiles() {
-        char currentDir[MAX_PATH];
-        GetCurrentDirectoryA(MAX_PATH, currentDir);
+    // Один чанк (до 1024 байт): все блоки кроме последнего сжимаются сразу,
+    // последний остается в Output - из него получается либо CV, либо корень
+    static Output chunkOutput(const uint8_t* input, size_t len, uint64_t counter) {
+        Output o;
+        memcpy(o.cv, iv(), sizeof(o.cv));
+        size_t blocks = len == 0 ? 1 : (len + BLOCK_LEN - 1) / BLOCK_LEN;
+
+        uint32_t m[16];
+        uint32_t out[16];
+        for (size_t b = 0; b + 1 < blocks; b++) {
+            loadBlock(input + b * BLOCK_LEN, BLOCK_LEN, m);
+            compress(o.cv, m, BLOCK_LEN, counter, b == 0 ? CHUNK_START : 0, out);
+            memcpy(o.cv, out, sizeof(o.cv));
+        }
 
-        printHeader("LOCAL FILES");
-        cout << "Directory: " << currentDir << endl;
-        printLine();
+        size_t lastLen = len - (blocks - 1) * BLOCK_LEN;
+        loadBlock(input + (blocks - 1) * BLOCK_LEN, lastLen, o.block);
+        o.blockLen = static_cast<uint32_t>(lastLen);
+        o.counter = counter;
+        o.flags = (blocks == 1 ? CHUNK_START : 0) | CHUNK_END;
+        return o;
+    }
 
-        WIN32_FIND_DATAA findFileData;
-        HANDLE hFind = FindFirstFileA((string(currentDir) + "\\*").c_str(), &findFileData);
+    static Output parentOutput(const uint32_t left[8], const uint32_t right[8]) {
+        Output o;
+        memcpy(o.cv, iv(), sizeof(o.cv));
+        memcpy(o.block, left, 8 * sizeof(uint32_t));
+        memcpy(o.block + 8, right, 8 * sizeof(uint32_t));
+        o.blockLen = BLOCK_LEN;
+        o.counter = 0;
+        o.flags = PARENT;
+        return o;
+    }
 
-        if (hFind != INVALID_HANDLE_VALUE) {
-            int fileCount = 0;
-            long long totalSize = 0;
-            vector<pair<string, long long>> files;
+    static void outputCv(const Output& o, uint32_t cv[8]) {
+        uint32_t out[16];
+        compress(o.cv, o.block, o.blockLen, o.counter, o.flags, out);
+        memcpy(cv, out, 8 * sizeof(uint32_t));
+    }
 
-            do {
-                if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                    string filename = findFileData.cFileName;
-                    long long filesize = (static_cast<long long>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
-                    files.push_back(make_pair(filename, filesize));
-                    fileCount++;
-                    totalSize += filesize;
-                }
-            } while (FindNextFileA(hFind, &findFileData) != 0);
+    static void outputRoot(const Output& o, uint8_t digest[OUT_LEN]) {
+        uint32_t out[16];
+        compress(o.cv, o.block, o.blockLen, 0, o.flags | ROOT, out);
+        for (int i = 0; i < 8; i++) {
+            store32(digest + i * 4, out[i]);
+        }
+    }
 
-            FindClose(hFind);
+#ifdef BLAKE3_USE_SSE2
+    static __m128i rot16(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 16), _mm_slli_epi32(x, 16)); }
+    static __m128i rot12(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 20)); }
+    static __m128i rot8(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24)); }
+    static __m128i rot7(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 25)); }
+
+    static void g4(__m128i* v, int a, int b, int c, int d, __m128i x, __m128i y) {
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+        v[d] = rot16(_mm_xor_si128(v[d], v[a]));
+        v[c] = _mm_add_epi32(v[c], v[d]);
+        v[b] = rot12(_mm_xor_si128(v[b], v[c]));
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+        v[d] = rot8(_mm_xor_si128(v[d], v[a]));
+        v[c] = _mm_add_epi32(v[c], v[d]);
+        v[b] = rot7(_mm_xor_si128(v[b], v[c]));
+    }
 
-            sort(files.begin(), files.end());
+    static void transpose4(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+        __m128i ab01 = _mm_unpacklo_epi32(a, b);
+        __m128i ab23 = _mm_unpackhi_epi32(a, b);
+        __m128i cd01 = _mm_unpacklo_epi32(c, d);
+        __m128i cd23 = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(ab01, cd01);
+        b = _mm_unpackhi_epi64(ab01, cd01);
+        c = _mm_unpacklo_epi64(ab23, cd23);
+        d = _mm_unpackhi_epi64(ab23, cd23);
+    }
 
-            if (fileCount > 0) {
-                cout << "Total files: " << fileCount << " | Total size: " << formatFileSize(totalSize) << endl;
-                printLine();
+    // Четыре полных соседних чанка параллельно - по одному в каждой дорожке SSE2
+    static void hash4Chunks(const uint8_t* input, uint64_t counter, uint32_t* cvs) {
+        const uint32_t* IV = iv();
+        __m128i h[8];
+        for (int i = 0; i < 8; i++) {
+            h[i] = _mm_set1_epi32(static_cast<int>(IV[i]));
+        }
 
-                for (int i = 0; i < files.size(); i++) {
-                    string filename = files[i].first;
-                    long long filesize = files[i].second;
+        const __m128i counterLo = _mm_set_epi32(
+            static_cast<int>(static_cast<uint32_t>(counter + 3)), static_cast<int>(static_cast<uint32_t>(counter + 2)),
+            static_cast<int>(static_cast<uint32_t>(counter + 1)), static_cast<int>(static_cast<uint32_t>(counter)));
+        const __m128i counterHi = _mm_set_epi32(
+            static_cast<int>(static_cast<uint32_t>((counter + 3) >> 32)), static_cast<int>(static_cast<uint32_t>((counter + 2) >> 32)),
+            static_cast<int>(static_cast<uint32_t>((counter + 1) >> 32)), static_cast<int>(static_cast<uint32_t>(counter >> 32)));
+
+        for (size_t b = 0; b < CHUNK_LEN / BLOCK_LEN; b++) {
+            __m128i m[16];
+            for (int q = 0; q < 4; q++) {
+                const uint8_t* base = input + b * BLOCK_LEN + q * 16;
+                m[q * 4 + 0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base));
+                m[q * 4 + 1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + CHUNK_LEN));
+                m[q * 4 + 2] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + 2 * CHUNK_LEN));
+                m[q * 4 + 3] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + 3 * CHUNK_LEN));
+                transpose4(m[q * 4 + 0], m[q * 4 + 1], m[q * 4 + 2], m[q * 4 + 3]);
+            }
 
-                    cout << setw(3) << (i + 1) << ". "
-                        << setw(35) << left << filename
-                        << " (" << formatFileSize(filesize) << ")" << endl;
-                }
+            uint32_t flags = (b == 0 ? CHUNK_START : 0) | (b == CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+            __m128i v[16] = {
+                h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                _mm_set1_epi32(static_cast<int>(IV[0])), _mm_set1_epi32(static_cast<int>(IV[1])),
+                _mm_set1_epi32(static_cast<int>(IV[2])), _mm_set1_epi32(static_cast<int>(IV[3])),
+                counterLo, counterHi, _mm_set1_epi32(static_cast<int>(BLOCK_LEN)), _mm_set1_epi32(static_cast<int>(flags))
+            };
+
+            for (size_t r = 0; r < 7; r++) {
+                const uint8_t* sc = schedule(r);
+                g4(v, 0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+                g4(v, 1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+                g4(v, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+                g4(v, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+                g4(v, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+                g4(v, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+                g4(v, 2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+                g4(v, 3, 4, 9, 14, m[sc[14]], m[sc[15]]);
             }
-            else {
-                cout << "No files found." << endl;
+
+            for (int i = 0; i < 8; i++) {
+                h[i] = _mm_xor_si128(v[i], v[i + 8]);
             }
         }
-        else {
-            cerr << "Error reading directory." << endl;
-        }
 
-        printLine();
+        for (int i = 0; i < 8; i++) {
+            uint32_t lanes[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), h[i]);
+            for (int lane = 0; lane < 4; lane++) {
+                cvs[lane * 8 + i] = lanes[lane];
+            }
+        }
+    }
+#endif
+
+    // CV каждого чанка диапазона (len > 0), по 8 слов на чанк
+    static void chunkCvs(const uint8_t* input, size_t len, uint64_t counter, vector<uint32_t>& cvs) {
+        size_t chunks = (len + CHUNK_LEN - 1) / CHUNK_LEN;
+        cvs.resize(chunks * 8);
+
+        size_t i = 0;
+#ifdef BLAKE3_USE_SSE2
+        size_t fullChunks = len / CHUNK_LEN;
+        for (; i + 4 <= fullChunks; i += 4) {
+            hash4Chunks(input + i * CHUNK_LEN, counter + i, &cvs[i * 8]);
+        }
+#endif
+        for (; i < chunks; i++) {
+            size_t remaining = len - i * CHUNK_LEN;
+            size_t chunkLen = remaining < CHUNK_LEN ? remaining : CHUNK_LEN;
+            outputCv(chunkOutput(input + i * CHUNK_LEN, chunkLen, counter + i), &cvs[i * 8]);
+        }
     }
 
-    void requestFileList() {
-        printHeader("SERVER FILE LIST");
-
-        auto totalStartTime = chrono::steady_clock::now();
-
-        SOCKET sock = createConnection(1000);
-        if (sock == INVALID_SOCKET) {
-            cerr << "Cannot connect to server" << endl;
-            return;
+    static size_t largestPowerOfTwoBelow(size_t n) {
+        size_t p = 1;
+        while (p * 2 < n) {
+            p *= 2;
         }
+        return p;
+    }
 
-        DWORD readTimeout = 2000;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&readTimeout, sizeof(readTimeout));
+    // Левое поддерево всегда полное (степень двойки листьев), как в спецификации
+    static Output mergeOutput(const uint32_t* cvs, size_t count) {
+        size_t left = largestPowerOfTwoBelow(count);
+        uint32_t leftCv[8];
+        uint32_t rightCv[8];
+        mergeCvs(cvs, left, leftCv);
+        mergeCvs(cvs + left * 8, count - left, rightCv);
+        return parentOutput(leftCv, rightCv);
+    }
 
-        string command = "LIST\n";
-        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
-            cerr << "Failed to send command" << endl;
-            closesocket(sock);
+    static void mergeCvs(const uint32_t* cvs, size_t count, uint32_t out[8]) {
+        if (count == 1) {
+            memcpy(out, cvs, 8 * sizeof(uint32_t));
             return;
         }
+        outputCv(mergeOutput(cvs, count), out);
+    }
 
-        cout << "Receiving file list..." << endl;
+    // CV поддерева, начинающегося с чанка counter (len > 0)
+    static void subtreeCv(const uint8_t* input, size_t len, uint64_t counter, uint32_t out[8]) {
+        vector<uint32_t> cvs;
+        chunkCvs(input, len, counter, cvs);
+        mergeCvs(cvs.data(), cvs.size() / 8, out);
+    }
 
-        string response;
-        char buffer[8192];
-        int bytesReceived;
+    // Корневой хеш набора CV поддеревьев, перечисленных слева направо
+    static void rootFromCvs(const uint32_t* cvs, size_t count, uint8_t digest[OUT_LEN]) {
+        outputRoot(mergeOutput(cvs, count), digest);
+    }
 
-        while (true) {
-            bytesReceived = recv(sock, buffer, sizeof(buffer) - 1, 0);
-            if (bytesReceived > 0) {
-                buffer[bytesReceived] = '\0';
-                response.append(buffer, bytesReceived);
-            }
-            else if (bytesReceived == 0) {
-                break;
-            }
-            else {
-                break;
-            }
+    static void hashBuffer(const uint8_t* input, size_t len, uint8_t digest[OUT_LEN]) {
+        if (len <= CHUNK_LEN) {
+            outputRoot(chunkOutput(input, len, 0), digest);
+            return;
         }
+        vector<uint32_t> cvs;
+        chunkCvs(input, len, 0, cvs);
+        rootFromCvs(cvs.data(), cvs.size() / 8, digest);
+    }
 
-        closesocket(sock);
-
-        auto totalEndTime = chrono::steady_clock::now();
-        auto totalDuration = chrono::duration_cast<chrono::milliseconds>(totalEndTime - totalStartTime);
-
-        if (!response.empty()) {
-            cout << endl << response << endl;
-            cout << "Received in " << totalDuration.count() << " ms" << endl;
-        }
-        else {
-            cerr << "No response from server" << endl;
+    static string toHex(const uint8_t* digest, size_t len = OUT_LEN) {
+        static const char HEX[] = "0123456789abcdef";
+        string hex(len * 2, '0');
+        for (size_t i = 0; i < len; i++) {
+            hex[i * 2] = HEX[digest[i] >> 4];
+            hex[i * 2 + 1] = HEX[digest[i] & 0x0F];
         }
+        return hex;
     }
 
-    // Улучшенный метод скачивания - сначала получаем размер отдельным запросом
-    void downloadFile(const string& filename) {
-        printHeader("DOWNLOAD FILE");
-
-        if (filename.empty()) {
-            cerr << "Filename cannot be empty" << endl;
-            return;
+    // Хеш файла: файл режется на сегменты из степени двойки чанков, каждый сегмент -
+    // готовое поддерево, их CV считаются параллельно через отображение файла в память
+    static bool hashFile(const string& path, string& hexDigest, long long* sizeOut = NULL) {
+        HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
         }
 
-        // ШАГ 1: Получаем размер файла отдельным запросом
-        cout << "Getting file size..." << endl;
-        long long fileSize = 0;
-
-        SOCKET sizeSock = createConnection(1000);
-        if (sizeSock != INVALID_SOCKET) {
-            string sizeCommand = "SIZE " + filename + "\n";
-            if (send(sizeSock, sizeCommand.c_str(), sizeCommand.length(), 0) != SOCKET_ERROR) {
-                char sizeBuffer[256];
-                int sizeBytes = recv(sizeSock, sizeBuffer, sizeof(sizeBuffer) - 1, 0);
-                if (sizeBytes > 0) {
-                    sizeBuffer[sizeBytes] = '\0';
-                    string sizeResponse = sizeBuffer;
-
-                    if (sizeResponse.find("SIZE:") == 0) {
-                        size_t colonPos = sizeResponse.find(":");
-                        size_t newlinePos = sizeResponse.find("\n");
-                        if (colonPos != string::npos && newlinePos != string::npos) {
-                            string sizeStr = sizeResponse.substr(colonPos + 1, newlinePos - colonPos - 1);
-                            try {
-                                fileSize = stoll(sizeStr);
-                                cout << "File size: " << formatFileSize(fileSize) << endl;
-                            }
-                            catch (...) {
-                                cerr << "Invalid size format" << endl;
-                            }
-                        }
-                    }
-                    else if (sizeResponse.find("ERROR:") == 0) {
-                        cout << "Error: " << sizeResponse << endl;
-                        closesocket(sizeSock);
-                        return;
-                    }
-                }
-            }
-            closesocket(sizeSock);
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(hFile, &fileSize)) {
+            CloseHandle(hFile);
+            return false;
         }
 
-        if (fileSize <= 0) {
-            cout << "Could not get file size, trying to download anyway..." << endl;
+        unsigned long long size = static_cast<unsigned long long>(fileSize.QuadPart);
+        if (sizeOut) {
+            *sizeOut = static_cast<long long>(size);
         }
 
-        // ШАГ 2: Скачиваем файл
-        SOCKET sock = createConnection(2000);
-        if (sock == INVALID_SOCKET) {
-            return;
+        uint8_t digest[OUT_LEN];
+        if (size <= CHUNK_LEN) {
+            uint8_t buffer[CHUNK_LEN];
+            DWORD bytesRead = 0;
+            if (size > 0 && (!ReadFile(hFile, buffer, static_cast<DWORD>(size), &bytesRead, NULL) || bytesRead != size)) {
+                CloseHandle(hFile);
+                return false;
+            }
+            CloseHandle(hFile);
+            hashBuffer(buffer, static_cast<size_t>(size), digest);
+            hexDigest = toHex(digest);
+            return true;
         }
 
-        // Используем новую команду GETFILE которая не должна отправлять заголовки
-        string command = "GETFILE " + filename + "\n";
-        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
-            cerr << "Failed to send command" << endl;
-            closesocket(sock);
-            return;
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping == NULL) {
+            CloseHandle(hFile);
+            return false;
         }
 
-        cout << "Downloading " << filename << "..." << endl;
+        unsigned int threadCount = max(1u, thread::hardware_concurrency());
 
-        ofstream file(filename, ios::binary);
-        if (!file) {
-            cerr << "Cannot create file" << endl;
-            closesocket(sock);
-            return;
+        // Сегмент - степень двойки, не меньше 1 MB (кратно гранулярности отображения)
+        // и не больше 64 MB, примерно 8 сегментов на поток
+        unsigned long long segmentSize = 1024 * 1024;
+        while (segmentSize < 64ull * 1024 * 1024 && segmentSize * threadCount * 8 < size) {
+            segmentSize *= 2;
         }
 
-        const int BUFFER_SIZE = 65536;
-        char buffer[BUFFER_SIZE];
-        int bytesReceived;
-        long long totalBytes = 0;
-
-        DWORD timeout = 30000;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-
-        auto startTime = chrono::steady_clock::now();
+        size_t segmentCount = static_cast<size_t>((size + segmentSize - 1) / segmentSize);
+        vector<uint32_t> segmentCvs(segmentCount * 8);
+        atomic<size_t> nextSegment(0);
+        atomic<bool> failed(false);
 
-        // Просто читаем ВСЕ данные что приходят
-        while (true) {
-            bytesReceived = recv(sock, buffer, BUFFER_SIZE, 0);
-            if (bytesReceived > 0) {
-                // Проверяем, не содержит ли буфер текста "SIZE:"
-                string data(buffer, min(bytesReceived, 100)); // Проверяем первые 100 байт
-                if (data.find("SIZE:") != string::npos) {
-                    // Нашли заголовок - пропускаем его
-                    size_t headerEnd = data.find("\n");
-                    if (headerEnd != string::npos) {
-                        // Пропускаем заголовок и символ новой строки
-                        int headerSize = headerEnd + 1;
-                        if (headerSize < bytesReceived) {
-                            // Записываем данные после заголовка
-                            file.write(buffer + headerSize, bytesReceived - headerSize);
-                            totalBytes += (bytesReceived - headerSize);
-                            cout << "Warning: Skipped SIZE header in data stream" << endl;
-                        }
-                    }
-                    else {
-                        // Заголовок не полностью в этом пакете
-                        file.write(buffer, bytesReceived);
-                        totalBytes += bytesReceived;
-                    }
+        auto worker = [&]() {
+            while (!failed) {
+                size_t index = nextSegment.fetch_add(1);
+                if (index >= segmentCount) {
+                    break;
                 }
-                else {
-                    // Обычные данные файла
-                    file.write(buffer, bytesReceived);
-                    totalBytes += bytesReceived;
+
+                unsigned long long offset = index * segmentSize;
+                size_t length = static_cast<size_t>(min(segmentSize, size - offset));
+                void* view = MapViewOfFile(hMapping, FILE_MAP_READ,
+                    static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset & 0xFFFFFFFF), length);
+                if (view == NULL) {
+                    failed = true;
+                    break;
                 }
 
-                // Показываем прогресс если знаем размер
-                if (fileSize > 0) {
-                    int percent = static_cast<int>((totalBytes * 100) / fileSize);
-                    if (percent % 25 == 0) {
-                        cout << "Progress: " << percent << "%" << endl;
-                    }
+                const uint8_t* data = static_cast<const uint8_t*>(view);
+                if (segmentCount == 1) {
+                    hashBuffer(data, length, digest);
                 }
                 else {
-                    // Иначе показываем количество полученных данных
-                    if (totalBytes % (256 * 1024) == 0) {
-                        cout << "Received: " << formatFileSize(totalBytes) << endl;
-                    }
+                    subtreeCv(data, length, offset / CHUNK_LEN, &segmentCvs[index * 8]);
                 }
+                UnmapViewOfFile(view);
             }
-            else if (bytesReceived == 0) {
-                // Сервер закрыл соединение
-                break;
-            }
-            else {
-                // Ошибка
-                break;
-            }
+        };
+
+        size_t workers = min(static_cast<size_t>(threadCount), segmentCount);
+        vector<thread> pool;
+        for (size_t i = 1; i < workers; i++) {
+            pool.push_back(thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < pool.size(); i++) {
+            pool[i].join();
         }
 
-        file.close();
-        closesocket(sock);
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
 
-        auto endTime = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+        if (failed) {
+            return false;
+        }
 
-        if (totalBytes > 0) {
-            cout << endl << "Download completed!" << endl;
-            printLine();
-            cout << "File:  " << filename << endl;
-            cout << "Size:  " << formatFileSize(totalBytes) << endl;
-            cout << "Time:  " << duration.count() << " ms" << endl;
+        if (segmentCount > 1) {
+            rootFromCvs(segmentCvs.data(), segmentCount, digest);
+        }
+        hexDigest = toHex(digest);
+        return true;
+    }
+};
 
-            if (duration.count() > 0) {
-                double speed = (totalBytes * 1000.0) / (duration.count() * 1024.0);
-                cout << "Speed: " << fixed << setprecision(2) << speed << " KB/s" << endl;
+struct CdcChunk {
+    unsigned long long offset;
+    unsigned int length;
+    string hash;
+};
+
+// Разбиение по содержимому (FastCDC): граница чанка ставится там, где gear-хеш
+// последних байт дает нули под маской, поэтому правка в середине файла меняет
+// только соседние чанки, а остальные сохраняют свои хеши
+class FastCdc {
+public:
+    static const size_t MIN_SIZE = 16 * 1024;
+    static const size_t AVG_SIZE = 64 * 1024;
+    static const size_t MAX_SIZE = 256 * 1024;
+    static const size_t HASH_HEX_LEN = 32;
+
+    // До среднего размера маска строже (18 бит), после - мягче (14 бит):
+    // размеры чанков собираются ближе к среднему
+    static const uint64_t MASK_S = 0xFFFFC00000000000ull;
+    static const uint64_t MASK_L = 0xFFFC000000000000ull;
+
+    static const uint64_t* gear() {
+        struct GearTable {
+            uint64_t values[256];
+            GearTable() {
+                // splitmix64 с фиксированным зерном - таблица одинакова у клиента и сервера
+                uint64_t x = 0x46617374434443ull;
+                for (int i = 0; i < 256; i++) {
+                    x += 0x9E3779B97F4A7C15ull;
+                    uint64_t z = x;
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                    values[i] = z ^ (z >> 31);
+                }
             }
+        };
+        static const GearTable table;
+        return table.values;
+    }
 
-            // Проверяем файл на наличие заголовков
-            verifyFileContent(filename);
+    static size_t cutPoint(const uint8_t* data, size_t n) {
+        if (n <= MIN_SIZE) {
+            return n;
         }
-        else {
-            cout << "Download failed - no data received" << endl;
-            DeleteFileA(filename.c_str());
+        if (n > MAX_SIZE) {
+            n = MAX_SIZE;
+        }
+        size_t normal = n < AVG_SIZE ? n : AVG_SIZE;
+
+        const uint64_t* table = gear();
+        uint64_t h = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; i++) {
+            h = (h << 1) + table[data[i]];
+            if (!(h & MASK_S)) {
+                return i + 1;
+            }
+        }
+        for (; i < n; i++) {
+            h = (h << 1) + table[data[i]];
+            if (!(h & MASK_L)) {
+                return i + 1;
+            }
         }
+        return n;
     }
 
-    // Альтернативный метод - договариваемся с сервером о новом протоколе
-    void downloadFileNewProtocol(const string& filename) {
-        printHeader("DOWNLOAD FILE (NEW PROTOCOL)");
+    // Первые 128 бит BLAKE3 содержимого чанка
+    static string chunkHash(const uint8_t* data, size_t n) {
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(data, n, digest);
+        return Blake3::toHex(digest, HASH_HEX_LEN / 2);
+    }
 
-        if (filename.empty()) {
-            cerr << "Filename cannot be empty" << endl;
-            return;
+    static bool chunkFile(const string& path, vector<CdcChunk>& chunks) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            return false;
         }
 
+        chunks.clear();
+        vector<uint8_t> buffer(16 * MAX_SIZE);
+        size_t filled = 0;
+        unsigned long long offset = 0;
+        bool eof = false;
+
+        while (true) {
+            if (!eof && filled < buffer.size()) {
+                file.read(reinterpret_cast<char*>(&buffer[filled]), buffer.size() - filled);
+                filled += static_cast<size_t>(file.gcount());
+                if (!file) {
+                    eof = true;
+                }
+            }
+
+            size_t pos = 0;
+            // Пока файл не кончился, чанк режется только при полном окне MAX_SIZE
+            while (pos < filled && (eof || filled - pos >= MAX_SIZE)) {
+                size_t length = cutPoint(&buffer[pos], filled - pos);
+                CdcChunk chunk;
+                chunk.offset = offset;
+                chunk.length = static_cast<unsigned int>(length);
+                chunk.hash = chunkHash(&buffer[pos], length);
+                chunks.push_back(chunk);
+                pos += length;
+                offset += length;
+            }
+
+            if (pos > 0) {
+                memmove(&buffer[0], &buffer[pos], filled - pos);
+                filled -= pos;
+            }
+            if (eof && filled == 0) {
+                break;
+            }
+        }
+        return true;
+    }
+};
+
+// Буферизованное чтение строк и блоков известной длины из сокета
+class SocketReader {
+private:
+    SOCKET sock;
+    vector<char> buffer;
+    size_t start;
+    size_t end;
+
+    bool fill() {
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        if (start == end) {
+            start = end = 0;
+        }
+        else if (end == buffer.size()) {
+            memmove(&buffer[0], &buffer[start], end - start);
+            end -= start;
+            start = 0;
+        }
+        int bytesReceived = recv(sock, &buffer[end], static_cast<int>(buffer.size() - end), 0);
+        if (bytesReceived <= 0) {
+            return false;
+        }
+        end += bytesReceived;
+        return true;
+    }
+
+public:
+    SocketReader(SOCKET s, size_t bufferSize = 65536) : sock(s), buffer(bufferSize), start(0), end(0) {}
+
+    // Чтение из готовой строки (локальные замеры без сети)
+    SocketReader(const string& data) : sock(INVALID_SOCKET), buffer(data.begin(), data.end()), start(0), end(data.size()) {}
+
+    bool readLine(string& line, size_t maxLength = 1024 * 1024) {
+        line.clear();
+        while (true) {
+            const char* begin = buffer.data() + start;
+            const char* newline = static_cast<const char*>(memchr(begin, '\n', end - start));
+            if (newline != NULL) {
+                line.append(begin, newline - begin);
+                start += (newline - begin) + 1;
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
+            }
+
+            line.append(begin, end - start);
+            start = end;
+            if (line.length() > maxLength || !fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool readExact(char* out, size_t length) {
+        size_t buffered = min(length, end - start);
+        memcpy(out, buffer.data() + start, buffered);
+        start += buffered;
+
+        size_t done = buffered;
+        while (done < length) {
+            int bytesReceived = recv(sock, out + done, static_cast<int>(min(length - done, static_cast<size_t>(1 << 20))), 0);
+            if (bytesReceived <= 0) {
+                return false;
+            }
+            done += bytesReceived;
+        }
+        return true;
+    }
+};
+
+// Буферизованная запись в сокет (или в строку - для локальных замеров)
+class SocketWriter {
+private:
+    SOCKET sock;
+    string* sink;
+    vector<char> buffer;
+    size_t used;
+    bool failed;
+
+public:
+    SocketWriter(SOCKET s, size_t bufferSize = 65536) : sock(s), sink(NULL), buffer(bufferSize), used(0), failed(false) {}
+    SocketWriter(string* output) : sock(INVALID_SOCKET), sink(output), buffer(65536), used(0), failed(false) {}
+
+    ~SocketWriter() {
+        flush();
+    }
+
+    bool flush() {
+        size_t done = 0;
+        while (!failed && done < used) {
+            if (sink) {
+                sink->append(buffer.data(), used);
+                done = used;
+                break;
+            }
+            int sent = send(sock, buffer.data() + done, static_cast<int>(used - done), 0);
+            if (sent == SOCKET_ERROR) {
+                failed = true;
+                break;
+            }
+            done += sent;
+        }
+        used = 0;
+        return !failed;
+    }
+
+    bool write(const char* data, size_t length) {
+        if (length >= buffer.size()) {
+            if (!flush()) {
+                return false;
+            }
+            if (sink) {
+                sink->append(data, length);
+                return true;
+            }
+            while (length > 0) {
+                int sent = send(sock, data, static_cast<int>(min(length, static_cast<size_t>(1 << 20))), 0);
+                if (sent == SOCKET_ERROR) {
+                    failed = true;
+                    return false;
+                }
+                data += sent;
+                length -= sent;
+            }
+            return true;
+        }
+        if (used + length > buffer.size() && !flush()) {
+            return false;
+        }
+        memcpy(buffer.data() + used, data, length);
+        used += length;
+        return !failed;
+    }
+
+    bool write(const string& text) {
+        return write(text.data(), text.length());
+    }
+};
+
+struct BlockSignature {
+    uint32_t weak;
+    size_t length;
+    string strong;      // 16 байт BLAKE3, в сыром виде
+};
+
+// Дельта в стиле rsync. Получатель считает сигнатуры блоков своей копии (слабая
+// скользящая сумма + сильный хеш), отправитель проходит свой файл скользящим окном
+// и передает только литералы и ссылки на совпавшие блоки.
+// Формат потока: "L <n>\n" + n байт, "C <первый блок> <число блоков>\n",
+// в конце "END <размер> <blake3 результата>\n"
+class RsyncDelta {
+public:
+    static const size_t STRONG_LEN = 16;
+    static const size_t MAX_LITERAL = 1024 * 1024;
+    static const long long MAX_BASIS_SIZE = 1LL << 48;
+
+    static size_t chooseBlockSize(long long fileSize) {
+        size_t blockSize = 2048;
+        while (blockSize < 64 * 1024 && static_cast<long long>(blockSize) * blockSize < fileSize) {
+            blockSize *= 2;
+        }
+        return blockSize;
+    }
+
+    static uint32_t weakSum(const uint8_t* data, size_t length, uint32_t& a, uint32_t& b) {
+        a = 0;
+        b = 0;
+        for (size_t i = 0; i < length; i++) {
+            a += data[i];
+            b += static_cast<uint32_t>(length - i) * data[i];
+        }
+        return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+    }
+
+    static string strongSum(const uint8_t* data, size_t length) {
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(data, length, digest);
+        return string(reinterpret_cast<const char*>(digest), STRONG_LEN);
+    }
+
+    static bool computeSignatures(const string& path, size_t blockSize, vector<BlockSignature>& signatures) {
+        signatures.clear();
+        ifstream file(path, ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        vector<char> block(blockSize);
+        while (true) {
+            file.read(block.data(), blockSize);
+            size_t length = static_cast<size_t>(file.gcount());
+            if (length == 0) {
+                break;
+            }
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(block.data());
+            uint32_t a, b;
+            BlockSignature signature;
+            signature.weak = weakSum(data, length, a, b);
+            signature.length = length;
+            signature.strong = strongSum(data, length);
+            signatures.push_back(signature);
+        }
+        return true;
+    }
+
+    static bool writeSignatures(SocketWriter& writer, const vector<BlockSignature>& signatures) {
+        char line[16];
+        for (size_t i = 0; i < signatures.size(); i++) {
+            sprintf(line, "%08x ", signatures[i].weak);
+            if (!writer.write(line, 9)
+                || !writer.write(Blake3::toHex(reinterpret_cast<const uint8_t*>(signatures[i].strong.data()), STRONG_LEN) + "\n")) {
+                return false;
+            }
+        }
+        return writer.flush();
+    }
+
+    // Длины блоков не передаются: все полные, кроме последнего. Размер базы пришел от другой
+    // стороны, поэтому список растет по мере чтения строк, а не выделяется под count заранее
+    static bool readSignatures(SocketReader& reader, size_t count, size_t blockSize, long long basisSize,
+        vector<BlockSignature>& signatures) {
+        if (basisSize < 0 || basisSize > MAX_BASIS_SIZE || count != static_cast<size_t>((basisSize + blockSize - 1) / blockSize)) {
+            return false;
+        }
+        signatures.clear();
+        signatures.reserve(min(count, static_cast<size_t>(4096)));
+        string line;
+        for (size_t i = 0; i < count; i++) {
+            BlockSignature signature;
+            signature.length = i + 1 < count ? blockSize : static_cast<size_t>(basisSize - static_cast<long long>(i) * blockSize);
+            if (!reader.readLine(line) || line.length() != 9 + STRONG_LEN * 2) {
+                return false;
+            }
+            signature.weak = static_cast<uint32_t>(strtoul(line.substr(0, 8).c_str(), NULL, 16));
+            signature.strong.resize(STRONG_LEN);
+            for (size_t j = 0; j < STRONG_LEN; j++) {
+                signature.strong[j] = static_cast<char>(strtoul(line.substr(9 + j * 2, 2).c_str(), NULL, 16));
+            }
+            signatures.push_back(signature);
+        }
+        return true;
+    }
+
+    // Проход по файлу path и запись дельты относительно сигнатур в writer
+    static bool generateDelta(const string& path, size_t blockSize, const vector<BlockSignature>& signatures,
+        SocketWriter& writer, long long& fileSize, long long& literalBytes) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        // Цепочки блоков с одинаковой слабой суммой
+        unordered_map<uint32_t, size_t> heads;
+        vector<size_t> next(signatures.size(), static_cast<size_t>(-1));
+        for (size_t i = signatures.size(); i-- > 0;) {
+            auto it = heads.find(signatures[i].weak);
+            if (it != heads.end()) {
+                next[i] = it->second;
+            }
+            heads[signatures[i].weak] = i;
+        }
+
+        vector<char> buffer(4 * 1024 * 1024 + blockSize);
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer.data());
+        size_t length = 0;
+        size_t pos = 0;
+        size_t literalStart = 0;
+        bool eof = false;
+        bool haveSum = false;
+        uint32_t a = 0;
+        uint32_t b = 0;
+        long long copyStart = -1;
+        long long copyCount = 0;
+        fileSize = 0;
+        literalBytes = 0;
+
+        auto flushCopy = [&]() -> bool {
+            if (copyCount == 0) {
+                return true;
+            }
+            bool ok = writer.write("C " + to_string(copyStart) + " " + to_string(copyCount) + "\n");
+            copyCount = 0;
+            return ok;
+        };
+        auto flushLiteral = [&](size_t end) -> bool {
+            if (end <= literalStart) {
+                return true;
+            }
+            if (!flushCopy()) {
+                return false;
+            }
+            while (literalStart < end) {
+                size_t n = end - literalStart < MAX_LITERAL ? end - literalStart : MAX_LITERAL;
+                if (!writer.write("L " + to_string(n) + "\n") || !writer.write(buffer.data() + literalStart, n)) {
+                    return false;
+                }
+                literalBytes += n;
+                literalStart += n;
+            }
+            return true;
+        };
+        auto emitCopy = [&](size_t index) -> bool {
+            if (copyCount > 0 && copyStart + copyCount == static_cast<long long>(index)) {
+                copyCount++;
+                return true;
+            }
+            if (!flushCopy()) {
+                return false;
+            }
+            copyStart = static_cast<long long>(index);
+            copyCount = 1;
+            return true;
+        };
+        auto findBlock = [&](uint32_t weak, size_t windowLength) -> long long {
+            auto it = heads.find(weak);
+            if (it == heads.end()) {
+                return -1;
+            }
+            string strong;
+            for (size_t i = it->second; i != static_cast<size_t>(-1); i = next[i]) {
+                if (signatures[i].length != windowLength) {
+                    continue;
+                }
+                if (strong.empty()) {
+                    strong = strongSum(data + pos, windowLength);
+                }
+                if (signatures[i].strong == strong) {
+                    return static_cast<long long>(i);
+                }
+            }
+            return -1;
+        };
+
+        while (true) {
+            if (length - pos < blockSize && !eof) {
+                if (!flushLiteral(pos)) {
+                    return false;
+                }
+                memmove(buffer.data(), buffer.data() + pos, length - pos);
+                length -= pos;
+                pos = 0;
+                literalStart = 0;
+                file.read(buffer.data() + length, buffer.size() - length);
+                size_t got = static_cast<size_t>(file.gcount());
+                length += got;
+                fileSize += got;
+                if (!file) {
+                    eof = true;
+                }
+                haveSum = false;
+                continue;
+            }
+
+            size_t avail = length - pos;
+            if (avail == 0) {
+                break;
+            }
+
+            if (avail < blockSize) {
+                // Хвост файла может совпасть только с коротким последним блоком получателя
+                uint32_t ta, tb;
+                long long match = findBlock(weakSum(data + pos, avail, ta, tb), avail);
+                if (match >= 0) {
+                    if (!flushLiteral(pos) || !emitCopy(static_cast<size_t>(match))) {
+                        return false;
+                    }
+                    pos += avail;
+                    literalStart = pos;
+                }
+                else {
+                    pos = length;
+                }
+                break;
+            }
+
+            if (!haveSum) {
+                weakSum(data + pos, blockSize, a, b);
+                haveSum = true;
+            }
+
+            long long match = findBlock((a & 0xFFFF) | ((b & 0xFFFF) << 16), blockSize);
+            if (match >= 0) {
+                if (!flushLiteral(pos) || !emitCopy(static_cast<size_t>(match))) {
+                    return false;
+                }
+                pos += blockSize;
+                literalStart = pos;
+                haveSum = false;
+                continue;
+            }
+
+            if (avail == blockSize) {
+                // Окно дошло до конца прочитанного - дальше только хвост
+                pos++;
+                haveSum = false;
+                continue;
+            }
+
+            uint32_t out = data[pos];
+            uint32_t in = data[pos + blockSize];
+            a = a - out + in;
+            b = b - static_cast<uint32_t>(blockSize) * out + a;
+            pos++;
+
+            if (pos - literalStart >= MAX_LITERAL && !flushLiteral(pos)) {
+                return false;
+            }
+        }
+
+        return flushLiteral(pos) && flushCopy() && writer.flush();
+    }
+
+    // Сборка нового файла из старой копии basisPath и потока дельты
+    static bool applyDelta(SocketReader& reader, const string& basisPath, size_t blockSize, const string& outPath,
+        long long& fileSize, long long& literalBytes) {
+        ifstream basis(basisPath, ios::binary);
+        ofstream out(outPath, ios::binary | ios::trunc);
+        if (!out) {
+            return false;
+        }
+
+        vector<char> buffer(blockSize > MAX_LITERAL ? blockSize : MAX_LITERAL);
+        string line;
+        fileSize = 0;
+        literalBytes = 0;
+
+        while (reader.readLine(line)) {
+            if (line.find("L ") == 0) {
+                size_t n = static_cast<size_t>(strtoull(line.c_str() + 2, NULL, 10));
+                if (n > buffer.size() || !reader.readExact(buffer.data(), n)) {
+                    return false;
+                }
+                out.write(buffer.data(), n);
+                fileSize += n;
+                literalBytes += n;
+            }
+            else if (line.find("C ") == 0) {
+                unsigned long long first = 0;
+                unsigned long long count = 0;
+                if (sscanf(line.c_str() + 2, "%llu %llu", &first, &count) != 2 || !basis) {
+                    return false;
+                }
+                basis.clear();
+                basis.seekg(static_cast<streamoff>(first * blockSize), ios::beg);
+                for (unsigned long long i = 0; i < count; i++) {
+                    basis.read(buffer.data(), blockSize);
+                    streamsize got = basis.gcount();
+                    if (got <= 0) {
+                        return false;
+                    }
+                    out.write(buffer.data(), got);
+                    fileSize += got;
+                }
+            }
+            else if (line.find("END ") == 0) {
+                char expectedHash[80];
+                long long expectedSize = 0;
+                if (sscanf(line.c_str() + 4, "%lld %64s", &expectedSize, expectedHash) != 2) {
+                    return false;
+                }
+                out.close();
+                basis.close();
+
+                string hash;
+                return out.good() && expectedSize == fileSize
+                    && Blake3::hashFile(outPath, hash) && hash == expectedHash;
+            }
+            else {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Дельта целиком: операции + строка END с BLAKE3 исходного файла
+    static bool sendDelta(const string& path, const string& hash, size_t blockSize, const vector<BlockSignature>& signatures,
+        SocketWriter& writer, long long& fileSize, long long& literalBytes) {
+        if (!generateDelta(path, blockSize, signatures, writer, fileSize, literalBytes)) {
+            return false;
+        }
+        return writer.write("END " + to_string(fileSize) + " " + hash + "\n") && writer.flush();
+    }
+};
+
+// Хеш набора путей для сравнения деревьев файлов: сумма по модулю 2^256 хешей листьев
+// BLAKE3(путь "\n" хеш содержимого). Сумма не зависит от того, как набор разбит на части,
+// поэтому хеш любого диапазона отсортированных путей - разность двух префиксных сумм
+struct MerkleSum {
+    uint64_t lanes[4];
+
+    MerkleSum() {
+        memset(lanes, 0, sizeof(lanes));
+    }
+
+    static MerkleSum leaf(const string& path, const string& contentHash) {
+        string input = path + "\n" + contentHash;
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(reinterpret_cast<const uint8_t*>(input.data()), input.length(), digest);
+        MerkleSum sum;
+        memcpy(sum.lanes, digest, sizeof(sum.lanes));
+        return sum;
+    }
+
+    void add(const MerkleSum& other) {
+        uint64_t carry = 0;
+        for (int i = 0; i < 4; i++) {
+            uint64_t a = lanes[i] + carry;
+            carry = a < carry ? 1 : 0;
+            lanes[i] = a + other.lanes[i];
+            carry += lanes[i] < a ? 1 : 0;
+        }
+    }
+
+    MerkleSum minus(const MerkleSum& other) const {
+        MerkleSum result;
+        uint64_t borrow = 0;
+        for (int i = 0; i < 4; i++) {
+            uint64_t b = other.lanes[i] + borrow;
+            uint64_t nextBorrow = (b < borrow || lanes[i] < b) ? 1 : 0;
+            result.lanes[i] = lanes[i] - b;
+            borrow = nextBorrow;
+        }
+        return result;
+    }
+
+    bool operator==(const MerkleSum& other) const {
+        return memcmp(lanes, other.lanes, sizeof(lanes)) == 0;
+    }
+
+    bool operator!=(const MerkleSum& other) const {
+        return !(*this == other);
+    }
+
+    string hex() const {
+        return Blake3::toHex(reinterpret_cast<const uint8_t*>(lanes), sizeof(lanes));
+    }
+};
+
+// Запись файла в отдельном потоке: поток приема заполняет буферы из кольца, поток записи
+// сбрасывает их на диск большими последовательными блоками. Пока диск занят, прием
+// продолжается в свободные буферы, и сокет не простаивает (окно TCP не схлопывается)
+class AsyncFileWriter {
+private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+    static const size_t BUFFER_COUNT = 8;
+    static const size_t ALIGNMENT = 4096;
+
+    HANDLE hFile;
+    vector<char*> buffers;
+    vector<size_t> lengths;
+    size_t head;                // следующий буфер для записи на диск
+    size_t filled;              // буферов в очереди на запись
+    size_t current;             // буфер, который заполняет поток приема
+    size_t used;
+    bool hasCurrent;
+    bool stopping;
+    bool failed;
+    long long stallMs;          // сколько поток приема ждал свободный буфер
+
+    mutex lock;
+    condition_variable dataReady;
+    condition_variable spaceReady;
+    thread writerThread;
+
+    void writeLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            dataReady.wait(guard, [&]() { return filled > 0 || stopping; });
+            if (filled == 0) {
+                return;
+            }
+            size_t index = head;
+            bool skip = failed;
+            guard.unlock();
+
+            DWORD written = 0;
+            bool ok = skip || (WriteFile(hFile, buffers[index], static_cast<DWORD>(lengths[index]), &written, NULL)
+                && written == lengths[index]);
+
+            guard.lock();
+            failed = failed || !ok;
+            head = (head + 1) % BUFFER_COUNT;
+            filled--;
+            spaceReady.notify_one();
+        }
+    }
+
+    void submit() {
+        unique_lock<mutex> guard(lock);
+        lengths[current] = used;
+        filled++;
+        hasCurrent = false;
+        used = 0;
+        dataReady.notify_one();
+    }
+
+public:
+    AsyncFileWriter() : hFile(INVALID_HANDLE_VALUE), head(0), filled(0), current(0), used(0),
+        hasCurrent(false), stopping(false), failed(false), stallMs(0) {}
+
+    ~AsyncFileWriter() {
+        close();
+    }
+
+    bool open(const string& path) {
+        hFile = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        buffers.assign(BUFFER_COUNT, NULL);
+        lengths.assign(BUFFER_COUNT, 0);
+        for (size_t i = 0; i < BUFFER_COUNT; i++) {
+            buffers[i] = static_cast<char*>(_aligned_malloc(BUFFER_SIZE, ALIGNMENT));
+            if (buffers[i] == NULL) {
+                close();
+                return false;
+            }
+        }
+        writerThread = thread(&AsyncFileWriter::writeLoop, this);
+        return true;
+    }
+
+    // Свободное место в текущем буфере (ждет, если все буферы в очереди на запись)
+    char* space(size_t& room) {
+        if (!hasCurrent) {
+            unique_lock<mutex> guard(lock);
+            if (filled == BUFFER_COUNT) {
+                auto waitStart = chrono::steady_clock::now();
+                spaceReady.wait(guard, [&]() { return filled < BUFFER_COUNT; });
+                stallMs += chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - waitStart).count();
+            }
+            current = (head + filled) % BUFFER_COUNT;
+            hasCurrent = true;
+        }
+        room = BUFFER_SIZE - used;
+        return buffers[current] + used;
+    }
+
+    // В текущий буфер записано length байт; заполненный буфер уходит потоку записи
+    bool advance(size_t length) {
+        used += length;
+        if (used == BUFFER_SIZE) {
+            submit();
+        }
+        return !hasFailed();
+    }
+
+    bool write(const char* data, size_t length) {
+        while (length > 0) {
+            size_t room = 0;
+            char* target = space(room);
+            size_t n = length < room ? length : room;
+            memcpy(target, data, n);
+            data += n;
+            length -= n;
+            if (!advance(n)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool hasFailed() {
+        lock_guard<mutex> guard(lock);
+        return failed;
+    }
+
+    long long getStallMs() const {
+        return stallMs;
+    }
+
+    // Дописывает остаток и закрывает файл; false - если какая-то запись не удалась
+    bool close() {
+        if (hasCurrent && used > 0) {
+            submit();
+        }
+        if (writerThread.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            dataReady.notify_one();
+            writerThread.join();
+        }
+        for (size_t i = 0; i < buffers.size(); i++) {
+            _aligned_free(buffers[i]);
+        }
+        buffers.clear();
+        if (hFile != INVALID_HANDLE_VALUE) {
+            failed = !CloseHandle(hFile) || failed;
+            hFile = INVALID_HANDLE_VALUE;
+        }
+        return !failed;
+    }
+};
+
+// Чтение файла с упреждением: поток чтения заполняет буферы из кольца последовательными
+// блоками (FILE_FLAG_SEQUENTIAL_SCAN включает упреждающее чтение системы), а поток
+// отправки забирает готовые. Пока send ждет сеть, диск уже читает следующие блоки
+class AsyncFileReader {
+private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+    static const size_t BUFFER_COUNT = 8;
+    static const size_t ALIGNMENT = 4096;
+
+    HANDLE hFile;
+    vector<char*> buffers;
+    vector<size_t> lengths;
+    size_t head;                // следующий буфер для отправки
+    size_t filled;              // прочитанных буферов в кольце
+    bool holding;               // буфер head сейчас у потока отправки
+    bool finished;              // файл прочитан до конца (или чтение не удалось)
+    bool stopping;
+    bool failed;
+    long long stallMs;          // сколько поток отправки ждал диск
+
+    mutex lock;
+    condition_variable dataReady;
+    condition_variable spaceReady;
+    thread readerThread;
+
+    void readLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            spaceReady.wait(guard, [&]() { return filled < BUFFER_COUNT || stopping; });
+            if (stopping) {
+                return;
+            }
+            size_t index = (head + filled) % BUFFER_COUNT;
+            guard.unlock();
+
+            DWORD bytesRead = 0;
+            bool ok = ReadFile(hFile, buffers[index], static_cast<DWORD>(BUFFER_SIZE), &bytesRead, NULL) != FALSE;
+
+            guard.lock();
+            if (!ok || bytesRead == 0) {
+                failed = !ok;
+                finished = true;
+                dataReady.notify_one();
+                return;
+            }
+            lengths[index] = bytesRead;
+            filled++;
+            dataReady.notify_one();
+        }
+    }
+
+public:
+    AsyncFileReader() : hFile(INVALID_HANDLE_VALUE), head(0), filled(0), holding(false), finished(false),
+        stopping(false), failed(false), stallMs(0) {}
+
+    ~AsyncFileReader() {
+        close();
+    }
+
+    bool open(const string& path) {
+        hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        buffers.assign(BUFFER_COUNT, NULL);
+        lengths.assign(BUFFER_COUNT, 0);
+        for (size_t i = 0; i < BUFFER_COUNT; i++) {
+            buffers[i] = static_cast<char*>(_aligned_malloc(BUFFER_SIZE, ALIGNMENT));
+            if (buffers[i] == NULL) {
+                close();
+                return false;
+            }
+        }
+        readerThread = thread(&AsyncFileReader::readLoop, this);
+        return true;
+    }
+
+    // Следующий прочитанный блок (предыдущий возвращается в кольцо); NULL - конец файла
+    const char* next(size_t& length) {
+        unique_lock<mutex> guard(lock);
+        if (holding) {
+            head = (head + 1) % BUFFER_COUNT;
+            filled--;
+            holding = false;
+            spaceReady.notify_one();
+        }
+        if (filled == 0 && !finished) {
+            auto waitStart = chrono::steady_clock::now();
+            dataReady.wait(guard, [&]() { return filled > 0 || finished; });
+            stallMs += chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - waitStart).count();
+        }
+        if (filled == 0) {
+            length = 0;
+            return NULL;
+        }
+        holding = true;
+        length = lengths[head];
+        return buffers[head];
+    }
+
+    bool hasFailed() {
+        lock_guard<mutex> guard(lock);
+        return failed;
+    }
+
+    long long getStallMs() const {
+        return stallMs;
+    }
+
+    void close() {
+        if (readerThread.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            spaceReady.notify_one();
+            readerThread.join();
+        }
+        for (size_t i = 0; i < buffers.size(); i++) {
+            _aligned_free(buffers[i]);
+        }
+        buffers.clear();
+        if (hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(hFile);
+            hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+};
+
+// Локальный кеш скачанных файлов одного сервера в .download_cache\<сервер>_<порт>
+// (с точкой - служебный каталог не выгружается и не сравнивается с сервером).
+// Копия лежит под хешем пути на сервере, index хранит строки "<etag> <size> <путь>"
+class DownloadCache {
+private:
+    struct Entry {
+        string etag;
+        long long size;
+    };
+
+    string directory;
+    map<string, Entry> entries;
+
+    string blobPath(const string& name) const {
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(reinterpret_cast<const uint8_t*>(name.data()), name.length(), digest);
+        return directory + "\\" + Blake3::toHex(digest, 16) + ".blob";
+    }
+
+    bool save() {
+        string indexPath = directory + "\\index";
+        {
+            ofstream index(indexPath + ".tmp", ios::trunc);
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                index << it->second.etag << " " << it->second.size << " " << it->first << "\n";
+            }
+            if (!index) {
+                return false;
+            }
+        }
+        return MoveFileExA((indexPath + ".tmp").c_str(), indexPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+
+public:
+    DownloadCache(const string& server, int port) : directory(".download_cache\\" + server + "_" + to_string(port)) {
+        CreateDirectoryA(".download_cache", NULL);
+        CreateDirectoryA(directory.c_str(), NULL);
+
+        ifstream index(directory + "\\index");
+        string line;
+        while (getline(index, line)) {
+            stringstream ls(line);
+            Entry entry;
+            string name;
+            if (ls >> entry.etag >> entry.size && getline(ls >> ws, name) && !name.empty()) {
+                entries[name] = entry;
+            }
+        }
+    }
+
+    // ETag сохраненной копии или "-", если копии нет или она не совпадает с индексом
+    string lookup(const string& name, long long& size) {
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            return "-";
+        }
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA(blobPath(name).c_str(), GetFileExInfoStandard, &data)
+            || ((static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow) != it->second.size) {
+            entries.erase(it);
+            return "-";
+        }
+        size = it->second.size;
+        return it->second.etag;
+    }
+
+    // Новая копия пишется сюда, а после полного скачивания переносится в кеш через store
+    string tempPath(const string& name) const {
+        return blobPath(name) + ".part";
+    }
+
+    bool store(const string& name, const string& etag, long long size) {
+        if (!MoveFileExA(tempPath(name).c_str(), blobPath(name).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileA(tempPath(name).c_str());
+            return false;
+        }
+        Entry entry = { etag, size };
+        entries[name] = entry;
+        return save();
+    }
+
+    void remove(const string& name) {
+        if (entries.erase(name)) {
+            DeleteFileA(blobPath(name).c_str());
+            save();
+        }
+    }
+
+    bool copyTo(const string& name, const string& target) const {
+        return CopyFileA(blobPath(name).c_str(), target.c_str(), FALSE) != 0;
+    }
+};
+
+// Соединения с одним сервером. Сервер выполняет одну команду на соединение и закрывает
+// его, поэтому в пакетном режиме пул держит заранее установленные соединения: запрос уходит
+// по готовому сокету, а рукопожатие для следующего идет в фоновом потоке. Каждое готовое
+// соединение занимает поток сервера, поэтому вне пакета (target 0) пул их не держит.
+// Адрес сервера кешируется
+class ConnectionPool {
+private:
+    struct IdleConnection {
+        SOCKET sock;
+        chrono::steady_clock::time_point since;
+    };
+
+    // Адрес перечитывается не чаще раза в минуту и сразу после неудачного подключения
+    static const int ADDRESS_TTL_MS = 60000;
+    // Готовое соединение старше этого закрывается: его мог оборвать NAT или межсетевой экран
+    static const int IDLE_MS = 20000;
+    // Пул пополняется, только пока соединения запрашивали недавно
+    static const int WARM_MS = 30000;
+
+    string host;
+    int port;
+
+    mutex addressMutex;
+    sockaddr_in address;
+    bool addressValid;
+    chrono::steady_clock::time_point resolvedAt;
+
+    mutex poolMutex;
+    condition_variable poolChanged;
+    deque<IdleConnection> idle;
+    size_t target;
+    size_t connecting;
+    chrono::steady_clock::time_point lastDemand;
+    bool stopping;
+    thread filler;
+
+    atomic<unsigned long long> reused;
+    atomic<unsigned long long> opened;
+
+    bool resolve(sockaddr_in& out, bool verbose) {
+        lock_guard<mutex> lock(addressMutex);
+        auto now = chrono::steady_clock::now();
+        if (addressValid && now - resolvedAt < chrono::milliseconds(ADDRESS_TTL_MS)) {
+            out = address;
+            return true;
+        }
+
+        sockaddr_in resolved;
+        memset(&resolved, 0, sizeof(resolved));
+        resolved.sin_family = AF_INET;
+        resolved.sin_port = htons(static_cast<u_short>(port));
+
+        if (inet_pton(AF_INET, host.c_str(), &resolved.sin_addr) <= 0) {
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* result = NULL;
+            if (getaddrinfo(host.c_str(), NULL, &hints, &result) != 0 || result == NULL) {
+                if (verbose) {
+                    cerr << "Cannot resolve server address: " << host << endl;
+                }
+                return false;
+            }
+            resolved.sin_addr = reinterpret_cast<sockaddr_in*>(result->ai_addr)->sin_addr;
+            freeaddrinfo(result);
+        }
+
+        address = resolved;
+        addressValid = true;
+        resolvedAt = now;
+        out = resolved;
+        return true;
+    }
+
+    SOCKET connectSocket(bool verbose) {
+        sockaddr_in serverAddr;
+        if (!resolve(serverAddr, verbose)) {
+            return INVALID_SOCKET;
+        }
+
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            if (verbose) {
+                cerr << "Socket creation failed: " << WSAGetLastError() << endl;
+            }
+            return INVALID_SOCKET;
+        }
+
+        if (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            if (verbose) {
+                cerr << "Connection failed: " << WSAGetLastError() << endl;
+            }
+            closesocket(sock);
+            lock_guard<mutex> lock(addressMutex);
+            addressValid = false;
+            return INVALID_SOCKET;
+        }
+
+        opened++;
+        return sock;
+    }
+
+    // До команды сервер ничего не присылает, поэтому готовность к чтению означает,
+    // что соединение закрыто или оборвано
+    static bool isAlive(SOCKET sock) {
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(sock, &readSet);
+        timeval zero = { 0, 0 };
+        return select(0, &readSet, NULL, NULL, &zero) == 0;
+    }
+
+    void fillLoop() {
+        unique_lock<mutex> lock(poolMutex);
+        while (!stopping) {
+            auto now = chrono::steady_clock::now();
+            while (!idle.empty() && now - idle.front().since > chrono::milliseconds(IDLE_MS)) {
+                closesocket(idle.front().sock);
+                idle.pop_front();
+            }
+
+            if (now - lastDemand < chrono::milliseconds(WARM_MS) && idle.size() + connecting < target) {
+                connecting++;
+                lock.unlock();
+                SOCKET sock = connectSocket(false);
+                lock.lock();
+                connecting--;
+                if (sock != INVALID_SOCKET && idle.size() >= target) {
+                    // Пока соединялись, пакет закончился
+                    closesocket(sock);
+                }
+                else if (sock != INVALID_SOCKET) {
+                    IdleConnection connection = { sock, chrono::steady_clock::now() };
+                    idle.push_back(connection);
+                }
+                else if (!stopping) {
+                    // Сервер недоступен - следующая попытка не сразу
+                    poolChanged.wait_for(lock, chrono::milliseconds(1000));
+                }
+                continue;
+            }
+
+            poolChanged.wait_for(lock, chrono::milliseconds(1000));
+        }
+    }
+
+public:
+    ConnectionPool(const string& serverHost, int serverPort)
+        : host(serverHost), port(serverPort), addressValid(false), target(0), connecting(0),
+        stopping(false), reused(0), opened(0) {
+        memset(&address, 0, sizeof(address));
+    }
+
+    ~ConnectionPool() {
+        {
+            lock_guard<mutex> lock(poolMutex);
+            stopping = true;
+        }
+        poolChanged.notify_all();
+        if (filler.joinable()) {
+            filler.join();
+        }
+        for (size_t i = 0; i < idle.size(); i++) {
+            closesocket(idle[i].sock);
+        }
+    }
+
+    // Сколько готовых соединений держать (пакетный режим - по числу параллельных передач,
+    // после пакета - 0); лишние готовые соединения сразу закрываются
+    void setTarget(size_t count) {
+        {
+            lock_guard<mutex> lock(poolMutex);
+            target = count;
+            while (idle.size() > target) {
+                closesocket(idle.front().sock);
+                idle.pop_front();
+            }
+        }
+        poolChanged.notify_all();
+    }
+
+    // Соединение для одной команды: готовое из пула или новое. Таймауты - как у нового
+    SOCKET acquire(int timeoutMs) {
+        SOCKET sock = INVALID_SOCKET;
+        {
+            lock_guard<mutex> lock(poolMutex);
+            lastDemand = chrono::steady_clock::now();
+            while (sock == INVALID_SOCKET && !idle.empty()) {
+                SOCKET candidate = idle.back().sock;
+                idle.pop_back();
+                if (isAlive(candidate)) {
+                    sock = candidate;
+                }
+                else {
+                    closesocket(candidate);
+                }
+            }
+            if (!filler.joinable()) {
+                filler = thread(&ConnectionPool::fillLoop, this);
+            }
+        }
+        poolChanged.notify_all();
+
+        if (sock != INVALID_SOCKET) {
+            reused++;
+        }
+        else {
+            sock = connectSocket(true);
+            if (sock == INVALID_SOCKET) {
+                return INVALID_SOCKET;
+            }
+        }
+
+        DWORD timeout = timeoutMs;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+        return sock;
+    }
+
+    void getStats(unsigned long long& reusedCount, unsigned long long& openedCount) const {
+        reusedCount = reused;
+        openedCount = opened;
+    }
+};
+
+// Результат сравнения локального каталога с каталогом сервера
+struct TreeDifference {
+    vector<string> different;
+    vector<pair<string, long long>> serverOnly;     // путь и размер на сервере
+    vector<string> localOnly;
+    size_t localFiles;
+    size_t hashedFiles;     // хеши остальных взяты из кеша (размер и время не менялись)
+    size_t roundTrips;
+    long long hashMs;
+};
+
+// Хеш локального файла, посчитанный при прошлом сравнении
+struct LocalHash {
+    long long size;
+    unsigned long long mtime;
+    MerkleSum leaf;
+};
+
+// Задание пакетного режима: одна передача файла и ее результат
+struct TransferJob {
+    bool upload;
+    string remoteName;
+    string localPath;
+
+    bool ok;
+    bool permanent;         // повтор не поможет (нет файла, неверное имя)
+    bool deduplicated;      // сервер уже хранил такое содержимое - данные не передавались
+    int attempts;
+    long long bytes;
+    long long latencyMs;    // от подключения до первого ответа сервера (последняя попытка)
+    long long durationMs;   // все попытки вместе с паузами между ними
+    string error;
+
+    TransferJob(bool isUpload, const string& remote, const string& local)
+        : upload(isUpload), remoteName(remote), localPath(local), ok(false), permanent(false), deduplicated(false),
+        attempts(0), bytes(0), latencyMs(0), durationMs(0) {}
+};
+
+// Параметры пакетного режима из командной строки
+struct BatchOptions {
+    int jobs;               // одновременных передач
+    int retries;            // повторов неудачной передачи
+    bool json;              // результаты строками JSON
+    string directory;       // локальный каталог для get
+
+    BatchOptions() : jobs(4), retries(2), json(false), directory(".") {}
+};
+
+class FileClient {
+private:
+    string serverIP;
+    int port;
+    unique_ptr<ConnectionPool> pool;
+
+    // Хеши локальных файлов по полному пути: при повторных сравнениях (зеркалирование)
+    // пересчитываются только файлы, у которых изменились размер или время
+    map<string, LocalHash> localHashes;
+    mutex localHashMutex;
+
+public:
+    FileClient(const string& ip, int p) : serverIP(ip), port(p) {
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            cerr << "WSAStartup failed: " << WSAGetLastError() << endl;
+            return;
+        }
+        pool.reset(new ConnectionPool(serverIP, port));
+    }
+
+    ~FileClient() {
+        pool.reset();
+        WSACleanup();
+    }
+
+    // Соединение для одной команды - из пула готовых соединений
+    SOCKET createConnection(int timeoutMs = 2000) {
+        return pool ? pool->acquire(timeoutMs) : INVALID_SOCKET;
+    }
+
+    void printSeparator(int length = 50) {
+        cout << string(length, '=') << endl;
+    }
+
+    void printLine(int length = 50) {
+        cout << string(length, '-') << endl;
+    }
+
+    void printHeader(const string& title) {
+        cout << endl;
+        printSeparator();
+        cout << "  " << title << endl;
+        printSeparator();
+    }
+
+    string formatFileSize(long long bytes) {
+        const char* sizes[] = { "B", "KB", "MB", "GB", "TB" };
+        int i = 0;
+        double dblBytes = static_cast<double>(bytes);
+
+        while (dblBytes >= 1024 && i < 4) {
+            dblBytes /= 1024;
+            i++;
+        }
+
+        char buffer[32];
+        if (i == 0) {
+            sprintf(buffer, "%lld %s", bytes, sizes[i]);
+        }
+        else {
+            sprintf(buffer, "%.2f %s", dblBytes, sizes[i]);
+        }
+        return string(buffer);
+    }
+
+    // Файлы сервера могут лежать в подкаталогах ("docs/a.txt") - локальная копия
+    // сохраняется по тому же относительному пути, недостающие каталоги создаются
+    static void createLocalDirectories(const string& path) {
+        for (size_t slash = path.find_first_of("\\/"); slash != string::npos; slash = path.find_first_of("\\/", slash + 1)) {
+            if (slash > 0) {
+                CreateDirectoryA(path.substr(0, slash).c_str(), NULL);
+            }
+        }
+    }
+
+    // Файлы каталога со всеми подкаталогами - относительные пути с '/', как у сервера.
+    // Служебные каталоги верхнего уровня (начинающиеся с точки) пропускаются
+    static void listLocalTree(const string& directory, vector<pair<string, long long>>& files) {
+        vector<string> pending(1, "");
+        while (!pending.empty()) {
+            string prefix = pending.back().empty() ? "" : pending.back() + "/";
+            pending.pop_back();
+
+            WIN32_FIND_DATAA findFileData;
+            HANDLE hFind = FindFirstFileA((directory + "\\" + prefix + "*").c_str(), &findFileData);
+            if (hFind == INVALID_HANDLE_VALUE) {
+                continue;
+            }
+            do {
+                string name = findFileData.cFileName;
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                    long long size = (static_cast<long long>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
+                    files.push_back(make_pair(prefix + name, size));
+                }
+                else if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && !(prefix.empty() && name[0] == '.')) {
+                    pending.push_back(prefix + name);
+                }
+            } while (FindNextFileA(hFind, &findFileData) != 0);
+            FindClose(hFind);
+        }
+    }
+
+    // Относительный путь от сервера: без дисков, абсолютных путей и выхода наверх
+    static bool isSafeRelativePath(const string& path) {
+        if (path.empty() || path[0] == '/' || path[0] == '\\' || path.find(':') != string::npos) {
+            return false;
+        }
+        size_t start = 0;
+        while (start <= path.length()) {
+            size_t slash = path.find_first_of("\\/", start);
+            if (slash == string::npos) {
+                slash = path.length();
+            }
+            string part = path.substr(start, slash - start);
+            if (part.empty() || part == "." || part == "..") {
+                return false;
+            }
+            start = slash + 1;
+        }
+        return true;
+    }
+
+    void showLocalFiles() {
+        char currentDir[MAX_PATH];
+        GetCurrentDirectoryA(MAX_PATH, currentDir);
+
+        printHeader("LOCAL FILES");
+        cout << "Directory: " << currentDir << endl;
+        printLine();
+
+        WIN32_FIND_DATAA findFileData;
+        HANDLE hFind = FindFirstFileA((string(currentDir) + "\\*").c_str(), &findFileData);
+
+        if (hFind != INVALID_HANDLE_VALUE) {
+            int fileCount = 0;
+            long long totalSize = 0;
+            vector<pair<string, long long>> files;
+
+            do {
+                if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                    string filename = findFileData.cFileName;
+                    long long filesize = (static_cast<long long>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
+                    files.push_back(make_pair(filename, filesize));
+                    fileCount++;
+                    totalSize += filesize;
+                }
+            } while (FindNextFileA(hFind, &findFileData) != 0);
+
+            FindClose(hFind);
+
+            sort(files.begin(), files.end());
+
+            if (fileCount > 0) {
+                cout << "Total files: " << fileCount << " | Total size: " << formatFileSize(totalSize) << endl;
+                printLine();
+
+                for (int i = 0; i < files.size(); i++) {
+                    string filename = files[i].first;
+                    long long filesize = files[i].second;
+
+                    cout << setw(3) << (i + 1) << ". "
+                        << setw(35) << left << filename
+                        << " (" << formatFileSize(filesize) << ")" << endl;
+                }
+            }
+            else {
+                cout << "No files found." << endl;
+            }
+        }
+        else {
+            cerr << "Error reading directory." << endl;
+        }
+
+        printLine();
+    }
+
+    void requestFileList() {
+        printHeader("SERVER FILE LIST");
+
+        auto totalStartTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(1000);
+        if (sock == INVALID_SOCKET) {
+            cerr << "Cannot connect to server" << endl;
+            return;
+        }
+
+        DWORD readTimeout = 2000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&readTimeout, sizeof(readTimeout));
+
+        string command = "LIST\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        cout << "Receiving file list..." << endl;
+
+        string response;
+        char buffer[8192];
+        int bytesReceived;
+
+        while (true) {
+            bytesReceived = recv(sock, buffer, sizeof(buffer) - 1, 0);
+            if (bytesReceived > 0) {
+                buffer[bytesReceived] = '\0';
+                response.append(buffer, bytesReceived);
+            }
+            else if (bytesReceived == 0) {
+                break;
+            }
+            else {
+                break;
+            }
+        }
+
+        closesocket(sock);
+
+        auto totalEndTime = chrono::steady_clock::now();
+        auto totalDuration = chrono::duration_cast<chrono::milliseconds>(totalEndTime - totalStartTime);
+
+        if (!response.empty()) {
+            cout << endl << response << endl;
+            cout << "Received in " << totalDuration.count() << " ms" << endl;
+        }
+        else {
+            cerr << "No response from server" << endl;
+        }
+    }
+
+    // Улучшенный метод скачивания - сначала получаем размер отдельным запросом
+    void downloadFile(const string& filename) {
+        printHeader("DOWNLOAD FILE");
+
+        if (filename.empty()) {
+            cerr << "Filename cannot be empty" << endl;
+            return;
+        }
+
+        // Размер приходит в первой строке ответа GETIF - отдельный запрос за ним не нужен
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "GETIF - " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string reply;
+        if (!reader.readLine(reply) || reply.find("OK ") != 0) {
+            cout << "Error: " << reply << endl;
+            closesocket(sock);
+            return;
+        }
+
+        long long fileSize = 0;
+        stringstream(reply.substr(3)) >> fileSize;
+        cout << "File size: " << formatFileSize(fileSize) << endl;
+        cout << "Downloading " << filename << "..." << endl;
+
+        createLocalDirectories(filename);
+        AsyncFileWriter file;
+        if (!file.open(filename)) {
+            cerr << "Cannot create file" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        long long totalBytes = 0;
+        int lastPercent = -1;
+
+        auto startTime = chrono::steady_clock::now();
+
+        // Данные читаются прямо в буферы записи, на диск их пишет отдельный поток
+        while (totalBytes < fileSize) {
+            size_t room = 0;
+            char* buffer = file.space(room);
+            size_t length = static_cast<size_t>(fileSize - totalBytes < static_cast<long long>(room) ? fileSize - totalBytes : room);
+            if (!reader.readExact(buffer, length) || !file.advance(length)) {
+                break;
+            }
+            totalBytes += length;
+
+            int percent = static_cast<int>((totalBytes * 100) / fileSize);
+            if (percent % 25 == 0 && percent != lastPercent) {
+                cout << "Progress: " << percent << "%" << endl;
+                lastPercent = percent;
+            }
+        }
+
+        closesocket(sock);
+        bool written = file.close();
+
+        auto endTime = chrono::steady_clock::now();
+        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+
+        if (totalBytes == fileSize && written) {
+            cout << endl << "Download completed!" << endl;
+            printLine();
+            cout << "File:  " << filename << endl;
+            cout << "Size:  " << formatFileSize(totalBytes) << endl;
+            cout << "Time:  " << duration.count() << " ms" << endl;
+
+            if (duration.count() > 0) {
+                double speed = (totalBytes * 1000.0) / (duration.count() * 1024.0);
+                cout << "Speed: " << fixed << setprecision(2) << speed << " KB/s" << endl;
+            }
+            if (file.getStallMs() > 0) {
+                cout << "Disk:  receiving waited " << file.getStallMs() << " ms for the disk" << endl;
+            }
+
+            // Проверяем файл на наличие заголовков
+            verifyFileContent(filename);
+        }
+        else if (!written) {
+            cout << "Download failed - cannot write " << filename << endl;
+            DeleteFileA(filename.c_str());
+        }
+        else {
+            cout << "Download failed - received " << totalBytes << " of " << fileSize << " bytes" << endl;
+            DeleteFileA(filename.c_str());
+        }
+    }
+
+    // Альтернативный метод - договариваемся с сервером о новом протоколе
+    void downloadFileNewProtocol(const string& filename) {
+        printHeader("DOWNLOAD FILE (NEW PROTOCOL)");
+
+        if (filename.empty()) {
+            cerr << "Filename cannot be empty" << endl;
+            return;
+        }
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        // Новая команда - RAW означает "сырые" данные без заголовков
+        string command = "RAW " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        // Сначала получаем ответ сервера
+        char responseBuffer[256];
+        int responseBytes = recv(sock, responseBuffer, sizeof(responseBuffer) - 1, 0);
+        if (responseBytes <= 0) {
+            cerr << "No response from server" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        responseBuffer[responseBytes] = '\0';
+        string response = responseBuffer;
+
+        if (response.find("ERROR") != string::npos) {
+            cout << "Server error: " << response << endl;
+            closesocket(sock);
+            return;
+        }
+
+        cout << "Starting download of " << filename << "..." << endl;
+
+        createLocalDirectories(filename);
+        AsyncFileWriter file;
+        if (!file.open(filename)) {
+            cerr << "Cannot create file" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        int bytesReceived;
+        long long totalBytes = responseBytes;
+
+        // Записываем уже полученный ответ (если это не был заголовок ошибки)
+        if (response.find("OK") == 0 || response.find("READY") == 0) {
+            // Это служебный ответ, не записываем его в файл
+            cout << "Server ready for transfer" << endl;
+            totalBytes = 0;
+        }
+        else {
+            // Возможно, это уже часть файла
+            file.write(responseBuffer, responseBytes);
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        auto startTime = chrono::steady_clock::now();
+
+        // Читаем остальные данные прямо в буферы записи
+        long long nextReport = 256 * 1024;
+        while (true) {
+            size_t room = 0;
+            char* buffer = file.space(room);
+            bytesReceived = recv(sock, buffer, static_cast<int>(room), 0);
+            if (bytesReceived > 0) {
+                totalBytes += bytesReceived;
+                if (!file.advance(bytesReceived)) {
+                    break;
+                }
+
+                // Показываем прогресс
+                if (totalBytes >= nextReport) {
+                    cout << "Received: " << formatFileSize(totalBytes) << endl;
+                    nextReport += 256 * 1024;
+                }
+            }
+            else if (bytesReceived == 0) {
+                break;
+            }
+            else {
+                break;
+            }
+        }
+
+        closesocket(sock);
+        bool written = file.close();
+
+        auto endTime = chrono::steady_clock::now();
+        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+
+        if (totalBytes > 0 && written) {
+            cout << endl << "Download completed!" << endl;
+            printLine();
+            cout << "File:  " << filename << endl;
+            cout << "Size:  " << formatFileSize(totalBytes) << endl;
+            cout << "Time:  " << duration.count() << " ms" << endl;
+
+            verifyFileContent(filename);
+        }
+        else {
+            cout << "Download failed" << endl;
+        }
+    }
+
+    void verifyFileContent(const string& filename) {
+        cout << endl << "Verifying file content for SIZE: headers..." << endl;
+
+        ifstream file(filename, ios::binary);
+        if (!file) {
+            cout << "Cannot open file for verification" << endl;
+            return;
+        }
+
+        // Читаем весь файл для проверки
+        file.seekg(0, ios::end);
+        streamsize fileSize = file.tellg();
+        file.seekg(0, ios::beg);
+
+        if (fileSize == 0) {
+            cout << "File is empty" << endl;
+            file.close();
+            return;
+        }
+
+        // Читаем первые 1000 байт для быстрой проверки
+        const int CHECK_SIZE = min((streamsize)1000, fileSize);
+        vector<char> buffer(CHECK_SIZE);
+        file.read(buffer.data(), CHECK_SIZE);
+        file.close();
+
+        string content(buffer.data(), CHECK_SIZE);
+
+        // Ищем заголовок SIZE:
+        size_t sizePos = content.find("SIZE:");
+        if (sizePos != string::npos) {
+            cout << "!!! ERROR !!! File contains 'SIZE:' at position " << sizePos << endl;
+
+            // Находим конец строки с размером
+            size_t endLine = content.find("\n", sizePos);
+            if (endLine != string::npos) {
+                string header = content.substr(sizePos, endLine - sizePos + 1);
+                cout << "Header found: " << header;
+
+                // Показываем контекст
+                size_t contextStart = max(0, (int)sizePos - 20);
+                size_t contextEnd = min(content.length(), endLine + 20);
+                cout << "Context: ..." << content.substr(contextStart, contextEnd - contextStart) << "..." << endl;
+
+                // Предлагаем очистить файл
+                cout << endl << "Do you want to remove the header from the file? (y/n): ";
+                string answer;
+                getline(cin, answer);
+
+                if (answer == "y" || answer == "Y") {
+                    removeHeaderFromFile(filename, endLine + 1);
+                }
+            }
+        }
+        else {
+            cout << "✓ File is CLEAN - no SIZE: headers found in first " << CHECK_SIZE << " bytes" << endl;
+
+            // Показываем начало файла для текстовых файлов
+            bool isText = true;
+            for (char ch : content) {
+                if (ch == 0 || (ch < 32 && ch != '\n' && ch != '\r' && ch != '\t' && ch != '\b')) {
+                    isText = false;
+                    break;
+                }
+            }
+
+            if (isText && !content.empty()) {
+                cout << "First few lines:" << endl;
+                cout << "----------------" << endl;
+
+                stringstream ss(content);
+                string line;
+                int lineCount = 0;
+                while (getline(ss, line) && lineCount < 3) {
+                    cout << line << endl;
+                    lineCount++;
+                }
+                cout << "----------------" << endl;
+            }
+        }
+    }
+
+    void removeHeaderFromFile(const string& filename, size_t headerSize) {
+        ifstream inFile(filename, ios::binary);
+        if (!inFile) {
+            cerr << "Cannot open file for cleaning" << endl;
+            return;
+        }
+
+        // Переходим после заголовка
+        inFile.seekg(headerSize, ios::beg);
+
+        // Создаем временный файл
+        string tempFile = filename + ".clean";
+        ofstream outFile(tempFile, ios::binary);
+
+        if (!outFile) {
+            cerr << "Cannot create clean file" << endl;
+            inFile.close();
+            return;
+        }
+
+        // Копируем данные после заголовка
+        const int BUFFER_SIZE = 65536;
+        char buffer[BUFFER_SIZE];
+
+        while (!inFile.eof()) {
+            inFile.read(buffer, BUFFER_SIZE);
+            streamsize bytesRead = inFile.gcount();
+            if (bytesRead > 0) {
+                outFile.write(buffer, bytesRead);
+            }
+        }
+
+        inFile.close();
+        outFile.close();
+
+        // Заменяем старый файл чистым
+        DeleteFileA(filename.c_str());
+        rename(tempFile.c_str(), filename.c_str());
+
+        cout << "File cleaned successfully!" << endl;
+
+        // Проверяем новый размер
+        ifstream checkFile(filename, ios::binary | ios::ate);
+        streamsize newSize = checkFile.tellg();
+        checkFile.close();
+
+        cout << "New file size: " << formatFileSize(newSize) << endl;
+    }
+
+    void uploadFile() {
+        printHeader("UPLOAD FILE");
+
+        showLocalFiles();
+
+        cout << endl << "Enter filename to upload: ";
+        string filename;
+        getline(cin, filename);
+
+        if (filename.empty()) {
+            cout << "Upload cancelled" << endl;
+            return;
+        }
+
+        char currentDir[MAX_PATH];
+        GetCurrentDirectoryA(MAX_PATH, currentDir);
+        string fullPath = string(currentDir) + "\\" + filename;
+
+        ifstream testFile(fullPath, ios::binary | ios::ate);
+        if (!testFile) {
+            cerr << "File not found: " << filename << endl;
+            return;
+        }
+
+        streamsize fileSize = testFile.tellg();
+        testFile.close();
+
+        cout << endl << "File: " << filename << " (" << formatFileSize(fileSize) << ")" << endl;
+
+        cout << "Start upload? (y/n): ";
+        string confirm;
+        getline(cin, confirm);
+
+        if (confirm != "y" && confirm != "Y") {
+            cout << "Upload cancelled" << endl;
+            return;
+        }
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD uploadTimeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&uploadTimeout, sizeof(uploadTimeout));
+
+        // Отправляем размер файла отдельно от данных
+        string command = "PUT " + filename + " " + to_string(fileSize) + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        // Ждем подтверждения
+        char readyBuffer[256];
+        DWORD readyTimeout = 2000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&readyTimeout, sizeof(readyTimeout));
+
+        int readyBytes = recv(sock, readyBuffer, sizeof(readyBuffer) - 1, 0);
+        if (readyBytes <= 0 || string(readyBuffer).find("READY") == string::npos) {
+            cerr << "Server not ready: ";
+            if (readyBytes > 0) {
+                readyBuffer[readyBytes] = '\0';
+                cerr << readyBuffer;
+            }
+            closesocket(sock);
+            return;
+        }
+
+        cout << "Uploading file..." << endl;
+
+        auto startTime = chrono::steady_clock::now();
+
+        streamsize totalSent = 0;
+        if (!sendFileData(sock, fullPath, fileSize, totalSent)) {
+            closesocket(sock);
+            return;
+        }
+
+        // Закрываем отправку
+        shutdown(sock, SD_SEND);
+
+        // Ждем подтверждения
+        char confirmBuffer[256];
+        DWORD confirmTimeout = 2000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&confirmTimeout, sizeof(confirmTimeout));
+
+        int confirmBytes = recv(sock, confirmBuffer, sizeof(confirmBuffer) - 1, 0);
+        closesocket(sock);
+
+        if (confirmBytes > 0) {
+            confirmBuffer[confirmBytes] = '\0';
+            cout << endl << "Server response: " << confirmBuffer << endl;
+        }
+
+        auto endTime = chrono::steady_clock::now();
+        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+
+        printUploadSummary(filename, totalSent, duration.count());
+    }
+
+    // Файл читается отдельным потоком с упреждением, здесь только отправка готовых блоков.
+    // false - отправлено не все (ошибка сети, чтения или файл стал короче): вызывающий
+    // закрывает сокет без shutdown, и сервер не примет обрезанный файл за целый
+    bool sendFileData(SOCKET sock, const string& fullPath, streamsize fileSize, streamsize& totalSent) {
+        AsyncFileReader file;
+        if (!file.open(fullPath)) {
+            cerr << "Cannot open file" << endl;
+            return false;
+        }
+
+        totalSent = 0;
+        int lastPercent = -1;
+        size_t length = 0;
+        bool sent = true;
+        while (const char* block = file.next(length)) {
+            if (!sendAll(sock, block, length)) {
+                cerr << "Upload failed: " << WSAGetLastError() << endl;
+                sent = false;
+                break;
+            }
+            totalSent += length;
+
+            if (fileSize > 0) {
+                int percent = static_cast<int>((totalSent * 100) / fileSize);
+                if (percent % 25 == 0 && percent != lastPercent) {
+                    cout << "Progress: " << percent << "%" << endl;
+                    lastPercent = percent;
+                }
+            }
+        }
+
+        bool readFailed = file.hasFailed();
+        if (readFailed) {
+            cerr << "Cannot read " << fullPath << endl;
+        }
+        else if (sent && totalSent != fileSize) {
+            cerr << "File changed during upload: sent " << totalSent << " of " << fileSize << " bytes" << endl;
+        }
+        else if (file.getStallMs() > 0) {
+            cout << "Sending waited " << file.getStallMs() << " ms for the disk" << endl;
+        }
+        file.close();
+        return sent && !readFailed && totalSent == fileSize;
+    }
+
+    void printUploadSummary(const string& filename, streamsize totalSent, long long durationMs) {
+        cout << endl << "Upload completed!" << endl;
+        printLine();
+        cout << "File:  " << filename << endl;
+        cout << "Size:  " << formatFileSize(totalSent) << endl;
+        cout << "Time:  " << durationMs << " ms" << endl;
+
+        if (durationMs > 0) {
+            double speed = (totalSent * 1000.0) / (durationMs * 1024.0);
+            cout << "Speed: " << fixed << setprecision(2) << speed << " KB/s" << endl;
+        }
+    }
+
+    // Сначала отправляется BLAKE3 файла: если сервер уже хранит такое содержимое,
+    // файл появляется на сервере без передачи данных
+    void uploadFileWithHash() {
+        printHeader("UPLOAD FILE (HASH FIRST)");
+
+        showLocalFiles();
+
+        cout << endl << "Enter filename to upload: ";
+        string filename;
+        getline(cin, filename);
+
+        if (filename.empty()) {
+            cout << "Upload cancelled" << endl;
+            return;
+        }
+
+        char currentDir[MAX_PATH];
+        GetCurrentDirectoryA(MAX_PATH, currentDir);
+        string fullPath = string(currentDir) + "\\" + filename;
+
+        cout << "Hashing " << filename << "..." << endl;
+
+        auto startTime = chrono::steady_clock::now();
+
+        string hash;
+        long long fileSize = 0;
+        if (!Blake3::hashFile(fullPath, hash, &fileSize)) {
+            cerr << "File not found: " << filename << endl;
+            return;
+        }
+
+        auto hashDuration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        cout << "BLAKE3: " << hash << " (" << hashDuration.count() << " ms)" << endl;
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD uploadTimeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&uploadTimeout, sizeof(uploadTimeout));
+
+        string command = "PUTHASH " + hash + " " + to_string(fileSize) + " " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        char replyBuffer[256];
+        DWORD replyTimeout = 5000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&replyTimeout, sizeof(replyTimeout));
+
+        int replyBytes = recv(sock, replyBuffer, sizeof(replyBuffer) - 1, 0);
+        if (replyBytes <= 0) {
+            cerr << "No response from server" << endl;
+            closesocket(sock);
+            return;
+        }
+        replyBuffer[replyBytes] = '\0';
+        string reply = replyBuffer;
+
+        streamsize totalSent = 0;
+        if (reply.find("UPLOAD_COMPLETE") == 0) {
+            closesocket(sock);
+            cout << endl << "Server already has this content - no data sent" << endl;
+            cout << "Server response: " << reply << endl;
+        }
+        else if (reply.find("READY") == 0) {
+            cout << "Uploading file..." << endl;
+
+            if (!sendFileData(sock, fullPath, fileSize, totalSent)) {
+                closesocket(sock);
+                return;
+            }
+            shutdown(sock, SD_SEND);
+
+            // Сервер хеширует принятые данные перед ответом
+            DWORD confirmTimeout = 60000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&confirmTimeout, sizeof(confirmTimeout));
+
+            char confirmBuffer[256];
+            int confirmBytes = recv(sock, confirmBuffer, sizeof(confirmBuffer) - 1, 0);
+            closesocket(sock);
+
+            if (confirmBytes > 0) {
+                confirmBuffer[confirmBytes] = '\0';
+                cout << endl << "Server response: " << confirmBuffer << endl;
+            }
+        }
+        else {
+            closesocket(sock);
+            cerr << "Server error: " << reply << endl;
+            return;
+        }
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        printUploadSummary(filename, totalSent, duration.count());
+    }
+
+    // Запрашивает у сервера BLAKE3 файла - так локальную копию можно сверить без скачивания
+    bool requestFileHash(const string& filename, string& hash, long long& fileSize) {
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+
+        // Хеширование большого файла на сервере может занять время
+        DWORD timeout = 120000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "HASH " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return false;
+        }
+
+        string response;
+        char buffer[256];
+        int bytesReceived;
+        while (response.find('\n') == string::npos
+            && (bytesReceived = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, bytesReceived);
+        }
+        closesocket(sock);
+
+        if (response.find("HASH: ") != 0) {
+            cout << "Server error: " << response << endl;
+            return false;
+        }
+
+        stringstream ss(response.substr(6));
+        ss >> hash >> fileSize;
+        return !ss.fail() && hash.length() == Blake3::OUT_LEN * 2;
+    }
+
+    void compareWithServer(const string& filename) {
+        printHeader("COMPARE WITH SERVER");
+
+        if (filename.empty()) {
+            cerr << "Filename cannot be empty" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        string localHash;
+        long long localSize = 0;
+        if (!Blake3::hashFile(filename, localHash, &localSize)) {
+            cerr << "Cannot read local file: " << filename << endl;
+            return;
+        }
+
+        auto hashedTime = chrono::steady_clock::now();
+
+        string serverHash;
+        long long serverSize = 0;
+        if (!requestFileHash(filename, serverHash, serverSize)) {
+            return;
+        }
+
+        auto endTime = chrono::steady_clock::now();
+
+        cout << "Local:  " << localHash << " (" << formatFileSize(localSize) << ", "
+            << chrono::duration_cast<chrono::milliseconds>(hashedTime - startTime).count() << " ms)" << endl;
+        cout << "Server: " << serverHash << " (" << formatFileSize(serverSize) << ", "
+            << chrono::duration_cast<chrono::milliseconds>(endTime - hashedTime).count() << " ms)" << endl;
+        printLine();
+
+        if (localHash == serverHash && localSize == serverSize) {
+            cout << "✓ Files are IDENTICAL - no download needed" << endl;
+        }
+        else {
+            cout << "Files DIFFER" << endl;
+        }
+    }
+
+    bool sendAll(SOCKET sock, const char* data, size_t length) {
+        while (length > 0) {
+            int sent = send(sock, data, static_cast<int>(min(length, static_cast<size_t>(1 << 20))), 0);
+            if (sent == SOCKET_ERROR) {
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    // Строки и пустая строка в конце - отдельным потоком: STAT отвечает, не дожидаясь конца
+    // списка, и без встречного чтения буферы сокета заполнились бы с обеих сторон
+    thread sendLinesAsync(SOCKET sock, const vector<string>& lines, atomic<bool>& sent) {
+        return thread([this, sock, &lines, &sent]() {
+            string list;
+            for (size_t i = 0; i < lines.size(); i++) {
+                list += lines[i] + "\n";
+            }
+            list += "\n";
+            sent = sendAll(sock, list.c_str(), list.length());
+        });
+    }
+
+    void printTransferSummary(const string& filename, long long fileSize, long long transferred, long long durationMs) {
+        printLine();
+        cout << "File:        " << filename << endl;
+        cout << "Size:        " << formatFileSize(fileSize) << endl;
+        cout << "Transferred: " << formatFileSize(transferred);
+        if (fileSize > 0) {
+            cout << " (" << fixed << setprecision(1) << (transferred * 100.0 / fileSize) << "%)";
+        }
+        cout << endl;
+        cout << "Time:        " << durationMs << " ms" << endl;
+    }
+
+    // Загрузка по чанкам: сервер получает только те чанки, которых нет ни в одном его файле
+    void uploadFileChunked() {
+        printHeader("UPLOAD FILE (CHUNKED)");
+
+        showLocalFiles();
+
+        cout << endl << "Enter filename to upload: ";
+        string filename;
+        getline(cin, filename);
+
+        if (filename.empty()) {
+            cout << "Upload cancelled" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        cout << "Chunking " << filename << "..." << endl;
+        vector<CdcChunk> chunks;
+        if (!FastCdc::chunkFile(filename, chunks)) {
+            cerr << "File not found: " << filename << endl;
+            return;
+        }
+
+        long long fileSize = 0;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            fileSize += chunks[i].length;
+        }
+        cout << chunks.size() << " chunks, " << formatFileSize(fileSize) << endl;
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "CDCPUT " + to_string(fileSize) + " " + to_string(chunks.size()) + " " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string reply;
+        if (!reader.readLine(reply) || reply != "READY") {
+            cerr << "Server not ready: " << reply << endl;
+            closesocket(sock);
+            return;
+        }
+
+        string recipe;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            recipe += chunks[i].hash + " " + to_string(chunks[i].length) + "\n";
+        }
+        if (!sendAll(sock, recipe.c_str(), recipe.length())) {
+            cerr << "Failed to send chunk list" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        string needLine;
+        string indexLine;
+        if (!reader.readLine(needLine) || needLine.find("NEED ") != 0 || !reader.readLine(indexLine, 64 * 1024 * 1024)) {
+            cerr << "Server error: " << needLine << endl;
+            closesocket(sock);
+            return;
+        }
+
+        cout << "Server needs " << needLine.substr(5) << " of " << chunks.size() << " chunks" << endl;
+
+        ifstream file(filename, ios::binary);
+        vector<char> buffer(FastCdc::MAX_SIZE);
+        stringstream indices(indexLine);
+        long long index = 0;
+        long long transferred = 0;
+        while (indices >> index) {
+            if (index < 0 || index >= static_cast<long long>(chunks.size())) {
+                break;
+            }
+            const CdcChunk& chunk = chunks[static_cast<size_t>(index)];
+            file.seekg(static_cast<streamoff>(chunk.offset), ios::beg);
+            file.read(buffer.data(), chunk.length);
+            if (file.gcount() != static_cast<streamsize>(chunk.length) || !sendAll(sock, buffer.data(), chunk.length)) {
+                cerr << "Upload failed: " << WSAGetLastError() << endl;
+                break;
+            }
+            transferred += chunk.length;
+        }
+        file.close();
+
+        shutdown(sock, SD_SEND);
+
+        string confirm;
+        reader.readLine(confirm);
+        closesocket(sock);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        cout << endl << "Server response: " << confirm << endl;
+        printTransferSummary(filename, fileSize, transferred, duration.count());
+    }
+
+    // Скачивание по чанкам: чанки, которые уже есть в локальной копии файла, не передаются
+    void downloadFileChunked(const string& filename) {
+        printHeader("DOWNLOAD FILE (CHUNKED)");
+
+        if (filename.empty()) {
+            cerr << "Filename cannot be empty" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        // Серверу может понадобиться время, чтобы разбить большой файл
+        DWORD timeout = 120000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "CDCGET " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string header;
+        if (!reader.readLine(header) || header.find("RECIPE ") != 0) {
+            cout << "Server error: " << header << endl;
+            closesocket(sock);
+            return;
+        }
+
+        stringstream hs(header.substr(7));
+        long long fileSize = 0;
+        size_t count = 0;
+        hs >> fileSize >> count;
+        if (hs.fail() || fileSize < 0 || count > static_cast<size_t>(fileSize / FastCdc::MIN_SIZE + 1)) {
+            cerr << "Invalid chunk list header: " << header << endl;
+            closesocket(sock);
+            return;
+        }
+
+        vector<CdcChunk> chunks(count);
+        unsigned long long offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            string line;
+            if (!reader.readLine(line)) {
+                cerr << "Chunk list truncated" << endl;
+                closesocket(sock);
+                return;
+            }
+            stringstream ls(line);
+            ls >> chunks[i].hash >> chunks[i].length;
+            chunks[i].offset = offset;
+            offset += chunks[i].length;
+        }
+
+        // Чанки локальной копии (если она есть)
+        vector<CdcChunk> localChunks;
+        map<string, unsigned long long> localOffsets;
+        if (FastCdc::chunkFile(filename, localChunks)) {
+            for (size_t i = 0; i < localChunks.size(); i++) {
+                localOffsets[localChunks[i].hash] = localChunks[i].offset;
+            }
+        }
+
+        string wantList;
+        size_t wantCount = 0;
+        map<string, bool> requested;
+        for (size_t i = 0; i < count; i++) {
+            if (!localOffsets.count(chunks[i].hash) && !requested.count(chunks[i].hash)) {
+                requested[chunks[i].hash] = true;
+                wantList += to_string(i) + " ";
+                wantCount++;
+            }
+        }
+
+        cout << "Need " << wantCount << " of " << count << " chunks from server" << endl;
+
+        string wantMsg = "WANT " + to_string(wantCount) + "\n" + wantList + "\n";
+        if (!sendAll(sock, wantMsg.c_str(), wantMsg.length())) {
+            cerr << "Failed to send chunk request" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        createLocalDirectories(filename);
+        string tempPath = filename + ".cdc.part";
+        ifstream localFile(filename, ios::binary);
+        fstream out(tempPath, ios::binary | ios::in | ios::out | ios::trunc);
+        if (!out) {
+            cerr << "Cannot create file" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        vector<char> buffer(FastCdc::MAX_SIZE);
+        map<string, unsigned long long> written;
+        long long transferred = 0;
+        bool ok = true;
+        for (size_t i = 0; ok && i < count; i++) {
+            const CdcChunk& chunk = chunks[i];
+            if (chunk.length > buffer.size()) {
+                ok = false;
+                break;
+            }
+            if (written.count(chunk.hash)) {
+                out.seekg(static_cast<streamoff>(written[chunk.hash]), ios::beg);
+                out.read(buffer.data(), chunk.length);
+                ok = out.gcount() == static_cast<streamsize>(chunk.length);
+            }
+            else if (localOffsets.count(chunk.hash)) {
+                localFile.seekg(static_cast<streamoff>(localOffsets[chunk.hash]), ios::beg);
+                localFile.read(buffer.data(), chunk.length);
+                ok = localFile.gcount() == static_cast<streamsize>(chunk.length);
+            }
+            else {
+                ok = reader.readExact(buffer.data(), chunk.length)
+                    && FastCdc::chunkHash(reinterpret_cast<const uint8_t*>(buffer.data()), chunk.length) == chunk.hash;
+                transferred += chunk.length;
+            }
+
+            out.seekp(static_cast<streamoff>(chunk.offset), ios::beg);
+            out.write(buffer.data(), chunk.length);
+            ok = ok && out.good();
+            written[chunk.hash] = chunk.offset;
+        }
+
+        out.close();
+        localFile.close();
+        closesocket(sock);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        if (!ok) {
+            cout << "Download failed" << endl;
+            DeleteFileA(tempPath.c_str());
+            return;
+        }
+
+        if (!MoveFileExA(tempPath.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            cerr << "Cannot replace " << filename << " (Error: " << GetLastError() << ")" << endl;
+            DeleteFileA(tempPath.c_str());
+            return;
+        }
+
+        cout << endl << "Download completed!" << endl;
+        printTransferSummary(filename, fileSize, transferred, duration.count());
+    }
+
+    // Скачивание дельтой: сервер получает сигнатуры блоков локальной копии
+    // и присылает только отличающиеся байты
+    void downloadFileDelta(const string& filename) {
+        printHeader("DOWNLOAD FILE (DELTA)");
+
+        if (filename.empty()) {
+            cerr << "Filename cannot be empty" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        long long basisSize = 0;
+        ifstream sizeCheck(filename, ios::binary | ios::ate);
+        if (sizeCheck) {
+            basisSize = static_cast<long long>(sizeCheck.tellg());
+        }
+        sizeCheck.close();
+
+        size_t blockSize = RsyncDelta::chooseBlockSize(basisSize);
+        vector<BlockSignature> signatures;
+        if (basisSize > 0 && !RsyncDelta::computeSignatures(filename, blockSize, signatures)) {
+            signatures.clear();
+        }
+        basisSize = 0;
+        for (size_t i = 0; i < signatures.size(); i++) {
+            basisSize += signatures[i].length;
+        }
+        cout << "Local copy: " << signatures.size() << " blocks of " << formatFileSize(static_cast<long long>(blockSize)) << endl;
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        // Серверу может понадобиться время, чтобы посчитать хеш большого файла
+        DWORD timeout = 120000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "DELTAGET " + to_string(blockSize) + " " + to_string(signatures.size()) + " "
+            + to_string(basisSize) + " " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string reply;
+        if (!reader.readLine(reply) || reply != "READY") {
+            cout << "Server error: " << reply << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketWriter writer(sock);
+        if (!RsyncDelta::writeSignatures(writer, signatures)) {
+            cerr << "Failed to send signatures" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        createLocalDirectories(filename);
+        string tempPath = filename + ".delta.part";
+        long long fileSize = 0;
+        long long literalBytes = 0;
+        bool ok = RsyncDelta::applyDelta(reader, filename, blockSize, tempPath, fileSize, literalBytes);
+        closesocket(sock);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        if (!ok) {
+            cout << "Download failed" << endl;
+            DeleteFileA(tempPath.c_str());
+            return;
+        }
+
+        if (!MoveFileExA(tempPath.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            cerr << "Cannot replace " << filename << " (Error: " << GetLastError() << ")" << endl;
+            DeleteFileA(tempPath.c_str());
+            return;
+        }
+
+        cout << endl << "Download completed!" << endl;
+        printTransferSummary(filename, fileSize, literalBytes, duration.count());
+    }
+
+    // Загрузка дельтой относительно копии файла на сервере
+    void uploadFileDelta() {
+        printHeader("UPLOAD FILE (DELTA)");
+
+        showLocalFiles();
+
+        cout << endl << "Enter filename to upload: ";
+        string filename;
+        getline(cin, filename);
+
+        if (filename.empty()) {
+            cout << "Upload cancelled" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        string hash;
+        long long fileSize = 0;
+        if (!Blake3::hashFile(filename, hash, &fileSize)) {
+            cerr << "File not found: " << filename << endl;
+            return;
+        }
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        // Сервер сначала читает свою копию целиком, чтобы посчитать сигнатуры
+        DWORD timeout = 120000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "DELTAPUT " + to_string(fileSize) + " " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string header;
+        if (!reader.readLine(header) || header.find("SIGS ") != 0) {
+            cout << "Server error: " << header << endl;
+            closesocket(sock);
+            return;
+        }
+
+        stringstream hs(header.substr(5));
+        long long blockSize = 0;
+        long long count = 0;
+        long long basisSize = 0;
+        hs >> blockSize >> count >> basisSize;
+
+        vector<BlockSignature> signatures;
+        if (blockSize < 512 || blockSize > 1024 * 1024 || count < 0
+            || !RsyncDelta::readSignatures(reader, static_cast<size_t>(count), static_cast<size_t>(blockSize), basisSize, signatures)) {
+            cerr << "Invalid signature list" << endl;
+            closesocket(sock);
+            return;
+        }
+        cout << "Server copy: " << signatures.size() << " blocks of " << formatFileSize(blockSize) << endl;
+
+        SocketWriter writer(sock);
+        long long literalBytes = 0;
+        if (!RsyncDelta::sendDelta(filename, hash, static_cast<size_t>(blockSize), signatures, writer, fileSize, literalBytes)) {
+            cerr << "Upload failed: " << WSAGetLastError() << endl;
+        }
+
+        shutdown(sock, SD_SEND);
+
+        string confirm;
+        reader.readLine(confirm);
+        closesocket(sock);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        cout << endl << "Server response: " << confirm << endl;
+        printTransferSummary(filename, fileSize, literalBytes, duration.count());
+    }
+
+    // Копия файла с правками: по смещению offset удаляется removeLength байт и вставляется insert
+    struct FileEdit {
+        long long offset;
+        long long removeLength;
+        string insert;
+    };
+
+    bool writeEditedCopy(const string& sourcePath, const string& targetPath, const vector<FileEdit>& edits) {
+        ifstream in(sourcePath, ios::binary);
+        ofstream out(targetPath, ios::binary | ios::trunc);
+        if (!in || !out) {
+            return false;
+        }
+
+        vector<char> buffer(1024 * 1024);
+        long long position = 0;
+        size_t next = 0;
+        while (true) {
+            long long limit = next < edits.size() ? edits[next].offset - position : static_cast<long long>(buffer.size());
+            if (limit > static_cast<long long>(buffer.size())) {
+                limit = static_cast<long long>(buffer.size());
+            }
+            if (limit > 0) {
+                in.read(buffer.data(), limit);
+                streamsize got = in.gcount();
+                out.write(buffer.data(), got);
+                position += got;
+                if (got < limit) {
+                    break;
+                }
+                continue;
+            }
+            if (next >= edits.size()) {
+                break;
+            }
+            out.write(edits[next].insert.data(), edits[next].insert.size());
+            in.seekg(static_cast<streamoff>(edits[next].removeLength), ios::cur);
+            position += edits[next].removeLength;
+            next++;
+        }
+        return out.good();
+    }
+
+    void benchmarkDeltaScenario(const string& name, const string& basePath, const string& newPath) {
+        auto t0 = chrono::steady_clock::now();
+
+        ifstream sizeCheck(basePath, ios::binary | ios::ate);
+        long long baseSize = static_cast<long long>(sizeCheck.tellg());
+        sizeCheck.close();
+
+        size_t blockSize = RsyncDelta::chooseBlockSize(baseSize);
+        vector<BlockSignature> signatures;
+        string signatureWire;
+        {
+            SocketWriter writer(&signatureWire);
+            RsyncDelta::computeSignatures(basePath, blockSize, signatures);
+            RsyncDelta::writeSignatures(writer, signatures);
+        }
+        auto t1 = chrono::steady_clock::now();
+
+        string hash;
+        long long newSize = 0;
+        Blake3::hashFile(newPath, hash, &newSize);
+        auto t2 = chrono::steady_clock::now();
+
+        string deltaWire;
+        long long literalBytes = 0;
+        {
+            SocketWriter writer(&deltaWire);
+            RsyncDelta::sendDelta(newPath, hash, blockSize, signatures, writer, newSize, literalBytes);
+        }
+        auto t3 = chrono::steady_clock::now();
+
+        SocketReader reader(deltaWire);
+        string rebuiltPath = newPath + ".rebuilt";
+        long long rebuiltSize = 0;
+        long long rebuiltLiteral = 0;
+        bool ok = RsyncDelta::applyDelta(reader, basePath, blockSize, rebuiltPath, rebuiltSize, rebuiltLiteral);
+        auto t4 = chrono::steady_clock::now();
+        DeleteFileA(rebuiltPath.c_str());
+
+        auto ms = [](chrono::steady_clock::time_point a, chrono::steady_clock::time_point b) {
+            return static_cast<long long>(chrono::duration_cast<chrono::milliseconds>(b - a).count());
+        };
+        long long wire = static_cast<long long>(signatureWire.size() + deltaWire.size());
+
+        printLine();
+        cout << name << endl;
+        cout << "Block size:  " << formatFileSize(static_cast<long long>(blockSize)) << " (" << signatures.size() << " blocks)" << endl;
+        cout << "Signatures:  " << formatFileSize(static_cast<long long>(signatureWire.size())) << " in " << ms(t0, t1) << " ms" << endl;
+        cout << "Delta:       " << formatFileSize(static_cast<long long>(deltaWire.size())) << " (" << formatFileSize(literalBytes)
+            << " literal) in " << ms(t2, t3) << " ms + " << ms(t1, t2) << " ms hash" << endl;
+        cout << "Apply:       " << ms(t3, t4) << " ms, " << (ok ? "verified" : "FAILED") << endl;
+        cout << "On the wire: " << formatFileSize(wire) << " of " << formatFileSize(newSize);
+        if (newSize > 0) {
+            cout << " (" << fixed << setprecision(2) << (wire * 100.0 / newSize) << "%)";
+        }
+        cout << endl;
+    }
+
+    // Локальный замер дельты без сети: дописывание в конец и правки в середине большого файла
+    void runDeltaBenchmark() {
+        printHeader("DELTA SYNC BENCHMARK");
+
+        cout << "File size in MB [256]: ";
+        string sizeInput;
+        getline(cin, sizeInput);
+        long long sizeMb = sizeInput.empty() ? 256 : atoll(sizeInput.c_str());
+        if (sizeMb <= 0) {
+            cout << "Benchmark cancelled" << endl;
+            return;
+        }
+        long long baseSize = sizeMb * 1024 * 1024;
+
+        string basePath = "delta_bench_base.bin";
+        string newPath = "delta_bench_new.bin";
+
+        cout << "Generating " << formatFileSize(baseSize) << " of test data..." << endl;
+        {
+            ofstream out(basePath, ios::binary | ios::trunc);
+            vector<uint64_t> block(128 * 1024);
+            uint64_t x = 0x5DEECE66Dull;
+            for (long long written = 0; out && written < baseSize;) {
+                for (size_t i = 0; i < block.size(); i++) {
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    block[i] = x;
+                }
+                long long n = baseSize - written;
+                long long blockBytes = static_cast<long long>(block.size() * sizeof(uint64_t));
+                if (n > blockBytes) {
+                    n = blockBytes;
+                }
+                out.write(reinterpret_cast<const char*>(block.data()), n);
+                written += n;
+            }
+            if (!out) {
+                cerr << "Cannot create " << basePath << endl;
+                return;
+            }
+        }
+
+        // Лог: в конец дописано 2% новых данных
+        vector<FileEdit> appendEdits(1);
+        appendEdits[0].offset = baseSize;
+        appendEdits[0].removeLength = 0;
+        appendEdits[0].insert.assign(static_cast<size_t>(baseSize / 50), 'A');
+        for (size_t i = 0; i < appendEdits[0].insert.size(); i++) {
+            appendEdits[0].insert[i] = static_cast<char>(i * 131 + (i >> 11));
+        }
+        if (writeEditedCopy(basePath, newPath, appendEdits)) {
+            benchmarkDeltaScenario("Append-mostly (+2% at the end)", basePath, newPath);
+        }
+
+        // Документ: замена, вставка и удаление в середине файла
+        vector<FileEdit> middleEdits(3);
+        middleEdits[0].offset = baseSize / 4;
+        middleEdits[0].removeLength = 100;
+        middleEdits[0].insert = string(100, 'R');
+        middleEdits[1].offset = baseSize / 2;
+        middleEdits[1].removeLength = 0;
+        middleEdits[1].insert = string(1000, 'I');
+        middleEdits[2].offset = baseSize / 4 * 3;
+        middleEdits[2].removeLength = 4096;
+        if (writeEditedCopy(basePath, newPath, middleEdits)) {
+            benchmarkDeltaScenario("Edits in the middle (replace, insert, delete)", basePath, newPath);
+        }
+
+        DeleteFileA(basePath.c_str());
+        DeleteFileA(newPath.c_str());
+    }
+
+    // Пакетное скачивание: все файлы по маске или списку идут одним ответом сервера
+    void downloadMultipleFiles() {
+        printHeader("DOWNLOAD MANY FILES (BATCH)");
+
+        cout << "Enter pattern (e.g. *.txt, docs/*), or leave empty to type names: ";
+        string pattern;
+        getline(cin, pattern);
+
+        vector<string> names;
+        if (pattern.empty()) {
+            cout << "Enter filenames, one per line (empty line to finish):" << endl;
+            string name;
+            while (getline(cin, name) && !name.empty()) {
+                names.push_back(name);
+            }
+            if (names.empty()) {
+                cout << "Download cancelled" << endl;
+                return;
+            }
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = pattern.empty() ? "MGET\n" : "MGET " + pattern + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock, 256 * 1024);
+        string line;
+        if (pattern.empty()) {
+            if (!reader.readLine(line) || line != "READY") {
+                cout << "Server error: " << line << endl;
+                closesocket(sock);
+                return;
+            }
+            string list;
+            for (size_t i = 0; i < names.size(); i++) {
+                list += names[i] + "\n";
+            }
+            list += "\n";
+            if (!sendAll(sock, list.c_str(), list.length())) {
+                cerr << "Failed to send file list" << endl;
+                closesocket(sock);
+                return;
+            }
+        }
+
+        vector<char> buffer(1024 * 1024);
+        long long receivedFiles = 0;
+        long long receivedBytes = 0;
+        long long missingFiles = 0;
+        bool complete = false;
+
+        while (reader.readLine(line)) {
+            if (line.find("FILE ") == 0) {
+                size_t space = line.find(' ', 5);
+                long long fileSize = atoll(line.c_str() + 5);
+                string filename = space == string::npos ? "" : line.substr(space + 1);
+                // Путь приходит от сервера - только относительный и без выхода наверх
+                bool safe = isSafeRelativePath(filename);
+
+                ofstream out;
+                if (safe) {
+                    createLocalDirectories(filename);
+                    out.open(filename, ios::binary | ios::trunc);
+                }
+                long long remaining = fileSize;
+                bool ok = true;
+                while (ok && remaining > 0) {
+                    size_t n = remaining < static_cast<long long>(buffer.size()) ? static_cast<size_t>(remaining) : buffer.size();
+                    ok = reader.readExact(buffer.data(), n);
+                    if (ok && out) {
+                        out.write(buffer.data(), n);
+                    }
+                    remaining -= n;
+                }
+                if (!ok) {
+                    cerr << "Connection lost while receiving " << filename << endl;
+                    break;
+                }
+                if (!safe || !out) {
+                    cerr << "Skipped " << filename << " (cannot write)" << endl;
+                    continue;
+                }
+                receivedFiles++;
+                receivedBytes += fileSize;
+            }
+            else if (line.find("MISSING ") == 0) {
+                cout << "Not found on server: " << line.substr(8) << endl;
+                missingFiles++;
+            }
+            else if (line.find("END ") == 0) {
+                complete = true;
+                break;
+            }
+            else {
+                cout << "Server error: " << line << endl;
+                break;
+            }
+        }
+        closesocket(sock);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        cout << endl << (complete ? "Batch download completed!" : "Batch download incomplete") << endl;
+        printLine();
+        cout << "Files:       " << receivedFiles;
+        if (missingFiles > 0) {
+            cout << " (" << missingFiles << " missing)";
+        }
+        cout << endl;
+        cout << "Size:        " << formatFileSize(receivedBytes) << endl;
+        cout << "Time:        " << duration.count() << " ms" << endl;
+        if (duration.count() > 0) {
+            cout << "Rate:        " << fixed << setprecision(0) << (receivedFiles * 1000.0 / duration.count()) << " files/s, "
+                << formatFileSize(static_cast<long long>(receivedBytes * 1000.0 / duration.count())) << "/s" << endl;
+        }
+    }
+
+    // Пакетная загрузка каталога вместе с подкаталогами: все файлы идут одним потоком
+    // через одно соединение, на сервере они ложатся по тем же относительным путям
+    void uploadDirectoryBulk() {
+        printHeader("UPLOAD DIRECTORY (BULK)");
+
+        cout << "Enter directory to upload [.]: ";
+        string directory;
+        getline(cin, directory);
+        if (directory.empty()) {
+            directory = ".";
+        }
+
+        DWORD attributes = GetFileAttributesA(directory.c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            cerr << "Directory not found: " << directory << endl;
+            return;
+        }
+
+        // Относительные пути с '/' - так их ждет сервер
+        vector<pair<string, long long>> files;
+        listLocalTree(directory, files);
+
+        if (files.empty()) {
+            cout << "No files to upload" << endl;
+            return;
+        }
+        cout << "Uploading " << files.size() << " files from " << directory << "..." << endl;
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 60000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "BULKPUT\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string reply;
+        if (!reader.readLine(reply) || reply != "READY") {
+            cout << "Server error: " << reply << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketWriter writer(sock, 256 * 1024);
+        vector<char> buffer(1024 * 1024);
+        long long sentFiles = 0;
+        long long sentBytes = 0;
+        bool ok = true;
+
+        for (size_t i = 0; ok && i < files.size(); i++) {
+            ifstream file(directory + "\\" + files[i].first, ios::binary);
+            if (!file) {
+                cerr << "Skipped " << files[i].first << " (cannot open)" << endl;
+                continue;
+            }
+
+            // Размер берется из каталога; если файл успели изменить, поток обрывается
+            ok = writer.write("FILE " + to_string(files[i].second) + " " + files[i].first + "\n");
+            long long remaining = files[i].second;
+            while (ok && remaining > 0) {
+                size_t n = remaining < static_cast<long long>(buffer.size()) ? static_cast<size_t>(remaining) : buffer.size();
+                file.read(buffer.data(), n);
+                ok = static_cast<size_t>(file.gcount()) == n && writer.write(buffer.data(), n);
+                remaining -= n;
+            }
+            if (ok) {
+                sentFiles++;
+                sentBytes += files[i].second;
+            }
+        }
+
+        if (ok) {
+            writer.write("END\n");
+        }
+        else {
+            cerr << "Upload failed while sending files" << endl;
+        }
+        writer.flush();
+        shutdown(sock, SD_SEND);
+
+        string confirm;
+        reader.readLine(confirm);
+        closesocket(sock);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        cout << endl << "Server response: " << confirm << endl;
+        printLine();
+        cout << "Files:       " << sentFiles << endl;
+        cout << "Size:        " << formatFileSize(sentBytes) << endl;
+        cout << "Time:        " << duration.count() << " ms" << endl;
+        if (duration.count() > 0) {
+            cout << "Rate:        " << fixed << setprecision(0) << (sentFiles * 1000.0 / duration.count()) << " files/s, "
+                << formatFileSize(static_cast<long long>(sentBytes * 1000.0 / duration.count())) << "/s" << endl;
+        }
+    }
+
+    static string percentEncode(const string& value) {
+        static const char HEX[] = "0123456789ABCDEF";
+        string result;
+        for (size_t i = 0; i < value.length(); i++) {
+            unsigned char c = static_cast<unsigned char>(value[i]);
+            if (c <= ' ' || c == '%' || c == '=' || c >= 0x7F) {
+                result += '%';
+                result += HEX[c >> 4];
+                result += HEX[c & 0x0F];
+            }
+            else {
+                result += static_cast<char>(c);
+            }
+        }
+        return result;
+    }
+
+    // Постраничный список с фильтром и сортировкой (LISTX, формат tsv)
+    void requestFileListing() {
+        printHeader("LIST FILES (FILTERED)");
+
+        cout << "Filter pattern (e.g. *.log, empty for all): ";
+        string glob;
+        getline(cin, glob);
+
+        cout << "Sort by [name/size/mtime, default name]: ";
+        string sortKey;
+        getline(cin, sortKey);
+        if (sortKey != "size" && sortKey != "mtime") {
+            sortKey = "name";
+        }
+
+        cout << "Descending order? [y/N]: ";
+        string descending;
+        getline(cin, descending);
+
+        cout << "Page size [20]: ";
+        string pageInput;
+        getline(cin, pageInput);
+        long long pageSize = pageInput.empty() ? 20 : atoll(pageInput.c_str());
+        if (pageSize <= 0) {
+            pageSize = 20;
+        }
+
+        string baseCommand = "LISTX format=tsv sort=" + sortKey + " limit=" + to_string(pageSize);
+        if (descending == "y" || descending == "Y") {
+            baseCommand += " order=desc";
+        }
+        if (!glob.empty()) {
+            baseCommand += " glob=" + percentEncode(glob);
+        }
+
+        string cursor;
+        long long shown = 0;
+        while (true) {
+            SOCKET sock = createConnection(2000);
+            if (sock == INVALID_SOCKET) {
+                return;
+            }
+
+            DWORD timeout = 10000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+            string command = baseCommand + (cursor.empty() ? "" : " cursor=" + percentEncode(cursor)) + "\n";
+            if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+                cerr << "Failed to send command" << endl;
+                closesocket(sock);
+                return;
+            }
+
+            SocketReader reader(sock);
+            string line;
+            bool ended = false;
+            long long total = 0;
+            cursor.clear();
+            while (reader.readLine(line)) {
+                vector<string> fields;
+                stringstream ls(line);
+                string field;
+                while (getline(ls, field, '\t')) {
+                    fields.push_back(field);
+                }
+
+                if (!fields.empty() && fields[0] == "END") {
+                    total = fields.size() > 2 ? atoll(fields[2].c_str()) : 0;
+                    cursor = fields.size() > 3 ? fields[3] : "";
+                    ended = true;
+                    break;
+                }
+                if (fields.size() < 3) {
+                    cout << "Server error: " << line << endl;
+                    break;
+                }
+
+                time_t modified = static_cast<time_t>(atoll(fields[2].c_str()));
+                char timeBuffer[32] = "";
+                tm* localTime = localtime(&modified);
+                if (localTime != NULL) {
+                    strftime(timeBuffer, sizeof(timeBuffer), "%d.%m.%Y %H:%M", localTime);
+                }
+
+                shown++;
+                cout << setw(4) << shown << ". " << setw(30) << left << fields[0]
+                    << " " << setw(10) << right << formatFileSize(atoll(fields[1].c_str()))
+                    << "  " << timeBuffer << endl;
+            }
+            closesocket(sock);
+
+            if (!ended) {
+                cout << "Listing incomplete" << endl;
+                return;
+            }
+            if (cursor.empty()) {
+                cout << "-- " << shown << " shown, " << total << " files on server --" << endl;
+                return;
+            }
+
+            cout << "-- Enter for next page, q to stop --";
+            string answer;
+            getline(cin, answer);
+            if (answer == "q" || answer == "Q") {
+                return;
+            }
+        }
+    }
+
+    // Просмотр каталога сервера: LISTDIR отдает содержимое по дереву путей сервера
+    void browseServerDirectory() {
+        printHeader("BROWSE SERVER DIRECTORY");
+
+        cout << "Directory (empty for root, e.g. docs/2024): ";
+        string path;
+        getline(cin, path);
+        replace(path.begin(), path.end(), '\\', '/');
+
+        cout << "Include subdirectories? [y/N]: ";
+        string recursive;
+        getline(cin, recursive);
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 10000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "LISTDIR";
+        if (recursive == "y" || recursive == "Y") {
+            command += " -r";
+        }
+        if (!path.empty()) {
+            command += " " + path;
+        }
+        command += "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        cout << "/" << path << endl;
+        printLine();
+
+        SocketReader reader(sock);
+        string line;
+        bool ended = false;
+        while (reader.readLine(line)) {
+            if (line.find("DIR ") == 0) {
+                cout << "  " << setw(40) << left << line.substr(4) << right << "     <DIR>" << endl;
+            }
+            else if (line.find("FILE ") == 0) {
+                stringstream ls(line.substr(5));
+                long long size = 0;
+                long long mtime = 0;
+                ls >> size >> mtime;
+                string name;
+                getline(ls >> ws, name);
+                cout << "  " << setw(40) << left << name << " " << setw(10) << right << formatFileSize(size) << endl;
+            }
+            else if (line.find("END ") == 0) {
+                stringstream ls(line.substr(4));
+                long long dirs = 0;
+                long long files = 0;
+                ls >> dirs >> files;
+                printLine();
+                cout << dirs << " directories, " << files << " files" << endl;
+                ended = true;
+                break;
+            }
+            else {
+                cout << "Server error: " << line << endl;
+                break;
+            }
+        }
+        closesocket(sock);
+
+        if (!ended && line.find("ERROR") != 0) {
+            cout << "Listing incomplete" << endl;
+        }
+    }
+
+    // Поиск по именам файлов на сервере: приходят только найденные файлы, лучшие первыми
+    void searchServerFiles() {
+        printHeader("SEARCH FILES ON SERVER");
+
+        cout << "Search for (part of path, or path prefix): ";
+        string query;
+        getline(cin, query);
+        if (query.empty()) {
+            cout << "Search cancelled" << endl;
+            return;
+        }
+
+        cout << "Match path prefix only? [y/N]: ";
+        string prefixOnly;
+        getline(cin, prefixOnly);
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 10000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "SEARCH q=" + percentEncode(query) + " limit=50";
+        if (prefixOnly == "y" || prefixOnly == "Y") {
+            command += " mode=prefix";
+        }
+        command += "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string line;
+        long long shown = 0;
+        while (reader.readLine(line)) {
+            if (line.find("MATCH ") == 0) {
+                size_t space = line.find(' ', 6);
+                long long size = atoll(line.c_str() + 6);
+                string name = space == string::npos ? "" : line.substr(space + 1);
+                shown++;
+                cout << setw(4) << shown << ". " << setw(40) << left << name
+                    << " " << setw(10) << right << formatFileSize(size) << endl;
+            }
+            else if (line.find("END ") == 0) {
+                stringstream ls(line.substr(4));
+                long long count = 0;
+                long long total = 0;
+                ls >> count >> total;
+                auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+                printLine();
+                cout << total << " matches";
+                if (total > count) {
+                    cout << " (best " << count << " shown)";
+                }
+                cout << ", " << duration.count() << " ms" << endl;
+                break;
+            }
+            else {
+                cout << "Server error: " << line << endl;
+                break;
+            }
+        }
+        closesocket(sock);
+    }
+
+    // Подписка на изменения файлов сервера: события приходят сразу после загрузок,
+    // опрашивать LIST не нужно. Номер последнего события позволяет продолжить позже
+    void watchServerChanges() {
+        printHeader("WATCH SERVER CHANGES");
+
+        cout << "Path prefix to watch (empty for all): ";
+        string prefix;
+        getline(cin, prefix);
+
+        cout << "Resume from sequence number (empty for now): ";
+        string since;
+        getline(cin, since);
+
+        cout << "Watch for how many seconds [60]: ";
+        string secondsInput;
+        getline(cin, secondsInput);
+        long long seconds = secondsInput.empty() ? 60 : atoll(secondsInput.c_str());
+        if (seconds <= 0) {
+            seconds = 60;
+        }
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        // Сервер шлет PING раз в 15 секунд, поэтому короткий таймаут не обрывает подписку
+        DWORD timeout = 1000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "WATCH";
+        if (!prefix.empty()) {
+            command += " prefix=" + percentEncode(prefix);
+        }
+        if (!since.empty()) {
+            command += " since=" + since;
+        }
+        command += "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        cout << "Watching for " << seconds << " s..." << endl;
+        printLine();
+
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(seconds);
+        auto lastData = chrono::steady_clock::now();
+        SocketReader reader(sock);
+        string line;
+        string sequence;
+        long long eventCount = 0;
+        while (chrono::steady_clock::now() < deadline) {
+            if (!reader.readLine(line)) {
+                // Таймаут чтения - ждем дальше, пока сервер хоть изредка что-то присылает
+                if (WSAGetLastError() != WSAETIMEDOUT || chrono::steady_clock::now() - lastData > chrono::seconds(40)) {
+                    cout << "Connection closed by server" << endl;
+                    break;
+                }
+                continue;
+            }
+            lastData = chrono::steady_clock::now();
+
+            stringstream ls(line);
+            string type;
+            ls >> type >> sequence;
+            if (type == "ADD" || type == "MODIFY" || type == "DELETE") {
+                long long size = 0;
+                long long mtime = 0;
+                string name;
+                ls >> size >> mtime;
+                getline(ls >> ws, name);
+
+                time_t now = time(NULL);
+                char timeBuffer[16] = "";
+                tm* localTime = localtime(&now);
+                if (localTime != NULL) {
+                    strftime(timeBuffer, sizeof(timeBuffer), "%H:%M:%S", localTime);
+                }
+                cout << "[" << timeBuffer << "] " << setw(7) << left << type << right << name;
+                if (type != "DELETE") {
+                    cout << " (" << formatFileSize(size) << ")";
+                }
+                cout << endl;
+                eventCount++;
+            }
+            else if (type == "RESET") {
+                cout << "Missed events - refresh the file list (continuing from " << sequence << ")" << endl;
+            }
+            else if (type != "WATCHING" && type != "PING") {
+                cout << "Server error: " << line << endl;
+                break;
+            }
+        }
+        closesocket(sock);
+
+        printLine();
+        cout << eventCount << " events";
+        if (!sequence.empty()) {
+            cout << ", resume with sequence " << sequence;
+        }
+        cout << endl;
+    }
+
+    // Размеры, время и хеши многих файлов за одно соединение
+    void statManyFiles() {
+        printHeader("STAT MANY FILES");
+
+        cout << "Enter filenames, one per line (empty line to finish), or @<list file>:" << endl;
+        vector<string> names;
+        string name;
+        while (getline(cin, name) && !name.empty()) {
+            if (name[0] != '@') {
+                names.push_back(name);
+                continue;
+            }
+            ifstream list(name.substr(1));
+            if (!list) {
+                cerr << "Cannot open " << name.substr(1) << endl;
+                continue;
+            }
+            string listed;
+            while (getline(list, listed)) {
+                if (!listed.empty() && listed.back() == '\r') {
+                    listed.pop_back();
+                }
+                if (!listed.empty()) {
+                    names.push_back(listed);
+                }
+            }
+        }
+        if (names.empty()) {
+            cout << "Stat cancelled" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "STAT\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string line;
+        if (!reader.readLine(line) || line != "READY") {
+            cout << "Server error: " << line << endl;
+            closesocket(sock);
+            return;
+        }
+
+        atomic<bool> listSent(false);
+        thread sender = sendLinesAsync(sock, names, listSent);
+
+        bool complete = false;
+        long long totalSize = 0;
+        while (reader.readLine(line)) {
+            if (line.find("OK ") == 0) {
+                stringstream ls(line.substr(3));
+                long long size = 0;
+                long long mtime = 0;
+                string hash;
+                ls >> size >> mtime >> hash;
+                string filename;
+                getline(ls >> ws, filename);
+                totalSize += size;
+                cout << setw(40) << left << filename << " " << setw(10) << right << formatFileSize(size)
+                    << "  " << (hash == "-" ? string("(hash not computed)") : hash.substr(0, 16)) << endl;
+            }
+            else if (line.find("MISSING ") == 0) {
+                cout << setw(40) << left << line.substr(8) << right << " not found" << endl;
+            }
+            else if (line.find("END ") == 0) {
+                stringstream ls(line.substr(4));
+                long long found = 0;
+                long long missing = 0;
+                ls >> found >> missing;
+                auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+                printLine();
+                cout << found << " found (" << formatFileSize(totalSize) << "), " << missing << " missing, "
+                    << duration.count() << " ms" << endl;
+                complete = true;
+                break;
+            }
+            else {
+                cout << "Server error: " << line << endl;
+                break;
+            }
+        }
+        if (!complete) {
+            shutdown(sock, SD_BOTH);
+        }
+        sender.join();
+        closesocket(sock);
+
+        if (!complete) {
+            cout << (listSent ? "Stat incomplete" : "Stat incomplete: failed to send file list") << endl;
+        }
+    }
+
+    // Скачивание через локальный кеш: сервер получает ETag сохраненной копии, и если
+    // файл не менялся, отвечает одной строкой - файл берется из кеша
+    void downloadFileCached(const string& filename) {
+        printHeader("DOWNLOAD FILE (CACHED)");
+
+        if (filename.empty()) {
+            cerr << "Filename cannot be empty" << endl;
+            return;
+        }
+        if (!isSafeRelativePath(filename)) {
+            cerr << "Invalid filename: " << filename << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        DownloadCache cache(serverIP, port);
+        long long fileSize = 0;
+        string etag = cache.lookup(filename, fileSize);
+
         SOCKET sock = createConnection(2000);
         if (sock == INVALID_SOCKET) {
             return;
         }
 
-        // Новая команда - RAW означает "сырые" данные без заголовков
-        string command = "RAW " + filename + "\n";
-        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
-            cerr << "Failed to send command" << endl;
-            closesocket(sock);
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "GETIF " + etag + " " + filename + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        SocketReader reader(sock);
+        string reply;
+        if (!reader.readLine(reply)) {
+            cerr << "No response from server" << endl;
+            closesocket(sock);
+            return;
+        }
+
+        long long transferred = 0;
+        if (reply.find("NOT_MODIFIED ") == 0) {
+            closesocket(sock);
+            cout << "Not modified, using cached copy (" << etag << ")" << endl;
+        }
+        else if (reply.find("OK ") == 0) {
+            stringstream rs(reply.substr(3));
+            rs >> fileSize >> etag;
+            cout << "Downloading " << formatFileSize(fileSize) << " (" << etag << ")..." << endl;
+
+            string tempPath = cache.tempPath(filename);
+            ofstream out(tempPath, ios::binary | ios::trunc);
+            vector<char> buffer(1 << 20);
+            bool ok = static_cast<bool>(out);
+            while (ok && transferred < fileSize) {
+                size_t length = static_cast<size_t>(fileSize - transferred < static_cast<long long>(buffer.size())
+                    ? fileSize - transferred : static_cast<long long>(buffer.size()));
+                ok = reader.readExact(buffer.data(), length) && out.write(buffer.data(), length).good();
+                transferred += length;
+            }
+            out.close();
+            closesocket(sock);
+
+            if (!ok || !cache.store(filename, etag, fileSize)) {
+                cout << "Download failed" << endl;
+                DeleteFileA(tempPath.c_str());
+                return;
+            }
+        }
+        else {
+            closesocket(sock);
+            cout << "Server error: " << reply << endl;
+            if (reply.find("ERROR: File not found") == 0) {
+                cache.remove(filename);
+            }
+            return;
+        }
+
+        createLocalDirectories(filename);
+        if (!cache.copyTo(filename, filename)) {
+            cerr << "Cannot write " << filename << " (Error: " << GetLastError() << ")" << endl;
+            return;
+        }
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        cout << endl << "Download completed!" << endl;
+        printTransferSummary(filename, fileSize, transferred, duration.count());
+    }
+
+    // Сравнение локального каталога с каталогом сервера по дереву хешей (MERKLE): клиент
+    // считает хеши своих файлов и спускается только в те части дерева сервера, хеши которых
+    // не совпали с локальными. Все узлы одного уровня запрашиваются за одно соединение
+    bool compareTreeWithServer(const string& directory, TreeDifference& diff) {
+        auto startTime = chrono::steady_clock::now();
+
+        vector<pair<string, long long>> files;
+        listLocalTree(directory, files);
+        sort(files.begin(), files.end());
+        diff.localFiles = files.size();
+
+        vector<MerkleSum> leaves(files.size());
+        atomic<size_t> nextFile(0);
+        atomic<size_t> hashedFiles(0);
+        size_t threadCount = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 4;
+        vector<thread> workers;
+        for (size_t t = 0; t < threadCount && t < files.size(); t++) {
+            workers.push_back(thread([&]() {
+                for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+                    string fullPath = directory + "\\" + files[i].first;
+                    LocalHash entry = { -1, 0, MerkleSum() };
+                    WIN32_FILE_ATTRIBUTE_DATA data;
+                    if (GetFileAttributesExA(fullPath.c_str(), GetFileExInfoStandard, &data)) {
+                        entry.size = (static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+                        entry.mtime = (static_cast<unsigned long long>(data.ftLastWriteTime.dwHighDateTime) << 32)
+                            | data.ftLastWriteTime.dwLowDateTime;
+
+                        lock_guard<mutex> lock(localHashMutex);
+                        auto it = localHashes.find(fullPath);
+                        if (it != localHashes.end() && it->second.size == entry.size && it->second.mtime == entry.mtime) {
+                            leaves[i] = it->second.leaf;
+                            continue;
+                        }
+                    }
+
+                    string hash;
+                    if (!Blake3::hashFile(fullPath, hash)) {
+                        hash = "-";
+                    }
+                    leaves[i] = MerkleSum::leaf(files[i].first, hash);
+                    hashedFiles++;
+
+                    if (hash != "-" && entry.size >= 0) {
+                        entry.leaf = leaves[i];
+                        lock_guard<mutex> lock(localHashMutex);
+                        localHashes[fullPath] = entry;
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        diff.hashedFiles = hashedFiles;
+
+        vector<MerkleSum> prefixSums(files.size() + 1);
+        for (size_t i = 0; i < files.size(); i++) {
+            prefixSums[i + 1] = prefixSums[i];
+            prefixSums[i + 1].add(leaves[i]);
+        }
+        diff.hashMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime).count();
+
+        // Локальные файлы, пути которых начинаются с prefix: [first, last)
+        auto localRange = [&](const string& prefix, size_t& first, size_t& last) {
+            auto low = lower_bound(files.begin(), files.end(), prefix,
+                [](const pair<string, long long>& file, const string& key) { return file.first < key; });
+            auto high = partition_point(low, files.end(),
+                [&](const pair<string, long long>& file) { return file.first.compare(0, prefix.length(), prefix) <= 0; });
+            first = static_cast<size_t>(low - files.begin());
+            last = static_cast<size_t>(high - files.begin());
+        };
+
+        auto addLocalOnly = [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                diff.localOnly.push_back(files[i].first);
+            }
+        };
+
+        // Узел сервера и его части (в порядке имен): локальные файлы между частями сервер не
+        // знает, в совпавших частях различий нет, в остальные нужно спуститься
+        auto compareNode = [&](const string& hash, const string& prefix, const vector<string>& children, vector<string>& next) {
+            size_t first = 0;
+            size_t last = 0;
+            localRange(prefix, first, last);
+            if (prefixSums[last].minus(prefixSums[first]).hex() == hash) {
+                return;
+            }
+
+            size_t position = first;
+            for (size_t c = 0; c < children.size(); c++) {
+                stringstream cs(children[c]);
+                string kind;
+                string childHash;
+                long long value = 0;
+                cs >> kind >> childHash >> value;
+                string path;
+                getline(cs >> ws, path);
+
+                size_t childFirst = 0;
+                size_t childLast = 0;
+                localRange(path, childFirst, childLast);
+                if (childFirst < position) {
+                    childFirst = childLast = position;
+                }
+                if (kind == "FILE") {
+                    childLast = childFirst < files.size() && files[childFirst].first == path ? childFirst + 1 : childFirst;
+                }
+                addLocalOnly(position, childFirst);
+
+                if (kind == "FILE" && childLast == childFirst) {
+                    diff.serverOnly.push_back(make_pair(path, value));
+                }
+                else if (kind == "FILE" && leaves[childFirst].hex() != childHash) {
+                    diff.different.push_back(path);
+                }
+                else if (kind == "RANGE" && prefixSums[childLast].minus(prefixSums[childFirst]).hex() != childHash) {
+                    next.push_back(path);
+                }
+                position = childLast;
+            }
+            addLocalOnly(position, last);
+        };
+
+        vector<string> pending(1, "");
+        diff.roundTrips = 0;
+        while (!pending.empty()) {
+            SOCKET sock = createConnection(2000);
+            if (sock == INVALID_SOCKET) {
+                return false;
+            }
+
+            // На первый запрос сервер может досчитывать хеши своих файлов
+            DWORD timeout = 300000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+            string command = "MERKLE\n";
+            if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+                cerr << "Failed to send command" << endl;
+                closesocket(sock);
+                return false;
+            }
+
+            SocketReader reader(sock);
+            string line;
+            if (!reader.readLine(line) || line != "READY") {
+                cerr << "Server error: " << line << endl;
+                closesocket(sock);
+                return false;
+            }
+
+            string request;
+            for (size_t i = 0; i < pending.size(); i++) {
+                request += "RANGE " + pending[i] + "\n";
+            }
+            request += "\n";
+            if (!sendAll(sock, request.c_str(), request.length())) {
+                cerr << "Failed to send range list" << endl;
+                closesocket(sock);
+                return false;
+            }
+            diff.roundTrips++;
+
+            vector<string> next;
+            bool haveNode = false;
+            bool complete = false;
+            string nodeHash;
+            string nodePrefix;
+            vector<string> children;
+            while (reader.readLine(line)) {
+                if (line.find("NODE ") == 0 || line.find("END ") == 0) {
+                    if (haveNode) {
+                        compareNode(nodeHash, nodePrefix, children, next);
+                    }
+                    if (line.find("END ") == 0) {
+                        complete = true;
+                        break;
+                    }
+                    stringstream ns(line.substr(5));
+                    long long count = 0;
+                    ns >> nodeHash >> count;
+                    nodePrefix.clear();
+                    getline(ns >> ws, nodePrefix);
+                    children.clear();
+                    haveNode = true;
+                }
+                else if (line.find("RANGE ") == 0 || line.find("FILE ") == 0) {
+                    children.push_back(line);
+                }
+                else {
+                    cerr << "Server error: " << line << endl;
+                    break;
+                }
+            }
+            closesocket(sock);
+
+            if (!complete) {
+                cerr << "Comparison incomplete" << endl;
+                return false;
+            }
+            pending.swap(next);
+        }
+        return true;
+    }
+
+    void compareDirectoryTree() {
+        printHeader("COMPARE DIRECTORY WITH SERVER");
+
+        cout << "Enter local directory [.]: ";
+        string directory;
+        getline(cin, directory);
+        if (directory.empty()) {
+            directory = ".";
+        }
+
+        DWORD attributes = GetFileAttributesA(directory.c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            cerr << "Directory not found: " << directory << endl;
             return;
         }
 
-        // Сначала получаем ответ сервера
-        char responseBuffer[256];
-        int responseBytes = recv(sock, responseBuffer, sizeof(responseBuffer) - 1, 0);
-        if (responseBytes <= 0) {
-            cerr << "No response from server" << endl;
-            closesocket(sock);
+        auto startTime = chrono::steady_clock::now();
+
+        cout << "Hashing local files and comparing..." << endl;
+        TreeDifference diff;
+        if (!compareTreeWithServer(directory, diff)) {
             return;
         }
 
-        responseBuffer[responseBytes] = '\0';
-        string response = responseBuffer;
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
 
-        if (response.find("ERROR") != string::npos) {
-            cout << "Server error: " << response << endl;
+        for (size_t i = 0; i < diff.different.size(); i++) {
+            cout << "  DIFFERENT    " << diff.different[i] << endl;
+        }
+        for (size_t i = 0; i < diff.serverOnly.size(); i++) {
+            cout << "  SERVER ONLY  " << diff.serverOnly[i].first << " (" << formatFileSize(diff.serverOnly[i].second) << ")" << endl;
+        }
+        for (size_t i = 0; i < diff.localOnly.size(); i++) {
+            cout << "  LOCAL ONLY   " << diff.localOnly[i] << endl;
+        }
+
+        printLine();
+        if (diff.different.empty() && diff.serverOnly.empty() && diff.localOnly.empty()) {
+            cout << "Directories are identical" << endl;
+        }
+        else {
+            cout << "Different: " << diff.different.size() << ", server only: " << diff.serverOnly.size()
+                << ", local only: " << diff.localOnly.size() << endl;
+        }
+        cout << "Local files: " << diff.localFiles << " (" << diff.hashedFiles << " hashed in " << diff.hashMs << " ms)" << endl;
+        cout << "Round trips: " << diff.roundTrips << ", total time: " << duration.count() << " ms" << endl;
+    }
+
+    static string jsonEscape(const string& text) {
+        string result;
+        for (size_t i = 0; i < text.length(); i++) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += static_cast<char>(c);
+            }
+            else if (c < 0x20) {
+                char escaped[8];
+                sprintf(escaped, "\\u%04x", c);
+                result += escaped;
+            }
+            else {
+                result += static_cast<char>(c);
+            }
+        }
+        return result;
+    }
+
+    static bool hasWildcards(const string& pattern) {
+        return pattern.find_first_of("*?") != string::npos;
+    }
+
+    // Аргументы вида @файл заменяются строками этого файла (по имени в строке)
+    static vector<string> expandArgumentLists(const vector<string>& arguments) {
+        vector<string> result;
+        for (size_t i = 0; i < arguments.size(); i++) {
+            if (arguments[i].length() < 2 || arguments[i][0] != '@') {
+                result.push_back(arguments[i]);
+                continue;
+            }
+            ifstream list(arguments[i].substr(1));
+            if (!list) {
+                cerr << "Cannot open " << arguments[i].substr(1) << endl;
+                continue;
+            }
+            string line;
+            while (getline(list, line)) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (!line.empty()) {
+                    result.push_back(line);
+                }
+            }
+        }
+        return result;
+    }
+
+    // Имя на сервере для локального пути: относительный путь сохраняется, иначе - имя файла
+    static string remoteNameFor(const string& localPath) {
+        string name = localPath;
+        replace(name.begin(), name.end(), '\\', '/');
+        return isSafeRelativePath(name) ? name : name.substr(name.find_last_of('/') + 1);
+    }
+
+    // Ответы сервера, которые повтор не исправит. Остальные ошибки ("File is busy, try again
+    // later", "File is being modified", сбой записи на сервере) повторяются с обычной паузой
+    static bool isPermanentError(const string& reply) {
+        static const char* const permanent[] = {
+            "ERROR: File not found", "ERROR: Invalid filename", "ERROR: Usage:", "ERROR: Unknown command"
+        };
+        for (size_t i = 0; i < sizeof(permanent) / sizeof(permanent[0]); i++) {
+            if (reply.find(permanent[i]) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Скачивание для пакетного режима. GETIF без версии всегда присылает размер, поэтому
+    // оборванная передача видна; файл пишется во временный и заменяет старый целиком
+    bool fetchFile(TransferJob& job) {
+        if (!isSafeRelativePath(job.remoteName)) {
+            job.error = "invalid filename";
+            job.permanent = true;
+            return false;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(5000);
+        if (sock == INVALID_SOCKET) {
+            job.error = "connection failed";
+            return false;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "GETIF - " + job.remoteName + "\n";
+        SocketReader reader(sock);
+        string reply;
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR || !reader.readLine(reply)) {
+            job.error = "no response from server";
             closesocket(sock);
-            return;
+            return false;
         }
+        job.latencyMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime).count();
 
-        cout << "Starting download of " << filename << "..." << endl;
+        if (reply.find("OK ") != 0) {
+            job.error = reply;
+            job.permanent = isPermanentError(reply);
+            closesocket(sock);
+            return false;
+        }
 
-        ofstream file(filename, ios::binary);
-        if (!file) {
-            cerr << "Cannot create file" << endl;
+        long long fileSize = 0;
+        stringstream(reply.substr(3)) >> fileSize;
+
+        createLocalDirectories(job.localPath);
+        string tempPath = job.localPath + ".part";
+        AsyncFileWriter out;
+        if (!out.open(tempPath)) {
+            job.error = "cannot create " + tempPath;
+            job.permanent = true;
             closesocket(sock);
-            return;
+            return false;
         }
 
-        const int BUFFER_SIZE = 65536;
-        char buffer[BUFFER_SIZE];
-        int bytesReceived;
-        long long totalBytes = responseBytes;
+        job.bytes = 0;
+        bool ok = true;
+        while (ok && job.bytes < fileSize) {
+            size_t room = 0;
+            char* buffer = out.space(room);
+            size_t length = static_cast<size_t>(fileSize - job.bytes < static_cast<long long>(room) ? fileSize - job.bytes : room);
+            ok = reader.readExact(buffer, length) && out.advance(length);
+            if (ok) {
+                job.bytes += length;
+            }
+        }
+        closesocket(sock);
+        ok = out.close() && ok;
 
-        // Записываем уже полученный ответ (если это не был заголовок ошибки)
-        if (response.find("OK") == 0 || response.find("READY") == 0) {
-            // Это служебный ответ, не записываем его в файл
-            cout << "Server ready for transfer" << endl;
-            totalBytes = 0;
+        if (!ok) {
+            job.error = "interrupted after " + to_string(job.bytes) + " of " + to_string(fileSize) + " bytes";
+            DeleteFileA(tempPath.c_str());
+            return false;
         }
-        else {
-            // Возможно, это уже часть файла
-            file.write(responseBuffer, responseBytes);
+        if (!MoveFileExA(tempPath.c_str(), job.localPath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            job.error = "cannot replace " + job.localPath + " (error " + to_string(GetLastError()) + ")";
+            job.permanent = true;
+            DeleteFileA(tempPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Загрузка для пакетного режима через PUTHASH: если у сервера уже есть такое
+    // содержимое, данные не передаются; ответ сервера сверяется с размером файла
+    bool pushFile(TransferJob& job) {
+        string hash;
+        long long fileSize = 0;
+        if (!Blake3::hashFile(job.localPath, hash, &fileSize)) {
+            job.error = "cannot read " + job.localPath;
+            job.permanent = true;
+            return false;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        SOCKET sock = createConnection(5000);
+        if (sock == INVALID_SOCKET) {
+            job.error = "connection failed";
+            return false;
         }
 
         DWORD timeout = 30000;
         setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "PUTHASH " + hash + " " + to_string(fileSize) + " " + job.remoteName + "\n";
+        SocketReader reader(sock);
+        string reply;
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR || !reader.readLine(reply)) {
+            job.error = "no response from server";
+            closesocket(sock);
+            return false;
+        }
+        job.latencyMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime).count();
+
+        if (reply.find("UPLOAD_COMPLETE") == 0) {
+            closesocket(sock);
+            job.bytes = 0;
+            job.deduplicated = true;
+            return true;
+        }
+        if (reply != "READY") {
+            job.error = reply;
+            job.permanent = isPermanentError(reply);
+            closesocket(sock);
+            return false;
+        }
+
+        AsyncFileReader file;
+        job.bytes = 0;
+        bool ok = file.open(job.localPath);
+        while (ok && job.bytes < fileSize) {
+            size_t length = 0;
+            const char* block = file.next(length);
+            ok = block != NULL && sendAll(sock, block, length);
+            if (ok) {
+                job.bytes += length;
+            }
+        }
+        file.close();
+        shutdown(sock, SD_SEND);
+
+        // Сервер хеширует принятые данные перед ответом
+        timeout = 120000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        string confirm;
+        bool confirmed = reader.readLine(confirm);
+        closesocket(sock);
+
+        if (!ok) {
+            job.error = "interrupted after " + to_string(job.bytes) + " of " + to_string(fileSize) + " bytes";
+            return false;
+        }
+        if (!confirmed || confirm.find("UPLOAD_COMPLETE: " + to_string(fileSize) + " ") != 0) {
+            job.error = confirmed ? confirm : "no confirmation from server";
+            return false;
+        }
+        return true;
+    }
 
+    // Очередь передач: options.jobs потоков берут задания по порядку, неудачное задание
+    // повторяется до options.retries раз с растущей паузой. Возвращает число неудачных
+    size_t runTransferJobs(vector<TransferJob>& jobs, const BatchOptions& options) {
+        pool->setTarget(static_cast<size_t>(options.jobs));
         auto startTime = chrono::steady_clock::now();
 
-        // Читаем остальные данные
-        while (true) {
-            bytesReceived = recv(sock, buffer, BUFFER_SIZE, 0);
-            if (bytesReceived > 0) {
-                file.write(buffer, bytesReceived);
-                totalBytes += bytesReceived;
+        atomic<size_t> nextJob(0);
+        mutex outputMutex;
+        vector<thread> workers;
+        for (size_t t = 0; t < static_cast<size_t>(options.jobs) && t < jobs.size(); t++) {
+            workers.push_back(thread([&]() {
+                for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) {
+                    TransferJob& job = jobs[i];
+                    auto jobStart = chrono::steady_clock::now();
+                    while (true) {
+                        job.attempts++;
+                        job.error.clear();
+                        job.permanent = false;
+                        job.ok = job.upload ? pushFile(job) : fetchFile(job);
+                        if (job.ok || job.permanent || job.attempts > options.retries) {
+                            break;
+                        }
+                        this_thread::sleep_for(chrono::milliseconds(250 * job.attempts));
+                    }
+                    job.durationMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - jobStart).count();
 
-                // Показываем прогресс
-                if (totalBytes % (256 * 1024) == 0) {
-                    cout << "Received: " << formatFileSize(totalBytes) << endl;
+                    if (!options.json) {
+                        lock_guard<mutex> lock(outputMutex);
+                        cout << (job.ok ? "OK    " : "FAIL  ") << (job.upload ? "put " : "get ") << job.remoteName << "  ";
+                        if (job.ok) {
+                            cout << formatFileSize(job.bytes) << (job.deduplicated ? " (deduplicated)" : "") << ", " << job.durationMs << " ms";
+                        }
+                        else {
+                            cout << job.error;
+                        }
+                        if (job.attempts > 1) {
+                            cout << " (" << job.attempts << " attempts)";
+                        }
+                        cout << endl;
+                    }
                 }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        pool->setTarget(0);
+
+        long long wallMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime).count();
+        printJobSummary(jobs, wallMs, options.json);
+
+        size_t failed = 0;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            failed += jobs[i].ok ? 0 : 1;
+        }
+        return failed;
+    }
+
+    // Итоги пакета: в JSON - строка на каждое задание и строка summary, иначе - три строки
+    void printJobSummary(const vector<TransferJob>& jobs, long long wallMs, bool json) {
+        vector<long long> latencies;
+        long long totalBytes = 0;
+        size_t failed = 0;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (jobs[i].ok) {
+                latencies.push_back(jobs[i].latencyMs);
+                totalBytes += jobs[i].bytes;
             }
-            else if (bytesReceived == 0) {
+            else {
+                failed++;
+            }
+        }
+        sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double q) -> long long {
+            return latencies.empty() ? 0 : latencies[static_cast<size_t>(q * (latencies.size() - 1) + 0.5)];
+        };
+        double mbPerSecond = wallMs > 0 ? totalBytes / 1048576.0 * 1000.0 / wallMs : 0.0;
+        unsigned long long reused = 0;
+        unsigned long long opened = 0;
+        pool->getStats(reused, opened);
+
+        if (!json) {
+            printLine();
+            cout << "Jobs:        " << jobs.size() << " (" << jobs.size() - failed << " ok, " << failed << " failed)" << endl;
+            cout << "Transferred: " << formatFileSize(totalBytes) << " in " << wallMs << " ms ("
+                << fixed << setprecision(2) << mbPerSecond << " MB/s)" << endl;
+            cout << "Latency:     p50 " << percentile(0.5) << " ms, p95 " << percentile(0.95) << " ms, max "
+                << (latencies.empty() ? 0 : latencies.back()) << " ms" << endl;
+            cout << "Connections: " << opened << " opened, " << reused << " taken ready from the pool" << endl;
+            return;
+        }
+
+        char numbers[256];
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const TransferJob& job = jobs[i];
+            sprintf(numbers, "\"bytes\":%lld,\"attempts\":%d,\"latency_ms\":%lld,\"duration_ms\":%lld,\"mb_per_s\":%.2f",
+                job.bytes, job.attempts, job.latencyMs, job.durationMs,
+                job.durationMs > 0 ? job.bytes / 1048576.0 * 1000.0 / job.durationMs : 0.0);
+            cout << "{\"op\":\"" << (job.upload ? "put" : "get") << "\",\"name\":\"" << jsonEscape(job.remoteName)
+                << "\",\"local\":\"" << jsonEscape(job.localPath) << "\",\"status\":\"" << (job.ok ? "ok" : "failed")
+                << "\"," << numbers << ",\"deduplicated\":" << (job.deduplicated ? "true" : "false")
+                << ",\"error\":\"" << jsonEscape(job.error) << "\"}" << endl;
+        }
+        sprintf(numbers, "\"bytes\":%lld,\"duration_ms\":%lld,\"mb_per_s\":%.2f,\"latency_p50_ms\":%lld,\"latency_p95_ms\":%lld",
+            totalBytes, wallMs, mbPerSecond, percentile(0.5), percentile(0.95));
+        cout << "{\"summary\":true,\"jobs\":" << jobs.size() << ",\"ok\":" << jobs.size() - failed << ",\"failed\":" << failed
+            << "," << numbers << ",\"connections_opened\":" << opened << ",\"connections_reused\":" << reused << "}" << endl;
+    }
+
+    // Файлы сервера по маске (LISTX без ограничения числа записей)
+    bool listServerFiles(const string& glob, vector<pair<string, long long>>& files) {
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        string command = "LISTX format=tsv limit=0 glob=" + percentEncode(glob) + "\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return false;
+        }
+
+        SocketReader reader(sock);
+        string line;
+        bool complete = false;
+        while (reader.readLine(line)) {
+            if (line.find("END\t") == 0) {
+                complete = true;
                 break;
             }
-            else {
+            if (line.find("ERROR:") == 0) {
+                cerr << "Server error: " << line << endl;
                 break;
             }
+            size_t tab = line.find('\t');
+            if (tab != string::npos) {
+                files.push_back(make_pair(line.substr(0, tab), atoll(line.c_str() + tab + 1)));
+            }
         }
-
-        file.close();
         closesocket(sock);
+        return complete;
+    }
 
-        auto endTime = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+    string localPathFor(const string& remoteName, const BatchOptions& options) {
+        return options.directory == "." ? remoteName : options.directory + "\\" + remoteName;
+    }
 
-        if (totalBytes > 0) {
-            cout << endl << "Download completed!" << endl;
-            printLine();
-            cout << "File:  " << filename << endl;
-            cout << "Size:  " << formatFileSize(totalBytes) << endl;
-            cout << "Time:  " << duration.count() << " ms" << endl;
+    // get <имя|маска|@список>...
+    int batchGet(const vector<string>& arguments, const BatchOptions& options) {
+        vector<string> names = expandArgumentLists(arguments);
+        vector<TransferJob> jobs;
+        for (size_t i = 0; i < names.size(); i++) {
+            if (!hasWildcards(names[i])) {
+                jobs.push_back(TransferJob(false, names[i], localPathFor(names[i], options)));
+                continue;
+            }
+            vector<pair<string, long long>> matches;
+            if (!listServerFiles(names[i], matches)) {
+                return 1;
+            }
+            if (matches.empty()) {
+                cerr << "No files match " << names[i] << endl;
+            }
+            for (size_t m = 0; m < matches.size(); m++) {
+                jobs.push_back(TransferJob(false, matches[m].first, localPathFor(matches[m].first, options)));
+            }
+        }
+        if (jobs.empty()) {
+            cerr << "Nothing to download" << endl;
+            return 1;
+        }
+        return runTransferJobs(jobs, options) == 0 ? 0 : 1;
+    }
 
-            verifyFileContent(filename);
+    // put <путь|маска|@список>... - каталог выгружается целиком, под своим именем
+    int batchPut(const vector<string>& arguments, const BatchOptions& options) {
+        vector<string> paths = expandArgumentLists(arguments);
+        vector<TransferJob> jobs;
+        for (size_t i = 0; i < paths.size(); i++) {
+            const string& path = paths[i];
+            if (hasWildcards(path)) {
+                size_t slash = path.find_last_of("\\/");
+                string directory = slash == string::npos ? "" : path.substr(0, slash + 1);
+                WIN32_FIND_DATAA findFileData;
+                HANDLE hFind = FindFirstFileA(path.c_str(), &findFileData);
+                if (hFind == INVALID_HANDLE_VALUE) {
+                    cerr << "No files match " << path << endl;
+                    continue;
+                }
+                do {
+                    if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                        string localPath = directory + findFileData.cFileName;
+                        jobs.push_back(TransferJob(true, remoteNameFor(localPath), localPath));
+                    }
+                } while (FindNextFileA(hFind, &findFileData) != 0);
+                FindClose(hFind);
+                continue;
+            }
+
+            DWORD attributes = GetFileAttributesA(path.c_str());
+            if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                jobs.push_back(TransferJob(true, remoteNameFor(path), path));
+                continue;
+            }
+
+            string base = path;
+            while (!base.empty() && (base.back() == '\\' || base.back() == '/')) {
+                base.pop_back();
+            }
+            base = base.substr(base.find_last_of("\\/:") + 1);
+            if (base == "." || base == "..") {
+                base.clear();
+            }
+
+            vector<pair<string, long long>> files;
+            listLocalTree(path, files);
+            for (size_t f = 0; f < files.size(); f++) {
+                jobs.push_back(TransferJob(true, base.empty() ? files[f].first : base + "/" + files[f].first,
+                    path + "\\" + files[f].first));
+            }
         }
-        else {
-            cout << "Download failed" << endl;
+        if (jobs.empty()) {
+            cerr << "Nothing to upload" << endl;
+            return 1;
         }
+        return runTransferJobs(jobs, options) == 0 ? 0 : 1;
     }
 
-    void verifyFileContent(const string& filename) {
-        cout << endl << "Verifying file content for SIZE: headers..." << endl;
+    // ls [-r] [путь] - строки LISTDIR как есть или в JSON
+    int batchList(const vector<string>& arguments, const BatchOptions& options) {
+        string command = "LISTDIR";
+        for (size_t i = 0; i < arguments.size(); i++) {
+            command += " " + arguments[i];
+        }
+        command += "\n";
 
-        ifstream file(filename, ios::binary);
-        if (!file) {
-            cout << "Cannot open file for verification" << endl;
-            return;
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return 1;
         }
 
-        // Читаем весь файл для проверки
-        file.seekg(0, ios::end);
-        streamsize fileSize = file.tellg();
-        file.seekg(0, ios::beg);
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
 
-        if (fileSize == 0) {
-            cout << "File is empty" << endl;
-            file.close();
-            return;
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
+            closesocket(sock);
+            return 1;
         }
 
-        // Читаем первые 1000 байт для быстрой проверки
-        const int CHECK_SIZE = min((streamsize)1000, fileSize);
-        vector<char> buffer(CHECK_SIZE);
-        file.read(buffer.data(), CHECK_SIZE);
-        file.close();
+        SocketReader reader(sock);
+        string line;
+        bool complete = false;
+        while (reader.readLine(line)) {
+            if (line.find("ERROR:") == 0) {
+                cerr << "Server error: " << line << endl;
+                break;
+            }
+            complete = line.find("END ") == 0;
+            if (!options.json) {
+                cout << line << endl;
+            }
+            else if (line.find("DIR ") == 0) {
+                cout << "{\"type\":\"dir\",\"name\":\"" << jsonEscape(line.substr(4)) << "\"}" << endl;
+            }
+            else if (line.find("FILE ") == 0) {
+                stringstream ls(line.substr(5));
+                long long size = 0;
+                long long mtime = 0;
+                ls >> size >> mtime;
+                string name;
+                getline(ls >> ws, name);
+                cout << "{\"type\":\"file\",\"name\":\"" << jsonEscape(name) << "\",\"size\":" << size << ",\"mtime\":" << mtime << "}" << endl;
+            }
+            if (complete) {
+                break;
+            }
+        }
+        closesocket(sock);
+        return complete ? 0 : 1;
+    }
 
-        string content(buffer.data(), CHECK_SIZE);
+    // stat <имя|@список>... - строки STAT как есть или в JSON; код 1, если чего-то нет
+    int batchStat(const vector<string>& arguments, const BatchOptions& options) {
+        vector<string> names = expandArgumentLists(arguments);
+        if (names.empty()) {
+            return 1;
+        }
 
-        // Ищем заголовок SIZE:
-        size_t sizePos = content.find("SIZE:");
-        if (sizePos != string::npos) {
-            cout << "!!! ERROR !!! File contains 'SIZE:' at position " << sizePos << endl;
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
+            return 1;
+        }
 
-            // Находим конец строки с размером
-            size_t endLine = content.find("\n", sizePos);
-            if (endLine != string::npos) {
-                string header = content.substr(sizePos, endLine - sizePos + 1);
-                cout << "Header found: " << header;
+        DWORD timeout = 30000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
 
-                // Показываем контекст
-                size_t contextStart = max(0, (int)sizePos - 20);
-                size_t contextEnd = min(content.length(), endLine + 20);
-                cout << "Context: ..." << content.substr(contextStart, contextEnd - contextStart) << "..." << endl;
+        string command = "STAT\n";
+        SocketReader reader(sock);
+        string line;
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR || !reader.readLine(line) || line != "READY") {
+            cerr << "Server error: " << line << endl;
+            closesocket(sock);
+            return 1;
+        }
+
+        atomic<bool> listSent(false);
+        thread sender = sendLinesAsync(sock, names, listSent);
+
+        bool complete = false;
+        long long missing = 0;
+        while (reader.readLine(line)) {
+            if (line.find("END ") == 0) {
+                long long found = 0;
+                stringstream(line.substr(4)) >> found >> missing;
+                complete = true;
+            }
+            if (!options.json) {
+                cout << line << endl;
+            }
+            else if (line.find("OK ") == 0) {
+                stringstream ls(line.substr(3));
+                long long size = 0;
+                long long mtime = 0;
+                string hash;
+                ls >> size >> mtime >> hash;
+                string name;
+                getline(ls >> ws, name);
+                cout << "{\"name\":\"" << jsonEscape(name) << "\",\"size\":" << size << ",\"mtime\":" << mtime
+                    << ",\"blake3\":" << (hash == "-" ? string("null") : "\"" + hash + "\"") << "}" << endl;
+            }
+            else if (line.find("MISSING ") == 0) {
+                cout << "{\"name\":\"" << jsonEscape(line.substr(8)) << "\",\"missing\":true}" << endl;
+            }
+            if (complete || line.find("ERROR:") == 0) {
+                break;
+            }
+        }
+        if (!complete) {
+            shutdown(sock, SD_BOTH);
+        }
+        sender.join();
+        closesocket(sock);
+        if (!listSent && !complete) {
+            cerr << "Failed to send file list" << endl;
+        }
+        return complete && missing == 0 ? 0 : 1;
+    }
 
-                // Предлагаем очистить файл
-                cout << endl << "Do you want to remove the header from the file? (y/n): ";
-                string answer;
-                getline(cin, answer);
+    // Один проход синхронизации: сравнение по дереву хешей, затем выгрузка отличающихся и
+    // новых локальных файлов (down - скачивание отличающихся и новых файлов сервера)
+    bool syncPass(const string& directory, bool down, const BatchOptions& options) {
+        TreeDifference diff;
+        if (!compareTreeWithServer(directory, diff)) {
+            return false;
+        }
 
-                if (answer == "y" || answer == "Y") {
-                    removeHeaderFromFile(filename, endLine + 1);
-                }
+        vector<TransferJob> jobs;
+        for (size_t i = 0; i < diff.different.size(); i++) {
+            jobs.push_back(TransferJob(!down, diff.different[i], directory + "\\" + diff.different[i]));
+        }
+        if (down) {
+            for (size_t i = 0; i < diff.serverOnly.size(); i++) {
+                jobs.push_back(TransferJob(false, diff.serverOnly[i].first, directory + "\\" + diff.serverOnly[i].first));
             }
         }
         else {
-            cout << "✓ File is CLEAN - no SIZE: headers found in first " << CHECK_SIZE << " bytes" << endl;
-
-            // Показываем начало файла для текстовых файлов
-            bool isText = true;
-            for (char ch : content) {
-                if (ch == 0 || (ch < 32 && ch != '\n' && ch != '\r' && ch != '\t' && ch != '\b')) {
-                    isText = false;
-                    break;
-                }
+            for (size_t i = 0; i < diff.localOnly.size(); i++) {
+                jobs.push_back(TransferJob(true, diff.localOnly[i], directory + "\\" + diff.localOnly[i]));
             }
+        }
 
-            if (isText && !content.empty()) {
-                cout << "First few lines:" << endl;
-                cout << "----------------" << endl;
-
-                stringstream ss(content);
-                string line;
-                int lineCount = 0;
-                while (getline(ss, line) && lineCount < 3) {
-                    cout << line << endl;
-                    lineCount++;
-                }
-                cout << "----------------" << endl;
-            }
+        if (!options.json) {
+            cout << "Compared " << diff.localFiles << " local files (" << diff.hashedFiles << " hashed in " << diff.hashMs
+                << " ms) in " << diff.roundTrips << " round trips: " << jobs.size() << " to " << (down ? "download" : "upload") << endl;
         }
+        if (jobs.empty()) {
+            return true;
+        }
+        return runTransferJobs(jobs, options) == 0;
     }
 
-    void removeHeaderFromFile(const string& filename, size_t headerSize) {
-        ifstream inFile(filename, ios::binary);
-        if (!inFile) {
-            cerr << "Cannot open file for cleaning" << endl;
-            return;
-        }
+    // Зеркалирование каталога: проходы синхронизации раз в intervalSeconds, а при изменениях
+    // в локальном каталоге - сразу (после паузы, чтобы серия записей попала в один проход).
+    // durationSeconds = 0 - до завершения программы. Результат - успех последнего прохода
+    bool mirrorDirectory(const string& directory, bool down, const BatchOptions& options, long long intervalSeconds, long long durationSeconds) {
+        HANDLE change = FindFirstChangeNotificationA(directory.c_str(), TRUE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
 
-        // Переходим после заголовка
-        inFile.seekg(headerSize, ios::beg);
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(durationSeconds);
+        bool ok = true;
+        long long pass = 0;
+        while (true) {
+            pass++;
+            if (!options.json) {
+                time_t now = time(NULL);
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+                cout << "[" << stamp << "] Pass " << pass << endl;
+            }
+            ok = syncPass(directory, down, options);
 
-        // Создаем временный файл
-        string tempFile = filename + ".clean";
-        ofstream outFile(tempFile, ios::binary);
+            // Скачивания самого прохода тоже меняют каталог - эти уведомления сбрасываются, иначе
+            // сразу шел бы лишний полный проход. Правка, сделанная во время прохода, дождется интервала
+            if (down && change != INVALID_HANDLE_VALUE) {
+                for (int i = 0; i < 100 && WaitForSingleObject(change, 0) == WAIT_OBJECT_0; i++) {
+                    FindNextChangeNotification(change);
+                }
+            }
 
-        if (!outFile) {
-            cerr << "Cannot create clean file" << endl;
-            inFile.close();
-            return;
+            auto wakeAt = chrono::steady_clock::now() + chrono::seconds(intervalSeconds);
+            if (durationSeconds > 0 && wakeAt > deadline) {
+                wakeAt = deadline;
+            }
+            while (true) {
+                auto now = chrono::steady_clock::now();
+                if (now >= wakeAt) {
+                    break;
+                }
+                DWORD waitMs = static_cast<DWORD>(chrono::duration_cast<chrono::milliseconds>(wakeAt - now).count());
+                if (change == INVALID_HANDLE_VALUE) {
+                    Sleep(waitMs);
+                    continue;
+                }
+                if (WaitForSingleObject(change, waitMs) == WAIT_OBJECT_0) {
+                    Sleep(1000);
+                    FindNextChangeNotification(change);
+                    break;
+                }
+            }
+            if (durationSeconds > 0 && chrono::steady_clock::now() >= deadline) {
+                break;
+            }
         }
 
-        // Копируем данные после заголовка
-        const int BUFFER_SIZE = 65536;
-        char buffer[BUFFER_SIZE];
+        if (change != INVALID_HANDLE_VALUE) {
+            FindCloseChangeNotification(change);
+        }
+        return ok;
+    }
 
-        while (!inFile.eof()) {
-            inFile.read(buffer, BUFFER_SIZE);
-            streamsize bytesRead = inFile.gcount();
-            if (bytesRead > 0) {
-                outFile.write(buffer, bytesRead);
+    // sync [--down] [--watch <секунд>] <каталог>: один проход, а с --watch - зеркалирование
+    int batchSync(const vector<string>& arguments, const BatchOptions& options) {
+        bool down = false;
+        long long intervalSeconds = 0;
+        string directory;
+        for (size_t i = 0; i < arguments.size(); i++) {
+            if (arguments[i] == "--down") {
+                down = true;
+            }
+            else if (arguments[i] == "--watch" && i + 1 < arguments.size()) {
+                intervalSeconds = atoll(arguments[++i].c_str());
+            }
+            else {
+                directory = arguments[i];
             }
         }
+        if (directory.empty() || intervalSeconds < 0) {
+            cerr << "Usage: sync [--down] [--watch <seconds>] <dir>" << endl;
+            return 2;
+        }
+        if (down) {
+            CreateDirectoryA(directory.c_str(), NULL);
+        }
 
-        inFile.close();
-        outFile.close();
-
-        // Заменяем старый файл чистым
-        DeleteFileA(filename.c_str());
-        rename(tempFile.c_str(), filename.c_str());
-
-        cout << "File cleaned successfully!" << endl;
-
-        // Проверяем новый размер
-        ifstream checkFile(filename, ios::binary | ios::ate);
-        streamsize newSize = checkFile.tellg();
-        checkFile.close();
+        DWORD attributes = GetFileAttributesA(directory.c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            cerr << "Directory not found: " << directory << endl;
+            return 1;
+        }
 
-        cout << "New file size: " << formatFileSize(newSize) << endl;
+        if (intervalSeconds > 0) {
+            return mirrorDirectory(directory, down, options, intervalSeconds, 0) ? 0 : 1;
+        }
+        return syncPass(directory, down, options) ? 0 : 1;
     }
 
-    void uploadFile() {
-        printHeader("UPLOAD FILE");
+    void mirrorDirectoryInteractive() {
+        printHeader("MIRROR DIRECTORY WITH SERVER");
 
-        showLocalFiles();
+        cout << "Enter local directory [.]: ";
+        string directory;
+        getline(cin, directory);
+        if (directory.empty()) {
+            directory = ".";
+        }
 
-        cout << endl << "Enter filename to upload: ";
-        string filename;
-        getline(cin, filename);
+        cout << "Direction - (u)pload local changes or (d)ownload server changes [u]: ";
+        string direction;
+        getline(cin, direction);
+        bool down = direction == "d" || direction == "D";
+        if (down) {
+            CreateDirectoryA(directory.c_str(), NULL);
+        }
 
-        if (filename.empty()) {
-            cout << "Upload cancelled" << endl;
+        DWORD attributes = GetFileAttributesA(directory.c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            cerr << "Directory not found: " << directory << endl;
             return;
         }
 
-        char currentDir[MAX_PATH];
-        GetCurrentDirectoryA(MAX_PATH, currentDir);
-        string fullPath = string(currentDir) + "\\" + filename;
+        cout << "Keep mirroring for how many minutes (0 - single pass) [0]: ";
+        string minutesInput;
+        getline(cin, minutesInput);
+        long long minutes = atoll(minutesInput.c_str());
+
+        BatchOptions options;
+        cout << "Parallel transfers [" << options.jobs << "]: ";
+        string jobsInput;
+        getline(cin, jobsInput);
+        int jobs = atoi(jobsInput.c_str());
+        if (jobs >= 1 && jobs <= 64) {
+            options.jobs = jobs;
+        }
 
-        ifstream testFile(fullPath, ios::binary | ios::ate);
-        if (!testFile) {
-            cerr << "File not found: " << filename << endl;
+        if (minutes <= 0) {
+            syncPass(directory, down, options);
             return;
         }
 
-        streamsize fileSize = testFile.tellg();
-        testFile.close();
-
-        cout << endl << "File: " << filename << " (" << formatFileSize(fileSize) << ")" << endl;
-
-        cout << "Start upload? (y/n): ";
-        string confirm;
-        getline(cin, confirm);
+        cout << "Mirroring " << directory << (down ? " from " : " to ") << serverIP << ":" << port
+            << " for " << minutes << " min (checking every 10 s and on local changes)..." << endl;
+        printLine();
+        mirrorDirectory(directory, down, options, 10, minutes * 60);
+        printLine();
+        cout << "Mirroring stopped" << endl;
+    }
 
-        if (confirm != "y" && confirm != "Y") {
-            cout << "Upload cancelled" << endl;
-            return;
-        }
+    // Счетчики сервера: соединения, объем, число команд и задержки (перцентили в мкс)
+    void showServerStats() {
+        printHeader("SERVER STATISTICS");
 
         SOCKET sock = createConnection(2000);
         if (sock == INVALID_SOCKET) {
             return;
         }
 
-        DWORD uploadTimeout = 30000;
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&uploadTimeout, sizeof(uploadTimeout));
+        DWORD timeout = 5000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
 
-        // Отправляем размер файла отдельно от данных
-        string command = "PUT " + filename + " " + to_string(fileSize) + "\n";
+        string command = "STATS\n";
         if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
             cerr << "Failed to send command" << endl;
             closesocket(sock);
             return;
         }
 
-        // Ждем подтверждения
-        char readyBuffer[256];
-        DWORD readyTimeout = 2000;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&readyTimeout, sizeof(readyTimeout));
+        SocketReader reader(sock);
+        string line;
+        while (reader.readLine(line) && line != "END") {
+            cout << line << endl;
+        }
+        closesocket(sock);
+    }
 
-        int readyBytes = recv(sock, readyBuffer, sizeof(readyBuffer) - 1, 0);
-        if (readyBytes <= 0 || string(readyBuffer).find("READY") == string::npos) {
-            cerr << "Server not ready: ";
-            if (readyBytes > 0) {
-                readyBuffer[readyBytes] = '\0';
-                cerr << readyBuffer;
-            }
-            closesocket(sock);
+    // Трассировка выбранных сервером запросов в формате Chrome trace events - файл
+    // открывается в Perfetto (ui.perfetto.dev) или chrome://tracing
+    void saveServerTrace() {
+        printHeader("SERVER REQUEST TRACE");
+
+        string path;
+        cout << "Save trace to [server_trace.json]: ";
+        getline(cin, path);
+        if (path.empty()) {
+            path = "server_trace.json";
+        }
+
+        SOCKET sock = createConnection(2000);
+        if (sock == INVALID_SOCKET) {
             return;
         }
 
-        cout << "Uploading file..." << endl;
+        DWORD timeout = 10000;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
 
-        ifstream file(fullPath, ios::binary);
-        if (!file) {
-            cerr << "Cannot open file" << endl;
+        string command = "TRACE\n";
+        if (send(sock, command.c_str(), command.length(), 0) == SOCKET_ERROR) {
+            cerr << "Failed to send command" << endl;
             closesocket(sock);
             return;
         }
 
-        const int BUFFER_SIZE = 65536;
-        char buffer[BUFFER_SIZE];
-        streamsize totalSent = 0;
-        auto startTime = chrono::steady_clock::now();
-
-        while (!file.eof()) {
-            file.read(buffer, BUFFER_SIZE);
-            streamsize bytesRead = file.gcount();
-            if (bytesRead > 0) {
-                int sent = send(sock, buffer, bytesRead, 0);
-                if (sent == SOCKET_ERROR) {
-                    cerr << "Upload failed: " << WSAGetLastError() << endl;
-                    break;
-                }
-                totalSent += sent;
-
-                if (fileSize > 0) {
-                    int percent = static_cast<int>((totalSent * 100) / fileSize);
-                    if (percent % 25 == 0) {
-                        cout << "Progress: " << percent << "%" << endl;
-                    }
-                }
-            }
+        string trace;
+        char buffer[65536];
+        int received;
+        while ((received = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+            trace.append(buffer, received);
         }
-
-        file.close();
-
-        // Закрываем отправку
-        shutdown(sock, SD_SEND);
-
-        // Ждем подтверждения
-        char confirmBuffer[256];
-        DWORD confirmTimeout = 2000;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&confirmTimeout, sizeof(confirmTimeout));
-
-        int confirmBytes = recv(sock, confirmBuffer, sizeof(confirmBuffer) - 1, 0);
         closesocket(sock);
 
-        if (confirmBytes > 0) {
-            confirmBuffer[confirmBytes] = '\0';
-            cout << endl << "Server response: " << confirmBuffer << endl;
+        if (trace.empty() || trace[0] != '{') {
+            cout << (trace.empty() ? "No response from server" : trace) << endl;
+            return;
         }
 
-        auto endTime = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
-
-        cout << endl << "Upload completed!" << endl;
-        printLine();
-        cout << "File:  " << filename << endl;
-        cout << "Size:  " << formatFileSize(totalSent) << endl;
-        cout << "Time:  " << duration.count() << " ms" << endl;
-
-        if (duration.count() > 0) {
-            double speed = (totalSent * 1000.0) / (duration.count() * 1024.0);
-            cout << "Speed: " << fixed << setprecision(2) << speed << " KB/s" << endl;
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(trace.c_str(), trace.length());
+        if (!out) {
+            cerr << "Cannot write " << path << endl;
+            return;
         }
+        cout << "Trace saved: " << path << " (" << formatFileSize(trace.length()) << ")" << endl;
+        cout << "Only sampled requests are traced: start the server with --trace-rate (e.g. 0.1)" << endl;
     }
 
     void createTestFile() {
@@ -822,6 +5304,11 @@ public:
             cout << "✓ Connection SUCCESSFUL!" << endl;
             cout << "Server response: " << buffer;
             cout << "Connection time: " << connectDuration.count() << " ms" << endl;
+
+            unsigned long long reused = 0;
+            unsigned long long opened = 0;
+            pool->getStats(reused, opened);
+            cout << "Connections: " << opened << " opened, " << reused << " taken ready from the pool" << endl;
         }
         else {
             cout << "Connected but no response (timeout)" << endl;
@@ -844,10 +5331,29 @@ public:
             cout << "6. Create test file" << endl;
             cout << "7. Test connection" << endl;
             cout << "8. Verify file for headers" << endl;
-            cout << "9. Exit" << endl;
+            cout << "9. Compare local file with server (hash)" << endl;
+            cout << "10. Upload file (hash first, deduplicated)" << endl;
+            cout << "11. Upload file (chunked, changed parts only)" << endl;
+            cout << "12. Download file (chunked, changed parts only)" << endl;
+            cout << "13. Upload file (delta against server copy)" << endl;
+            cout << "14. Download file (delta against local copy)" << endl;
+            cout << "15. Delta sync benchmark (local)" << endl;
+            cout << "16. Download many files (batch)" << endl;
+            cout << "17. Upload directory (bulk)" << endl;
+            cout << "18. List files (filtered, paged)" << endl;
+            cout << "19. Browse server directory" << endl;
+            cout << "20. Search files on server" << endl;
+            cout << "21. Watch server for changes" << endl;
+            cout << "22. Stat many files" << endl;
+            cout << "23. Download file (cached, revalidated)" << endl;
+            cout << "24. Compare directory with server (hash tree)" << endl;
+            cout << "25. Mirror directory with server" << endl;
+            cout << "26. Server statistics" << endl;
+            cout << "27. Save server request trace" << endl;
+            cout << "0. Exit" << endl;
             cout << "==================================" << endl;
 
-            cout << "Select option [1-9]: ";
+            cout << "Select option [0-27]: ";
             getline(cin, choice);
 
             if (choice == "1") {
@@ -883,7 +5389,76 @@ public:
                 getline(cin, filename);
                 verifyFileContent(filename);
             }
-            else if (choice == "9" || choice == "exit") {
+            else if (choice == "9") {
+                cout << endl << "Enter filename to compare: ";
+                string filename;
+                getline(cin, filename);
+                compareWithServer(filename);
+            }
+            else if (choice == "10") {
+                uploadFileWithHash();
+            }
+            else if (choice == "11") {
+                uploadFileChunked();
+            }
+            else if (choice == "12") {
+                cout << endl << "Enter filename to download: ";
+                string filename;
+                getline(cin, filename);
+                downloadFileChunked(filename);
+            }
+            else if (choice == "13") {
+                uploadFileDelta();
+            }
+            else if (choice == "14") {
+                cout << endl << "Enter filename to download: ";
+                string filename;
+                getline(cin, filename);
+                downloadFileDelta(filename);
+            }
+            else if (choice == "15") {
+                runDeltaBenchmark();
+            }
+            else if (choice == "16") {
+                downloadMultipleFiles();
+            }
+            else if (choice == "17") {
+                uploadDirectoryBulk();
+            }
+            else if (choice == "18") {
+                requestFileListing();
+            }
+            else if (choice == "19") {
+                browseServerDirectory();
+            }
+            else if (choice == "20") {
+                searchServerFiles();
+            }
+            else if (choice == "21") {
+                watchServerChanges();
+            }
+            else if (choice == "22") {
+                statManyFiles();
+            }
+            else if (choice == "23") {
+                cout << endl << "Enter filename to download: ";
+                string filename;
+                getline(cin, filename);
+                downloadFileCached(filename);
+            }
+            else if (choice == "24") {
+                compareDirectoryTree();
+            }
+            else if (choice == "25") {
+                mirrorDirectoryInteractive();
+            }
+            else if (choice == "26") {
+                showServerStats();
+            }
+            else if (choice == "27") {
+                saveServerTrace();
+            }
+            else if (choice == "0" || choice == "exit") {
                 cout << endl << "Goodbye!" << endl;
                 break;
             }
@@ -894,7 +5469,100 @@ public:
     }
 };
 
-int main() {
+void printUsage() {
+    cout << "Usage: client [options] <command> [arguments]" << endl;
+    cout << endl;
+    cout << "Commands:" << endl;
+    cout << "  get <name|glob|@list>...   download files from the server" << endl;
+    cout << "  put <path|glob|@list>...   upload files or whole directories" << endl;
+    cout << "  ls [-r] [path]             list a server directory" << endl;
+    cout << "  stat <name|@list>...       size, time and hash of server files" << endl;
+    cout << "  sync [--down] <dir>        upload (with --down: download) files that differ" << endl;
+    cout << "       [--watch <seconds>]   keep mirroring: every N seconds and on local changes" << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "  -s, --server <host>        server address (default 127.0.0.1)" << endl;
+    cout << "  -p, --port <port>          server port (default 8888)" << endl;
+    cout << "  -j, --jobs <n>             parallel transfers, 1-64 (default 4)" << endl;
+    cout << "  -r, --retries <n>          retries of a failed transfer (default 2)" << endl;
+    cout << "  -d, --dir <dir>            local directory for get (default .)" << endl;
+    cout << "  --json                     results as JSON lines" << endl;
+    cout << endl;
+    cout << "Without a command the interactive menu starts." << endl;
+}
+
+// Пакетный режим: параметры, команда и ее аргументы. Код возврата: 0 - все получилось,
+// 1 - часть передач или запросов не удалась, 2 - неверная командная строка
+int runCommandLine(int argc, char* argv[]) {
+    string serverIP = "127.0.0.1";
+    int port = 8888;
+    BatchOptions options;
+
+    int i = 1;
+    for (; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if ((arg == "-s" || arg == "--server") && hasValue) {
+            serverIP = argv[++i];
+        }
+        else if ((arg == "-p" || arg == "--port") && hasValue) {
+            port = atoi(argv[++i]);
+        }
+        else if ((arg == "-j" || arg == "--jobs") && hasValue) {
+            options.jobs = atoi(argv[++i]);
+        }
+        else if ((arg == "-r" || arg == "--retries") && hasValue) {
+            options.retries = atoi(argv[++i]);
+        }
+        else if ((arg == "-d" || arg == "--dir") && hasValue) {
+            options.directory = argv[++i];
+        }
+        else if (arg == "--json") {
+            options.json = true;
+        }
+        else if (arg == "-h" || arg == "--help") {
+            printUsage();
+            return 0;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (i >= argc || port <= 0 || port > 65535 || options.jobs < 1 || options.jobs > 64 || options.retries < 0) {
+        printUsage();
+        return 2;
+    }
+
+    string command = argv[i++];
+    vector<string> arguments(argv + i, argv + argc);
+
+    FileClient client(serverIP, port);
+    if (command == "get" && !arguments.empty()) {
+        return client.batchGet(arguments, options);
+    }
+    if (command == "put" && !arguments.empty()) {
+        return client.batchPut(arguments, options);
+    }
+    if (command == "ls") {
+        return client.batchList(arguments, options);
+    }
+    if (command == "stat" && !arguments.empty()) {
+        return client.batchStat(arguments, options);
+    }
+    if (command == "sync") {
+        return client.batchSync(arguments, options);
+    }
+
+    printUsage();
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return runCommandLine(argc, argv);
+    }
+
     cout << "========================================" << endl;
     cout << "    FILE TRANSFER CLIENT - CLEAN MODE   " << endl;
     cout << "========================================" << endl;
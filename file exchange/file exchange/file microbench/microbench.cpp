@@ -0,0 +1,340 @@
+﻿#define FILE_SERVER_NO_MAIN
+#include "../file server/server.cpp"
+
+#include <cstdlib>
+#include <new>
+
+// Микротесты горячих функций сервера: разбор команды, цепочка выбора команды, форматирование
+// размера и времени в журнале, сборка списка файлов. Для каждого теста - время и число
+// выделений памяти на вызов, чтобы регрессии и улучшения были видны в цифрах
+
+// Выделения памяти считаются отдельно в каждом потоке: фоновые потоки теста не мешают
+static thread_local unsigned long long allocationCount = 0;
+
+void* operator new(size_t size) {
+    allocationCount++;
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+// Результаты складываются сюда, чтобы компилятор не выбросил измеряемый код
+static volatile size_t benchmarkSink = 0;
+
+// Поток вывода в никуда - на время тестов журнала
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+
+    streamsize xsputn(const char*, streamsize n) override {
+        return n;
+    }
+};
+
+// Пара соединенных сокетов на loopback: server - конец, который получает функция сервера
+struct SocketPair {
+    SOCKET server;
+    SOCKET client;
+
+    SocketPair() : server(INVALID_SOCKET), client(INVALID_SOCKET) {}
+
+    bool open() {
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = 0;
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        int length = sizeof(addr);
+        bool ok = listener != INVALID_SOCKET
+            && bind(listener, (sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR
+            && listen(listener, 1) != SOCKET_ERROR
+            && getsockname(listener, (sockaddr*)&addr, &length) != SOCKET_ERROR;
+        if (ok) {
+            client = socket(AF_INET, SOCK_STREAM, 0);
+            ok = client != INVALID_SOCKET && connect(client, (sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+        }
+        if (ok) {
+            server = accept(listener, NULL, NULL);
+            ok = server != INVALID_SOCKET;
+        }
+        if (listener != INVALID_SOCKET) {
+            closesocket(listener);
+        }
+        return ok;
+    }
+
+    void close() {
+        if (server != INVALID_SOCKET) {
+            closesocket(server);
+            server = INVALID_SOCKET;
+        }
+        if (client != INVALID_SOCKET) {
+            closesocket(client);
+            client = INVALID_SOCKET;
+        }
+    }
+
+    ~SocketPair() {
+        close();
+    }
+};
+
+// Вычитывает все, что сервер шлет клиентскому концу пары, пока соединение не закроется
+class Drainer {
+private:
+    SOCKET sock;
+    thread worker;
+
+public:
+    explicit Drainer(SOCKET s) : sock(s) {
+        worker = thread([this]() {
+            vector<char> buffer(1 << 20);
+            while (recv(sock, buffer.data(), static_cast<int>(buffer.size()), 0) > 0) {
+            }
+        });
+    }
+
+    ~Drainer() {
+        shutdown(sock, SD_BOTH);
+        worker.join();
+    }
+};
+
+struct MicroResult {
+    string name;
+    long long iterations;
+    double nsPerCall;
+    double allocationsPerCall;
+};
+
+// Тест выполняет тело iterations раз; число повторов растет, пока замер не займет minTimeMs
+class MicroRunner {
+private:
+    string filter;
+    long long minTimeMs;
+    vector<MicroResult> results;
+
+public:
+    MicroRunner(const string& f, long long minMs) : filter(f), minTimeMs(minMs) {}
+
+    void run(const string& name, const function<void(long long)>& body) {
+        if (!filter.empty() && name.find(filter) == string::npos) {
+            return;
+        }
+
+        body(1);
+        long long iterations = 1;
+        while (true) {
+            unsigned long long allocationsBefore = allocationCount;
+            auto start = chrono::steady_clock::now();
+            body(iterations);
+            long long elapsedNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            unsigned long long allocations = allocationCount - allocationsBefore;
+
+            if (elapsedNs >= minTimeMs * 1000000 || iterations >= 1000000000) {
+                MicroResult result = { name, iterations, static_cast<double>(elapsedNs) / iterations,
+                    static_cast<double>(allocations) / iterations };
+                results.push_back(result);
+                cout << left << setw(40) << name << right << setw(12) << iterations << fixed << setprecision(1)
+                    << setw(14) << result.nsPerCall << setprecision(2) << setw(12) << result.allocationsPerCall << endl;
+                return;
+            }
+
+            // Следующий замер - с запасом на нужное время, но не больше чем в 10 раз длиннее
+            long long target = elapsedNs > 0 ? static_cast<long long>(iterations * (minTimeMs * 1000000.0 * 1.4 / elapsedNs)) : iterations * 10;
+            iterations = target > iterations * 10 ? iterations * 10 : (target > iterations ? target : iterations + 1);
+        }
+    }
+
+    bool writeJson(const string& path) const {
+        ofstream out(path, ios::trunc);
+        out << "{" << endl << "  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            out << (i > 0 ? "," : "") << endl << "    {\"name\": \"" << results[i].name << "\", \"iterations\": "
+                << results[i].iterations << fixed << setprecision(3) << ", \"ns_per_call\": " << results[i].nsPerCall
+                << ", \"allocations_per_call\": " << results[i].allocationsPerCall << "}";
+        }
+        out << endl << "  ]" << endl << "}" << endl;
+        return static_cast<bool>(out);
+    }
+};
+
+static string exeDirectory() {
+    char buffer[MAX_PATH];
+    GetModuleFileNameA(NULL, buffer, MAX_PATH);
+    string path = buffer;
+    size_t pos = path.find_last_of("\\/");
+    return pos == string::npos ? "." : path.substr(0, pos);
+}
+
+// Каталог с entryCount пустыми файлами с длинными именами (создается один раз)
+static void prepareListingDirectory(const string& directory, int entryCount) {
+    CreateDirectoryA(directory.c_str(), NULL);
+    for (int i = 0; i < entryCount; i++) {
+        char name[128];
+        sprintf(name, "\\quarterly_financial_report_department_%03d_revision_%05d_final.xlsx", i % 100, i);
+        string path = directory + name;
+        if (GetFileAttributesA(path.c_str()) == INVALID_FILE_ATTRIBUTES) {
+            ofstream(path, ios::binary);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string filter;
+    string jsonPath;
+    long long minTimeMs = 500;
+    int listingEntries = 10000;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--filter" && hasValue) {
+            filter = argv[++i];
+        }
+        else if (arg == "--min-time" && hasValue) {
+            minTimeMs = atoll(argv[++i]);
+        }
+        else if (arg == "--entries" && hasValue) {
+            listingEntries = atoi(argv[++i]);
+        }
+        else if (arg == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        }
+        else {
+            cout << "Usage: file_microbench [--filter TEXT] [--min-time MS] [--entries N] [--json FILE]" << endl;
+            return arg == "-h" || arg == "--help" ? 0 : 2;
+        }
+    }
+    if (minTimeMs <= 0 || listingEntries < 1) {
+        cerr << "Invalid options" << endl;
+        return 2;
+    }
+
+    const string serverDirectory = "microbench_files";
+    cout << "Preparing " << listingEntries << " files for the listing benchmark..." << endl;
+    prepareListingDirectory(exeDirectory() + "\\" + serverDirectory, listingEntries);
+
+    // Сервер не запускается (start не вызывается): нужны только его методы и каталог в памяти.
+    // Порт 0 - любой свободный, чтобы не мешать настоящему серверу
+    streambuf* consoleBuffer = cout.rdbuf();
+    NullBuffer nullBuffer;
+    cout.rdbuf(&nullBuffer);
+    FileServer server(0, serverDirectory);
+    server.flushLog();
+    cout.rdbuf(consoleBuffer);
+
+    cout << endl << left << setw(40) << "benchmark" << right << setw(12) << "iterations" << setw(14) << "ns/call"
+        << setw(12) << "allocs/call" << endl;
+
+    MicroRunner runner(filter, minTimeMs);
+
+    const long long sizes[] = { 512, 4096, 1536000, 5368709120LL, 734003200, 12, 98765432, 1 };
+    runner.run("formatFileSize", [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++) {
+            benchmarkSink += server.formatFileSize(sizes[i & 7]).length();
+        }
+    });
+
+    // Без ограничения частоты: измеряется запись в буфер журнала, а не отказ по пределу
+    server.setLogOptions(LOG_INFO, false, 0);
+    cout.rdbuf(&nullBuffer);
+    runner.run("logMessage/short", [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++) {
+            server.logMessage("Client connected from: 127.0.0.1");
+        }
+    });
+    string longMessage = "File received: projects/2024/quarterly_financial_report_department_042_revision_00042_final.xlsx"
+        " (734003200 bytes in 1532 ms)";
+    runner.run("logMessage/long", [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++) {
+            server.logMessage(longMessage);
+        }
+    });
+    server.flushLog();
+    cout.rdbuf(consoleBuffer);
+
+    SocketPair commandPair;
+    if (!commandPair.open()) {
+        cerr << "Cannot create loopback socket pair: " << WSAGetLastError() << endl;
+        return 1;
+    }
+    string shortCommand = "PING\n";
+    string longCommand = "GETIF 1f3a5c-65e1f0a2b3 projects/2024/finance/quarterly/department_042/"
+        "quarterly_financial_report_department_042_revision_00042_final_reviewed_by_accounting.xlsx\n";
+    runner.run("readCommand/short", [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++) {
+            send(commandPair.client, shortCommand.c_str(), static_cast<int>(shortCommand.length()), 0);
+            benchmarkSink += server.readCommand(commandPair.server).length();
+        }
+    });
+    runner.run("readCommand/longName", [&](long long iterations) {
+        for (long long i = 0; i < iterations; i++) {
+            send(commandPair.client, longCommand.c_str(), static_cast<int>(longCommand.length()), 0);
+            benchmarkSink += server.readCommand(commandPair.server).length();
+        }
+    });
+    commandPair.close();
+
+    // Выбор команды вместе с ее коротким ответом: PING - в конце цепочки, неизвестная
+    // команда проходит всю цепочку
+    SocketPair dispatchPair;
+    if (!dispatchPair.open()) {
+        cerr << "Cannot create loopback socket pair: " << WSAGetLastError() << endl;
+        return 1;
+    }
+    {
+        Drainer drainer(dispatchPair.client);
+        runner.run("dispatchCommand/PING", [&](long long iterations) {
+            for (long long i = 0; i < iterations; i++) {
+                server.dispatchCommand(dispatchPair.server, "PING");
+            }
+        });
+        runner.run("dispatchCommand/unknown", [&](long long iterations) {
+            for (long long i = 0; i < iterations; i++) {
+                server.dispatchCommand(dispatchPair.server, "RENAME old_name.txt new_name.txt");
+            }
+        });
+
+        server.setQuiet(true);
+        runner.run("sendFileListAndClose/" + to_string(listingEntries), [&](long long iterations) {
+            for (long long i = 0; i < iterations; i++) {
+                server.sendFileListAndClose(dispatchPair.server);
+            }
+        });
+    }
+    dispatchPair.close();
+
+    if (!jsonPath.empty()) {
+        if (!runner.writeJson(jsonPath)) {
+            cerr << "Cannot write " << jsonPath << endl;
+            return 1;
+        }
+        cout << "Results written to " << jsonPath << endl;
+    }
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 #include <fstream>
 #include <string>
 #include <windows.h>
@@ -15,528 +16,6552 @@
 #include <algorithm>
 #include <tuple>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define BLAKE3_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
 #pragma comment(lib, "ws2_32.lib")
 
-class FileServer {
-private:
-    SOCKET serverSocket;
-    sockaddr_in serverAddr;
-    atomic<bool> running;
-    string serverDirectory;
-    int port;
-    string exePath;
-
+// BLAKE3 (режим хеширования, 256 бит). Полные чанки хешируются по 4 штуки за раз
+// через SSE2, дерево собирается из поддеревьев, которые можно считать параллельно.
+class Blake3 {
 public:
-    FileServer(int p, const string& directory = "server_files") : running(true), serverDirectory(directory), port(p) {
-        char exePathBuffer[MAX_PATH];
-        GetModuleFileNameA(NULL, exePathBuffer, MAX_PATH);
-        exePath = string(exePathBuffer);
-        size_t pos = exePath.find_last_of("\\/");
-        if (pos != string::npos) {
-            exePath = exePath.substr(0, pos);
+    static const size_t CHUNK_LEN = 1024;
+    static const size_t BLOCK_LEN = 64;
+    static const size_t OUT_LEN = 32;
+
+    enum Flags {
+        CHUNK_START = 1,
+        CHUNK_END = 2,
+        PARENT = 4,
+        ROOT = 8
+    };
+
+    struct Output {
+        uint32_t cv[8];
+        uint32_t block[16];
+        uint32_t blockLen;
+        uint64_t counter;
+        uint32_t flags;
+    };
+
+    static const uint32_t* iv() {
+        static const uint32_t IV[8] = {
+            0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+            0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+        };
+        return IV;
+    }
+
+    static const uint8_t* schedule(size_t round) {
+        static const uint8_t SCHEDULE[7][16] = {
+            { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+            { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+            { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+            { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+            { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+            { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+            { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+        };
+        return SCHEDULE[round];
+    }
+
+    static uint32_t load32(const uint8_t* p) {
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+            | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    static void store32(uint8_t* p, uint32_t w) {
+        p[0] = static_cast<uint8_t>(w);
+        p[1] = static_cast<uint8_t>(w >> 8);
+        p[2] = static_cast<uint8_t>(w >> 16);
+        p[3] = static_cast<uint8_t>(w >> 24);
+    }
+
+    static uint32_t rotr(uint32_t w, int c) {
+        return (w >> c) | (w << (32 - c));
+    }
+
+    static void g(uint32_t* s, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+        s[a] = s[a] + s[b] + x;
+        s[d] = rotr(s[d] ^ s[a], 16);
+        s[c] = s[c] + s[d];
+        s[b] = rotr(s[b] ^ s[c], 12);
+        s[a] = s[a] + s[b] + y;
+        s[d] = rotr(s[d] ^ s[a], 8);
+        s[c] = s[c] + s[d];
+        s[b] = rotr(s[b] ^ s[c], 7);
+    }
+
+    static void compress(const uint32_t cv[8], const uint32_t m[16], uint32_t blockLen,
+        uint64_t counter, uint32_t flags, uint32_t out[16]) {
+        const uint32_t* IV = iv();
+        uint32_t s[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            IV[0], IV[1], IV[2], IV[3],
+            static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), blockLen, flags
+        };
+
+        for (size_t r = 0; r < 7; r++) {
+            const uint8_t* sc = schedule(r);
+            g(s, 0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+            g(s, 1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+            g(s, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+            g(s, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+            g(s, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+            g(s, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+            g(s, 2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+            g(s, 3, 4, 9, 14, m[sc[14]], m[sc[15]]);
         }
 
-        string fullServerPath = exePath + "\\" + serverDirectory;
-        if (!CreateDirectoryA(fullServerPath.c_str(), NULL)) {
-            DWORD error = GetLastError();
-            if (error != ERROR_ALREADY_EXISTS) {
-                cerr << "Warning: Cannot create server directory: " << fullServerPath
-                    << " (Error: " << error << ")" << endl;
+        for (int i = 0; i < 8; i++) {
+            out[i] = s[i] ^ s[i + 8];
+            out[i + 8] = s[i + 8] ^ cv[i];
+        }
+    }
+
+    static void loadBlock(const uint8_t* p, size_t len, uint32_t m[16]) {
+        uint8_t padded[BLOCK_LEN];
+        if (len < BLOCK_LEN) {
+            memset(padded, 0, sizeof(padded));
+            if (len > 0) {
+                memcpy(padded, p, len);
             }
+            p = padded;
+        }
+        for (int i = 0; i < 16; i++) {
+            m[i] = load32(p + i * 4);
         }
+    }
 
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            cerr << "WSAStartup failed: " << WSAGetLastError() << endl;
-            return;
+    // Один чанк (до 1024 байт): все блоки кроме последнего сжимаются сразу,
+    // последний остается в Output - из него получается либо CV, либо корень
+    static Output chunkOutput(const uint8_t* input, size_t len, uint64_t counter) {
+        Output o;
+        memcpy(o.cv, iv(), sizeof(o.cv));
+        size_t blocks = len == 0 ? 1 : (len + BLOCK_LEN - 1) / BLOCK_LEN;
+
+        uint32_t m[16];
+        uint32_t out[16];
+        for (size_t b = 0; b + 1 < blocks; b++) {
+            loadBlock(input + b * BLOCK_LEN, BLOCK_LEN, m);
+            compress(o.cv, m, BLOCK_LEN, counter, b == 0 ? CHUNK_START : 0, out);
+            memcpy(o.cv, out, sizeof(o.cv));
         }
 
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket == INVALID_SOCKET) {
-            cerr << "Socket creation failed: " << WSAGetLastError() << endl;
-            WSACleanup();
-            return;
+        size_t lastLen = len - (blocks - 1) * BLOCK_LEN;
+        loadBlock(input + (blocks - 1) * BLOCK_LEN, lastLen, o.block);
+        o.blockLen = static_cast<uint32_t>(lastLen);
+        o.counter = counter;
+        o.flags = (blocks == 1 ? CHUNK_START : 0) | CHUNK_END;
+        return o;
+    }
+
+    static Output parentOutput(const uint32_t left[8], const uint32_t right[8]) {
+        Output o;
+        memcpy(o.cv, iv(), sizeof(o.cv));
+        memcpy(o.block, left, 8 * sizeof(uint32_t));
+        memcpy(o.block + 8, right, 8 * sizeof(uint32_t));
+        o.blockLen = BLOCK_LEN;
+        o.counter = 0;
+        o.flags = PARENT;
+        return o;
+    }
+
+    static void outputCv(const Output& o, uint32_t cv[8]) {
+        uint32_t out[16];
+        compress(o.cv, o.block, o.blockLen, o.counter, o.flags, out);
+        memcpy(cv, out, 8 * sizeof(uint32_t));
+    }
+
+    static void outputRoot(const Output& o, uint8_t digest[OUT_LEN]) {
+        uint32_t out[16];
+        compress(o.cv, o.block, o.blockLen, 0, o.flags | ROOT, out);
+        for (int i = 0; i < 8; i++) {
+            store32(digest + i * 4, out[i]);
         }
+    }
 
-        int opt = 1;
-        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+#ifdef BLAKE3_USE_SSE2
+    static __m128i rot16(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 16), _mm_slli_epi32(x, 16)); }
+    static __m128i rot12(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 20)); }
+    static __m128i rot8(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24)); }
+    static __m128i rot7(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 25)); }
 
-        int sendBufSize = 65536;
-        int recvBufSize = 65536;
-        setsockopt(serverSocket, SOL_SOCKET, SO_SNDBUF, (char*)&sendBufSize, sizeof(sendBufSize));
-        setsockopt(serverSocket, SOL_SOCKET, SO_RCVBUF, (char*)&recvBufSize, sizeof(recvBufSize));
+    static void g4(__m128i* v, int a, int b, int c, int d, __m128i x, __m128i y) {
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+        v[d] = rot16(_mm_xor_si128(v[d], v[a]));
+        v[c] = _mm_add_epi32(v[c], v[d]);
+        v[b] = rot12(_mm_xor_si128(v[b], v[c]));
+        v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+        v[d] = rot8(_mm_xor_si128(v[d], v[a]));
+        v[c] = _mm_add_epi32(v[c], v[d]);
+        v[b] = rot7(_mm_xor_si128(v[b], v[c]));
+    }
 
-        memset(&serverAddr, 0, sizeof(serverAddr));
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_addr.s_addr = INADDR_ANY;
-        serverAddr.sin_port = htons(static_cast<u_short>(port));
+    static void transpose4(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+        __m128i ab01 = _mm_unpacklo_epi32(a, b);
+        __m128i ab23 = _mm_unpackhi_epi32(a, b);
+        __m128i cd01 = _mm_unpacklo_epi32(c, d);
+        __m128i cd23 = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(ab01, cd01);
+        b = _mm_unpackhi_epi64(ab01, cd01);
+        c = _mm_unpacklo_epi64(ab23, cd23);
+        d = _mm_unpackhi_epi64(ab23, cd23);
+    }
 
-        if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            cerr << "Bind failed on port " << port << ": " << WSAGetLastError() << endl;
-            closesocket(serverSocket);
-            WSACleanup();
-            return;
+    // Четыре полных соседних чанка параллельно - по одному в каждой дорожке SSE2
+    static void hash4Chunks(const uint8_t* input, uint64_t counter, uint32_t* cvs) {
+        const uint32_t* IV = iv();
+        __m128i h[8];
+        for (int i = 0; i < 8; i++) {
+            h[i] = _mm_set1_epi32(static_cast<int>(IV[i]));
         }
 
-        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-            cerr << "Listen failed: " << WSAGetLastError() << endl;
-            closesocket(serverSocket);
-            WSACleanup();
-            return;
+        const __m128i counterLo = _mm_set_epi32(
+            static_cast<int>(static_cast<uint32_t>(counter + 3)), static_cast<int>(static_cast<uint32_t>(counter + 2)),
+            static_cast<int>(static_cast<uint32_t>(counter + 1)), static_cast<int>(static_cast<uint32_t>(counter)));
+        const __m128i counterHi = _mm_set_epi32(
+            static_cast<int>(static_cast<uint32_t>((counter + 3) >> 32)), static_cast<int>(static_cast<uint32_t>((counter + 2) >> 32)),
+            static_cast<int>(static_cast<uint32_t>((counter + 1) >> 32)), static_cast<int>(static_cast<uint32_t>(counter >> 32)));
+
+        for (size_t b = 0; b < CHUNK_LEN / BLOCK_LEN; b++) {
+            __m128i m[16];
+            for (int q = 0; q < 4; q++) {
+                const uint8_t* base = input + b * BLOCK_LEN + q * 16;
+                m[q * 4 + 0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base));
+                m[q * 4 + 1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + CHUNK_LEN));
+                m[q * 4 + 2] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + 2 * CHUNK_LEN));
+                m[q * 4 + 3] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + 3 * CHUNK_LEN));
+                transpose4(m[q * 4 + 0], m[q * 4 + 1], m[q * 4 + 2], m[q * 4 + 3]);
+            }
+
+            uint32_t flags = (b == 0 ? CHUNK_START : 0) | (b == CHUNK_LEN / BLOCK_LEN - 1 ? CHUNK_END : 0);
+            __m128i v[16] = {
+                h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                _mm_set1_epi32(static_cast<int>(IV[0])), _mm_set1_epi32(static_cast<int>(IV[1])),
+                _mm_set1_epi32(static_cast<int>(IV[2])), _mm_set1_epi32(static_cast<int>(IV[3])),
+                counterLo, counterHi, _mm_set1_epi32(static_cast<int>(BLOCK_LEN)), _mm_set1_epi32(static_cast<int>(flags))
+            };
+
+            for (size_t r = 0; r < 7; r++) {
+                const uint8_t* sc = schedule(r);
+                g4(v, 0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+                g4(v, 1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+                g4(v, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+                g4(v, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+                g4(v, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+                g4(v, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+                g4(v, 2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+                g4(v, 3, 4, 9, 14, m[sc[14]], m[sc[15]]);
+            }
+
+            for (int i = 0; i < 8; i++) {
+                h[i] = _mm_xor_si128(v[i], v[i + 8]);
+            }
         }
 
-        cout << "=========================================" << endl;
-        cout << "  CLEAN File Server v3.0" << endl;
-        cout << "=========================================" << endl;
-        cout << "Server successfully started on port " << port << endl;
-        cout << "Server directory: " << fullServerPath << endl;
-        cout << "NO HEADERS in files - pure data only!" << endl;
-        cout << "=========================================" << endl;
+        for (int i = 0; i < 8; i++) {
+            uint32_t lanes[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), h[i]);
+            for (int lane = 0; lane < 4; lane++) {
+                cvs[lane * 8 + i] = lanes[lane];
+            }
+        }
+    }
+#endif
 
-        showExistingFiles();
-        createTestFileIfNeeded(fullServerPath);
+    // CV каждого чанка диапазона (len > 0), по 8 слов на чанк
+    static void chunkCvs(const uint8_t* input, size_t len, uint64_t counter, vector<uint32_t>& cvs) {
+        size_t chunks = (len + CHUNK_LEN - 1) / CHUNK_LEN;
+        cvs.resize(chunks * 8);
+
+        size_t i = 0;
+#ifdef BLAKE3_USE_SSE2
+        size_t fullChunks = len / CHUNK_LEN;
+        for (; i + 4 <= fullChunks; i += 4) {
+            hash4Chunks(input + i * CHUNK_LEN, counter + i, &cvs[i * 8]);
+        }
+#endif
+        for (; i < chunks; i++) {
+            size_t remaining = len - i * CHUNK_LEN;
+            size_t chunkLen = remaining < CHUNK_LEN ? remaining : CHUNK_LEN;
+            outputCv(chunkOutput(input + i * CHUNK_LEN, chunkLen, counter + i), &cvs[i * 8]);
+        }
     }
 
-    void createTestFileIfNeeded(const string& serverPath) {
-        string testFilePath = serverPath + "\\test.txt";
-        ifstream testFile(testFilePath);
-        if (!testFile) {
-            ofstream newFile(testFilePath);
-            if (newFile) {
-                newFile << "This is a CLEAN test file.\n";
-                newFile << "It contains NO headers or metadata.\n";
-                newFile << "Just pure text content.\n";
-                newFile << "When downloaded, you should NOT see 'SIZE:' anywhere.\n";
-                newFile << "Server: " << getCurrentTime() << "\n";
-                newFile.close();
-                cout << "Created clean test file: test.txt" << endl;
-            }
+    static size_t largestPowerOfTwoBelow(size_t n) {
+        size_t p = 1;
+        while (p * 2 < n) {
+            p *= 2;
         }
-        testFile.close();
+        return p;
     }
 
-    string getCurrentTime() {
-        auto now = chrono::system_clock::now();
-        auto now_time = chrono::system_clock::to_time_t(now);
-        char buffer[80];
-        ctime_s(buffer, sizeof(buffer), &now_time);
-        string timeStr(buffer);
-        timeStr.pop_back();
-        return timeStr;
+    // Левое поддерево всегда полное (степень двойки листьев), как в спецификации
+    static Output mergeOutput(const uint32_t* cvs, size_t count) {
+        size_t left = largestPowerOfTwoBelow(count);
+        uint32_t leftCv[8];
+        uint32_t rightCv[8];
+        mergeCvs(cvs, left, leftCv);
+        mergeCvs(cvs + left * 8, count - left, rightCv);
+        return parentOutput(leftCv, rightCv);
     }
 
-    void showExistingFiles() {
-        string fullServerPath = exePath + "\\" + serverDirectory;
-        cout << "\nExisting files in server directory:" << endl;
-        cout << "-----------------------------------" << endl;
+    static void mergeCvs(const uint32_t* cvs, size_t count, uint32_t out[8]) {
+        if (count == 1) {
+            memcpy(out, cvs, 8 * sizeof(uint32_t));
+            return;
+        }
+        outputCv(mergeOutput(cvs, count), out);
+    }
 
-        string searchPath = fullServerPath + "\\*";
-        WIN32_FIND_DATAA findFileData;
-        HANDLE hFind = FindFirstFileA(searchPath.c_str(), &findFileData);
+    // CV поддерева, начинающегося с чанка counter (len > 0)
+    static void subtreeCv(const uint8_t* input, size_t len, uint64_t counter, uint32_t out[8]) {
+        vector<uint32_t> cvs;
+        chunkCvs(input, len, counter, cvs);
+        mergeCvs(cvs.data(), cvs.size() / 8, out);
+    }
 
-        if (hFind == INVALID_HANDLE_VALUE) {
-            cout << "No files found." << endl;
-            cout << "Directory: " << fullServerPath << endl;
+    // Корневой хеш набора CV поддеревьев, перечисленных слева направо
+    static void rootFromCvs(const uint32_t* cvs, size_t count, uint8_t digest[OUT_LEN]) {
+        outputRoot(mergeOutput(cvs, count), digest);
+    }
+
+    static void hashBuffer(const uint8_t* input, size_t len, uint8_t digest[OUT_LEN]) {
+        if (len <= CHUNK_LEN) {
+            outputRoot(chunkOutput(input, len, 0), digest);
             return;
         }
+        vector<uint32_t> cvs;
+        chunkCvs(input, len, 0, cvs);
+        rootFromCvs(cvs.data(), cvs.size() / 8, digest);
+    }
 
-        int fileCount = 0;
-        long long totalSize = 0;
+    static string toHex(const uint8_t* digest, size_t len = OUT_LEN) {
+        static const char HEX[] = "0123456789abcdef";
+        string hex(len * 2, '0');
+        for (size_t i = 0; i < len; i++) {
+            hex[i * 2] = HEX[digest[i] >> 4];
+            hex[i * 2 + 1] = HEX[digest[i] & 0x0F];
+        }
+        return hex;
+    }
 
-        do {
-            if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                string filename = findFileData.cFileName;
-                long long fileSize = (static_cast<long long>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
+    // Хеш файла: файл режется на сегменты из степени двойки чанков, каждый сегмент -
+    // готовое поддерево, их CV считаются параллельно через отображение файла в память
+    static bool hashFile(const string& path, string& hexDigest, long long* sizeOut = NULL) {
+        HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
 
-                cout << "  " << filename << " (" << formatFileSize(fileSize) << ")" << endl;
-                fileCount++;
-                totalSize += fileSize;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(hFile, &fileSize)) {
+            CloseHandle(hFile);
+            return false;
+        }
+
+        unsigned long long size = static_cast<unsigned long long>(fileSize.QuadPart);
+        if (sizeOut) {
+            *sizeOut = static_cast<long long>(size);
+        }
+
+        uint8_t digest[OUT_LEN];
+        if (size <= CHUNK_LEN) {
+            uint8_t buffer[CHUNK_LEN];
+            DWORD bytesRead = 0;
+            if (size > 0 && (!ReadFile(hFile, buffer, static_cast<DWORD>(size), &bytesRead, NULL) || bytesRead != size)) {
+                CloseHandle(hFile);
+                return false;
             }
-        } while (FindNextFileA(hFind, &findFileData) != 0);
+            CloseHandle(hFile);
+            hashBuffer(buffer, static_cast<size_t>(size), digest);
+            hexDigest = toHex(digest);
+            return true;
+        }
+
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping == NULL) {
+            CloseHandle(hFile);
+            return false;
+        }
 
-        FindClose(hFind);
+        unsigned int threadCount = max(1u, thread::hardware_concurrency());
 
-        if (fileCount > 0) {
-            cout << "-----------------------------------" << endl;
-            cout << "Total: " << fileCount << " files, " << formatFileSize(totalSize) << endl;
+        // Сегмент - степень двойки, не меньше 1 MB (кратно гранулярности отображения)
+        // и не больше 64 MB, примерно 8 сегментов на поток
+        unsigned long long segmentSize = 1024 * 1024;
+        while (segmentSize < 64ull * 1024 * 1024 && segmentSize * threadCount * 8 < size) {
+            segmentSize *= 2;
         }
-        cout << "=========================================" << endl;
+
+        size_t segmentCount = static_cast<size_t>((size + segmentSize - 1) / segmentSize);
+        vector<uint32_t> segmentCvs(segmentCount * 8);
+        atomic<size_t> nextSegment(0);
+        atomic<bool> failed(false);
+
+        auto worker = [&]() {
+            while (!failed) {
+                size_t index = nextSegment.fetch_add(1);
+                if (index >= segmentCount) {
+                    break;
+                }
+
+                unsigned long long offset = index * segmentSize;
+                size_t length = static_cast<size_t>(min(segmentSize, size - offset));
+                void* view = MapViewOfFile(hMapping, FILE_MAP_READ,
+                    static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset & 0xFFFFFFFF), length);
+                if (view == NULL) {
+                    failed = true;
+                    break;
+                }
+
+                const uint8_t* data = static_cast<const uint8_t*>(view);
+                if (segmentCount == 1) {
+                    hashBuffer(data, length, digest);
+                }
+                else {
+                    subtreeCv(data, length, offset / CHUNK_LEN, &segmentCvs[index * 8]);
+                }
+                UnmapViewOfFile(view);
+            }
+        };
+
+        size_t workers = min(static_cast<size_t>(threadCount), segmentCount);
+        vector<thread> pool;
+        for (size_t i = 1; i < workers; i++) {
+            pool.push_back(thread(worker));
+        }
+        worker();
+        for (size_t i = 0; i < pool.size(); i++) {
+            pool[i].join();
+        }
+
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+
+        if (failed) {
+            return false;
+        }
+
+        if (segmentCount > 1) {
+            rootFromCvs(segmentCvs.data(), segmentCount, digest);
+        }
+        hexDigest = toHex(digest);
+        return true;
     }
+};
 
-    void logMessage(const string& message) {
-        auto now = chrono::system_clock::now();
-        auto now_time = chrono::system_clock::to_time_t(now);
-        auto now_ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()) % 1000;
+struct CdcChunk {
+    unsigned long long offset;
+    unsigned int length;
+    string hash;
+};
 
-        cout << "[" << put_time(localtime(&now_time), "%H:%M:%S")
-            << "." << setfill('0') << setw(3) << now_ms.count()
-            << "] " << message << endl;
+// Разбиение по содержимому (FastCDC): граница чанка ставится там, где gear-хеш
+// последних байт дает нули под маской, поэтому правка в середине файла меняет
+// только соседние чанки, а остальные сохраняют свои хеши
+class FastCdc {
+public:
+    static const size_t MIN_SIZE = 16 * 1024;
+    static const size_t AVG_SIZE = 64 * 1024;
+    static const size_t MAX_SIZE = 256 * 1024;
+    static const size_t HASH_HEX_LEN = 32;
+
+    // До среднего размера маска строже (18 бит), после - мягче (14 бит):
+    // размеры чанков собираются ближе к среднему
+    static const uint64_t MASK_S = 0xFFFFC00000000000ull;
+    static const uint64_t MASK_L = 0xFFFC000000000000ull;
+
+    static const uint64_t* gear() {
+        struct GearTable {
+            uint64_t values[256];
+            GearTable() {
+                // splitmix64 с фиксированным зерном - таблица одинакова у клиента и сервера
+                uint64_t x = 0x46617374434443ull;
+                for (int i = 0; i < 256; i++) {
+                    x += 0x9E3779B97F4A7C15ull;
+                    uint64_t z = x;
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                    values[i] = z ^ (z >> 31);
+                }
+            }
+        };
+        static const GearTable table;
+        return table.values;
     }
 
-    string formatFileSize(long long bytes) {
-        const char* sizes[] = { "B", "KB", "MB", "GB", "TB" };
-        int i = 0;
-        double dblBytes = static_cast<double>(bytes);
+    static size_t cutPoint(const uint8_t* data, size_t n) {
+        if (n <= MIN_SIZE) {
+            return n;
+        }
+        if (n > MAX_SIZE) {
+            n = MAX_SIZE;
+        }
+        size_t normal = n < AVG_SIZE ? n : AVG_SIZE;
 
-        while (dblBytes >= 1024 && i < 4) {
-            dblBytes /= 1024;
-            i++;
+        const uint64_t* table = gear();
+        uint64_t h = 0;
+        size_t i = MIN_SIZE;
+        for (; i < normal; i++) {
+            h = (h << 1) + table[data[i]];
+            if (!(h & MASK_S)) {
+                return i + 1;
+            }
+        }
+        for (; i < n; i++) {
+            h = (h << 1) + table[data[i]];
+            if (!(h & MASK_L)) {
+                return i + 1;
+            }
         }
+        return n;
+    }
 
-        char buffer[32];
-        if (i == 0) {
-            sprintf(buffer, "%lld %s", bytes, sizes[i]);
+    // Первые 128 бит BLAKE3 содержимого чанка
+    static string chunkHash(const uint8_t* data, size_t n) {
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(data, n, digest);
+        return Blake3::toHex(digest, HASH_HEX_LEN / 2);
+    }
+
+    static bool chunkFile(const string& path, vector<CdcChunk>& chunks) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            return false;
         }
-        else {
-            sprintf(buffer, "%.2f %s", dblBytes, sizes[i]);
+
+        chunks.clear();
+        vector<uint8_t> buffer(16 * MAX_SIZE);
+        size_t filled = 0;
+        unsigned long long offset = 0;
+        bool eof = false;
+
+        while (true) {
+            if (!eof && filled < buffer.size()) {
+                file.read(reinterpret_cast<char*>(&buffer[filled]), buffer.size() - filled);
+                filled += static_cast<size_t>(file.gcount());
+                if (!file) {
+                    eof = true;
+                }
+            }
+
+            size_t pos = 0;
+            // Пока файл не кончился, чанк режется только при полном окне MAX_SIZE
+            while (pos < filled && (eof || filled - pos >= MAX_SIZE)) {
+                size_t length = cutPoint(&buffer[pos], filled - pos);
+                CdcChunk chunk;
+                chunk.offset = offset;
+                chunk.length = static_cast<unsigned int>(length);
+                chunk.hash = chunkHash(&buffer[pos], length);
+                chunks.push_back(chunk);
+                pos += length;
+                offset += length;
+            }
+
+            if (pos > 0) {
+                memmove(&buffer[0], &buffer[pos], filled - pos);
+                filled -= pos;
+            }
+            if (eof && filled == 0) {
+                break;
+            }
         }
-        return string(buffer);
+        return true;
     }
+};
 
-    string readCommand(SOCKET clientSocket) {
-        char buffer[1024];
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived;
+// Буферизованное чтение строк и блоков известной длины из сокета
+class SocketReader {
+private:
+    SOCKET sock;
+    vector<char> buffer;
+    size_t start;
+    size_t end;
 
-        DWORD timeout = 100;
-        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    bool fill() {
+        if (sock == INVALID_SOCKET) {
+            return false;
+        }
+        if (start == end) {
+            start = end = 0;
+        }
+        else if (end == buffer.size()) {
+            memmove(&buffer[0], &buffer[start], end - start);
+            end -= start;
+            start = 0;
+        }
+        int bytesReceived = recv(sock, &buffer[end], static_cast<int>(buffer.size() - end), 0);
+        if (bytesReceived <= 0) {
+            return false;
+        }
+        end += bytesReceived;
+        return true;
+    }
 
-        bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            string command = buffer;
+public:
+    SocketReader(SOCKET s, size_t bufferSize = 65536) : sock(s), buffer(bufferSize), start(0), end(0) {}
 
-            size_t newlinePos = command.find('\n');
-            if (newlinePos != string::npos) {
-                command = command.substr(0, newlinePos);
+    // Чтение из готовой строки (локальные замеры без сети)
+    SocketReader(const string& data) : sock(INVALID_SOCKET), buffer(data.begin(), data.end()), start(0), end(data.size()) {}
+
+    bool readLine(string& line, size_t maxLength = 1024 * 1024) {
+        line.clear();
+        while (true) {
+            const char* begin = buffer.data() + start;
+            const char* newline = static_cast<const char*>(memchr(begin, '\n', end - start));
+            if (newline != NULL) {
+                line.append(begin, newline - begin);
+                start += (newline - begin) + 1;
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                return true;
             }
 
-            if (!command.empty() && command.back() == '\r') {
-                command.pop_back();
+            line.append(begin, end - start);
+            start = end;
+            if (line.length() > maxLength || !fill()) {
+                return false;
             }
+        }
+    }
 
-            return command;
+    bool readExact(char* out, size_t length) {
+        size_t buffered = min(length, end - start);
+        memcpy(out, buffer.data() + start, buffered);
+        start += buffered;
+
+        size_t done = buffered;
+        while (done < length) {
+            int bytesReceived = recv(sock, out + done, static_cast<int>(min(length - done, static_cast<size_t>(1 << 20))), 0);
+            if (bytesReceived <= 0) {
+                return false;
+            }
+            done += bytesReceived;
         }
-        else if (bytesReceived == 0) {
-            return "DISCONNECT";
+        return true;
+    }
+};
+
+// Буферизованная запись в сокет (или в строку - для локальных замеров)
+class SocketWriter {
+private:
+    SOCKET sock;
+    string* sink;
+    vector<char> buffer;
+    size_t used;
+    bool failed;
+
+public:
+    SocketWriter(SOCKET s, size_t bufferSize = 65536) : sock(s), sink(NULL), buffer(bufferSize), used(0), failed(false) {}
+    SocketWriter(string* output) : sock(INVALID_SOCKET), sink(output), buffer(65536), used(0), failed(false) {}
+
+    ~SocketWriter() {
+        flush();
+    }
+
+    bool flush() {
+        size_t done = 0;
+        while (!failed && done < used) {
+            if (sink) {
+                sink->append(buffer.data(), used);
+                done = used;
+                break;
+            }
+            int sent = send(sock, buffer.data() + done, static_cast<int>(used - done), 0);
+            if (sent == SOCKET_ERROR) {
+                failed = true;
+                break;
+            }
+            done += sent;
+        }
+        used = 0;
+        return !failed;
+    }
+
+    bool write(const char* data, size_t length) {
+        if (length >= buffer.size()) {
+            if (!flush()) {
+                return false;
+            }
+            if (sink) {
+                sink->append(data, length);
+                return true;
+            }
+            while (length > 0) {
+                int sent = send(sock, data, static_cast<int>(min(length, static_cast<size_t>(1 << 20))), 0);
+                if (sent == SOCKET_ERROR) {
+                    failed = true;
+                    return false;
+                }
+                data += sent;
+                length -= sent;
+            }
+            return true;
+        }
+        if (used + length > buffer.size() && !flush()) {
+            return false;
+        }
+        memcpy(buffer.data() + used, data, length);
+        used += length;
+        return !failed;
+    }
+
+    bool write(const string& text) {
+        return write(text.data(), text.length());
+    }
+};
+
+struct BlockSignature {
+    uint32_t weak;
+    size_t length;
+    string strong;      // 16 байт BLAKE3, в сыром виде
+};
+
+// Дельта в стиле rsync. Получатель считает сигнатуры блоков своей копии (слабая
+// скользящая сумма + сильный хеш), отправитель проходит свой файл скользящим окном
+// и передает только литералы и ссылки на совпавшие блоки.
+// Формат потока: "L <n>\n" + n байт, "C <первый блок> <число блоков>\n",
+// в конце "END <размер> <blake3 результата>\n"
+class RsyncDelta {
+public:
+    static const size_t STRONG_LEN = 16;
+    static const size_t MAX_LITERAL = 1024 * 1024;
+    static const long long MAX_BASIS_SIZE = 1LL << 48;
+
+    static size_t chooseBlockSize(long long fileSize) {
+        size_t blockSize = 2048;
+        while (blockSize < 64 * 1024 && static_cast<long long>(blockSize) * blockSize < fileSize) {
+            blockSize *= 2;
+        }
+        return blockSize;
+    }
+
+    static uint32_t weakSum(const uint8_t* data, size_t length, uint32_t& a, uint32_t& b) {
+        a = 0;
+        b = 0;
+        for (size_t i = 0; i < length; i++) {
+            a += data[i];
+            b += static_cast<uint32_t>(length - i) * data[i];
+        }
+        return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+    }
+
+    static string strongSum(const uint8_t* data, size_t length) {
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(data, length, digest);
+        return string(reinterpret_cast<const char*>(digest), STRONG_LEN);
+    }
+
+    static bool computeSignatures(const string& path, size_t blockSize, vector<BlockSignature>& signatures) {
+        signatures.clear();
+        ifstream file(path, ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        vector<char> block(blockSize);
+        while (true) {
+            file.read(block.data(), blockSize);
+            size_t length = static_cast<size_t>(file.gcount());
+            if (length == 0) {
+                break;
+            }
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(block.data());
+            uint32_t a, b;
+            BlockSignature signature;
+            signature.weak = weakSum(data, length, a, b);
+            signature.length = length;
+            signature.strong = strongSum(data, length);
+            signatures.push_back(signature);
+        }
+        return true;
+    }
+
+    static bool writeSignatures(SocketWriter& writer, const vector<BlockSignature>& signatures) {
+        char line[16];
+        for (size_t i = 0; i < signatures.size(); i++) {
+            sprintf(line, "%08x ", signatures[i].weak);
+            if (!writer.write(line, 9)
+                || !writer.write(Blake3::toHex(reinterpret_cast<const uint8_t*>(signatures[i].strong.data()), STRONG_LEN) + "\n")) {
+                return false;
+            }
+        }
+        return writer.flush();
+    }
+
+    // Длины блоков не передаются: все полные, кроме последнего. Размер базы пришел от другой
+    // стороны, поэтому список растет по мере чтения строк, а не выделяется под count заранее
+    static bool readSignatures(SocketReader& reader, size_t count, size_t blockSize, long long basisSize,
+        vector<BlockSignature>& signatures) {
+        if (basisSize < 0 || basisSize > MAX_BASIS_SIZE || count != static_cast<size_t>((basisSize + blockSize - 1) / blockSize)) {
+            return false;
+        }
+        signatures.clear();
+        signatures.reserve(min(count, static_cast<size_t>(4096)));
+        string line;
+        for (size_t i = 0; i < count; i++) {
+            BlockSignature signature;
+            signature.length = i + 1 < count ? blockSize : static_cast<size_t>(basisSize - static_cast<long long>(i) * blockSize);
+            if (!reader.readLine(line) || line.length() != 9 + STRONG_LEN * 2) {
+                return false;
+            }
+            signature.weak = static_cast<uint32_t>(strtoul(line.substr(0, 8).c_str(), NULL, 16));
+            signature.strong.resize(STRONG_LEN);
+            for (size_t j = 0; j < STRONG_LEN; j++) {
+                signature.strong[j] = static_cast<char>(strtoul(line.substr(9 + j * 2, 2).c_str(), NULL, 16));
+            }
+            signatures.push_back(signature);
+        }
+        return true;
+    }
+
+    // Проход по файлу path и запись дельты относительно сигнатур в writer
+    static bool generateDelta(const string& path, size_t blockSize, const vector<BlockSignature>& signatures,
+        SocketWriter& writer, long long& fileSize, long long& literalBytes) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            return false;
+        }
+
+        // Цепочки блоков с одинаковой слабой суммой
+        unordered_map<uint32_t, size_t> heads;
+        vector<size_t> next(signatures.size(), static_cast<size_t>(-1));
+        for (size_t i = signatures.size(); i-- > 0;) {
+            auto it = heads.find(signatures[i].weak);
+            if (it != heads.end()) {
+                next[i] = it->second;
+            }
+            heads[signatures[i].weak] = i;
+        }
+
+        vector<char> buffer(4 * 1024 * 1024 + blockSize);
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer.data());
+        size_t length = 0;
+        size_t pos = 0;
+        size_t literalStart = 0;
+        bool eof = false;
+        bool haveSum = false;
+        uint32_t a = 0;
+        uint32_t b = 0;
+        long long copyStart = -1;
+        long long copyCount = 0;
+        fileSize = 0;
+        literalBytes = 0;
+
+        auto flushCopy = [&]() -> bool {
+            if (copyCount == 0) {
+                return true;
+            }
+            bool ok = writer.write("C " + to_string(copyStart) + " " + to_string(copyCount) + "\n");
+            copyCount = 0;
+            return ok;
+        };
+        auto flushLiteral = [&](size_t end) -> bool {
+            if (end <= literalStart) {
+                return true;
+            }
+            if (!flushCopy()) {
+                return false;
+            }
+            while (literalStart < end) {
+                size_t n = end - literalStart < MAX_LITERAL ? end - literalStart : MAX_LITERAL;
+                if (!writer.write("L " + to_string(n) + "\n") || !writer.write(buffer.data() + literalStart, n)) {
+                    return false;
+                }
+                literalBytes += n;
+                literalStart += n;
+            }
+            return true;
+        };
+        auto emitCopy = [&](size_t index) -> bool {
+            if (copyCount > 0 && copyStart + copyCount == static_cast<long long>(index)) {
+                copyCount++;
+                return true;
+            }
+            if (!flushCopy()) {
+                return false;
+            }
+            copyStart = static_cast<long long>(index);
+            copyCount = 1;
+            return true;
+        };
+        auto findBlock = [&](uint32_t weak, size_t windowLength) -> long long {
+            auto it = heads.find(weak);
+            if (it == heads.end()) {
+                return -1;
+            }
+            string strong;
+            for (size_t i = it->second; i != static_cast<size_t>(-1); i = next[i]) {
+                if (signatures[i].length != windowLength) {
+                    continue;
+                }
+                if (strong.empty()) {
+                    strong = strongSum(data + pos, windowLength);
+                }
+                if (signatures[i].strong == strong) {
+                    return static_cast<long long>(i);
+                }
+            }
+            return -1;
+        };
+
+        while (true) {
+            if (length - pos < blockSize && !eof) {
+                if (!flushLiteral(pos)) {
+                    return false;
+                }
+                memmove(buffer.data(), buffer.data() + pos, length - pos);
+                length -= pos;
+                pos = 0;
+                literalStart = 0;
+                file.read(buffer.data() + length, buffer.size() - length);
+                size_t got = static_cast<size_t>(file.gcount());
+                length += got;
+                fileSize += got;
+                if (!file) {
+                    eof = true;
+                }
+                haveSum = false;
+                continue;
+            }
+
+            size_t avail = length - pos;
+            if (avail == 0) {
+                break;
+            }
+
+            if (avail < blockSize) {
+                // Хвост файла может совпасть только с коротким последним блоком получателя
+                uint32_t ta, tb;
+                long long match = findBlock(weakSum(data + pos, avail, ta, tb), avail);
+                if (match >= 0) {
+                    if (!flushLiteral(pos) || !emitCopy(static_cast<size_t>(match))) {
+                        return false;
+                    }
+                    pos += avail;
+                    literalStart = pos;
+                }
+                else {
+                    pos = length;
+                }
+                break;
+            }
+
+            if (!haveSum) {
+                weakSum(data + pos, blockSize, a, b);
+                haveSum = true;
+            }
+
+            long long match = findBlock((a & 0xFFFF) | ((b & 0xFFFF) << 16), blockSize);
+            if (match >= 0) {
+                if (!flushLiteral(pos) || !emitCopy(static_cast<size_t>(match))) {
+                    return false;
+                }
+                pos += blockSize;
+                literalStart = pos;
+                haveSum = false;
+                continue;
+            }
+
+            if (avail == blockSize) {
+                // Окно дошло до конца прочитанного - дальше только хвост
+                pos++;
+                haveSum = false;
+                continue;
+            }
+
+            uint32_t out = data[pos];
+            uint32_t in = data[pos + blockSize];
+            a = a - out + in;
+            b = b - static_cast<uint32_t>(blockSize) * out + a;
+            pos++;
+
+            if (pos - literalStart >= MAX_LITERAL && !flushLiteral(pos)) {
+                return false;
+            }
+        }
+
+        return flushLiteral(pos) && flushCopy() && writer.flush();
+    }
+
+    // Сборка нового файла из старой копии basisPath и потока дельты
+    static bool applyDelta(SocketReader& reader, const string& basisPath, size_t blockSize, const string& outPath,
+        long long& fileSize, long long& literalBytes) {
+        ifstream basis(basisPath, ios::binary);
+        ofstream out(outPath, ios::binary | ios::trunc);
+        if (!out) {
+            return false;
+        }
+
+        vector<char> buffer(blockSize > MAX_LITERAL ? blockSize : MAX_LITERAL);
+        string line;
+        fileSize = 0;
+        literalBytes = 0;
+
+        while (reader.readLine(line)) {
+            if (line.find("L ") == 0) {
+                size_t n = static_cast<size_t>(strtoull(line.c_str() + 2, NULL, 10));
+                if (n > buffer.size() || !reader.readExact(buffer.data(), n)) {
+                    return false;
+                }
+                out.write(buffer.data(), n);
+                fileSize += n;
+                literalBytes += n;
+            }
+            else if (line.find("C ") == 0) {
+                unsigned long long first = 0;
+                unsigned long long count = 0;
+                if (sscanf(line.c_str() + 2, "%llu %llu", &first, &count) != 2 || !basis) {
+                    return false;
+                }
+                basis.clear();
+                basis.seekg(static_cast<streamoff>(first * blockSize), ios::beg);
+                for (unsigned long long i = 0; i < count; i++) {
+                    basis.read(buffer.data(), blockSize);
+                    streamsize got = basis.gcount();
+                    if (got <= 0) {
+                        return false;
+                    }
+                    out.write(buffer.data(), got);
+                    fileSize += got;
+                }
+            }
+            else if (line.find("END ") == 0) {
+                char expectedHash[80];
+                long long expectedSize = 0;
+                if (sscanf(line.c_str() + 4, "%lld %64s", &expectedSize, expectedHash) != 2) {
+                    return false;
+                }
+                out.close();
+                basis.close();
+
+                string hash;
+                return out.good() && expectedSize == fileSize
+                    && Blake3::hashFile(outPath, hash) && hash == expectedHash;
+            }
+            else {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Дельта целиком: операции + строка END с BLAKE3 исходного файла
+    static bool sendDelta(const string& path, const string& hash, size_t blockSize, const vector<BlockSignature>& signatures,
+        SocketWriter& writer, long long& fileSize, long long& literalBytes) {
+        if (!generateDelta(path, blockSize, signatures, writer, fileSize, literalBytes)) {
+            return false;
+        }
+        return writer.write("END " + to_string(fileSize) + " " + hash + "\n") && writer.flush();
+    }
+};
+
+// Хеш набора путей для сравнения деревьев файлов: сумма по модулю 2^256 хешей листьев
+// BLAKE3(путь "\n" хеш содержимого). Сумма не зависит от того, как набор разбит на части,
+// поэтому хеш любого диапазона отсортированных путей - разность двух префиксных сумм
+struct MerkleSum {
+    uint64_t lanes[4];
+
+    MerkleSum() {
+        memset(lanes, 0, sizeof(lanes));
+    }
+
+    static MerkleSum leaf(const string& path, const string& contentHash) {
+        string input = path + "\n" + contentHash;
+        uint8_t digest[Blake3::OUT_LEN];
+        Blake3::hashBuffer(reinterpret_cast<const uint8_t*>(input.data()), input.length(), digest);
+        MerkleSum sum;
+        memcpy(sum.lanes, digest, sizeof(sum.lanes));
+        return sum;
+    }
+
+    void add(const MerkleSum& other) {
+        uint64_t carry = 0;
+        for (int i = 0; i < 4; i++) {
+            uint64_t a = lanes[i] + carry;
+            carry = a < carry ? 1 : 0;
+            lanes[i] = a + other.lanes[i];
+            carry += lanes[i] < a ? 1 : 0;
+        }
+    }
+
+    MerkleSum minus(const MerkleSum& other) const {
+        MerkleSum result;
+        uint64_t borrow = 0;
+        for (int i = 0; i < 4; i++) {
+            uint64_t b = other.lanes[i] + borrow;
+            uint64_t nextBorrow = (b < borrow || lanes[i] < b) ? 1 : 0;
+            result.lanes[i] = lanes[i] - b;
+            borrow = nextBorrow;
+        }
+        return result;
+    }
+
+    bool operator==(const MerkleSum& other) const {
+        return memcmp(lanes, other.lanes, sizeof(lanes)) == 0;
+    }
+
+    bool operator!=(const MerkleSum& other) const {
+        return !(*this == other);
+    }
+
+    string hex() const {
+        return Blake3::toHex(reinterpret_cast<const uint8_t*>(lanes), sizeof(lanes));
+    }
+};
+
+struct FileRecipe {
+    long long size;
+    unsigned long long mtime;
+    vector<CdcChunk> chunks;
+};
+
+struct ChunkLocation {
+    string filename;
+    unsigned long long offset;
+    unsigned int length;
+};
+
+// Индекс чанков всех файлов сервера: по хешу чанка находится файл и смещение,
+// где лежат такие же байты. Записи действительны, пока у файла не изменились
+// размер и время записи
+class ChunkIndex {
+private:
+    map<string, FileRecipe> recipes;
+    unordered_map<string, ChunkLocation> locations;
+    mutex indexMutex;
+
+    // Вызывается под indexMutex
+    void removeLocked(const string& filename) {
+        auto it = recipes.find(filename);
+        if (it == recipes.end()) {
+            return;
+        }
+        for (size_t i = 0; i < it->second.chunks.size(); i++) {
+            auto loc = locations.find(it->second.chunks[i].hash);
+            if (loc != locations.end() && loc->second.filename == filename) {
+                locations.erase(loc);
+            }
+        }
+        recipes.erase(it);
+    }
+
+public:
+    bool getRecipe(const string& filename, long long size, unsigned long long mtime, vector<CdcChunk>& chunks) {
+        lock_guard<mutex> lock(indexMutex);
+        auto it = recipes.find(filename);
+        if (it == recipes.end() || it->second.size != size || it->second.mtime != mtime) {
+            return false;
+        }
+        chunks = it->second.chunks;
+        return true;
+    }
+
+    void setRecipe(const string& filename, long long size, unsigned long long mtime, const vector<CdcChunk>& chunks) {
+        lock_guard<mutex> lock(indexMutex);
+        removeLocked(filename);
+
+        FileRecipe& recipe = recipes[filename];
+        recipe.size = size;
+        recipe.mtime = mtime;
+        recipe.chunks = chunks;
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (locations.find(chunks[i].hash) == locations.end()) {
+                ChunkLocation loc;
+                loc.filename = filename;
+                loc.offset = chunks[i].offset;
+                loc.length = chunks[i].length;
+                locations[chunks[i].hash] = loc;
+            }
+        }
+    }
+
+    void removeFile(const string& filename) {
+        lock_guard<mutex> lock(indexMutex);
+        removeLocked(filename);
+    }
+
+    void removeFiles(const vector<string>& filenames) {
+        lock_guard<mutex> lock(indexMutex);
+        for (size_t i = 0; i < filenames.size(); i++) {
+            removeLocked(filenames[i]);
+        }
+    }
+
+    // Место, где лежит чанк, и состояние файла на момент индексации
+    bool findChunk(const string& hash, ChunkLocation& loc, long long& size, unsigned long long& mtime) {
+        lock_guard<mutex> lock(indexMutex);
+        auto it = locations.find(hash);
+        if (it == locations.end()) {
+            return false;
+        }
+        loc = it->second;
+        const FileRecipe& recipe = recipes[loc.filename];
+        size = recipe.size;
+        mtime = recipe.mtime;
+        return true;
+    }
+
+    void getStats(size_t& files, size_t& chunks) {
+        lock_guard<mutex> lock(indexMutex);
+        files = recipes.size();
+        chunks = locations.size();
+    }
+};
+
+struct HashCacheEntry {
+    long long size;
+    unsigned long long mtime;
+    string hash;
+};
+
+struct CatalogEntry {
+    string name;
+    long long size;
+    unsigned long long mtime;
+};
+
+// Дерево путей снимка каталога. Компоненты путей интернированы: каждая строка хранится
+// один раз, а ее номер - место в отсортированном списке компонентов, поэтому дети узла,
+// упорядоченные по номеру, упорядочены и по имени. Поиск узла - O(глубины)
+class PathTree {
+private:
+    struct Node {
+        uint32_t component;
+        int32_t entry;          // номер файла в снимке, -1 - каталог
+        uint32_t firstChild;    // дети узла - children[firstChild, firstChild + childCount)
+        uint32_t childCount;
+    };
+
+    vector<string> components;
+    vector<Node> nodes;
+    vector<uint32_t> children;
+
+    // UINT32_MAX, если такого компонента нет ни в одном пути
+    uint32_t componentId(const string& component) const {
+        auto it = lower_bound(components.begin(), components.end(), component);
+        return it != components.end() && *it == component ? static_cast<uint32_t>(it - components.begin()) : UINT32_MAX;
+    }
+
+    int findChild(uint32_t node, uint32_t component) const {
+        const uint32_t* first = children.data() + nodes[node].firstChild;
+        const uint32_t* last = first + nodes[node].childCount;
+        const uint32_t* it = lower_bound(first, last, component,
+            [&](uint32_t child, uint32_t key) { return nodes[child].component < key; });
+        return it != last && nodes[*it].component == component ? static_cast<int>(*it) : -1;
+    }
+
+public:
+    static const uint32_t ROOT = 0;
+
+    static vector<string> split(const string& path) {
+        vector<string> parts;
+        size_t start = 0;
+        while (start <= path.length()) {
+            size_t slash = path.find('/', start);
+            if (slash == string::npos) {
+                slash = path.length();
+            }
+            parts.push_back(path.substr(start, slash - start));
+            start = slash + 1;
+        }
+        return parts;
+    }
+
+    // Путь внутри каталога сервера: компоненты через '/', без "." и "..", без выхода
+    // за пределы каталога и без служебных каталогов (.tmp, .blobs)
+    static bool isSafePath(const string& path) {
+        if (path.empty() || path.find_first_of("\\:*?\"<>|") != string::npos) {
+            return false;
+        }
+        vector<string> parts = split(path);
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (parts[i].empty() || parts[i] == "." || parts[i] == "..") {
+                return false;
+            }
+        }
+        return parts.size() == 1 || parts[0][0] != '.';
+    }
+
+    // Служебное содержимое каталога сервера: каталоги верхнего уровня, начинающиеся с точки
+    static bool isHidden(const string& path, bool directory) {
+        return !path.empty() && path[0] == '.' && (directory || path.find('/') != string::npos);
+    }
+
+    // Создает недостающие каталоги на пути к файлу path внутри root
+    static void createParentDirectories(const string& root, const string& path) {
+        for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1)) {
+            CreateDirectoryA((root + "\\" + path.substr(0, slash)).c_str(), NULL);
+        }
+    }
+
+    // Файлы и каталоги снимка (оба списка отсортированы по имени)
+    void build(const vector<CatalogEntry>& entries, const vector<CatalogEntry>& directories) {
+        components.clear();
+        for (size_t i = 0; i < directories.size() + entries.size(); i++) {
+            const string& path = i < directories.size() ? directories[i].name : entries[i - directories.size()].name;
+            vector<string> parts = split(path);
+            components.insert(components.end(), parts.begin(), parts.end());
+        }
+        sort(components.begin(), components.end());
+        components.erase(unique(components.begin(), components.end()), components.end());
+
+        // Пока дерево строится, ребра ищутся по (родитель, компонент)
+        Node root = { UINT32_MAX, -1, 0, 0 };
+        nodes.assign(1, root);
+        unordered_map<uint64_t, uint32_t> edges;
+        vector<pair<uint32_t, uint32_t>> links;     // (родитель, ребенок)
+
+        for (size_t i = 0; i < directories.size() + entries.size(); i++) {
+            bool isFile = i >= directories.size();
+            const string& path = isFile ? entries[i - directories.size()].name : directories[i].name;
+            vector<string> parts = split(path);
+
+            uint32_t node = ROOT;
+            for (size_t j = 0; j < parts.size(); j++) {
+                uint32_t component = componentId(parts[j]);
+                uint64_t key = (static_cast<uint64_t>(node) << 32) | component;
+                auto it = edges.find(key);
+                if (it != edges.end()) {
+                    node = it->second;
+                    continue;
+                }
+                Node child = { component, -1, 0, 0 };
+                nodes.push_back(child);
+                uint32_t index = static_cast<uint32_t>(nodes.size() - 1);
+                edges[key] = index;
+                links.push_back(make_pair(node, index));
+                node = index;
+            }
+            if (isFile) {
+                nodes[node].entry = static_cast<int32_t>(i - directories.size());
+            }
+        }
+
+        // Дети каждого узла лежат подряд, по номеру компонента (то есть по имени)
+        sort(links.begin(), links.end(), [&](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+            return a.first != b.first ? a.first < b.first : nodes[a.second].component < nodes[b.second].component;
+        });
+        children.resize(links.size());
+        for (size_t i = 0; i < links.size(); i++) {
+            children[i] = links[i].second;
+            Node& parent = nodes[links[i].first];
+            if (parent.childCount == 0) {
+                parent.firstChild = static_cast<uint32_t>(i);
+            }
+            parent.childCount++;
+        }
+    }
+
+    // Номер узла или -1; пустой путь - корень
+    int find(const string& path) const {
+        if (path.empty()) {
+            return ROOT;
+        }
+        int node = ROOT;
+        size_t start = 0;
+        while (node >= 0 && start <= path.length()) {
+            size_t slash = path.find('/', start);
+            if (slash == string::npos) {
+                slash = path.length();
+            }
+            uint32_t component = componentId(path.substr(start, slash - start));
+            node = component == UINT32_MAX ? -1 : findChild(static_cast<uint32_t>(node), component);
+            start = slash + 1;
+        }
+        return node;
+    }
+
+    const string& name(uint32_t node) const {
+        return components[nodes[node].component];
+    }
+
+    int entry(uint32_t node) const {
+        return nodes[node].entry;
+    }
+
+    uint32_t childCount(uint32_t node) const {
+        return nodes[node].childCount;
+    }
+
+    uint32_t child(uint32_t node, uint32_t index) const {
+        return children[nodes[node].firstChild + index];
+    }
+
+    size_t componentCount() const {
+        return components.size();
+    }
+};
+
+// Хранилище блобов по содержимому: server_files\.blobs\ab\<blake3>.
+// Имена в каталоге сервера - жесткие ссылки на блобы, поэтому LIST/GET работают как раньше.
+// Какое имя на какой блоб ссылается - в журнале refs.log, по нему ведется счетчик ссылок,
+// и блоб удаляется, как только на него не остается ни одного имени.
+class BlobStore {
+private:
+    string serverPath;
+    string root;
+    map<string, string> refs;       // имя -> хеш блоба
+    map<string, int> refCounts;     // хеш -> число имен
+    map<string, int> pins;          // хеш -> принятые блобы, еще не привязанные к имени
+    mutex storeMutex;
+    atomic<unsigned long long> tempCounter;
+
+    string journalPath() {
+        return root + "\\refs.log";
+    }
+
+    // lines - одна или несколько строк, каждая с \n
+    void appendJournal(const string& lines) {
+        if (lines.empty()) {
+            return;
+        }
+        ofstream journal(journalPath(), ios::app | ios::binary);
+        journal << lines;
+    }
+
+    bool sameFile(const string& a, const string& b) {
+        HANDLE ha = CreateFileA(a.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (ha == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        HANDLE hb = CreateFileA(b.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hb == INVALID_HANDLE_VALUE) {
+            CloseHandle(ha);
+            return false;
+        }
+
+        BY_HANDLE_FILE_INFORMATION ia, ib;
+        bool same = GetFileInformationByHandle(ha, &ia) && GetFileInformationByHandle(hb, &ib)
+            && ia.dwVolumeSerialNumber == ib.dwVolumeSerialNumber
+            && ia.nFileIndexHigh == ib.nFileIndexHigh
+            && ia.nFileIndexLow == ib.nFileIndexLow;
+
+        CloseHandle(ha);
+        CloseHandle(hb);
+        return same;
+    }
+
+    // Вызывается под storeMutex
+    long long releaseLocked(const string& name) {
+        auto it = refs.find(name);
+        if (it == refs.end()) {
+            return 0;
+        }
+
+        string hash = it->second;
+        refs.erase(it);
+
+        long long freed = 0;
+        if (--refCounts[hash] <= 0) {
+            refCounts.erase(hash);
+            if (pins.count(hash)) {
+                // Блоб ждет ссылки от другой загрузки
+                return 0;
+            }
+            string path = blobPath(hash);
+            long long size = 0;
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+                size = (static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+            }
+            if (DeleteFileA(path.c_str())) {
+                freed = size;
+            }
+        }
+        return freed;
+    }
+
+    // Вызывается под storeMutex, строка журнала добавляется в journal
+    bool linkLocked(const string& name, const string& hash, string& journal) {
+        auto it = refs.find(name);
+        if (it != refs.end() && it->second == hash) {
+            return true;
+        }
+
+        // Новая ссылка создается рядом и атомарно подменяет имя
+        string target = namePath(name);
+        PathTree::createParentDirectories(serverPath, name);
+        string staged = newTempPath();
+        if (!CreateHardLinkA(staged.c_str(), blobPath(hash).c_str(), NULL)) {
+            return false;
+        }
+        if (!MoveFileExA(staged.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileA(staged.c_str());
+            return false;
+        }
+
+        releaseLocked(name);
+        refs[name] = hash;
+        refCounts[hash]++;
+        journal += "+" + hash + " " + name + "\n";
+        return true;
+    }
+
+    // Вызывается под storeMutex. Блоб без имен остается до сборки мусора
+    void unpinLocked(const string& hash) {
+        auto it = pins.find(hash);
+        if (it != pins.end() && --it->second <= 0) {
+            pins.erase(it);
+        }
+    }
+
+public:
+    BlobStore(const string& serverDirectoryPath) : serverPath(serverDirectoryPath), tempCounter(0) {
+        root = serverPath + "\\.blobs";
+        CreateDirectoryA(root.c_str(), NULL);
+        CreateDirectoryA((root + "\\tmp").c_str(), NULL);
+    }
+
+    string blobPath(const string& hash) {
+        return root + "\\" + hash.substr(0, 2) + "\\" + hash;
+    }
+
+    string namePath(const string& name) {
+        return serverPath + "\\" + name;
+    }
+
+    static bool isValidHash(const string& hash) {
+        return hash.length() == Blake3::OUT_LEN * 2
+            && hash.find_first_not_of("0123456789abcdef") == string::npos;
+    }
+
+    // Если блоб есть, закрепляет его до link/linkAll/unpin: проверка и ссылка идут не под
+    // одной блокировкой, и без закрепления release или сборка мусора могли удалить блоб между ними
+    bool pinBlob(const string& hash, long long size) {
+        lock_guard<mutex> lock(storeMutex);
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!isValidHash(hash) || !GetFileAttributesExA(blobPath(hash).c_str(), GetFileExInfoStandard, &data)) {
+            return false;
+        }
+        long long blobSize = (static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+        if (size >= 0 && blobSize != size) {
+            return false;
+        }
+        pins[hash]++;
+        return true;
+    }
+
+    void unpin(const string& hash) {
+        lock_guard<mutex> lock(storeMutex);
+        unpinLocked(hash);
+    }
+
+    string newTempPath() {
+        return root + "\\tmp\\" + to_string(GetCurrentThreadId()) + "-" + to_string(++tempCounter) + ".part";
+    }
+
+    // Переносит принятый файл в хранилище; если такой блоб уже есть - временный файл удаляется.
+    // Блоб закрепляется так же, как в pinBlob
+    bool commitBlob(const string& tempPath, const string& hash) {
+        lock_guard<mutex> lock(storeMutex);
+
+        string path = blobPath(hash);
+        if (GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES) {
+            DeleteFileA(tempPath.c_str());
+            pins[hash]++;
+            return true;
+        }
+
+        CreateDirectoryA((root + "\\" + hash.substr(0, 2)).c_str(), NULL);
+        if (!MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_WRITE_THROUGH)) {
+            return false;
+        }
+        pins[hash]++;
+        return true;
+    }
+
+    // Заменяет файл name жесткой ссылкой на закрепленный блоб и снимает закрепление
+    // (даже при ошибке); старый блоб имени освобождается
+    bool link(const string& name, const string& hash) {
+        lock_guard<mutex> lock(storeMutex);
+        string journal;
+        bool linked = linkLocked(name, hash, journal);
+        unpinLocked(hash);
+        appendJournal(journal);
+        return linked;
+    }
+
+    // Пачка ссылок за одну блокировку и одну запись в журнал; linked[i] - результат для links[i].
+    // Каждая ссылка снимает одно закрепление своего блоба
+    void linkAll(const vector<pair<string, string>>& links, vector<char>& linked) {
+        lock_guard<mutex> lock(storeMutex);
+        string journal;
+        linked.assign(links.size(), 0);
+        for (size_t i = 0; i < links.size(); i++) {
+            linked[i] = linkLocked(links[i].first, links[i].second, journal) ? 1 : 0;
+            unpinLocked(links[i].second);
+        }
+        appendJournal(journal);
+    }
+
+    long long release(const string& name) {
+        lock_guard<mutex> lock(storeMutex);
+        if (refs.find(name) == refs.end()) {
+            return 0;
+        }
+        appendJournal("-" + name + "\n");
+        return releaseLocked(name);
+    }
+
+    // Журнал проигрывается заново, ссылки на удаленные или замененные снаружи имена
+    // отбрасываются, журнал сжимается до текущего состояния
+    void load() {
+        lock_guard<mutex> lock(storeMutex);
+
+        refs.clear();
+        refCounts.clear();
+
+        ifstream journal(journalPath(), ios::binary);
+        string line;
+        while (getline(journal, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.length() > Blake3::OUT_LEN * 2 + 2 && line[0] == '+') {
+                refs[line.substr(Blake3::OUT_LEN * 2 + 2)] = line.substr(1, Blake3::OUT_LEN * 2);
+            }
+            else if (line.length() > 1 && line[0] == '-') {
+                refs.erase(line.substr(1));
+            }
+        }
+        journal.close();
+
+        for (auto it = refs.begin(); it != refs.end();) {
+            if (isValidHash(it->second) && sameFile(namePath(it->first), blobPath(it->second))) {
+                refCounts[it->second]++;
+                ++it;
+            }
+            else {
+                it = refs.erase(it);
+            }
+        }
+
+        string compacted = journalPath() + ".tmp";
+        {
+            ofstream out(compacted, ios::binary | ios::trunc);
+            for (auto it = refs.begin(); it != refs.end(); ++it) {
+                out << "+" << it->second << " " << it->first << "\n";
+            }
+        }
+        MoveFileExA(compacted.c_str(), journalPath().c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+        // Недокачанные загрузки предыдущего запуска
+        WIN32_FIND_DATAA findData;
+        HANDLE hFind = FindFirstFileA((root + "\\tmp\\*").c_str(), &findData);
+        if (hFind != INVALID_HANDLE_VALUE) {
+            do {
+                if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                    DeleteFileA((root + "\\tmp\\" + findData.cFileName).c_str());
+                }
+            } while (FindNextFileA(hFind, &findData) != 0);
+            FindClose(hFind);
+        }
+    }
+
+    // Удаляет блобы, на которые не ссылается ни одно имя и которые не ждут ссылки
+    void collectGarbage(int& removed, long long& freed) {
+        lock_guard<mutex> lock(storeMutex);
+        removed = 0;
+        freed = 0;
+
+        WIN32_FIND_DATAA dirData;
+        HANDLE hDir = FindFirstFileA((root + "\\*").c_str(), &dirData);
+        if (hDir == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        do {
+            // ".." тоже из двух символов - берутся только шестнадцатеричные префиксы
+            string prefix = dirData.cFileName;
+            if (!(dirData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || prefix.length() != 2
+                || prefix.find_first_not_of("0123456789abcdef") != string::npos) {
+                continue;
+            }
+
+            WIN32_FIND_DATAA blobData;
+            HANDLE hBlob = FindFirstFileA((root + "\\" + prefix + "\\*").c_str(), &blobData);
+            if (hBlob == INVALID_HANDLE_VALUE) {
+                continue;
+            }
+            do {
+                string hash = blobData.cFileName;
+                if ((blobData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !isValidHash(hash)
+                    || refCounts.count(hash) || pins.count(hash)) {
+                    continue;
+                }
+                long long size = (static_cast<long long>(blobData.nFileSizeHigh) << 32) | blobData.nFileSizeLow;
+                if (DeleteFileA((root + "\\" + prefix + "\\" + hash).c_str())) {
+                    removed++;
+                    freed += size;
+                }
+            } while (FindNextFileA(hBlob, &blobData) != 0);
+            FindClose(hBlob);
+        } while (FindNextFileA(hDir, &dirData) != 0);
+
+        FindClose(hDir);
+    }
+
+    void getStats(size_t& names, size_t& blobs) {
+        lock_guard<mutex> lock(storeMutex);
+        names = refs.size();
+        blobs = refCounts.size();
+    }
+};
+
+// Неизменяемый снимок каталога файлов сервера, записи отсортированы по имени.
+// Имена - пути относительно каталога сервера с '/' между компонентами
+struct CatalogSnapshot {
+    enum SortKey { BY_NAME, BY_SIZE, BY_MTIME };
+
+    vector<CatalogEntry> entries;
+    vector<CatalogEntry> directories;   // подкаталоги (mtime - время изменения каталога), по имени
+    long long totalSize;
+    unsigned long long version;
+
+    // Порядок по размеру и по времени изменения (при равных - по имени);
+    // строится при первом запросе и живет вместе со снимком
+    mutable once_flag bySizeOnce;
+    mutable once_flag byMtimeOnce;
+    mutable vector<uint32_t> bySize;
+    mutable vector<uint32_t> byMtime;
+
+    // Дерево путей - тоже по первому запросу
+    mutable once_flag treeOnce;
+    mutable PathTree pathTree;
+
+    static long long sortValue(const CatalogEntry& entry, SortKey key) {
+        return key == BY_SIZE ? entry.size : (key == BY_MTIME ? static_cast<long long>(entry.mtime) : 0);
+    }
+
+    // NULL для BY_NAME - записи и так в нужном порядке
+    const vector<uint32_t>* order(SortKey key) const {
+        if (key == BY_NAME) {
+            return NULL;
+        }
+        once_flag& once = key == BY_SIZE ? bySizeOnce : byMtimeOnce;
+        vector<uint32_t>& index = key == BY_SIZE ? bySize : byMtime;
+        call_once(once, [&]() {
+            index.resize(entries.size());
+            for (size_t i = 0; i < index.size(); i++) {
+                index[i] = static_cast<uint32_t>(i);
+            }
+            stable_sort(index.begin(), index.end(), [&](uint32_t a, uint32_t b) {
+                return sortValue(entries[a], key) < sortValue(entries[b], key);
+            });
+        });
+        return &index;
+    }
+
+    const PathTree& tree() const {
+        call_once(treeOnce, [&]() { pathTree.build(entries, directories); });
+        return pathTree;
+    }
+
+    static const CatalogEntry* find(const vector<CatalogEntry>& list, const string& name) {
+        auto it = lower_bound(list.begin(), list.end(), name,
+            [](const CatalogEntry& entry, const string& key) { return entry.name < key; });
+        return it != list.end() && it->name == name ? &*it : NULL;
+    }
+
+    const CatalogEntry* find(const string& name) const {
+        return find(entries, name);
+    }
+
+    const CatalogEntry* findDirectory(const string& name) const {
+        return find(directories, name);
+    }
+};
+
+// Изменение каталога для подписчиков. removed - убранные файлы (в том числе старые версии
+// измененных), added - новые и измененные; при reset снимок построен заново целиком
+struct CatalogChange {
+    bool reset;
+    shared_ptr<const CatalogSnapshot> snapshot;
+    vector<CatalogEntry> removed;
+    vector<CatalogEntry> added;
+};
+
+// Каталог файлов сервера в памяти, вместе с подкаталогами. Читатели берут текущий снимок
+// через atomic_load и дальше работают с ним без блокировок. Изменения приходят пачками -
+// из уведомлений ReadDirectoryChangesW и после загрузок самого сервера; новый снимок
+// строится слиянием старого с изменениями, а старый живет, пока его кто-то читает
+class FileCatalog {
+private:
+    string directory;
+    shared_ptr<const CatalogSnapshot> current;
+    mutex updateMutex;
+    vector<function<void(const CatalogChange&)>> listeners;
+
+    HANDLE hDirectory;
+    HANDLE stopEvent;
+    OVERLAPPED overlapped;
+    vector<DWORD> notifyBuffer;     // DWORD - ReadDirectoryChangesW требует выравнивания
+    thread watcher;
+
+    static unsigned long long toUInt64(const FILETIME& ft) {
+        return (static_cast<unsigned long long>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+
+    static bool byName(const CatalogEntry& a, const CatalogEntry& b) {
+        return a.name < b.name;
+    }
+
+    // Все файлы и подкаталоги под relative ("" - весь каталог сервера), без служебных
+    // каталогов; точки повторной обработки (junction) не обходятся, чтобы не зациклиться
+    void scanTree(const string& relative, vector<CatalogEntry>& files, vector<CatalogEntry>& dirs) {
+        vector<string> pending(1, relative);
+        while (!pending.empty()) {
+            string prefix = pending.back().empty() ? "" : pending.back() + "/";
+            pending.pop_back();
+
+            WIN32_FIND_DATAA findFileData;
+            HANDLE hFind = FindFirstFileA((directory + "\\" + prefix + "*").c_str(), &findFileData);
+            if (hFind == INVALID_HANDLE_VALUE) {
+                continue;
+            }
+            do {
+                string name = findFileData.cFileName;
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                bool isDirectory = (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+                CatalogEntry entry;
+                entry.name = prefix + name;
+                entry.size = isDirectory ? 0 : (static_cast<long long>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
+                entry.mtime = toUInt64(findFileData.ftLastWriteTime);
+                if (PathTree::isHidden(entry.name, isDirectory)) {
+                    continue;
+                }
+                if (!isDirectory) {
+                    files.push_back(entry);
+                }
+                else if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                    dirs.push_back(entry);
+                    pending.push_back(entry.name);
+                }
+            } while (FindNextFileA(hFind, &findFileData) != 0);
+            FindClose(hFind);
+        }
+    }
+
+    // Путь лежит внутри одного из каталогов prefixes (отсортированы, каждый с '/' на конце,
+    // вложенные убраны - поэтому достаточно проверить ближайший меньший)
+    static bool underPrefix(const vector<string>& prefixes, const string& name) {
+        auto it = upper_bound(prefixes.begin(), prefixes.end(), name);
+        return it != prefixes.begin() && name.compare(0, (it - 1)->length(), *(it - 1)) == 0;
+    }
+
+    // Старый список без путей exact и без содержимого prefixes, плюс added;
+    // выброшенные старые записи попадают в removed, если он задан
+    static void mergeEntries(const vector<CatalogEntry>& old, const vector<string>& exact, const vector<string>& prefixes,
+        vector<CatalogEntry>& added, vector<CatalogEntry>& out, vector<CatalogEntry>* removed) {
+        stable_sort(added.begin(), added.end(), byName);
+        added.erase(unique(added.begin(), added.end(),
+            [](const CatalogEntry& a, const CatalogEntry& b) { return a.name == b.name; }), added.end());
+
+        out.reserve(old.size() + added.size());
+        size_t j = 0;
+        for (size_t i = 0; i < old.size(); i++) {
+            const CatalogEntry& entry = old[i];
+            if (binary_search(exact.begin(), exact.end(), entry.name) || underPrefix(prefixes, entry.name)) {
+                if (removed != NULL) {
+                    removed->push_back(entry);
+                }
+                continue;
+            }
+            while (j < added.size() && added[j].name < entry.name) {
+                out.push_back(added[j++]);
+            }
+            out.push_back(entry);
+        }
+        while (j < added.size()) {
+            out.push_back(added[j++]);
+        }
+    }
+
+    // Вызывается под updateMutex; подписчики получают изменения в порядке публикации
+    void publish(const shared_ptr<CatalogSnapshot>& next, CatalogChange& change) {
+        next->totalSize = 0;
+        for (size_t i = 0; i < next->entries.size(); i++) {
+            next->totalSize += next->entries[i].size;
+        }
+        next->version = snapshot()->version + 1;
+        atomic_store(&current, shared_ptr<const CatalogSnapshot>(next));
+
+        change.snapshot = next;
+        for (size_t i = 0; i < listeners.size(); i++) {
+            listeners[i](change);
+        }
+    }
+
+    void publishReset(const shared_ptr<CatalogSnapshot>& next) {
+        CatalogChange change;
+        change.reset = true;
+        publish(next, change);
+    }
+
+    bool issueRead() {
+        ResetEvent(overlapped.hEvent);
+        return ReadDirectoryChangesW(hDirectory, notifyBuffer.data(), static_cast<DWORD>(notifyBuffer.size() * sizeof(DWORD)), TRUE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+            NULL, &overlapped, NULL) != 0;
+    }
+
+    void watchLoop() {
+        HANDLE handles[2] = { overlapped.hEvent, stopEvent };
+        bool reading = true;
+        while (reading && WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0) {
+            DWORD bytes = 0;
+            if (!GetOverlappedResult(hDirectory, &overlapped, &bytes, FALSE)) {
+                reading = false;
+                break;
+            }
+
+            vector<string> names;
+            const char* p = reinterpret_cast<const char*>(notifyBuffer.data());
+            while (bytes > 0) {
+                const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+                int wideLength = static_cast<int>(info->FileNameLength / sizeof(WCHAR));
+                int length = WideCharToMultiByte(CP_ACP, 0, info->FileName, wideLength, NULL, 0, NULL, NULL);
+                string name(length, '\0');
+                WideCharToMultiByte(CP_ACP, 0, info->FileName, wideLength, &name[0], length, NULL, NULL);
+                // Пути подкаталогов приходят с '\', в каталоге они хранятся с '/'
+                replace(name.begin(), name.end(), '\\', '/');
+                if (!PathTree::isHidden(name, false)) {
+                    names.push_back(name);
+                }
+                if (info->NextEntryOffset == 0) {
+                    break;
+                }
+                p += info->NextEntryOffset;
+            }
+
+            // Следующее чтение ставится до обработки, чтобы не пропустить события
+            reading = issueRead();
+            if (bytes == 0) {
+                // Буфер уведомлений переполнился - события потеряны, перечитываем все
+                rescan();
+            }
+            else if (!names.empty()) {
+                refresh(names);
+            }
+        }
+
+        // Незавершенное чтение отменяется и дожидается, пока ядро отпустит буфер
+        if (reading) {
+            DWORD bytes = 0;
+            CancelIoEx(hDirectory, &overlapped);
+            GetOverlappedResult(hDirectory, &overlapped, &bytes, TRUE);
+        }
+    }
+
+public:
+    FileCatalog(const string& directoryPath) : directory(directoryPath), current(make_shared<CatalogSnapshot>()),
+        hDirectory(INVALID_HANDLE_VALUE), stopEvent(NULL), notifyBuffer(16384) {
+        memset(&overlapped, 0, sizeof(overlapped));
+    }
+
+    ~FileCatalog() {
+        stop();
+    }
+
+    shared_ptr<const CatalogSnapshot> snapshot() const {
+        return atomic_load(&current);
+    }
+
+    // Подписчик вызывается под блокировкой обновления - он должен работать быстро.
+    // Добавлять до первой загрузки каталога
+    void addListener(const function<void(const CatalogChange&)>& listener) {
+        lock_guard<mutex> lock(updateMutex);
+        listeners.push_back(listener);
+    }
+
+    // Полное перечитывание каталога со всеми подкаталогами
+    void rescan() {
+        auto next = make_shared<CatalogSnapshot>();
+        scanTree("", next->entries, next->directories);
+        sort(next->entries.begin(), next->entries.end(), byName);
+        sort(next->directories.begin(), next->directories.end(), byName);
+
+        lock_guard<mutex> lock(updateMutex);
+        publishReset(next);
+    }
+
+    // Готовые списки (например, из сохраненных метаданных), отсортированные по имени
+    void load(vector<CatalogEntry> entries, vector<CatalogEntry> directories) {
+        auto next = make_shared<CatalogSnapshot>();
+        next->entries.swap(entries);
+        next->directories.swap(directories);
+
+        lock_guard<mutex> lock(updateMutex);
+        publishReset(next);
+    }
+
+    // Перечитывает состояние перечисленных путей: файл появился или изменился, новый
+    // каталог читается целиком, у известного каталога обновляется только время (его
+    // содержимое приходит своими уведомлениями), удаленный путь уходит вместе со всем,
+    // что было под ним. Родительские каталоги тоже перечитываются - их время сдвинулось
+    void refresh(vector<string> names) {
+        size_t requested = names.size();
+        for (size_t i = 0; i < requested; i++) {
+            for (size_t slash = names[i].find('/'); slash != string::npos; slash = names[i].find('/', slash + 1)) {
+                names.push_back(names[i].substr(0, slash));
+            }
+        }
+        sort(names.begin(), names.end());
+        names.erase(unique(names.begin(), names.end()), names.end());
+
+        shared_ptr<const CatalogSnapshot> old = snapshot();
+        vector<CatalogEntry> files;
+        vector<CatalogEntry> dirs;
+        vector<string> exact;           // старые записи с этими именами заменяются
+        vector<string> prefixes;        // и содержимое этих каталогов тоже
+        for (size_t i = 0; i < names.size(); i++) {
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            bool exists = GetFileAttributesExA((directory + "\\" + names[i]).c_str(), GetFileExInfoStandard, &data) != 0;
+            bool isDirectory = exists && (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+            if (PathTree::isHidden(names[i], isDirectory)) {
+                continue;
+            }
+
+            CatalogEntry entry;
+            entry.name = names[i];
+            entry.size = exists && !isDirectory ? (static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow : 0;
+            entry.mtime = exists ? toUInt64(data.ftLastWriteTime) : 0;
+            exact.push_back(names[i]);
+
+            if (isDirectory && old->findDirectory(names[i]) != NULL) {
+                dirs.push_back(entry);
+                continue;
+            }
+            prefixes.push_back(names[i] + "/");
+            if (isDirectory) {
+                dirs.push_back(entry);
+                if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                    scanTree(names[i], files, dirs);
+                }
+            }
+            else if (exists) {
+                files.push_back(entry);
+            }
+        }
+
+        // Вложенные префиксы не нужны - их содержимое и так внутри внешнего
+        sort(prefixes.begin(), prefixes.end());
+        vector<string> outer;
+        for (size_t i = 0; i < prefixes.size(); i++) {
+            if (outer.empty() || prefixes[i].compare(0, outer.back().length(), outer.back()) != 0) {
+                outer.push_back(prefixes[i]);
+            }
+        }
+
+        lock_guard<mutex> lock(updateMutex);
+        old = snapshot();
+        auto next = make_shared<CatalogSnapshot>();
+        CatalogChange change;
+        change.reset = false;
+        mergeEntries(old->entries, exact, outer, files, next->entries, &change.removed);
+        mergeEntries(old->directories, exact, outer, dirs, next->directories, NULL);
+        change.added.swap(files);
+        publish(next, change);
+    }
+
+    void refresh(const string& name) {
+        refresh(vector<string>(1, name));
+    }
+
+    // initialScan = false, если снимок уже загружен и сверяется с диском отдельно
+    void start(bool initialScan = true) {
+        hDirectory = CreateFileA(directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+        // Подписка раньше сканирования: изменения во время скана придут уведомлениями
+        bool watching = hDirectory != INVALID_HANDLE_VALUE && overlapped.hEvent != NULL && stopEvent != NULL && issueRead();
+        if (initialScan) {
+            rescan();
+        }
+        if (watching) {
+            watcher = thread(&FileCatalog::watchLoop, this);
+        }
+    }
+
+    void stop() {
+        if (stopEvent != NULL) {
+            SetEvent(stopEvent);
+        }
+        if (watcher.joinable()) {
+            watcher.join();
+        }
+        if (hDirectory != INVALID_HANDLE_VALUE) {
+            CloseHandle(hDirectory);
+            hDirectory = INVALID_HANDLE_VALUE;
+        }
+        if (overlapped.hEvent != NULL) {
+            CloseHandle(overlapped.hEvent);
+            overlapped.hEvent = NULL;
+        }
+        if (stopEvent != NULL) {
+            CloseHandle(stopEvent);
+            stopEvent = NULL;
+        }
+    }
+};
+
+struct SearchMatch {
+    string name;
+    long long size;
+    int rank;
+};
+
+// Поисковый индекс имен файлов: триграммы путей (в нижнем регистре) -> отсортированные
+// списки номеров записей. Подстрока ищется пересечением списков ее триграмм и проверкой
+// оставшихся кандидатов. Удаленные записи только помечаются; списки чистятся перестройкой,
+// когда удаленных становится больше, чем живых
+class SearchIndex {
+private:
+    struct Record {
+        string name;
+        string lower;
+        long long size;
+        bool alive;
+    };
+
+    vector<Record> records;
+    unordered_map<string, uint32_t> ids;                // путь -> номер живой записи
+    unordered_map<uint32_t, vector<uint32_t>> postings;  // триграмма -> номера записей по возрастанию
+    size_t deadCount;
+    mutex indexMutex;
+
+    static uint32_t trigram(const char* p) {
+        return (static_cast<uint32_t>(static_cast<uint8_t>(p[0])) << 16)
+            | (static_cast<uint32_t>(static_cast<uint8_t>(p[1])) << 8) | static_cast<uint8_t>(p[2]);
+    }
+
+    // Вызывается под indexMutex
+    void addLocked(const CatalogEntry& entry) {
+        auto it = ids.find(entry.name);
+        if (it != ids.end()) {
+            records[it->second].size = entry.size;
+            return;
+        }
+
+        Record record;
+        record.name = entry.name;
+        record.lower = toLower(entry.name);
+        record.size = entry.size;
+        record.alive = true;
+        uint32_t id = static_cast<uint32_t>(records.size());
+        records.push_back(record);
+        ids[entry.name] = id;
+
+        // Номера только растут, поэтому списки остаются отсортированными
+        const string& lower = records.back().lower;
+        vector<uint32_t> grams;
+        for (size_t i = 0; i + 3 <= lower.length(); i++) {
+            grams.push_back(trigram(lower.data() + i));
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        for (size_t i = 0; i < grams.size(); i++) {
+            postings[grams[i]].push_back(id);
+        }
+    }
+
+    // Вызывается под indexMutex
+    void removeLocked(const string& name) {
+        auto it = ids.find(name);
+        if (it == ids.end()) {
+            return;
+        }
+        Record& record = records[it->second];
+        record.alive = false;
+        string().swap(record.name);
+        string().swap(record.lower);
+        ids.erase(it);
+        deadCount++;
+    }
+
+    // Вызывается под indexMutex
+    void rebuildLocked(const vector<CatalogEntry>& entries) {
+        records.clear();
+        ids.clear();
+        postings.clear();
+        deadCount = 0;
+        records.reserve(entries.size());
+        ids.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            addLocked(entries[i]);
+        }
+    }
+
+public:
+    SearchIndex() : deadCount(0) {}
+
+    static string toLower(const string& text) {
+        string lower = text;
+        for (size_t i = 0; i < lower.length(); i++) {
+            if (lower[i] >= 'A' && lower[i] <= 'Z') {
+                lower[i] = static_cast<char>(lower[i] - 'A' + 'a');
+            }
+        }
+        return lower;
+    }
+
+    // Ранг совпадения (меньше - лучше): 0 - имя файла целиком, 1 - начало имени файла,
+    // 2 - начало слова в пути, 3 - где-то внутри
+    static int rank(const string& lower, const string& query) {
+        size_t base = lower.rfind('/');
+        base = base == string::npos ? 0 : base + 1;
+        if (lower.compare(base, string::npos, query) == 0) {
+            return 0;
+        }
+        if (lower.compare(base, query.length(), query) == 0) {
+            return 1;
+        }
+        for (size_t pos = lower.find(query); pos != string::npos; pos = lower.find(query, pos + 1)) {
+            if (pos == 0 || strchr("/._- ", lower[pos - 1]) != NULL) {
+                return 2;
+            }
+        }
+        return 3;
+    }
+
+    // Оставляет limit лучших: по рангу, затем более короткие пути, затем по имени
+    static void selectTop(vector<SearchMatch>& matches, size_t limit) {
+        auto better = [](const SearchMatch& a, const SearchMatch& b) {
+            if (a.rank != b.rank) {
+                return a.rank < b.rank;
+            }
+            if (a.name.length() != b.name.length()) {
+                return a.name.length() < b.name.length();
+            }
+            return a.name < b.name;
+        };
+        if (matches.size() > limit) {
+            partial_sort(matches.begin(), matches.begin() + limit, matches.end(), better);
+            matches.resize(limit);
+        }
+        else {
+            sort(matches.begin(), matches.end(), better);
+        }
+    }
+
+    // Подписчик каталога: изменения применяются по мере публикации снимков
+    void apply(const CatalogChange& change) {
+        lock_guard<mutex> lock(indexMutex);
+        if (change.reset) {
+            rebuildLocked(change.snapshot->entries);
+            return;
+        }
+
+        // Измененный файл остается той же записью - меняется только размер
+        set<string> added;
+        for (size_t i = 0; i < change.added.size(); i++) {
+            added.insert(change.added[i].name);
+        }
+        for (size_t i = 0; i < change.removed.size(); i++) {
+            if (!added.count(change.removed[i].name)) {
+                removeLocked(change.removed[i].name);
+            }
+        }
+        for (size_t i = 0; i < change.added.size(); i++) {
+            addLocked(change.added[i]);
+        }
+
+        if (deadCount > 1024 && deadCount > records.size() / 2) {
+            vector<CatalogEntry> alive;
+            alive.reserve(records.size() - deadCount);
+            for (size_t i = 0; i < records.size(); i++) {
+                if (records[i].alive) {
+                    CatalogEntry entry;
+                    entry.name = records[i].name;
+                    entry.size = records[i].size;
+                    entry.mtime = 0;
+                    alive.push_back(entry);
+                }
+            }
+            rebuildLocked(alive);
+        }
+    }
+
+    // Пути, содержащие query (без учета регистра); total - сколько их всего
+    void search(const string& query, size_t limit, vector<SearchMatch>& matches, size_t& total) {
+        string lower = toLower(query);
+        matches.clear();
+
+        lock_guard<mutex> lock(indexMutex);
+        vector<uint32_t> candidates;
+        bool scanAll = lower.length() < 3;
+        if (!scanAll) {
+            // Самый короткий список - кандидаты, остальные списки их только отсеивают
+            vector<uint32_t> grams;
+            for (size_t i = 0; i + 3 <= lower.length(); i++) {
+                grams.push_back(trigram(lower.data() + i));
+            }
+            sort(grams.begin(), grams.end());
+            grams.erase(unique(grams.begin(), grams.end()), grams.end());
+
+            vector<const vector<uint32_t>*> lists;
+            for (size_t i = 0; i < grams.size(); i++) {
+                auto it = postings.find(grams[i]);
+                if (it == postings.end()) {
+                    total = 0;
+                    return;
+                }
+                lists.push_back(&it->second);
+            }
+            sort(lists.begin(), lists.end(), [](const vector<uint32_t>* a, const vector<uint32_t>* b) { return a->size() < b->size(); });
+
+            // Кандидаты отсортированы, поэтому поиск в следующем списке идет только вперед,
+            // шагами 1, 2, 4... от прошлой позиции: соседние кандидаты обычно рядом
+            candidates = *lists[0];
+            for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+                size_t kept = 0;
+                auto from = lists[i]->begin();
+                auto end = lists[i]->end();
+                for (size_t j = 0; j < candidates.size(); j++) {
+                    auto to = from;
+                    for (ptrdiff_t step = 1; to != end && *to < candidates[j]; step *= 2) {
+                        from = to;
+                        to = end - to > step ? to + step : end;
+                    }
+                    from = lower_bound(from, to, candidates[j]);
+                    if (from == end) {
+                        break;
+                    }
+                    if (*from == candidates[j]) {
+                        candidates[kept++] = candidates[j];
+                    }
+                }
+                candidates.resize(kept);
+            }
+        }
+
+        // Сначала только ранг и номер записи, строки копируются для отобранных
+        vector<pair<uint64_t, uint32_t>> found;
+        size_t count = scanAll ? records.size() : candidates.size();
+        for (size_t i = 0; i < count; i++) {
+            uint32_t id = scanAll ? static_cast<uint32_t>(i) : candidates[i];
+            const Record& record = records[id];
+            // Триграммы не учитывают порядок - совпадение проверяется по самой строке
+            if (record.alive && record.lower.find(lower) != string::npos) {
+                uint64_t key = (static_cast<uint64_t>(rank(record.lower, lower)) << 32) | record.name.length();
+                found.push_back(make_pair(key, id));
+            }
+        }
+        total = found.size();
+
+        if (found.empty()) {
+            return;
+        }
+        // limit лучших по (ранг, длина); записи с тем же ключом, что у последней из них,
+        // тоже берутся - среди равных порядок решает имя
+        size_t kept = found.size() < limit ? found.size() : limit;
+        nth_element(found.begin(), found.begin() + (kept - 1), found.end());
+        uint64_t boundary = found[kept - 1].first;
+        for (size_t i = 0; i < found.size(); i++) {
+            if (i < kept || found[i].first == boundary) {
+                const Record& record = records[found[i].second];
+                SearchMatch match;
+                match.name = record.name;
+                match.size = record.size;
+                match.rank = static_cast<int>(found[i].first >> 32);
+                matches.push_back(match);
+            }
+        }
+        selectTop(matches, limit);
+    }
+
+    void getStats(size_t& names, size_t& trigrams) {
+        lock_guard<mutex> lock(indexMutex);
+        names = ids.size();
+        trigrams = postings.size();
+    }
+};
+
+struct WatchEvent {
+    unsigned long long seq;
+    char type;          // 'A' - появился, 'M' - изменился, 'D' - удален
+    string name;
+    long long size;
+    unsigned long long mtime;
+};
+
+// Лента изменений файлов для WATCH: каждое изменение каталога превращается в события
+// с возрастающими номерами, последние CAPACITY событий хранятся, чтобы подписчик мог
+// продолжить с места обрыва. Номера начинаются с времени запуска в микросекундах -
+// номер из прошлого запуска сервера окажется слишком старым и приведет к RESET
+class ChangeFeed {
+private:
+    static const size_t CAPACITY = 100000;
+
+    deque<WatchEvent> events;
+    unsigned long long lastSeq;
+    shared_ptr<const CatalogSnapshot> previous;
+    mutex feedMutex;
+    condition_variable changed;
+
+    // Вызывается под feedMutex
+    void pushLocked(char type, const CatalogEntry& entry) {
+        WatchEvent event;
+        event.seq = ++lastSeq;
+        event.type = type;
+        event.name = entry.name;
+        event.size = type == 'D' ? 0 : entry.size;
+        event.mtime = type == 'D' ? 0 : entry.mtime;
+        events.push_back(event);
+        if (events.size() > CAPACITY) {
+            events.pop_front();
+        }
+    }
+
+public:
+    ChangeFeed() {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        lastSeq = ((static_cast<unsigned long long>(now.dwHighDateTime) << 32) | now.dwLowDateTime) / 10;
+    }
+
+    // Подписчик каталога. Полностью перестроенный снимок сравнивается с предыдущим,
+    // так что и после перечитывания каталога подписчики получают точные события
+    void apply(const CatalogChange& change) {
+        lock_guard<mutex> lock(feedMutex);
+        size_t before = events.size();
+        if (change.reset) {
+            if (previous) {
+                const vector<CatalogEntry>& oldEntries = previous->entries;
+                const vector<CatalogEntry>& newEntries = change.snapshot->entries;
+                size_t i = 0;
+                size_t j = 0;
+                while (i < oldEntries.size() || j < newEntries.size()) {
+                    if (j == newEntries.size() || (i < oldEntries.size() && oldEntries[i].name < newEntries[j].name)) {
+                        pushLocked('D', oldEntries[i++]);
+                    }
+                    else if (i == oldEntries.size() || newEntries[j].name < oldEntries[i].name) {
+                        pushLocked('A', newEntries[j++]);
+                    }
+                    else {
+                        if (oldEntries[i].size != newEntries[j].size || oldEntries[i].mtime != newEntries[j].mtime) {
+                            pushLocked('M', newEntries[j]);
+                        }
+                        i++;
+                        j++;
+                    }
+                }
+            }
+        }
+        else {
+            // Файл, который убран и добавлен в одном изменении, - измененный
+            map<string, const CatalogEntry*> removed;
+            for (size_t i = 0; i < change.removed.size(); i++) {
+                removed[change.removed[i].name] = &change.removed[i];
+            }
+            for (size_t i = 0; i < change.added.size(); i++) {
+                auto it = removed.find(change.added[i].name);
+                if (it == removed.end()) {
+                    pushLocked('A', change.added[i]);
+                    continue;
+                }
+                if (it->second->size != change.added[i].size || it->second->mtime != change.added[i].mtime) {
+                    pushLocked('M', change.added[i]);
+                }
+                removed.erase(it);
+            }
+            for (auto it = removed.begin(); it != removed.end(); ++it) {
+                pushLocked('D', *it->second);
+            }
+        }
+        previous = change.snapshot;
+        if (events.size() != before) {
+            changed.notify_all();
+        }
+    }
+
+    unsigned long long currentSeq() {
+        lock_guard<mutex> lock(feedMutex);
+        return lastSeq;
+    }
+
+    // Ждет событий новее after не дольше timeoutMs; true, если они есть
+    bool wait(unsigned long long after, int timeoutMs) {
+        unique_lock<mutex> lock(feedMutex);
+        return changed.wait_for(lock, chrono::milliseconds(timeoutMs), [&]() { return lastSeq > after; });
+    }
+
+    // События новее after; false, если часть из них уже вытеснена из ленты
+    bool read(unsigned long long after, vector<WatchEvent>& out) {
+        lock_guard<mutex> lock(feedMutex);
+        out.clear();
+        if (after > lastSeq || (after < lastSeq && (events.empty() || events.front().seq > after + 1))) {
+            return false;
+        }
+        size_t skip = after < lastSeq ? static_cast<size_t>(after + 1 - events.front().seq) : events.size();
+        out.assign(events.begin() + skip, events.end());
+        return true;
+    }
+};
+
+// Часть диапазона путей в ответе MERKLE: записи снимка [first, last) с общим префиксом
+struct MerkleChild {
+    string prefix;
+    size_t first;
+    size_t last;
+};
+
+// Дерево хешей каталога для MERKLE. Листья выровнены по записям снимка, prefix[i] -
+// сумма первых i листьев, так что хеш любого поддерева (а это всегда непрерывный
+// диапазон имен) - O(1). При новом снимке листья файлов с теми же именем, размером
+// и временем переносятся, хеши содержимого запрашиваются только для новых и измененных
+class MerkleIndex {
+private:
+    struct Leaf {
+        MerkleSum sum;
+        long long size;
+        unsigned long long mtime;
+    };
+
+    shared_ptr<const CatalogSnapshot> files;
+    vector<Leaf> leaves;
+    vector<MerkleSum> prefixSums;
+
+    // Конец диапазона имен, начинающихся с prefix, внутри [first, last)
+    size_t rangeEnd(const string& prefix, size_t first, size_t last) const {
+        auto it = partition_point(files->entries.begin() + first, files->entries.begin() + last,
+            [&](const CatalogEntry& entry) { return entry.name.compare(0, prefix.length(), prefix) <= 0; });
+        return static_cast<size_t>(it - files->entries.begin());
+    }
+
+    // Части по следующему компоненту пути: файлы и подкаталоги ("docs/")
+    bool splitByComponent(const string& prefix, size_t first, size_t last, size_t limit, vector<MerkleChild>& children) const {
+        children.clear();
+        for (size_t i = first; i < last; ) {
+            const string& name = files->entries[i].name;
+            size_t slash = name.find('/', prefix.length());
+            MerkleChild child;
+            child.prefix = slash == string::npos ? name : name.substr(0, slash + 1);
+            child.first = i;
+            child.last = slash == string::npos ? i + 1 : rangeEnd(child.prefix, i, last);
+            children.push_back(child);
+            if (children.size() > limit) {
+                return false;
+            }
+            i = child.last;
+        }
+        return true;
+    }
+
+public:
+    // Диапазон, до которого MERKLE раскрывается сразу в файлы, и наибольшее число частей узла
+    static const size_t LEAF_LIMIT = 16;
+    static const size_t FANOUT = 256;
+
+    // contentHash(entry, hash) - BLAKE3 содержимого файла, false - файл не прочитать.
+    // Возвращает число файлов, для которых он понадобился
+    size_t update(const shared_ptr<const CatalogSnapshot>& next,
+        const function<bool(const CatalogEntry&, string&)>& contentHash) {
+        if (files && files->version == next->version) {
+            return 0;
+        }
+
+        vector<Leaf> nextLeaves(next->entries.size());
+        size_t hashed = 0;
+        size_t j = 0;
+        for (size_t i = 0; i < next->entries.size(); i++) {
+            const CatalogEntry& entry = next->entries[i];
+            while (files && j < files->entries.size() && files->entries[j].name < entry.name) {
+                j++;
+            }
+            if (files && j < files->entries.size() && files->entries[j].name == entry.name
+                && leaves[j].size == entry.size && leaves[j].mtime == entry.mtime) {
+                nextLeaves[i] = leaves[j];
+                continue;
+            }
+            string hash;
+            if (!contentHash(entry, hash)) {
+                hash = "-";
+            }
+            nextLeaves[i].sum = MerkleSum::leaf(entry.name, hash);
+            nextLeaves[i].size = entry.size;
+            nextLeaves[i].mtime = entry.mtime;
+            hashed++;
+        }
+
+        prefixSums.resize(nextLeaves.size() + 1);
+        prefixSums[0] = MerkleSum();
+        for (size_t i = 0; i < nextLeaves.size(); i++) {
+            prefixSums[i + 1] = prefixSums[i];
+            prefixSums[i + 1].add(nextLeaves[i].sum);
+        }
+
+        files = next;
+        leaves.swap(nextLeaves);
+        return hashed;
+    }
+
+    const vector<CatalogEntry>& entries() const {
+        return files->entries;
+    }
+
+    // Записи, имена которых начинаются с prefix
+    void range(const string& prefix, size_t& first, size_t& last) const {
+        auto it = lower_bound(files->entries.begin(), files->entries.end(), prefix,
+            [](const CatalogEntry& entry, const string& key) { return entry.name < key; });
+        first = static_cast<size_t>(it - files->entries.begin());
+        last = rangeEnd(prefix, first, files->entries.size());
+    }
+
+    MerkleSum sum(size_t first, size_t last) const {
+        return prefixSums[last].minus(prefixSums[first]);
+    }
+
+    // Части узла prefix: по компонентам пути, а если их больше FANOUT - по символу после
+    // общего префикса всех имен диапазона. Цепочка из единственных подкаталогов
+    // пропускается сразу, чтобы клиент не тратил на нее запросы
+    void split(const string& prefix, size_t first, size_t last, vector<MerkleChild>& children) const {
+        string base = prefix;
+        bool fits = splitByComponent(base, first, last, FANOUT, children);
+        while (fits && children.size() == 1 && children[0].last - children[0].first > 1) {
+            base = children[0].prefix;
+            fits = splitByComponent(base, first, last, FANOUT, children);
+        }
+        if (fits) {
+            return;
+        }
+
+        const string& low = files->entries[first].name;
+        const string& high = files->entries[last - 1].name;
+        size_t common = base.length();
+        while (common < low.length() && common < high.length() && low[common] == high[common]) {
+            common++;
+        }
+
+        children.clear();
+        for (size_t i = first; i < last; ) {
+            const string& name = files->entries[i].name;
+            MerkleChild child;
+            child.prefix = name.substr(0, common + 1);
+            child.first = i;
+            child.last = name.length() == common ? i + 1 : rangeEnd(child.prefix, i, last);
+            children.push_back(child);
+            i = child.last;
+        }
+    }
+};
+
+// Метаданные каталога между запусками: пути, размеры, времена записи и BLAKE3 файлов,
+// времена изменения подкаталогов. Файл читается отображением в память, поэтому старт
+// не зависит от числа файлов; перечитываются только каталоги, менявшиеся после сохранения.
+// Формат: MetaHeader, count записей MetaRecord (файлы, затем каталоги, по имени),
+// затем строки имен подряд
+class MetadataStore {
+private:
+    string path;
+
+#pragma pack(push, 1)
+    struct MetaHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t directoryMtime;
+        uint64_t savedAt;
+        uint64_t namesSize;
+    };
+
+    struct MetaRecord {
+        uint64_t size;
+        uint64_t mtime;
+        uint64_t nameOffset;
+        uint32_t nameLength;
+        uint32_t flags;             // 1 - хеш действителен, 2 - запись о каталоге
+        uint8_t hash[Blake3::OUT_LEN];
+    };
+#pragma pack(pop)
+
+    static const uint32_t FORMAT_VERSION = 2;
+
+public:
+    MetadataStore(const string& storePath) : path(storePath) {}
+
+    bool load(vector<CatalogEntry>& entries, vector<CatalogEntry>& directories, map<string, HashCacheEntry>& hashes,
+        unsigned long long& directoryMtime, unsigned long long& savedAt) {
+        HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER fileSize;
+        HANDLE hMapping = NULL;
+        const char* view = NULL;
+        if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart >= static_cast<LONGLONG>(sizeof(MetaHeader))) {
+            hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (hMapping != NULL) {
+                view = static_cast<const char*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+            }
+        }
+
+        bool ok = false;
+        if (view != NULL) {
+            const MetaHeader* header = reinterpret_cast<const MetaHeader*>(view);
+            unsigned long long recordsEnd = sizeof(MetaHeader) + static_cast<unsigned long long>(header->count) * sizeof(MetaRecord);
+            ok = memcmp(header->magic, "FXMETA\0\0", 8) == 0 && header->version == FORMAT_VERSION
+                && recordsEnd + header->namesSize == static_cast<unsigned long long>(fileSize.QuadPart);
+
+            const MetaRecord* records = reinterpret_cast<const MetaRecord*>(view + sizeof(MetaHeader));
+            const char* names = view + recordsEnd;
+            if (ok) {
+                entries.reserve(header->count);
+            }
+            for (uint32_t i = 0; ok && i < header->count; i++) {
+                const MetaRecord& record = records[i];
+                if (record.nameOffset + record.nameLength > header->namesSize) {
+                    ok = false;
+                    break;
+                }
+                CatalogEntry entry;
+                entry.name.assign(names + record.nameOffset, record.nameLength);
+                entry.size = static_cast<long long>(record.size);
+                entry.mtime = record.mtime;
+                if (record.flags & 2) {
+                    directories.push_back(entry);
+                    continue;
+                }
+                if (record.flags & 1) {
+                    HashCacheEntry& hash = hashes[entry.name];
+                    hash.size = entry.size;
+                    hash.mtime = entry.mtime;
+                    hash.hash = Blake3::toHex(record.hash);
+                }
+                entries.push_back(entry);
+            }
+            if (ok) {
+                directoryMtime = header->directoryMtime;
+                savedAt = header->savedAt;
+            }
+            UnmapViewOfFile(view);
+        }
+
+        if (hMapping != NULL) {
+            CloseHandle(hMapping);
+        }
+        CloseHandle(hFile);
+
+        if (!ok) {
+            entries.clear();
+            directories.clear();
+            hashes.clear();
+        }
+        return ok;
+    }
+
+    // Пишется во временный файл рядом и подменяет старый
+    bool save(const CatalogSnapshot& snapshot, const map<string, HashCacheEntry>& hashes,
+        unsigned long long directoryMtime, unsigned long long savedAt) {
+        MetaHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "FXMETA\0\0", 8);
+        header.version = FORMAT_VERSION;
+        header.count = static_cast<uint32_t>(snapshot.entries.size() + snapshot.directories.size());
+        header.directoryMtime = directoryMtime;
+        header.savedAt = savedAt;
+
+        vector<MetaRecord> records(header.count);
+        string names;
+        for (size_t i = 0; i < records.size(); i++) {
+            bool isDirectory = i >= snapshot.entries.size();
+            const CatalogEntry& entry = isDirectory ? snapshot.directories[i - snapshot.entries.size()] : snapshot.entries[i];
+            MetaRecord& record = records[i];
+            memset(&record, 0, sizeof(record));
+            record.size = static_cast<uint64_t>(entry.size);
+            record.mtime = entry.mtime;
+            record.nameOffset = names.size();
+            record.nameLength = static_cast<uint32_t>(entry.name.length());
+            names += entry.name;
+            if (isDirectory) {
+                record.flags = 2;
+                continue;
+            }
+
+            auto it = hashes.find(entry.name);
+            if (it != hashes.end() && it->second.size == entry.size && it->second.mtime == entry.mtime
+                && it->second.hash.length() == Blake3::OUT_LEN * 2) {
+                for (size_t j = 0; j < Blake3::OUT_LEN; j++) {
+                    record.hash[j] = static_cast<uint8_t>(strtoul(it->second.hash.substr(j * 2, 2).c_str(), NULL, 16));
+                }
+                record.flags = 1;
+            }
+        }
+        header.namesSize = names.size();
+
+        string tempPath = path + ".tmp";
+        {
+            ofstream out(tempPath, ios::binary | ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (!records.empty()) {
+                out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(MetaRecord));
+            }
+            out.write(names.data(), names.size());
+            if (!out) {
+                out.close();
+                DeleteFileA(tempPath.c_str());
+                return false;
+            }
+        }
+        return MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+};
+
+// Гистограмма задержек в микросекундах с точностью около 6% (как HDR histogram: 16 корзин
+// на каждую степень двойки). Запись - одно атомарное сложение, без блокировок и выделений
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const size_t BUCKET_COUNT = SUB_BUCKETS + 32 * SUB_BUCKETS;    // до 2^36 мкс (~19 часов)
+
+    static size_t bucketOf(uint64_t us) {
+        if (us < SUB_BUCKETS) {
+            return static_cast<size_t>(us);
+        }
+        int exponent = SUB_BUCKET_BITS;
+        while (exponent < 63 && (us >> (exponent + 1)) != 0) {
+            exponent++;
+        }
+        size_t index = SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS
+            + static_cast<size_t>((us >> (exponent - SUB_BUCKET_BITS)) - SUB_BUCKETS);
+        return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
+    }
+
+    // Наибольшее значение, попадающее в корзину
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        size_t shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    atomic<uint64_t> buckets[BUCKET_COUNT];
+    atomic<uint64_t> count;
+    atomic<uint64_t> sumUs;
+    atomic<uint64_t> maxUs;
+
+    LatencyHistogram() : count(0), sumUs(0), maxUs(0) {
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            buckets[i] = 0;
+        }
+    }
+
+    void record(uint64_t us) {
+        buckets[bucketOf(us)].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        sumUs.fetch_add(us, memory_order_relaxed);
+        uint64_t seen = maxUs.load(memory_order_relaxed);
+        while (us > seen && !maxUs.compare_exchange_weak(seen, us, memory_order_relaxed)) {
+        }
+    }
+};
+
+// Сумма гистограмм всех потоков на момент чтения
+struct HistogramSnapshot {
+    vector<uint64_t> buckets;
+    uint64_t count;
+    uint64_t sumUs;
+    uint64_t maxUs;
+
+    HistogramSnapshot() : buckets(LatencyHistogram::BUCKET_COUNT), count(0), sumUs(0), maxUs(0) {}
+
+    void add(const LatencyHistogram& histogram) {
+        for (size_t i = 0; i < buckets.size(); i++) {
+            buckets[i] += histogram.buckets[i].load(memory_order_relaxed);
+        }
+        count += histogram.count.load(memory_order_relaxed);
+        sumUs += histogram.sumUs.load(memory_order_relaxed);
+        uint64_t m = histogram.maxUs.load(memory_order_relaxed);
+        maxUs = m > maxUs ? m : maxUs;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            total += buckets[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                uint64_t bound = LatencyHistogram::bucketUpperBound(i);
+                return bound < maxUs ? bound : maxUs;
+            }
+        }
+        return maxUs;
+    }
+
+    // Сколько значений не больше limitUs (по верхним границам корзин)
+    uint64_t countAtMost(uint64_t limitUs) const {
+        uint64_t result = 0;
+        for (size_t i = 0; i < buckets.size() && LatencyHistogram::bucketUpperBound(i) <= limitUs; i++) {
+            result += buckets[i];
+        }
+        return result;
+    }
+};
+
+// Счетчики сервера для STATS и экспорта в Prometheus. Каждый поток пишет в свой шард
+// (потоки распределяются по шардам по кругу), шарды разделены отступом в строку кэша,
+// при чтении шарды складываются. На пути обработки запроса нет ни блокировок, ни выделений
+class ServerMetrics {
+public:
+    enum { COMMAND_OTHER = 0 };
+
+    static const char* const* commandNames() {
+        static const char* const names[] = { "OTHER", "LIST", "LISTX", "LISTDIR", "WATCH", "MERKLE", "STAT", "STATS", "TRACE",
+            "SEARCH", "GET", "GETIF", "DOWNLOAD", "INFO", "HASH", "UPLOAD", "PUTHASH", "CDCPUT", "CDCGET", "MGET",
+            "BULKPUT", "DELTAGET", "DELTAPUT", "GC", "PING", "TEST", "EXIT", "QUIT", "DISCONNECT" };
+        return names;
+    }
+
+    static const size_t COMMAND_TYPES = 29;
+    static const size_t SHARD_COUNT = 16;
+
+private:
+    struct Shard {
+        char padding[64];
+        atomic<uint64_t> connectionsOpened;
+        atomic<uint64_t> connectionsClosed;
+        atomic<uint64_t> bytesIn;
+        atomic<uint64_t> bytesOut;
+        atomic<uint64_t> commands[COMMAND_TYPES];
+        atomic<uint64_t> errors[COMMAND_TYPES];
+        LatencyHistogram latency[COMMAND_TYPES];
+        LatencyHistogram firstByte;
+
+        Shard() : connectionsOpened(0), connectionsClosed(0), bytesIn(0), bytesOut(0) {
+            for (size_t i = 0; i < COMMAND_TYPES; i++) {
+                commands[i] = 0;
+                errors[i] = 0;
+            }
+        }
+    };
+
+    // Команда, которую сейчас выполняет поток
+    struct CommandTrace {
+        Shard* shard;
+        size_t type;
+        chrono::steady_clock::time_point start;
+        bool firstByteSeen;
+        bool failed;
+    };
+
+    Shard shards[SHARD_COUNT];
+    atomic<size_t> nextShard;
+    chrono::steady_clock::time_point startedAt;
+
+    static CommandTrace& currentTrace() {
+        static thread_local CommandTrace trace = { NULL, 0, chrono::steady_clock::time_point(), false, false };
+        return trace;
+    }
+
+    Shard& localShard() {
+        static thread_local size_t index = nextShard++ % SHARD_COUNT;
+        return shards[index];
+    }
+
+public:
+    ServerMetrics() : nextShard(0), startedAt(chrono::steady_clock::now()) {}
+
+    // Тип команды по первому слову (без выделения памяти)
+    static size_t commandType(const string& command) {
+        size_t length = command.find(' ');
+        length = length == string::npos ? command.length() : length;
+        const char* const* names = commandNames();
+        for (size_t i = 1; i < COMMAND_TYPES; i++) {
+            if (command.compare(0, length, names[i]) == 0) {
+                return i;
+            }
+        }
+        return COMMAND_OTHER;
+    }
+
+    void connectionOpened() {
+        localShard().connectionsOpened.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Объем соединения берется у TCP (SIO_TCP_INFO, Windows 10 1703+) - поэтому считать
+    // байты при каждой отправке и приеме не нужно
+    void connectionClosed(SOCKET sock) {
+        Shard& shard = localShard();
+        DWORD version = 0;
+        TCP_INFO_v0 info;
+        DWORD returned = 0;
+        if (WSAIoctl(sock, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &returned, NULL, NULL) == 0) {
+            shard.bytesIn.fetch_add(info.BytesIn, memory_order_relaxed);
+            shard.bytesOut.fetch_add(info.BytesOut, memory_order_relaxed);
+        }
+        shard.connectionsClosed.fetch_add(1, memory_order_relaxed);
+    }
+
+    void beginCommand(const string& command) {
+        CommandTrace& trace = currentTrace();
+        trace.shard = &localShard();
+        trace.type = commandType(command);
+        trace.start = chrono::steady_clock::now();
+        trace.firstByteSeen = false;
+        trace.failed = false;
+    }
+
+    void endCommand() {
+        CommandTrace& trace = currentTrace();
+        if (trace.shard == NULL) {
+            return;
+        }
+        uint64_t us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - trace.start).count();
+        trace.shard->commands[trace.type].fetch_add(1, memory_order_relaxed);
+        trace.shard->latency[trace.type].record(us);
+        if (trace.failed) {
+            trace.shard->errors[trace.type].fetch_add(1, memory_order_relaxed);
+        }
+        trace.shard = NULL;
+    }
+
+    // Отправка в рамках текущей команды: первая отправка - время до первого байта; ответ
+    // "ERROR..." или сбой отправки - команда завершилась ошибкой
+    static void noteSend(const char* data, int length, int result) {
+        CommandTrace& trace = currentTrace();
+        if (trace.shard == NULL) {
+            return;
+        }
+        if (result == SOCKET_ERROR) {
+            trace.failed = true;
+        }
+        if (!trace.firstByteSeen && length > 0) {
+            trace.firstByteSeen = true;
+            trace.failed = trace.failed || (length >= 5 && memcmp(data, "ERROR", 5) == 0);
+            trace.shard->firstByte.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - trace.start).count());
+        }
+    }
+
+    struct Totals {
+        uint64_t connectionsOpened;
+        uint64_t connectionsClosed;
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+        uint64_t commands[COMMAND_TYPES];
+        uint64_t errors[COMMAND_TYPES];
+        long long uptimeSeconds;
+    };
+
+    void readTotals(Totals& totals) const {
+        memset(&totals, 0, sizeof(totals));
+        for (size_t s = 0; s < SHARD_COUNT; s++) {
+            const Shard& shard = shards[s];
+            totals.connectionsOpened += shard.connectionsOpened.load(memory_order_relaxed);
+            totals.connectionsClosed += shard.connectionsClosed.load(memory_order_relaxed);
+            totals.bytesIn += shard.bytesIn.load(memory_order_relaxed);
+            totals.bytesOut += shard.bytesOut.load(memory_order_relaxed);
+            for (size_t i = 0; i < COMMAND_TYPES; i++) {
+                totals.commands[i] += shard.commands[i].load(memory_order_relaxed);
+                totals.errors[i] += shard.errors[i].load(memory_order_relaxed);
+            }
+        }
+        totals.uptimeSeconds = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - startedAt).count();
+    }
+
+    // type == COMMAND_TYPES - время до первого байта
+    HistogramSnapshot readHistogram(size_t type) const {
+        HistogramSnapshot snapshot;
+        for (size_t s = 0; s < SHARD_COUNT; s++) {
+            snapshot.add(type < COMMAND_TYPES ? shards[s].latency[type] : shards[s].firstByte);
+        }
+        return snapshot;
+    }
+
+    // Ответ на STATS: общие счетчики, затем по строке на каждую выполнявшуюся команду
+    string formatStats() const {
+        Totals totals;
+        readTotals(totals);
+        uint64_t commandCount = 0;
+        uint64_t errorCount = 0;
+        for (size_t i = 0; i < COMMAND_TYPES; i++) {
+            commandCount += totals.commands[i];
+            errorCount += totals.errors[i];
+        }
+
+        stringstream out;
+        out << "SERVER STATS\n";
+        out << "Uptime: " << totals.uptimeSeconds << " s\n";
+        out << "Connections: " << (totals.connectionsOpened - totals.connectionsClosed) << " active, "
+            << totals.connectionsOpened << " total\n";
+        out << "Bytes: " << totals.bytesIn << " in, " << totals.bytesOut << " out\n";
+        out << "Commands: " << commandCount << " (" << errorCount << " errors)\n";
+        out << left << setw(12) << "COMMAND" << right << setw(10) << "COUNT" << setw(8) << "ERRORS"
+            << setw(10) << "P50_US" << setw(10) << "P90_US" << setw(10) << "P99_US" << setw(11) << "P999_US" << setw(11) << "MAX_US" << "\n";
+        for (size_t i = 0; i <= COMMAND_TYPES; i++) {
+            HistogramSnapshot histogram = readHistogram(i);
+            if (histogram.count == 0) {
+                continue;
+            }
+            out << left << setw(12) << (i < COMMAND_TYPES ? commandNames()[i] : "FIRST_BYTE") << right << setw(10) << histogram.count
+                << setw(8) << (i < COMMAND_TYPES ? totals.errors[i] : 0) << setw(10) << histogram.percentile(0.5)
+                << setw(10) << histogram.percentile(0.9) << setw(10) << histogram.percentile(0.99)
+                << setw(11) << histogram.percentile(0.999) << setw(11) << histogram.maxUs << "\n";
+        }
+        out << "END\n";
+        return out.str();
+    }
+
+    // Текстовый формат Prometheus (version 0.0.4)
+    string formatPrometheus() const {
+        static const double bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+            0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+        Totals totals;
+        readTotals(totals);
+
+        stringstream out;
+        out << "# HELP fileserver_uptime_seconds Time since the server started.\n";
+        out << "# TYPE fileserver_uptime_seconds gauge\n";
+        out << "fileserver_uptime_seconds " << totals.uptimeSeconds << "\n";
+        out << "# HELP fileserver_connections_active Client connections being served.\n";
+        out << "# TYPE fileserver_connections_active gauge\n";
+        out << "fileserver_connections_active " << (totals.connectionsOpened - totals.connectionsClosed) << "\n";
+        out << "# HELP fileserver_connections_total Client connections accepted.\n";
+        out << "# TYPE fileserver_connections_total counter\n";
+        out << "fileserver_connections_total " << totals.connectionsOpened << "\n";
+        out << "# HELP fileserver_received_bytes_total Bytes received from closed connections.\n";
+        out << "# TYPE fileserver_received_bytes_total counter\n";
+        out << "fileserver_received_bytes_total " << totals.bytesIn << "\n";
+        out << "# HELP fileserver_sent_bytes_total Bytes sent on closed connections.\n";
+        out << "# TYPE fileserver_sent_bytes_total counter\n";
+        out << "fileserver_sent_bytes_total " << totals.bytesOut << "\n";
+
+        out << "# HELP fileserver_commands_total Commands handled.\n";
+        out << "# TYPE fileserver_commands_total counter\n";
+        for (size_t i = 0; i < COMMAND_TYPES; i++) {
+            if (totals.commands[i] > 0) {
+                out << "fileserver_commands_total{command=\"" << commandNames()[i] << "\"} " << totals.commands[i] << "\n";
+            }
+        }
+        out << "# HELP fileserver_command_errors_total Commands answered with an error.\n";
+        out << "# TYPE fileserver_command_errors_total counter\n";
+        for (size_t i = 0; i < COMMAND_TYPES; i++) {
+            if (totals.commands[i] > 0) {
+                out << "fileserver_command_errors_total{command=\"" << commandNames()[i] << "\"} " << totals.errors[i] << "\n";
+            }
+        }
+
+        for (int kind = 0; kind < 2; kind++) {
+            string metric = kind == 0 ? "fileserver_command_duration_seconds" : "fileserver_time_to_first_byte_seconds";
+            out << "# HELP " << metric << (kind == 0 ? " Command duration." : " Time from reading a command to its first response byte.") << "\n";
+            out << "# TYPE " << metric << " histogram\n";
+            for (size_t i = 0; i < COMMAND_TYPES; i++) {
+                if (kind == 1 && i > 0) {
+                    break;
+                }
+                HistogramSnapshot histogram = readHistogram(kind == 0 ? i : COMMAND_TYPES);
+                if (histogram.count == 0) {
+                    continue;
+                }
+                string labels = kind == 0 ? string("command=\"") + commandNames()[i] + "\"," : "";
+                for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+                    out << metric << "_bucket{" << labels << "le=\"" << bounds[b] << "\"} "
+                        << histogram.countAtMost(static_cast<uint64_t>(bounds[b] * 1000000)) << "\n";
+                }
+                out << metric << "_bucket{" << labels << "le=\"+Inf\"} " << histogram.count << "\n";
+                string plain = labels.empty() ? "" : "{" + labels.substr(0, labels.length() - 1) + "}";
+                out << metric << "_sum" << plain << " " << histogram.sumUs / 1000000.0 << "\n";
+                out << metric << "_count" << plain << " " << histogram.count << "\n";
+            }
+        }
+        return out.str();
+    }
+};
+
+enum LogLevel { LOG_DEBUG = 0, LOG_INFO, LOG_WARNING, LOG_ERROR };
+
+// Асинхронный журнал. Поток, который пишет в журнал, только копирует сообщение в запись
+// кольцевого буфера (без блокировок: место занимается через compare_exchange, запись
+// публикуется номером последовательности). Время форматирует и выводит фоновый поток -
+// пачкой и с одним сбросом на пачку. Если буфер полон, запись отбрасывается, а не ждет
+class AsyncLogger {
+public:
+    static const size_t CAPACITY = 4096;        // степень двойки
+    static const size_t TEXT_SIZE = 472;
+
+    static const char* levelName(int level) {
+        static const char* const names[] = { "debug", "info", "warning", "error" };
+        return level >= LOG_DEBUG && level <= LOG_ERROR ? names[level] : "info";
+    }
+
+    // "debug", "info", "warning" или "error"; -1 - неизвестный уровень
+    static int parseLevel(const string& name) {
+        for (int level = LOG_DEBUG; level <= LOG_ERROR; level++) {
+            if (name == levelName(level)) {
+                return level;
+            }
+        }
+        return -1;
+    }
+
+    // Строка в кавычках с экранированием JSON - для журнала и для ответов LISTX
+    static void appendJsonString(string& out, const char* text, size_t length) {
+        out += '"';
+        for (size_t i = 0; i < length; i++) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c < 0x20) {
+                char escaped[8];
+                sprintf(escaped, "\\u%04x", c);
+                out += escaped;
+            }
+            else {
+                out += static_cast<char>(c);
+            }
+        }
+        out += '"';
+    }
+
+private:
+    struct Record {
+        atomic<size_t> sequence;
+        long long timeUs;       // system_clock, микросекунды от эпохи
+        DWORD threadId;
+        int level;
+        size_t length;
+        char text[TEXT_SIZE];
+    };
+
+    unique_ptr<Record[]> ring;
+    char padding[64];
+    atomic<size_t> enqueuePos;
+    char padding2[64];
+    size_t dequeuePos;              // только фоновый поток
+    atomic<size_t> writtenPos;      // все записи до этой позиции уже выведены
+
+    atomic<int> minLevel;
+    atomic<bool> json;
+
+    // Ограничение частоты для debug и info: не больше rateLimit записей в секунду
+    atomic<int> rateLimit;
+    atomic<long long> rateWindow;
+    atomic<int> rateCount;
+    atomic<unsigned long long> suppressed;
+    atomic<unsigned long long> dropped;
+    unsigned long long reportedSuppressed;
+    unsigned long long reportedDropped;
+    long long reportedAt;
+
+    // Последняя отформатированная секунда: localtime_s - один раз в секунду, а не на запись
+    time_t cachedSecond;
+    bool cachedJson;
+    char cachedTime[32];
+
+    atomic<bool> running;
+    thread writer;
+
+    const char* formatTime(long long timeUs) {
+        time_t second = static_cast<time_t>(timeUs / 1000000);
+        bool jsonOutput = json;
+        if (second != cachedSecond || jsonOutput != cachedJson) {
+            tm local;
+            localtime_s(&local, &second);
+            strftime(cachedTime, sizeof(cachedTime), jsonOutput ? "%Y-%m-%dT%H:%M:%S" : "%H:%M:%S", &local);
+            cachedSecond = second;
+            cachedJson = jsonOutput;
+        }
+        return cachedTime;
+    }
+
+    void formatRecord(string& out, long long timeUs, DWORD threadId, int level, const char* text, size_t length) {
+        char milliseconds[8];
+        sprintf(milliseconds, ".%03d", static_cast<int>((timeUs / 1000) % 1000));
+        if (json) {
+            out += "{\"time\":\"";
+            out += formatTime(timeUs);
+            out += milliseconds;
+            out += "\",\"level\":\"";
+            out += levelName(level);
+            out += "\",\"thread\":";
+            out += to_string(threadId);
+            out += ",\"message\":";
+            appendJsonString(out, text, length);
+            out += "}\n";
+            return;
+        }
+        out += '[';
+        out += formatTime(timeUs);
+        out += milliseconds;
+        out += "] ";
+        if (level == LOG_WARNING) {
+            out += "WARNING: ";
+        }
+        else if (level == LOG_ERROR) {
+            out += "ERROR: ";
+        }
+        out.append(text, length);
+        out += '\n';
+    }
+
+    // Выводит все опубликованные записи; false - выводить было нечего
+    bool drain(string& batch) {
+        batch.clear();
+        while (true) {
+            Record& record = ring[dequeuePos & (CAPACITY - 1)];
+            if (record.sequence.load(memory_order_acquire) != dequeuePos + 1) {
+                break;
+            }
+            formatRecord(batch, record.timeUs, record.threadId, record.level, record.text, record.length);
+            record.sequence.store(dequeuePos + CAPACITY, memory_order_release);
+            dequeuePos++;
+        }
+
+        // Потерянные записи - одной строкой не чаще раза в секунду
+        unsigned long long suppressedNow = suppressed.load();
+        unsigned long long droppedNow = dropped.load();
+        long long nowUs = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        if ((suppressedNow != reportedSuppressed || droppedNow != reportedDropped) && (nowUs - reportedAt >= 1000000 || !running)) {
+            string note = "Log: " + to_string(suppressedNow - reportedSuppressed) + " messages suppressed by rate limit, "
+                + to_string(droppedNow - reportedDropped) + " dropped (buffer full)";
+            formatRecord(batch, nowUs, GetCurrentThreadId(), LOG_WARNING, note.c_str(), note.length());
+            reportedSuppressed = suppressedNow;
+            reportedDropped = droppedNow;
+            reportedAt = nowUs;
+        }
+
+        if (!batch.empty()) {
+            cout.write(batch.data(), batch.length());
+            cout.flush();
+        }
+        writtenPos.store(dequeuePos, memory_order_release);
+        return !batch.empty();
+    }
+
+    void writerLoop() {
+        string batch;
+        batch.reserve(256 * 1024);
+        while (running) {
+            if (!drain(batch)) {
+                Sleep(5);
+            }
+        }
+        drain(batch);
+    }
+
+public:
+    AsyncLogger() : ring(new Record[CAPACITY]), enqueuePos(0), dequeuePos(0), writtenPos(0), minLevel(LOG_INFO), json(false),
+        rateLimit(2000), rateWindow(0), rateCount(0), suppressed(0), dropped(0), reportedSuppressed(0), reportedDropped(0), reportedAt(0),
+        cachedSecond(-1), cachedJson(false), running(true) {
+        for (size_t i = 0; i < CAPACITY; i++) {
+            ring[i].sequence.store(i, memory_order_relaxed);
+        }
+        cachedTime[0] = '\0';
+        writer = thread(&AsyncLogger::writerLoop, this);
+    }
+
+    // rateLimit 0 - без ограничения частоты
+    void configure(int level, bool jsonOutput, int limit) {
+        minLevel = level;
+        json = jsonOutput;
+        rateLimit = limit;
+    }
+
+    bool enabled(int level) const {
+        return level >= minLevel.load(memory_order_relaxed);
+    }
+
+    // Горячий путь: время, номер потока и копия текста (длинные сообщения обрезаются)
+    void log(int level, const char* text, size_t length) {
+        if (!enabled(level)) {
+            return;
+        }
+        long long timeUs = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+        int limit = rateLimit.load(memory_order_relaxed);
+        if (level < LOG_WARNING && limit > 0) {
+            long long second = timeUs / 1000000;
+            long long window = rateWindow.load(memory_order_relaxed);
+            if (window != second && rateWindow.compare_exchange_strong(window, second)) {
+                rateCount.store(0, memory_order_relaxed);
+            }
+            if (rateCount.fetch_add(1, memory_order_relaxed) >= limit) {
+                suppressed.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+        }
+
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        Record* record;
+        while (true) {
+            record = &ring[pos & (CAPACITY - 1)];
+            size_t sequence = record->sequence.load(memory_order_acquire);
+            ptrdiff_t difference = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+            if (difference == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+
+        record->timeUs = timeUs;
+        record->threadId = GetCurrentThreadId();
+        record->level = level;
+        if (length > TEXT_SIZE) {
+            memcpy(record->text, text, TEXT_SIZE - 3);
+            memcpy(record->text + TEXT_SIZE - 3, "...", 3);
+            length = TEXT_SIZE;
+        }
+        else {
+            memcpy(record->text, text, length);
+        }
+        record->length = length;
+        record->sequence.store(pos + 1, memory_order_release);
+    }
+
+    // Ждет, пока фоновый поток выведет все записанное до вызова
+    void flush() {
+        size_t target = enqueuePos.load();
+        while (running && writtenPos.load(memory_order_acquire) < target) {
+            Sleep(1);
+        }
+    }
+
+    void stop() {
+        if (running.exchange(false)) {
+            writer.join();
+        }
+    }
+
+    ~AsyncLogger() {
+        stop();
+    }
+};
+
+// Трассировка запросов: отрезки времени (прием соединения, чтение команды, открытие файла,
+// чтение с диска, отправка...) по отдельным запросам, выбранным с заданной вероятностью.
+// Запрос на время выполнения берет себе буфер отрезков и пишет в него без блокировок;
+// выгрузка - в формате Chrome trace events (открывается в Perfetto и chrome://tracing)
+class RequestTracer {
+public:
+    static const size_t BUFFER_SPANS = 8192;    // степень двойки
+    static const size_t MAX_BUFFERS = 256;
+    // Отрезки внутри циклов передачи короче этого не записываются, чтобы буфер не
+    // заполнялся тысячами одинаковых отрезков по 20 мкс
+    static const long long BLOCK_SPAN_MIN_US = 200;
+
+private:
+    struct Span {
+        const char* name;       // строковый литерал
+        long long startUs;
+        long long durationUs;
+        unsigned long long request;
+    };
+
+    // Буфер пишет только поток запроса, который его занял. Выгрузка читает его
+    // одновременно и отбрасывает отрезки, которые могли быть перезаписаны во время чтения
+    struct SpanBuffer {
+        Span spans[BUFFER_SPANS];
+        atomic<unsigned long long> written;
+        atomic<bool> inUse;
+
+        SpanBuffer() : written(0), inUse(false) {}
+    };
+
+    struct RequestState {
+        RequestTracer* tracer;
+        SpanBuffer* buffer;
+        unsigned long long request;
+        uint32_t random;
+    };
+
+    atomic<SpanBuffer*> buffers[MAX_BUFFERS];
+    atomic<size_t> bufferCount;
+    mutex growMutex;
+    atomic<unsigned long long> nextRequest;
+    atomic<uint64_t> sampleThreshold;       // вероятность выборки * 2^32
+    chrono::steady_clock::time_point origin;
+
+    static RequestState& state() {
+        static thread_local RequestState current = { NULL, NULL, 0, 0 };
+        return current;
+    }
+
+    SpanBuffer* acquireBuffer() {
+        size_t count = bufferCount.load(memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            bool expected = false;
+            SpanBuffer* buffer = buffers[i].load(memory_order_acquire);
+            if (!buffer->inUse.load(memory_order_relaxed) && buffer->inUse.compare_exchange_strong(expected, true)) {
+                return buffer;
+            }
+        }
+
+        lock_guard<mutex> lock(growMutex);
+        count = bufferCount.load();
+        if (count >= MAX_BUFFERS) {
+            return NULL;
+        }
+        SpanBuffer* buffer = new SpanBuffer();
+        buffer->inUse = true;
+        buffers[count].store(buffer, memory_order_release);
+        bufferCount.store(count + 1, memory_order_release);
+        return buffer;
+    }
+
+    long long sinceOrigin(chrono::steady_clock::time_point time) const {
+        return chrono::duration_cast<chrono::microseconds>(time - origin).count();
+    }
+
+public:
+    RequestTracer() : bufferCount(0), nextRequest(1), sampleThreshold(0), origin(chrono::steady_clock::now()) {
+        for (size_t i = 0; i < MAX_BUFFERS; i++) {
+            buffers[i] = NULL;
+        }
+    }
+
+    ~RequestTracer() {
+        for (size_t i = 0; i < bufferCount; i++) {
+            delete buffers[i].load();
+        }
+    }
+
+    // 0 - трассировка выключена, 1 - каждый запрос
+    void setSampleRate(double rate) {
+        rate = rate < 0 ? 0 : (rate > 1 ? 1 : rate);
+        sampleThreshold = static_cast<uint64_t>(rate * 4294967296.0);
+    }
+
+    double getSampleRate() const {
+        return sampleThreshold.load() / 4294967296.0;
+    }
+
+    // Начало запроса в текущем потоке: решает, трассировать ли его
+    void beginRequest() {
+        RequestState& current = state();
+        endRequest();
+        uint64_t threshold = sampleThreshold.load(memory_order_relaxed);
+        if (threshold == 0) {
+            return;
+        }
+        if (current.random == 0) {
+            current.random = GetCurrentThreadId() * 2654435761u + 1;
+        }
+        current.random ^= current.random << 13;
+        current.random ^= current.random >> 17;
+        current.random ^= current.random << 5;
+        if (current.random >= threshold) {
+            return;
+        }
+        current.buffer = acquireBuffer();
+        if (current.buffer != NULL) {
+            current.tracer = this;
+            current.request = nextRequest.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    void endRequest() {
+        RequestState& current = state();
+        if (current.buffer != NULL) {
+            current.buffer->inUse.store(false, memory_order_release);
+            current.buffer = NULL;
+            current.tracer = NULL;
+        }
+    }
+
+    bool sampled() const {
+        return state().tracer == this;
+    }
+
+    void record(const char* name, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+        RequestState& current = state();
+        if (current.tracer != this) {
+            return;
+        }
+        SpanBuffer* buffer = current.buffer;
+        unsigned long long index = buffer->written.load(memory_order_relaxed);
+        Span& span = buffer->spans[index & (BUFFER_SPANS - 1)];
+        span.name = name;
+        span.startUs = sinceOrigin(start);
+        span.durationUs = chrono::duration_cast<chrono::microseconds>(end - start).count();
+        span.request = current.request;
+        buffer->written.store(index + 1, memory_order_release);
+    }
+
+    // Все отрезки из буферов в формате Chrome trace events. Дорожка (tid) - буфер:
+    // запросы в одном буфере никогда не пересекаются по времени
+    string exportChromeTrace() const {
+        ostringstream out;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"file server\"}}";
+
+        vector<Span> spans;
+        size_t count = bufferCount.load(memory_order_acquire);
+        for (size_t b = 0; b < count; b++) {
+            const SpanBuffer* buffer = buffers[b].load(memory_order_acquire);
+            unsigned long long end = buffer->written.load(memory_order_acquire);
+            unsigned long long begin = end > BUFFER_SPANS ? end - BUFFER_SPANS : 0;
+            spans.clear();
+            for (unsigned long long i = begin; i < end; i++) {
+                spans.push_back(buffer->spans[i & (BUFFER_SPANS - 1)]);
+            }
+            // Пока копировали, запрос мог дописать отрезки поверх самых старых. Отрезок номер
+            // after пишется до увеличения счетчика, поэтому занятым считается и его место:
+            // целы только отрезки с номера after + 1 - BUFFER_SPANS
+            atomic_thread_fence(memory_order_acquire);
+            unsigned long long after = buffer->written.load(memory_order_relaxed);
+            size_t skip = after + 1 > BUFFER_SPANS && after + 1 - BUFFER_SPANS > begin
+                ? static_cast<size_t>(after + 1 - BUFFER_SPANS - begin) : 0;
+
+            out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << (b + 1)
+                << ",\"args\":{\"name\":\"request slot " << (b + 1) << "\"}}";
+            for (size_t i = skip; i < spans.size(); i++) {
+                out << ",\n{\"name\":\"" << spans[i].name << "\",\"cat\":\"server\",\"ph\":\"X\",\"ts\":" << spans[i].startUs
+                    << ",\"dur\":" << spans[i].durationUs << ",\"pid\":1,\"tid\":" << (b + 1)
+                    << ",\"args\":{\"request\":" << spans[i].request << "}}";
+            }
+        }
+        out << "\n]}\n";
+        return out.str();
+    }
+};
+
+// Отрезок трассировки на время жизни объекта. Если запрос не выбран для трассировки,
+// время не замеряется вовсе
+class TraceSpan {
+private:
+    RequestTracer& tracer;
+    const char* name;
+    long long minDurationUs;
+    bool active;
+    chrono::steady_clock::time_point start;
+
+public:
+    TraceSpan(RequestTracer& t, const char* spanName, long long minUs = 0)
+        : tracer(t), name(spanName), minDurationUs(minUs), active(t.sampled()) {
+        if (active) {
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (!active) {
+            return;
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        if (chrono::duration_cast<chrono::microseconds>(end - start).count() >= minDurationUs) {
+            tracer.record(name, start, end);
+        }
+    }
+};
+
+class FileServer {
+private:
+    SOCKET serverSocket;
+    sockaddr_in serverAddr;
+    atomic<bool> running;
+    string serverDirectory;
+    int port;
+    string exePath;
+
+    // Хеши файлов действительны, пока у файла не изменились размер и время записи
+    map<string, HashCacheEntry> hashCache;
+    mutex hashCacheMutex;
+    atomic<unsigned long long> hashCacheGeneration;
+
+    // Дедуплицирующее хранилище, включается флагом --dedup
+    unique_ptr<BlobStore> blobStore;
+
+    ChunkIndex chunkIndex;
+
+    // Индекс для SEARCH, обновляется подпиской на каталог (объявлен раньше каталога,
+    // чтобы пережить его поток уведомлений)
+    SearchIndex searchIndex;
+
+    // Лента изменений для WATCH - тоже подписчик каталога
+    ChangeFeed changeFeed;
+
+    // Дерево хешей для MERKLE - строится по снимку каталога при запросе
+    MerkleIndex merkleIndex;
+    mutex merkleMutex;
+
+    // Каталог файлов в памяти - из него отвечают LIST и INFO
+    unique_ptr<FileCatalog> catalog;
+
+    // Сохраненные метаданные (server_files.meta рядом с каталогом)
+    unique_ptr<MetadataStore> metadataStore;
+    mutex metadataMutex;
+    bool metadataLoaded;
+    unsigned long long metadataDirectoryMtime;
+    unsigned long long metadataSavedAt;
+    atomic<unsigned long long> savedCatalogVersion;
+    atomic<unsigned long long> savedHashGeneration;
+
+    // Без журнала запросов (нагрузочный тест запускает сервер в своем процессе)
+    bool quiet;
+    unique_ptr<AsyncLogger> logger;
+
+    // Счетчики для STATS и экспорта в Prometheus
+    unique_ptr<ServerMetrics> metrics;
+    SOCKET metricsSocket;
+
+    // Трассировка выбранных запросов (TRACE, Ctrl+Break)
+    unique_ptr<RequestTracer> tracer;
+
+    static FileServer*& breakTarget() {
+        static FileServer* target = NULL;
+        return target;
+    }
+
+    static BOOL WINAPI consoleHandler(DWORD type) {
+        if (type != CTRL_BREAK_EVENT || breakTarget() == NULL) {
+            return FALSE;
+        }
+        breakTarget()->saveTrace();
+        return TRUE;
+    }
+
+    // Все отправки FileServer идут через эту функцию (внутри класса она скрывает ::send):
+    // для STATS отмечаются время до первого байта ответа и ответы с ошибкой
+    static int send(SOCKET sock, const char* data, int length, int flags) {
+        int result = ::send(sock, data, length, flags);
+        ServerMetrics::noteSend(data, length, result);
+        return result;
+    }
+
+public:
+    FileServer(int p, const string& directory = "server_files", bool dedupStorage = false) : running(true), serverDirectory(directory), port(p),
+        hashCacheGeneration(0), metadataLoaded(false), metadataDirectoryMtime(0), metadataSavedAt(0), savedCatalogVersion(0), savedHashGeneration(0), quiet(false),
+        logger(new AsyncLogger()), metrics(new ServerMetrics()), metricsSocket(INVALID_SOCKET), tracer(new RequestTracer()) {
+        char exePathBuffer[MAX_PATH];
+        GetModuleFileNameA(NULL, exePathBuffer, MAX_PATH);
+        exePath = string(exePathBuffer);
+        size_t pos = exePath.find_last_of("\\/");
+        if (pos != string::npos) {
+            exePath = exePath.substr(0, pos);
+        }
+
+        string fullServerPath = exePath + "\\" + serverDirectory;
+        if (!CreateDirectoryA(fullServerPath.c_str(), NULL)) {
+            DWORD error = GetLastError();
+            if (error != ERROR_ALREADY_EXISTS) {
+                cerr << "Warning: Cannot create server directory: " << fullServerPath
+                    << " (Error: " << error << ")" << endl;
+            }
+        }
+
+        catalog.reset(new FileCatalog(fullServerPath));
+        catalog->addListener([this](const CatalogChange& change) { searchIndex.apply(change); });
+        catalog->addListener([this](const CatalogChange& change) { changeFeed.apply(change); });
+        metadataStore.reset(new MetadataStore(fullServerPath + ".meta"));
+        metadataLoaded = loadMetadata();
+
+        if (dedupStorage) {
+            blobStore.reset(new BlobStore(fullServerPath));
+            blobStore->load();
+        }
+
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            cerr << "WSAStartup failed: " << WSAGetLastError() << endl;
+            return;
+        }
+
+        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (serverSocket == INVALID_SOCKET) {
+            cerr << "Socket creation failed: " << WSAGetLastError() << endl;
+            WSACleanup();
+            return;
+        }
+
+        int opt = 1;
+        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+
+        int sendBufSize = 65536;
+        int recvBufSize = 65536;
+        setsockopt(serverSocket, SOL_SOCKET, SO_SNDBUF, (char*)&sendBufSize, sizeof(sendBufSize));
+        setsockopt(serverSocket, SOL_SOCKET, SO_RCVBUF, (char*)&recvBufSize, sizeof(recvBufSize));
+
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(static_cast<u_short>(port));
+
+        if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            cerr << "Bind failed on port " << port << ": " << WSAGetLastError() << endl;
+            closesocket(serverSocket);
+            WSACleanup();
+            return;
+        }
+
+        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "Listen failed: " << WSAGetLastError() << endl;
+            closesocket(serverSocket);
+            WSACleanup();
+            return;
+        }
+
+        cout << "=========================================" << endl;
+        cout << "  CLEAN File Server v3.0" << endl;
+        cout << "=========================================" << endl;
+        cout << "Server successfully started on port " << port << endl;
+        cout << "Server directory: " << fullServerPath << endl;
+        cout << "NO HEADERS in files - pure data only!" << endl;
+        if (blobStore) {
+            int removed = 0;
+            long long freed = 0;
+            blobStore->collectGarbage(removed, freed);
+
+            size_t names = 0;
+            size_t blobs = 0;
+            blobStore->getStats(names, blobs);
+            cout << "Deduplicated storage: " << names << " names -> " << blobs << " blobs";
+            if (removed > 0) {
+                cout << " (" << removed << " unreferenced removed, " << formatFileSize(freed) << " freed)";
+            }
+            cout << endl;
+        }
+        cout << "=========================================" << endl;
+
+        showExistingFiles();
+        createTestFileIfNeeded(fullServerPath);
+    }
+
+    void createTestFileIfNeeded(const string& serverPath) {
+        string testFilePath = serverPath + "\\test.txt";
+        ifstream testFile(testFilePath);
+        if (!testFile) {
+            ofstream newFile(testFilePath);
+            if (newFile) {
+                newFile << "This is a CLEAN test file.\n";
+                newFile << "It contains NO headers or metadata.\n";
+                newFile << "Just pure text content.\n";
+                newFile << "When downloaded, you should NOT see 'SIZE:' anywhere.\n";
+                newFile << "Server: " << getCurrentTime() << "\n";
+                newFile.close();
+                cout << "Created clean test file: test.txt" << endl;
+            }
+        }
+        testFile.close();
+    }
+
+    string getCurrentTime() {
+        auto now = chrono::system_clock::now();
+        auto now_time = chrono::system_clock::to_time_t(now);
+        char buffer[80];
+        ctime_s(buffer, sizeof(buffer), &now_time);
+        string timeStr(buffer);
+        timeStr.pop_back();
+        return timeStr;
+    }
+
+    void showExistingFiles() {
+        string fullServerPath = exePath + "\\" + serverDirectory;
+        cout << "\nExisting files in server directory:" << endl;
+        cout << "-----------------------------------" << endl;
+
+        // Из каталога в памяти; при большом числе файлов печатаем только начало списка
+        const size_t SHOWN = 20;
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        if (files->entries.empty()) {
+            cout << "No files found." << endl;
+            cout << "Directory: " << fullServerPath << endl;
+            return;
+        }
+
+        for (size_t i = 0; i < files->entries.size() && i < SHOWN; i++) {
+            cout << "  " << files->entries[i].name << " (" << formatFileSize(files->entries[i].size) << ")" << endl;
+        }
+        if (files->entries.size() > SHOWN) {
+            cout << "  ... and " << (files->entries.size() - SHOWN) << " more" << endl;
+        }
+
+        cout << "-----------------------------------" << endl;
+        cout << "Total: " << files->entries.size() << " files, " << formatFileSize(files->totalSize) << endl;
+        cout << "=========================================" << endl;
+    }
+
+    void logMessage(const string& message, int level = LOG_INFO) {
+        if (quiet) {
+            return;
+        }
+        logger->log(level, message.data(), message.length());
+    }
+
+    // Уровень, формат (текст или JSON по строке) и предел записей debug/info в секунду
+    void setLogOptions(int level, bool json, int rateLimit) {
+        logger->configure(level, json, rateLimit);
+    }
+
+    void flushLog() {
+        logger->flush();
+    }
+
+    // Доля запросов, которые трассируются (0 - ни одного, 1 - все)
+    void setTraceRate(double rate) {
+        tracer->setSampleRate(rate);
+    }
+
+    // Трассировка в файл trace_<дата>_<время>.json рядом с программой
+    string saveTrace() {
+        time_t now = time(NULL);
+        tm local;
+        localtime_s(&local, &now);
+        char name[64];
+        strftime(name, sizeof(name), "trace_%Y%m%d_%H%M%S.json", &local);
+        string path = exePath + "\\" + name;
+
+        string trace = tracer->exportChromeTrace();
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(trace.c_str(), trace.length());
+        if (!out) {
+            logMessage("Cannot write trace: " + path, LOG_ERROR);
+            return "";
+        }
+        logMessage("Trace saved: " + path + " (" + formatFileSize(trace.length()) + ")");
+        return path;
+    }
+
+    // Ctrl+Break в консоли сервера сохраняет трассировку, не останавливая сервер
+    void saveTraceOnBreak() {
+        breakTarget() = this;
+        SetConsoleCtrlHandler(consoleHandler, TRUE);
+    }
+
+    string formatFileSize(long long bytes) {
+        const char* sizes[] = { "B", "KB", "MB", "GB", "TB" };
+        int i = 0;
+        double dblBytes = static_cast<double>(bytes);
+
+        while (dblBytes >= 1024 && i < 4) {
+            dblBytes /= 1024;
+            i++;
+        }
+
+        char buffer[32];
+        if (i == 0) {
+            sprintf(buffer, "%lld %s", bytes, sizes[i]);
+        }
+        else {
+            sprintf(buffer, "%.2f %s", dblBytes, sizes[i]);
+        }
+        return string(buffer);
+    }
+
+    static unsigned long long fileTimeToUInt64(const FILETIME& ft) {
+        return (static_cast<unsigned long long>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+
+    bool getFileStat(const string& fullPath, long long& size, unsigned long long& mtime) {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA(fullPath.c_str(), GetFileExInfoStandard, &data)
+            || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            return false;
+        }
+        size = (static_cast<long long>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+        mtime = fileTimeToUInt64(data.ftLastWriteTime);
+        return true;
+    }
+
+    // Путь файла в каталоге сервера (подкаталоги через '/') - без выхода за пределы каталога
+    bool isSafeFilename(const string& filename) {
+        return PathTree::isSafePath(filename);
+    }
+
+    bool getFileHash(const string& filename, string& hash, long long& size, bool logHashing = true) {
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+
+        unsigned long long mtime = 0;
+        if (!getFileStat(fullPath, size, mtime)) {
+            return false;
+        }
+
+        {
+            lock_guard<mutex> lock(hashCacheMutex);
+            auto it = hashCache.find(filename);
+            if (it != hashCache.end() && it->second.size == size && it->second.mtime == mtime) {
+                hash = it->second.hash;
+                return true;
+            }
+        }
+
+        auto startTime = chrono::steady_clock::now();
+        long long hashedSize = 0;
+        if (!Blake3::hashFile(fullPath, hash, &hashedSize)) {
+            return false;
+        }
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        // Если файл менялся во время хеширования - результат не кешируем
+        long long sizeAfter = 0;
+        unsigned long long mtimeAfter = 0;
+        if (getFileStat(fullPath, sizeAfter, mtimeAfter) && sizeAfter == size && mtimeAfter == mtime && hashedSize == size) {
+            lock_guard<mutex> lock(hashCacheMutex);
+            HashCacheEntry entry;
+            entry.size = size;
+            entry.mtime = mtime;
+            entry.hash = hash;
+            hashCache[filename] = entry;
+            hashCacheGeneration++;
+        }
+        size = hashedSize;
+
+        if (logHashing) {
+            logMessage("Hashed " + filename + " (" + formatFileSize(size) + " in " + to_string(duration.count()) + " ms)");
+        }
+        return true;
+    }
+
+    // Хеш уже известен (блоб) - кешируем его для текущих размера и времени записи
+    void rememberFileHash(const string& filename, const string& hash) {
+        HashCacheEntry entry;
+        if (!getFileStat(exePath + "\\" + serverDirectory + "\\" + filename, entry.size, entry.mtime)) {
+            return;
+        }
+        entry.hash = hash;
+
+        lock_guard<mutex> lock(hashCacheMutex);
+        hashCache[filename] = entry;
+        hashCacheGeneration++;
+    }
+
+    // Хеши пачки только что записанных файлов - одной блокировкой кеша
+    void rememberFileHashes(const vector<pair<string, string>>& hashes) {
+        vector<HashCacheEntry> entries(hashes.size());
+        vector<char> valid(hashes.size(), 0);
+        for (size_t i = 0; i < hashes.size(); i++) {
+            valid[i] = getFileStat(exePath + "\\" + serverDirectory + "\\" + hashes[i].first, entries[i].size, entries[i].mtime) ? 1 : 0;
+            entries[i].hash = hashes[i].second;
+        }
+
+        lock_guard<mutex> lock(hashCacheMutex);
+        for (size_t i = 0; i < hashes.size(); i++) {
+            if (valid[i]) {
+                hashCache[hashes[i].first] = entries[i];
+            }
+            else {
+                hashCache.erase(hashes[i].first);
+            }
+        }
+        hashCacheGeneration++;
+    }
+
+    void invalidateFileHash(const string& filename) {
+        lock_guard<mutex> lock(hashCacheMutex);
+        hashCache.erase(filename);
+    }
+
+    string readCommand(SOCKET clientSocket) {
+        char buffer[1024];
+        memset(buffer, 0, sizeof(buffer));
+        int bytesReceived;
+
+        DWORD timeout = 100;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+        if (bytesReceived > 0) {
+            buffer[bytesReceived] = '\0';
+            string command = buffer;
+
+            size_t newlinePos = command.find('\n');
+            if (newlinePos != string::npos) {
+                command = command.substr(0, newlinePos);
+            }
+
+            if (!command.empty() && command.back() == '\r') {
+                command.pop_back();
+            }
+
+            return command;
+        }
+        else if (bytesReceived == 0) {
+            return "DISCONNECT";
+        }
+
+        return "";
+    }
+
+    // Одна команда клиента (после нее сервер закрывает соединение)
+    void dispatchCommand(SOCKET clientSocket, const string& command) {
+        if (command == "LIST") {
+            sendFileListAndClose(clientSocket);
+        }
+        else if (command == "LISTX" || command.find("LISTX ") == 0) {
+            sendFileListing(clientSocket, command.substr(5));
+        }
+        else if (command == "LISTDIR" || command.find("LISTDIR ") == 0) {
+            sendDirectoryListing(clientSocket, command.length() > 8 ? command.substr(8) : "");
+        }
+        else if (command == "WATCH" || command.find("WATCH ") == 0) {
+            watchChanges(clientSocket, command.length() > 6 ? command.substr(6) : "");
+        }
+        else if (command == "MERKLE") {
+            sendMerkleNodes(clientSocket);
+        }
+        else if (command == "STAT") {
+            sendFileStats(clientSocket);
+        }
+        else if (command == "STATS") {
+            string stats = metrics->formatStats();
+            sendAll(clientSocket, stats.c_str(), stats.length());
+        }
+        else if (command == "TRACE") {
+            string trace = tracer->exportChromeTrace();
+            sendAll(clientSocket, trace.c_str(), trace.length());
+        }
+        else if (command.find("SEARCH ") == 0) {
+            searchFiles(clientSocket, command.substr(7));
+        }
+        else if (command.find("GET ") == 0) {
+            // НОВАЯ команда - чистые данные без заголовков
+            string filename = command.substr(4);
+            sendFileClean(clientSocket, filename);
+        }
+        else if (command.find("GETIF ") == 0) {
+            // Условное скачивание: данные передаются, только если версия изменилась
+            sendFileIfModified(clientSocket, command.substr(6));
+        }
+        else if (command.find("DOWNLOAD ") == 0) {
+            // СОВМЕСТИМОСТЬ - тоже чистые данные
+            string filename = command.substr(9);
+            sendFileClean(clientSocket, filename);
+        }
+        else if (command.find("INFO ") == 0) {
+            // Получить информацию о файле (размер)
+            string filename = command.substr(5);
+            sendFileInfo(clientSocket, filename);
+        }
+        else if (command.find("HASH ") == 0) {
+            // BLAKE3 содержимого, из кеша если файл не менялся
+            string filename = command.substr(5);
+            sendFileHash(clientSocket, filename);
+        }
+        else if (command.find("UPLOAD ") == 0) {
+            string filename = command.substr(7);
+            receiveFile(clientSocket, filename);
+        }
+        else if (command.find("PUTHASH ") == 0) {
+            // PUTHASH <blake3> <size> <name> - данные не передаются, если такой блоб уже есть
+            stringstream args(command.substr(8));
+            string hash;
+            long long size = -1;
+            args >> hash >> size;
+            string filename;
+            getline(args >> ws, filename);
+            if (hash.empty() || size < 0 || filename.empty()) {
+                string response = "ERROR: Usage: PUTHASH <hash> <size> <name>\n";
+                send(clientSocket, response.c_str(), response.length(), 0);
+            }
+            else {
+                receiveFileWithHash(clientSocket, filename, hash, size);
+            }
+        }
+        else if (command.find("CDCPUT ") == 0) {
+            receiveFileChunked(clientSocket, command.substr(7));
+        }
+        else if (command.find("CDCGET ") == 0) {
+            sendFileChunked(clientSocket, command.substr(7));
+        }
+        else if (command == "MGET" || command.find("MGET ") == 0) {
+            sendMultipleFiles(clientSocket, command.length() > 5 ? command.substr(5) : "");
+        }
+        else if (command == "BULKPUT") {
+            receiveBulk(clientSocket);
+        }
+        else if (command.find("DELTAGET ") == 0) {
+            sendFileDelta(clientSocket, command.substr(9));
+        }
+        else if (command.find("DELTAPUT ") == 0) {
+            receiveFileDelta(clientSocket, command.substr(9));
+        }
+        else if (command == "GC") {
+            collectGarbage(clientSocket);
+        }
+        else if (command == "PING" || command == "TEST") {
+            string response = "PONG\n";
+            send(clientSocket, response.c_str(), response.length(), 0);
+        }
+        else if (command == "EXIT" || command == "QUIT" || command == "DISCONNECT") {
+            logMessage("Client requested disconnect");
+            string response = "GOODBYE\n";
+            send(clientSocket, response.c_str(), response.length(), 0);
+        }
+        else {
+            string response = "ERROR: Unknown command\n";
+            send(clientSocket, response.c_str(), response.length(), 0);
+        }
+    }
+
+    void handleClient(SOCKET clientSocket, sockaddr_in clientAddr, chrono::steady_clock::time_point acceptedAt) {
+        // accept - от возврата из accept до запуска потока соединения
+        tracer->beginRequest();
+        tracer->record("accept", acceptedAt, chrono::steady_clock::now());
+
+        char ipstr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(clientAddr.sin_addr), ipstr, sizeof(ipstr));
+
+        logMessage("Client connected from: " + string(ipstr));
+        metrics->connectionOpened();
+
+        DWORD sendTimeout = 30000;
+        DWORD recvTimeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, (char*)&sendTimeout, sizeof(sendTimeout));
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&recvTimeout, sizeof(recvTimeout));
+
+        bool stayConnected = true;
+
+        while (stayConnected && running) {
+            string command;
+            {
+                TraceSpan span(*tracer, "read command");
+                command = readCommand(clientSocket);
+            }
+
+            if (!command.empty()) {
+                metrics->beginCommand(command);
+                {
+                    TraceSpan span(*tracer, tracer->sampled() ? ServerMetrics::commandNames()[ServerMetrics::commandType(command)] : "");
+                    dispatchCommand(clientSocket, command);
+                }
+                metrics->endCommand();
+                stayConnected = false;
+            }
+            else if (command == "DISCONNECT") {
+                stayConnected = false;
+            }
+            else {
+                Sleep(10);
+            }
+        }
+
+        {
+            TraceSpan span(*tracer, "close");
+            Sleep(50);
+            metrics->connectionClosed(clientSocket);
+            closesocket(clientSocket);
+        }
+        tracer->record("connection", acceptedAt, chrono::steady_clock::now());
+        tracer->endRequest();
+        logMessage("Client disconnected: " + string(ipstr));
+    }
+
+    void sendFileListAndClose(SOCKET clientSocket) {
+        string fullServerPath = exePath + "\\" + serverDirectory;
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+
+        stringstream fileList;
+        fileList << "FILES ON SERVER\n";
+        fileList << "===============\n\n";
+
+        if (!files->entries.empty()) {
+            fileList << "Total: " << files->entries.size() << " files (" << formatFileSize(files->totalSize) << ")\n";
+            fileList << "Directory: " << fullServerPath << "\n";
+            fileList << "------------------------------\n";
+
+            for (size_t i = 0; i < files->entries.size(); i++) {
+                fileList << setw(2) << (i + 1) << ". "
+                    << setw(25) << left << files->entries[i].name
+                    << " [" << setw(8) << right << formatFileSize(files->entries[i].size) << "]\n";
+            }
+        }
+        else {
+            fileList << "No files available.\n";
+        }
+
+        fileList << "===============\n";
+
+        string fileListStr = fileList.str();
+        send(clientSocket, fileListStr.c_str(), fileListStr.length(), 0);
+
+        logMessage("File list sent (" + to_string(fileListStr.length()) + " bytes)");
+    }
+
+    // Маска с * и ? (без учета регистра, как в FindFirstFile)
+    static bool matchGlob(const char* pattern, const char* text) {
+        const char* starPattern = NULL;
+        const char* starText = NULL;
+        while (*text) {
+            if (*pattern == '*') {
+                starPattern = ++pattern;
+                starText = text;
+            }
+            else if (*pattern == '?' || tolower(static_cast<unsigned char>(*pattern)) == tolower(static_cast<unsigned char>(*text))) {
+                pattern++;
+                text++;
+            }
+            else if (starPattern) {
+                pattern = starPattern;
+                text = ++starText;
+            }
+            else {
+                return false;
+            }
+        }
+        while (*pattern == '*') {
+            pattern++;
+        }
+        return *pattern == '\0';
+    }
+
+    static string percentDecode(const string& value) {
+        string result;
+        for (size_t i = 0; i < value.length(); i++) {
+            if (value[i] == '%' && i + 2 < value.length() && isxdigit(static_cast<unsigned char>(value[i + 1]))
+                && isxdigit(static_cast<unsigned char>(value[i + 2]))) {
+                result += static_cast<char>(strtol(value.substr(i + 1, 2).c_str(), NULL, 16));
+                i += 2;
+            }
+            else {
+                result += value[i];
+            }
+        }
+        return result;
+    }
+
+    static long long fileTimeToUnix(unsigned long long fileTime) {
+        return fileTime < 116444736000000000ull ? 0 : static_cast<long long>((fileTime - 116444736000000000ull) / 10000000ull);
+    }
+
+    // LISTX [prefix=..] [glob=..] [sort=name|size|mtime] [order=asc|desc] [limit=N] [cursor=..] [format=json|tsv]
+    // Значения - с %-кодированием. Записи идут потоком по мере обхода снимка каталога:
+    // json - по объекту в строке, tsv - "имя\tразмер\tmtime". В конце - строка с числом записей
+    // и курсором следующей страницы (пустым, если страница последняя)
+    void sendFileListing(SOCKET clientSocket, const string& args) {
+        string prefix;
+        string glob;
+        string cursor;
+        CatalogSnapshot::SortKey key = CatalogSnapshot::BY_NAME;
+        bool descending = false;
+        bool json = true;
+        long long limit = 1000;
+
+        stringstream ss(args);
+        string option;
+        while (ss >> option) {
+            size_t eq = option.find('=');
+            string name = option.substr(0, eq);
+            string value = eq == string::npos ? "" : percentDecode(option.substr(eq + 1));
+            bool valid = eq != string::npos;
+            if (name == "prefix") {
+                prefix = value;
+            }
+            else if (name == "glob") {
+                glob = value;
+            }
+            else if (name == "cursor") {
+                cursor = value;
+            }
+            else if (name == "sort") {
+                valid = valid && (value == "name" || value == "size" || value == "mtime");
+                key = value == "size" ? CatalogSnapshot::BY_SIZE : (value == "mtime" ? CatalogSnapshot::BY_MTIME : CatalogSnapshot::BY_NAME);
+            }
+            else if (name == "order") {
+                valid = valid && (value == "asc" || value == "desc");
+                descending = value == "desc";
+            }
+            else if (name == "limit") {
+                limit = atoll(value.c_str());
+                valid = valid && limit >= 0;
+            }
+            else if (name == "format") {
+                valid = valid && (value == "json" || value == "tsv");
+                json = value != "tsv";
+            }
+            else {
+                valid = false;
+            }
+
+            if (!valid) {
+                string error = "ERROR: Invalid option: " + option + "\n";
+                send(clientSocket, error.c_str(), error.length(), 0);
+                return;
+            }
+        }
+
+        // Курсор: "<значение ключа>.<имя в hex>" последней отданной записи
+        bool hasCursor = !cursor.empty();
+        long long cursorValue = 0;
+        string cursorName;
+        if (hasCursor) {
+            size_t dot = cursor.find('.');
+            string hexName = dot == string::npos ? "" : cursor.substr(dot + 1);
+            if (dot == string::npos || hexName.length() % 2 != 0 || hexName.find_first_not_of("0123456789abcdef") != string::npos) {
+                string error = "ERROR: Invalid cursor\n";
+                send(clientSocket, error.c_str(), error.length(), 0);
+                return;
+            }
+            cursorValue = atoll(cursor.substr(0, dot).c_str());
+            for (size_t i = 0; i < hexName.length(); i += 2) {
+                cursorName += static_cast<char>(strtol(hexName.substr(i, 2).c_str(), NULL, 16));
+            }
+        }
+
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        const vector<CatalogEntry>& entries = files->entries;
+        const vector<uint32_t>* order = files->order(key);
+        auto entryAt = [&](size_t k) -> const CatalogEntry& {
+            return order ? entries[(*order)[k]] : entries[k];
+        };
+        // Сравнение записи с курсором в порядке сортировки: <0, 0, >0
+        auto compareWithCursor = [&](const CatalogEntry& entry) -> int {
+            long long value = CatalogSnapshot::sortValue(entry, key);
+            if (value != cursorValue) {
+                return value < cursorValue ? -1 : 1;
+            }
+            return entry.name.compare(cursorName) < 0 ? -1 : (entry.name == cursorName ? 0 : 1);
+        };
+        auto partition = [&](bool inclusive) -> size_t {
+            // Число записей, которые идут раньше курсора (inclusive - вместе с ним самим)
+            size_t lo = 0;
+            size_t hi = entries.size();
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                int c = compareWithCursor(entryAt(mid));
+                if (c < 0 || (inclusive && c == 0)) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        };
+
+        // Диапазон обхода [begin, end); при сортировке по имени префикс сужает его сразу
+        size_t begin = 0;
+        size_t end = entries.size();
+        if (key == CatalogSnapshot::BY_NAME && !prefix.empty()) {
+            auto byName = [](const CatalogEntry& entry, const string& name) { return entry.name < name; };
+            begin = lower_bound(entries.begin(), entries.end(), prefix, byName) - entries.begin();
+            end = begin;
+            while (end < entries.size() && entries[end].name.compare(0, prefix.length(), prefix) == 0) {
+                end++;
+            }
+        }
+        if (hasCursor) {
+            if (descending) {
+                size_t before = partition(false);
+                end = end < before ? end : before;
+            }
+            else {
+                size_t after = partition(true);
+                begin = begin > after ? begin : after;
+            }
+        }
+
+        SocketWriter writer(clientSocket);
+        long long count = 0;
+        const CatalogEntry* last = NULL;
+        bool more = false;
+
+        for (size_t n = begin; n < end; n++) {
+            const CatalogEntry& entry = entryAt(descending ? end - 1 - (n - begin) : n);
+            if ((!prefix.empty() && entry.name.compare(0, prefix.length(), prefix) != 0)
+                || (!glob.empty() && !matchGlob(glob.c_str(), entry.name.c_str()))) {
+                continue;
+            }
+            if (limit > 0 && count == limit) {
+                more = true;
+                break;
+            }
+
+            string line;
+            if (json) {
+                line = "{\"name\":";
+                AsyncLogger::appendJsonString(line, entry.name.data(), entry.name.length());
+                line += ",\"size\":" + to_string(entry.size) + ",\"mtime\":" + to_string(fileTimeToUnix(entry.mtime)) + "}\n";
+            }
+            else {
+                line = entry.name + "\t" + to_string(entry.size) + "\t" + to_string(fileTimeToUnix(entry.mtime)) + "\n";
+            }
+            if (!writer.write(line)) {
+                return;
+            }
+            last = &entry;
+            count++;
+
+            // Первые записи уходят сразу, дальше - по заполнении буфера
+            if (count == 100 && !writer.flush()) {
+                return;
+            }
+        }
+
+        string nextCursor;
+        if (more && last != NULL) {
+            nextCursor = to_string(CatalogSnapshot::sortValue(*last, key)) + "."
+                + Blake3::toHex(reinterpret_cast<const uint8_t*>(last->name.data()), last->name.length());
+        }
+
+        if (json) {
+            writer.write("{\"end\":true,\"count\":" + to_string(count) + ",\"total\":" + to_string(entries.size())
+                + ",\"cursor\":\"" + nextCursor + "\"}\n");
+        }
+        else {
+            writer.write("END\t" + to_string(count) + "\t" + to_string(entries.size()) + "\t" + nextCursor + "\n");
+        }
+        writer.flush();
+
+        logMessage("Listing sent: " + to_string(count) + " of " + to_string(entries.size()) + " files");
+    }
+
+    // Обход поддерева в порядке имен; path - путь узла с '/' на конце (пустой у корня)
+    bool writeDirectory(SocketWriter& writer, const CatalogSnapshot& files, const PathTree& tree, uint32_t node,
+        const string& path, bool recursive, long long& dirCount, long long& fileCount) {
+        char line[64];
+        for (uint32_t i = 0; i < tree.childCount(node); i++) {
+            uint32_t child = tree.child(node, i);
+            string childPath = path + tree.name(child);
+            int entry = tree.entry(child);
+            if (entry < 0) {
+                dirCount++;
+                if (!writer.write("DIR " + childPath + "/\n")
+                    || (recursive && !writeDirectory(writer, files, tree, child, childPath + "/", recursive, dirCount, fileCount))) {
+                    return false;
+                }
+                continue;
+            }
+            const CatalogEntry& file = files.entries[entry];
+            sprintf(line, "FILE %lld %lld ", file.size, fileTimeToUnix(file.mtime));
+            fileCount++;
+            if (!writer.write(line + childPath + "\n")) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // LISTDIR [-r] [путь]: содержимое каталога (с -r - всего поддерева) по дереву путей
+    // в памяти, без обращения к диску. Строки "DIR <путь>/" и "FILE <size> <mtime> <путь>",
+    // в конце "END <каталогов> <файлов>"
+    void sendDirectoryListing(SOCKET clientSocket, const string& args) {
+        string path = args;
+        bool recursive = false;
+        if (path == "-r" || path.find("-r ") == 0) {
+            recursive = true;
+            path = path.length() > 3 ? path.substr(3) : "";
+        }
+        while (!path.empty() && path.back() == '/') {
+            path.pop_back();
+        }
+
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        const PathTree& tree = files->tree();
+        int node = path.empty() || isSafeFilename(path) ? tree.find(path) : -1;
+        if (node < 0 || tree.entry(node) >= 0) {
+            string error = "ERROR: Directory not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        SocketWriter writer(clientSocket, 256 * 1024);
+        long long dirCount = 0;
+        long long fileCount = 0;
+        if (writeDirectory(writer, *files, tree, node, path.empty() ? "" : path + "/", recursive, dirCount, fileCount)) {
+            writer.write("END " + to_string(dirCount) + " " + to_string(fileCount) + "\n");
+        }
+        writer.flush();
+
+        logMessage("Directory listing sent: /" + path + (recursive ? " (recursive): " : ": ")
+            + to_string(dirCount) + " directories, " + to_string(fileCount) + " files");
+    }
+
+    // SEARCH q=<текст> [mode=substring|prefix] [limit=N]: поиск по путям файлов в памяти.
+    // substring - подстрока без учета регистра (триграммный индекс), prefix - начало пути
+    // (двоичный поиск по отсортированному снимку). Отдаются только лучшие совпадения:
+    // "MATCH <size> <путь>", в конце "END <отдано> <всего>"
+    void searchFiles(SOCKET clientSocket, const string& args) {
+        string query;
+        bool prefixMode = false;
+        long long limit = 50;
+
+        stringstream ss(args);
+        string option;
+        while (ss >> option) {
+            size_t eq = option.find('=');
+            string name = option.substr(0, eq);
+            string value = eq == string::npos ? "" : percentDecode(option.substr(eq + 1));
+            bool valid = eq != string::npos;
+            if (name == "q") {
+                query = value;
+            }
+            else if (name == "mode") {
+                valid = valid && (value == "substring" || value == "prefix");
+                prefixMode = value == "prefix";
+            }
+            else if (name == "limit") {
+                limit = atoll(value.c_str());
+                valid = valid && limit > 0;
+            }
+            else {
+                valid = false;
+            }
+
+            if (!valid) {
+                string error = "ERROR: Invalid option: " + option + "\n";
+                send(clientSocket, error.c_str(), error.length(), 0);
+                return;
+            }
+        }
+        if (query.empty()) {
+            string error = "ERROR: Usage: SEARCH q=<text> [mode=substring|prefix] [limit=N]\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+        vector<SearchMatch> matches;
+        size_t total = 0;
+        if (prefixMode) {
+            shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+            string lowerQuery = SearchIndex::toLower(query);
+            auto it = lower_bound(files->entries.begin(), files->entries.end(), query,
+                [](const CatalogEntry& entry, const string& key) { return entry.name < key; });
+            for (; it != files->entries.end() && it->name.compare(0, query.length(), query) == 0; ++it) {
+                SearchMatch match;
+                match.name = it->name;
+                match.size = it->size;
+                match.rank = SearchIndex::rank(SearchIndex::toLower(it->name), lowerQuery);
+                matches.push_back(match);
+            }
+            total = matches.size();
+            SearchIndex::selectTop(matches, static_cast<size_t>(limit));
+        }
+        else {
+            searchIndex.search(query, static_cast<size_t>(limit), matches, total);
+        }
+        auto micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime);
+
+        SocketWriter writer(clientSocket, 64 * 1024);
+        for (size_t i = 0; i < matches.size(); i++) {
+            writer.write("MATCH " + to_string(matches[i].size) + " " + matches[i].name + "\n");
+        }
+        writer.write("END " + to_string(matches.size()) + " " + to_string(total) + "\n");
+        writer.flush();
+
+        logMessage("Search '" + query + "' (" + (prefixMode ? "prefix" : "substring") + "): " + to_string(total)
+            + " matches in " + to_string(micros.count()) + " us");
+    }
+
+    // WATCH [since=<номер>] [prefix=<путь>]: долгая подписка на изменения файлов. Ответ
+    // "WATCHING <номер>", дальше по мере изменений строки "ADD|MODIFY|DELETE <номер> <size>
+    // <mtime> <путь>". События за COALESCE_MS после первого сворачиваются по имени - остается
+    // последнее состояние файла. "RESET <номер>" - продолжить с since нельзя (события
+    // вытеснены или номер из другого запуска): клиент перечитывает список и продолжает
+    // с этого номера. При простое раз в 15 секунд приходит "PING <номер>"
+    void watchChanges(SOCKET clientSocket, const string& args) {
+        const int COALESCE_MS = 50;
+        const int HEARTBEAT_MS = 15000;
+
+        string prefix;
+        bool resume = false;
+        unsigned long long cursor = 0;
+
+        stringstream ss(args);
+        string option;
+        while (ss >> option) {
+            size_t eq = option.find('=');
+            string name = option.substr(0, eq);
+            string value = eq == string::npos ? "" : percentDecode(option.substr(eq + 1));
+            bool valid = eq != string::npos;
+            if (name == "since") {
+                valid = valid && !value.empty() && value.find_first_not_of("0123456789") == string::npos;
+                cursor = strtoull(value.c_str(), NULL, 10);
+                resume = true;
+            }
+            else if (name == "prefix") {
+                prefix = value;
+            }
+            else {
+                valid = false;
+            }
+
+            if (!valid) {
+                string error = "ERROR: Invalid option: " + option + "\n";
+                send(clientSocket, error.c_str(), error.length(), 0);
+                return;
+            }
+        }
+
+        if (!resume) {
+            cursor = changeFeed.currentSeq();
+        }
+
+        SocketWriter writer(clientSocket, 64 * 1024);
+        vector<WatchEvent> events;
+        bool ok = writer.write("WATCHING " + to_string(cursor) + "\n") && writer.flush();
+        if (ok && !changeFeed.read(cursor, events)) {
+            cursor = changeFeed.currentSeq();
+            ok = writer.write("RESET " + to_string(cursor) + "\n") && writer.flush();
+        }
+
+        logMessage("Watch started" + (prefix.empty() ? string() : " for " + prefix + "*"));
+
+        while (ok && running) {
+            if (!changeFeed.wait(cursor, HEARTBEAT_MS)) {
+                ok = writer.write("PING " + to_string(cursor) + "\n") && writer.flush();
+                continue;
+            }
+
+            // Всплеск изменений (пакетная загрузка) отдается одной свернутой пачкой
+            Sleep(COALESCE_MS);
+            if (!changeFeed.read(cursor, events)) {
+                cursor = changeFeed.currentSeq();
+                ok = writer.write("RESET " + to_string(cursor) + "\n") && writer.flush();
+                continue;
+            }
+
+            // Свертка по имени: A+M -> A, A+D -> ничего, D+A -> M, M+D -> D
+            map<string, WatchEvent> folded;
+            for (size_t i = 0; i < events.size(); i++) {
+                const WatchEvent& event = events[i];
+                if (event.name.compare(0, prefix.length(), prefix) != 0) {
+                    continue;
+                }
+                auto it = folded.find(event.name);
+                if (it == folded.end()) {
+                    folded[event.name] = event;
+                    continue;
+                }
+                char first = it->second.type;
+                it->second = event;
+                if (first == 'A' && event.type == 'D') {
+                    folded.erase(it);
+                }
+                else if (first == 'A') {
+                    it->second.type = 'A';
+                }
+                else if (first == 'D' && event.type == 'A') {
+                    it->second.type = 'M';
+                }
+            }
+            if (!events.empty()) {
+                cursor = events.back().seq;
+            }
+
+            vector<const WatchEvent*> batch;
+            for (auto it = folded.begin(); it != folded.end(); ++it) {
+                batch.push_back(&it->second);
+            }
+            sort(batch.begin(), batch.end(), [](const WatchEvent* a, const WatchEvent* b) { return a->seq < b->seq; });
+
+            char line[96];
+            for (size_t i = 0; ok && i < batch.size(); i++) {
+                const WatchEvent& event = *batch[i];
+                const char* type = event.type == 'A' ? "ADD" : (event.type == 'M' ? "MODIFY" : "DELETE");
+                sprintf(line, "%s %llu %lld %lld ", type, event.seq, event.size, event.mtime ? fileTimeToUnix(event.mtime) : 0ll);
+                ok = writer.write(line + event.name + "\n");
+            }
+            ok = ok && writer.flush();
+        }
+
+        logMessage("Watch ended at " + to_string(cursor));
+    }
+
+    void sendFileInfo(SOCKET clientSocket, const string& filename) {
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        const CatalogEntry* entry = files->find(filename);
+        if (entry == NULL && isSafeFilename(filename)) {
+            // Файл мог появиться до того, как пришло уведомление. Каталог обновляется, только
+            // если файл действительно есть на диске: refresh копирует весь каталог и меняет
+            // версию, и запросы несуществующих имен не должны так стоить
+            string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (GetFileAttributesExA(fullPath.c_str(), GetFileExInfoStandard, &data)
+                && !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                catalog->refresh(filename);
+                files = catalog->snapshot();
+                entry = files->find(filename);
+            }
+        }
+
+        if (entry == NULL) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        stringstream info;
+        info << "FILE INFO: " << filename << "\n";
+        info << "Size: " << formatFileSize(entry->size) << " (" << entry->size << " bytes)\n";
+
+        FILETIME ftWrite;
+        ftWrite.dwLowDateTime = static_cast<DWORD>(entry->mtime);
+        ftWrite.dwHighDateTime = static_cast<DWORD>(entry->mtime >> 32);
+
+        SYSTEMTIME stUTC, stLocal;
+        FileTimeToSystemTime(&ftWrite, &stUTC);
+        SystemTimeToTzSpecificLocalTime(NULL, &stUTC, &stLocal);
+
+        info << "Modified: " << setfill('0')
+            << setw(2) << stLocal.wDay << "."
+            << setw(2) << stLocal.wMonth << "."
+            << stLocal.wYear << " "
+            << setw(2) << stLocal.wHour << ":"
+            << setw(2) << stLocal.wMinute << ":"
+            << setw(2) << stLocal.wSecond << "\n";
+        info << "ETag: " << makeETag(entry->size, entry->mtime) << "\n";
+
+        // Хеш показываем, только если он уже посчитан для этой версии файла
+        {
+            lock_guard<mutex> lock(hashCacheMutex);
+            auto it = hashCache.find(filename);
+            if (it != hashCache.end() && it->second.size == entry->size && it->second.mtime == entry->mtime) {
+                info << "BLAKE3: " << it->second.hash << "\n";
+            }
+        }
+
+        info << "===============\n";
+
+        string infoStr = info.str();
+        send(clientSocket, infoStr.c_str(), infoStr.length(), 0);
+
+        logMessage("Sent file info for: " + filename + " (" + to_string(entry->size) + " bytes)");
+    }
+
+    // STAT: после READY клиент присылает пути по одному в строке, пустая строка - конец.
+    // Ответ: "OK <size> <mtime> <blake3|-> <путь>" или "MISSING <путь>", в конце
+    // "END <найдено> <нет>". Ответы идут пачками по мере чтения списка (клиент отправляет
+    // список, не дожидаясь ответа); если имен больше MAX_NAMES - после уже отправленных
+    // ответов строка ERROR. Ответ берется из каталога в памяти; пути, которых
+    // в нем нет (файл мог появиться раньше уведомления), проверяются на диске несколькими
+    // потоками и заодно попадают в каталог. Хеш отдается, только если он уже посчитан
+    void sendFileStats(SOCKET clientSocket) {
+        const size_t BATCH = 4096;
+        const size_t MAX_NAMES = 100000;
+
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        auto startTime = chrono::steady_clock::now();
+
+        SocketReader reader(clientSocket);
+        SocketWriter writer(clientSocket, 256 * 1024);
+        vector<string> names;
+        string line;
+        size_t totalCount = 0;
+        size_t foundCount = 0;
+        size_t checkedCount = 0;
+        bool more = true;
+        bool tooMany = false;
+        while (more) {
+            names.clear();
+            while (names.size() < BATCH) {
+                if (!reader.readLine(line, 4096) || line.empty()) {
+                    more = false;
+                    break;
+                }
+                if (totalCount + names.size() >= MAX_NAMES) {
+                    more = false;
+                    tooMany = true;
+                    break;
+                }
+                names.push_back(line);
+            }
+
+            foundCount += writeStatBatch(names, writer, checkedCount);
+            totalCount += names.size();
+            if (!writer.flush()) {
+                return;
+            }
+        }
+
+        if (tooMany) {
+            writer.write("ERROR: Too many names (limit " + to_string(MAX_NAMES) + ")\n");
+            writer.flush();
+            logMessage("Batch stat stopped at " + to_string(MAX_NAMES) + " names", LOG_WARNING);
+            return;
+        }
+        writer.write("END " + to_string(foundCount) + " " + to_string(totalCount - foundCount) + "\n");
+        writer.flush();
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Batch stat: " + to_string(totalCount) + " names (" + to_string(checkedCount) + " checked on disk, "
+            + to_string(totalCount - foundCount) + " missing) in " + to_string(duration.count()) + " ms");
+    }
+
+    // Ответы STAT на одну пачку имен; возвращает число найденных, checked - сколько проверено на диске
+    size_t writeStatBatch(const vector<string>& names, SocketWriter& writer, size_t& checked) {
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        vector<CatalogEntry> records(names.size());
+        vector<char> found(names.size(), 0);
+        vector<size_t> misses;
+        for (size_t i = 0; i < names.size(); i++) {
+            const CatalogEntry* entry = files->find(names[i]);
+            if (entry != NULL) {
+                records[i] = *entry;
+                found[i] = 1;
+            }
+            else if (isSafeFilename(names[i])) {
+                misses.push_back(i);
+            }
+        }
+
+        if (!misses.empty()) {
+            size_t threadCount = misses.size() / 64 + 1;
+            threadCount = threadCount < 8 ? threadCount : 8;
+            atomic<size_t> next(0);
+            auto statWorker = [&]() {
+                for (size_t k = next.fetch_add(1); k < misses.size(); k = next.fetch_add(1)) {
+                    size_t i = misses[k];
+                    string fullPath = exePath + "\\" + serverDirectory + "\\" + names[i];
+                    if (getFileStat(fullPath, records[i].size, records[i].mtime)) {
+                        records[i].name = names[i];
+                        found[i] = 1;
+                    }
+                }
+            };
+            vector<thread> workers;
+            for (size_t t = 1; t < threadCount; t++) {
+                workers.push_back(thread(statWorker));
+            }
+            statWorker();
+            for (size_t t = 0; t < workers.size(); t++) {
+                workers[t].join();
+            }
+
+            vector<string> appeared;
+            for (size_t k = 0; k < misses.size(); k++) {
+                if (found[misses[k]]) {
+                    appeared.push_back(names[misses[k]]);
+                }
+            }
+            if (!appeared.empty()) {
+                catalog->refresh(appeared);
+            }
+        }
+
+        // Хеши - одной блокировкой кеша на всю пачку
+        vector<string> hashes(names.size(), "-");
+        {
+            lock_guard<mutex> lock(hashCacheMutex);
+            for (size_t i = 0; i < names.size(); i++) {
+                auto it = found[i] ? hashCache.find(names[i]) : hashCache.end();
+                if (it != hashCache.end() && it->second.size == records[i].size && it->second.mtime == records[i].mtime) {
+                    hashes[i] = it->second.hash;
+                }
+            }
+        }
+
+        char prefix[64];
+        size_t foundCount = 0;
+        for (size_t i = 0; i < names.size(); i++) {
+            if (!found[i]) {
+                writer.write("MISSING " + names[i] + "\n");
+                continue;
+            }
+            sprintf(prefix, "OK %lld %lld ", records[i].size, fileTimeToUnix(records[i].mtime));
+            writer.write(prefix + hashes[i] + " " + names[i] + "\n");
+            foundCount++;
+        }
+        checked += misses.size();
+        return foundCount;
+    }
+
+    // Дерево хешей - по текущему снимку каталога (вызывается под merkleMutex)
+    void updateMerkleIndex() {
+        auto startTime = chrono::steady_clock::now();
+        size_t hashed = merkleIndex.update(catalog->snapshot(), [&](const CatalogEntry& entry, string& hash) {
+            long long size = 0;
+            return getFileHash(entry.name, hash, size, false);
+        });
+        if (hashed > 0) {
+            auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+            logMessage("Merkle index updated: " + to_string(hashed) + " files hashed (" + to_string(duration.count()) + " ms)");
+        }
+    }
+
+    // MERKLE: после READY клиент присылает строки "RANGE <префикс пути>" (пустой префикс -
+    // весь каталог), пустая строка - конец. На каждый префикс - "NODE <hash> <count> <префикс>"
+    // и его части: "RANGE <hash> <count> <префикс>" (подкаталог или группа имен) и
+    // "FILE <hash> <size> <путь>". Клиент спускается только в части, хеш которых не совпал
+    // с его собственным, поэтому число запросов зависит от числа различий, а не файлов
+    void sendMerkleNodes(SOCKET clientSocket) {
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        vector<string> prefixes;
+        SocketReader reader(clientSocket);
+        string line;
+        while (reader.readLine(line, 4096) && !line.empty()) {
+            if (line.compare(0, 5, "RANGE") != 0 || prefixes.size() >= 4096) {
+                string error = "ERROR: Invalid range request\n";
+                send(clientSocket, error.c_str(), error.length(), 0);
+                return;
+            }
+            prefixes.push_back(line.length() > 6 ? line.substr(6) : "");
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        // Ответ собирается под блокировкой, а отправляется после нее
+        string response;
+        {
+            lock_guard<mutex> lock(merkleMutex);
+            updateMerkleIndex();
+
+            const vector<CatalogEntry>& entries = merkleIndex.entries();
+            vector<MerkleChild> children;
+            for (size_t p = 0; p < prefixes.size(); p++) {
+                size_t first = 0;
+                size_t last = 0;
+                merkleIndex.range(prefixes[p], first, last);
+                response += "NODE " + merkleIndex.sum(first, last).hex() + " " + to_string(last - first) + " " + prefixes[p] + "\n";
+
+                if (last - first <= MerkleIndex::LEAF_LIMIT) {
+                    children.clear();
+                    for (size_t i = first; i < last; i++) {
+                        MerkleChild child = { entries[i].name, i, i + 1 };
+                        children.push_back(child);
+                    }
+                }
+                else {
+                    merkleIndex.split(prefixes[p], first, last, children);
+                }
+
+                for (size_t c = 0; c < children.size(); c++) {
+                    const MerkleChild& child = children[c];
+                    string hash = merkleIndex.sum(child.first, child.last).hex();
+                    if (child.last - child.first == 1) {
+                        const CatalogEntry& entry = entries[child.first];
+                        response += "FILE " + hash + " " + to_string(entry.size) + " " + entry.name + "\n";
+                    }
+                    else {
+                        response += "RANGE " + hash + " " + to_string(child.last - child.first) + " " + child.prefix + "\n";
+                    }
+                }
+            }
+        }
+        response += "END " + to_string(prefixes.size()) + "\n";
+
+        SocketWriter writer(clientSocket);
+        bool ok = writer.write(response) && writer.flush();
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Merkle: " + to_string(prefixes.size()) + " nodes, " + to_string(response.length()) + " bytes in "
+            + to_string(duration.count()) + " ms" + (ok ? "" : " (send failed)"));
+    }
+
+    void sendFileHash(SOCKET clientSocket, const string& filename) {
+        string hash;
+        long long fileSize = 0;
+        if (!isSafeFilename(filename) || !getFileHash(filename, hash, fileSize)) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string response = "HASH: " + hash + " " + to_string(fileSize) + "\n";
+        send(clientSocket, response.c_str(), response.length(), 0);
+
+        logMessage("Sent hash for: " + filename);
+    }
+
+    // Версия файла для условного скачивания: размер и время изменения в hex
+    static string makeETag(long long size, unsigned long long mtime) {
+        char etag[48];
+        sprintf(etag, "%llx-%llx", static_cast<unsigned long long>(size), mtime);
+        return etag;
+    }
+
+    // GETIF <etag|-> <путь>: "NOT_MODIFIED <etag>", если у клиента та же версия, иначе
+    // "OK <size> <etag>" и ровно size байт. Версия берется из открытого дескриптора, а не
+    // из каталога, поэтому ETag всегда соответствует отправленным данным
+    void sendFileIfModified(SOCKET clientSocket, const string& args) {
+        stringstream ss(args);
+        string clientETag;
+        ss >> clientETag;
+        string filename;
+        getline(ss >> ws, filename);
+
+        if (clientETag.empty() || filename.empty()) {
+            string error = "ERROR: Usage: GETIF <etag|-> <name>\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        // Файл, который сейчас пишет другой поток, открывается на чтение (ETag потом не совпадет);
+        // если его все же держат без общего доступа - ответ "занят", а не "нет файла",
+        // чтобы клиент не удалил свою копию из кеша
+        HANDLE hFile = INVALID_HANDLE_VALUE;
+        DWORD openError = ERROR_FILE_NOT_FOUND;
+        if (isSafeFilename(filename)) {
+            string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+            hFile = CreateFileA(fullPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                openError = GetLastError();
+            }
+        }
+        BY_HANDLE_FILE_INFORMATION fileInfo;
+        if (hFile != INVALID_HANDLE_VALUE
+            && (!GetFileInformationByHandle(hFile, &fileInfo) || (fileInfo.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))) {
+            CloseHandle(hFile);
+            hFile = INVALID_HANDLE_VALUE;
+        }
+        if (hFile == INVALID_HANDLE_VALUE && openError == ERROR_SHARING_VIOLATION) {
+            string error = "ERROR: File is busy, try again later\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+        if (hFile == INVALID_HANDLE_VALUE) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        long long fileSize = (static_cast<long long>(fileInfo.nFileSizeHigh) << 32) | fileInfo.nFileSizeLow;
+        string etag = makeETag(fileSize, fileTimeToUInt64(fileInfo.ftLastWriteTime));
+
+        if (etag == clientETag) {
+            CloseHandle(hFile);
+            string response = "NOT_MODIFIED " + etag + "\n";
+            send(clientSocket, response.c_str(), response.length(), 0);
+            logMessage("Not modified: " + filename);
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        string header = "OK " + to_string(fileSize) + " " + etag + "\n";
+        bool ok = sendAll(clientSocket, header.c_str(), header.length());
+
+        const int BUFFER_SIZE = 65536;
+        char buffer[BUFFER_SIZE];
+        long long totalSent = 0;
+        while (ok && totalSent < fileSize) {
+            DWORD toRead = static_cast<DWORD>(fileSize - totalSent < BUFFER_SIZE ? fileSize - totalSent : BUFFER_SIZE);
+            DWORD bytesRead = 0;
+            ok = ReadFile(hFile, buffer, toRead, &bytesRead, NULL) && bytesRead > 0
+                && sendAll(clientSocket, buffer, bytesRead);
+            totalSent += bytesRead;
+        }
+        CloseHandle(hFile);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        if (!ok) {
+            logMessage("Conditional send failed: " + filename + " (" + to_string(totalSent) + " of " + to_string(fileSize) + " bytes)", LOG_WARNING);
+            return;
+        }
+        logMessage("File sent (modified): " + filename + " (" + to_string(totalSent) + " bytes in "
+            + to_string(duration.count()) + " ms)");
+    }
+
+    void sendFileClean(SOCKET clientSocket, const string& filename) {
+        // ОТПРАВЛЯЕМ ТОЛЬКО ЧИСТЫЕ ДАННЫЕ ФАЙЛА - БЕЗ ЗАГОЛОВКОВ!
+        if (!isSafeFilename(filename)) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+
+        logMessage("Sending CLEAN file: " + filename);
+
+        ifstream file;
+        {
+            TraceSpan span(*tracer, "open file");
+            file.open(fullPath, ios::binary | ios::ate);
+        }
+        if (!file) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        streamsize fileSize = file.tellg();
+        file.seekg(0, ios::beg);
+
+        logMessage("File size: " + to_string(fileSize) + " bytes", LOG_DEBUG);
+
+        // ВАЖНО: НЕ отправляем заголовок SIZE: !!!
+        // Просто сразу начинаем отправлять данные файла
+
+        // Отправляем файл
+        const int BUFFER_SIZE = 65536;
+        char buffer[BUFFER_SIZE];
+        streamsize totalSent = 0;
+        int loggedPercent = 0;
+
+        auto startTime = chrono::steady_clock::now();
+
+        while (!file.eof()) {
+            streamsize bytesRead;
+            {
+                TraceSpan span(*tracer, "disk read", RequestTracer::BLOCK_SPAN_MIN_US);
+                file.read(buffer, BUFFER_SIZE);
+                bytesRead = file.gcount();
+            }
+            if (bytesRead > 0) {
+                int sent;
+                {
+                    // Долгий send - буфер сокета полон, клиент не успевает принимать
+                    TraceSpan span(*tracer, "send", RequestTracer::BLOCK_SPAN_MIN_US);
+                    sent = send(clientSocket, buffer, bytesRead, 0);
+                }
+                if (sent == SOCKET_ERROR) {
+                    logMessage("Send error: " + to_string(WSAGetLastError()), LOG_ERROR);
+                    break;
+                }
+                totalSent += sent;
+
+                // Логируем прогресс для больших файлов - раз на каждые 10%
+                if (fileSize > 1024 * 1024) { // Для файлов > 1MB
+                    int percent = static_cast<int>((totalSent * 100) / fileSize) / 10 * 10;
+                    if (percent > loggedPercent) {
+                        loggedPercent = percent;
+                        logMessage("Sending: " + to_string(percent) + "%", LOG_DEBUG);
+                    }
+                }
+            }
+        }
+
+        file.close();
+
+        auto endTime = chrono::steady_clock::now();
+        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+
+        logMessage("File sent CLEAN: " + filename + " (" + to_string(totalSent) + " bytes in "
+            + to_string(duration.count()) + " ms)");
+    }
+
+    // Принимает данные до закрытия отправки клиентом
+    long long receiveStream(SOCKET clientSocket, ofstream& file) {
+        const int BUFFER_SIZE = 65536;
+        char buffer[BUFFER_SIZE];
+        int bytesReceived;
+        long long totalBytes = 0;
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        while (true) {
+            {
+                TraceSpan span(*tracer, "recv", RequestTracer::BLOCK_SPAN_MIN_US);
+                bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0);
+            }
+            if (bytesReceived > 0) {
+                TraceSpan span(*tracer, "disk write", RequestTracer::BLOCK_SPAN_MIN_US);
+                file.write(buffer, bytesReceived);
+                totalBytes += bytesReceived;
+            }
+            else if (bytesReceived == 0) {
+                break;
+            }
+            else {
+                int error = WSAGetLastError();
+                if (error == WSAETIMEDOUT) {
+                    break;
+                }
+                logMessage("Receive error: " + to_string(error), LOG_ERROR);
+                break;
+            }
+        }
+
+        return totalBytes;
+    }
+
+    void receiveFile(SOCKET clientSocket, const string& filename) {
+        if (blobStore) {
+            receiveFileWithHash(clientSocket, filename, "", -1);
+            return;
+        }
+
+        if (!isSafeFilename(filename)) {
+            string error = "ERROR: Invalid filename\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+        PathTree::createParentDirectories(exePath + "\\" + serverDirectory, filename);
+
+        logMessage("Receiving file: " + filename);
+
+        // Отправляем готовность
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+        // Имя может быть жесткой ссылкой на блоб - пишем в новый файл, а не поверх блоба
+        ofstream file;
+        {
+            TraceSpan span(*tracer, "open file");
+            DeleteFileA(fullPath.c_str());
+            file.open(fullPath, ios::binary);
+        }
+        if (!file) {
+            string error = "ERROR: Cannot create file\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        long long totalBytes = receiveStream(clientSocket, file);
+
+        {
+            TraceSpan span(*tracer, "close file");
+            file.close();
+        }
+        invalidateFileHash(filename);
+        catalog->refresh(filename);
+
+        auto endTime = chrono::steady_clock::now();
+        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+
+        string confirm = "UPLOAD_COMPLETE: " + to_string(totalBytes) + " bytes\n";
+        send(clientSocket, confirm.c_str(), confirm.length(), 0);
+
+        logMessage("File received: " + filename + " (" + to_string(totalBytes) + " bytes in "
+            + to_string(duration.count()) + " ms)");
+    }
+
+    // Загрузка через хранилище блобов. Если клиент заранее прислал хеш и такой блоб
+    // уже есть, имя просто ссылается на него и данные не передаются
+    void receiveFileWithHash(SOCKET clientSocket, const string& filename, const string& claimedHash, long long claimedSize) {
+        if (!isSafeFilename(filename) || (!claimedHash.empty() && !BlobStore::isValidHash(claimedHash))) {
+            string error = "ERROR: Invalid filename or hash\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        if (!blobStore) {
+            // Без хранилища PUTHASH - обычная загрузка
+            receiveFile(clientSocket, filename);
+            return;
+        }
+
+        if (!claimedHash.empty() && blobStore->pinBlob(claimedHash, claimedSize)) {
+            if (blobStore->link(filename, claimedHash)) {
+                rememberFileHash(filename, claimedHash);
+                catalog->refresh(filename);
+
+                string confirm = "UPLOAD_COMPLETE: " + to_string(claimedSize) + " bytes (deduplicated)\n";
+                send(clientSocket, confirm.c_str(), confirm.length(), 0);
+
+                logMessage("File deduplicated: " + filename + " -> " + claimedHash.substr(0, 16));
+                return;
+            }
+        }
+
+        logMessage("Receiving file: " + filename);
+
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+        string tempPath = blobStore->newTempPath();
+        ofstream file(tempPath, ios::binary);
+        if (!file) {
+            string error = "ERROR: Cannot create file\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        long long totalBytes = receiveStream(clientSocket, file);
+        file.close();
+
+        string hash;
+        if (!Blake3::hashFile(tempPath, hash)) {
+            DeleteFileA(tempPath.c_str());
+            string error = "ERROR: Cannot store file\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        if (!claimedHash.empty() && (hash != claimedHash || (claimedSize >= 0 && totalBytes != claimedSize))) {
+            DeleteFileA(tempPath.c_str());
+            string error = "ERROR: Hash mismatch\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            logMessage("Upload rejected (hash mismatch): " + filename, LOG_WARNING);
+            return;
+        }
+
+        if (!blobStore->commitBlob(tempPath, hash) || !blobStore->link(filename, hash)) {
+            DeleteFileA(tempPath.c_str());
+            string error = "ERROR: Cannot store file\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+        rememberFileHash(filename, hash);
+        catalog->refresh(filename);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        string confirm = "UPLOAD_COMPLETE: " + to_string(totalBytes) + " bytes\n";
+        send(clientSocket, confirm.c_str(), confirm.length(), 0);
+
+        logMessage("File received: " + filename + " (" + to_string(totalBytes) + " bytes in "
+            + to_string(duration.count()) + " ms, blob " + hash.substr(0, 16) + ")");
+    }
+
+    void collectGarbage(SOCKET clientSocket) {
+        if (!blobStore) {
+            string error = "ERROR: Deduplicated storage is disabled\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        // Сборка мусора - команда администратора: только с самого сервера
+        sockaddr_in peer;
+        int peerLength = sizeof(peer);
+        if (getpeername(clientSocket, (sockaddr*)&peer, &peerLength) != 0
+            || peer.sin_family != AF_INET || (ntohl(peer.sin_addr.s_addr) >> 24) != 127) {
+            string error = "ERROR: GC is only allowed from the server host\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            logMessage("GC refused for a remote client", LOG_WARNING);
+            return;
+        }
+
+        int removed = 0;
+        long long freed = 0;
+        blobStore->collectGarbage(removed, freed);
+
+        string response = "GC_COMPLETE: " + to_string(removed) + " blobs, " + to_string(freed) + " bytes freed\n";
+        send(clientSocket, response.c_str(), response.length(), 0);
+
+        logMessage("Garbage collection: " + to_string(removed) + " blobs removed (" + formatFileSize(freed) + ")");
+    }
+
+    bool sendAll(SOCKET clientSocket, const char* data, size_t length) {
+        while (length > 0) {
+            int sent = send(clientSocket, data, static_cast<int>(min(length, static_cast<size_t>(1 << 20))), 0);
+            if (sent == SOCKET_ERROR) {
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    // Временные файлы сборки лежат в server_files\.tmp - это каталог, LIST его не показывает
+    string newTempFilePath() {
+        static atomic<unsigned long long> counter(0);
+        string tempDir = exePath + "\\" + serverDirectory + "\\.tmp";
+        CreateDirectoryA(tempDir.c_str(), NULL);
+        return tempDir + "\\" + to_string(GetCurrentThreadId()) + "-" + to_string(++counter) + ".part";
+    }
+
+    static bool readAt(HANDLE hFile, unsigned long long offset, char* out, size_t length) {
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(offset);
+        if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN)) {
+            return false;
+        }
+        while (length > 0) {
+            DWORD bytesRead = 0;
+            if (!ReadFile(hFile, out, static_cast<DWORD>(length), &bytesRead, NULL) || bytesRead == 0) {
+                return false;
+            }
+            out += bytesRead;
+            length -= bytesRead;
+        }
+        return true;
+    }
+
+    // Разбиение файла на чанки - из индекса, если файл не менялся с последнего раза
+    bool ensureRecipe(const string& filename, vector<CdcChunk>& chunks, long long& size, unsigned long long& mtime) {
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+        if (!getFileStat(fullPath, size, mtime)) {
+            return false;
+        }
+        if (chunkIndex.getRecipe(filename, size, mtime, chunks)) {
+            return true;
+        }
+
+        if (!FastCdc::chunkFile(fullPath, chunks)) {
+            return false;
+        }
+
+        long long sizeAfter = 0;
+        unsigned long long mtimeAfter = 0;
+        if (getFileStat(fullPath, sizeAfter, mtimeAfter) && sizeAfter == size && mtimeAfter == mtime) {
+            chunkIndex.setRecipe(filename, size, mtime, chunks);
+        }
+        return true;
+    }
+
+    // Фоновая индексация файлов, чтобы дедупликация работала и между разными файлами
+    void indexExistingFiles() {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+
+        // Все файлы вместе с подкаталогами - из каталога в памяти
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+
+        auto startTime = chrono::steady_clock::now();
+        for (size_t i = 0; i < files->entries.size() && running; i++) {
+            vector<CdcChunk> chunks;
+            long long size = 0;
+            unsigned long long mtime = 0;
+            ensureRecipe(files->entries[i].name, chunks, size, mtime);
+        }
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        size_t indexedFiles = 0;
+        size_t indexedChunks = 0;
+        chunkIndex.getStats(indexedFiles, indexedChunks);
+        logMessage("Chunk index ready: " + to_string(indexedFiles) + " files, " + to_string(indexedChunks)
+            + " unique chunks (" + to_string(duration.count()) + " ms)");
+
+        // Хеши всех файлов для MERKLE - заранее, чтобы первое сравнение деревьев не ждало их
+        if (running) {
+            lock_guard<mutex> lock(merkleMutex);
+            updateMerkleIndex();
+        }
+    }
+
+    // Готовый временный файл становится файлом name (через хранилище блобов, если оно включено)
+    bool installFile(const string& tempPath, const string& filename) {
+        invalidateFileHash(filename);
+
+        if (blobStore) {
+            string hash;
+            if (!Blake3::hashFile(tempPath, hash) || !blobStore->commitBlob(tempPath, hash) || !blobStore->link(filename, hash)) {
+                DeleteFileA(tempPath.c_str());
+                return false;
+            }
+            rememberFileHash(filename, hash);
+            catalog->refresh(filename);
+            return true;
+        }
+
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+        PathTree::createParentDirectories(exePath + "\\" + serverDirectory, filename);
+        if (!MoveFileExA(tempPath.c_str(), fullPath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileA(tempPath.c_str());
+            return false;
+        }
+        catalog->refresh(filename);
+        return true;
+    }
+
+    // CDCPUT <size> <count> <name>: клиент присылает список чанков (хеш и длина),
+    // сервер отвечает, каких у него нет, и получает только их
+    void receiveFileChunked(SOCKET clientSocket, const string& args) {
+        stringstream ss(args);
+        long long fileSize = -1;
+        long long count = -1;
+        ss >> fileSize >> count;
+        string filename;
+        getline(ss >> ws, filename);
+
+        if (fileSize < 0 || count < 0 || count > fileSize / static_cast<long long>(FastCdc::MIN_SIZE) + 1 || !isSafeFilename(filename)) {
+            string error = "ERROR: Usage: CDCPUT <size> <count> <name>\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        logMessage("Receiving chunked file: " + filename + " (" + to_string(count) + " chunks)");
+
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        // Размер и число чанков пришли от клиента: список растет по мере чтения строк,
+        // а не выделяется заранее под заявленное число
+        SocketReader reader(clientSocket);
+        vector<CdcChunk> chunks;
+        chunks.reserve(static_cast<size_t>(min(count, 4096LL)));
+        unsigned long long offset = 0;
+        for (long long i = 0; i < count; i++) {
+            string line;
+            long long length = 0;
+            if (!reader.readLine(line)) {
+                logMessage("Chunk list truncated: " + filename, LOG_WARNING);
+                return;
+            }
+            CdcChunk chunk;
+            stringstream ls(line);
+            ls >> chunk.hash >> length;
+            if (ls.fail() || length <= 0 || length > static_cast<long long>(FastCdc::MAX_SIZE)
+                || chunk.hash.length() != FastCdc::HASH_HEX_LEN
+                || offset + length > static_cast<unsigned long long>(fileSize)) {
+                string error = "ERROR: Invalid chunk list\n";
+                send(clientSocket, error.c_str(), error.length(), 0);
+                return;
+            }
+            chunk.offset = offset;
+            chunk.length = static_cast<unsigned int>(length);
+            offset += length;
+            chunks.push_back(chunk);
+        }
+
+        if (offset != static_cast<unsigned long long>(fileSize)) {
+            string error = "ERROR: Chunk sizes do not add up\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        // Старая версия этого же файла - главный источник совпадающих чанков
+        {
+            vector<CdcChunk> previous;
+            long long previousSize = 0;
+            unsigned long long previousMtime = 0;
+            ensureRecipe(filename, previous, previousSize, previousMtime);
+        }
+
+        // Файлы-источники держим открытыми без FILE_SHARE_WRITE, чтобы их не изменили до конца сборки
+        map<string, HANDLE> sources;
+        map<string, unsigned long long> placed;
+        vector<ChunkLocation> reuse(chunks.size());
+        vector<char> needed(chunks.size(), 0);
+        string needList;
+        size_t neededCount = 0;
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (placed.count(chunks[i].hash)) {
+                continue;
+            }
+            placed[chunks[i].hash] = chunks[i].offset;
+
+            ChunkLocation loc;
+            long long indexedSize = 0;
+            unsigned long long indexedMtime = 0;
+            bool found = chunkIndex.findChunk(chunks[i].hash, loc, indexedSize, indexedMtime) && loc.length == chunks[i].length;
+
+            if (found && !sources.count(loc.filename)) {
+                string sourcePath = exePath + "\\" + serverDirectory + "\\" + loc.filename;
+                HANDLE hSource = CreateFileA(sourcePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                long long currentSize = 0;
+                unsigned long long currentMtime = 0;
+                if (hSource != INVALID_HANDLE_VALUE
+                    && (!getFileStat(sourcePath, currentSize, currentMtime) || currentSize != indexedSize || currentMtime != indexedMtime)) {
+                    CloseHandle(hSource);
+                    hSource = INVALID_HANDLE_VALUE;
+                }
+                sources[loc.filename] = hSource;
+            }
+
+            if (found && sources[loc.filename] != INVALID_HANDLE_VALUE) {
+                reuse[i] = loc;
+            }
+            else {
+                needed[i] = 1;
+                neededCount++;
+                needList += to_string(i) + " ";
+            }
+        }
+
+        string needMsg = "NEED " + to_string(neededCount) + "\n" + needList + "\n";
+        sendAll(clientSocket, needMsg.c_str(), needMsg.length());
+
+        auto startTime = chrono::steady_clock::now();
+
+        string tempPath = newTempFilePath();
+        HANDLE hOut = CreateFileA(tempPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        bool ok = hOut != INVALID_HANDLE_VALUE;
+
+        vector<char> buffer(FastCdc::MAX_SIZE);
+        long long transferred = 0;
+        for (size_t i = 0; ok && i < chunks.size(); i++) {
+            const CdcChunk& chunk = chunks[i];
+            if (needed[i]) {
+                ok = reader.readExact(buffer.data(), chunk.length)
+                    && FastCdc::chunkHash(reinterpret_cast<const uint8_t*>(buffer.data()), chunk.length) == chunk.hash;
+                transferred += chunk.length;
+            }
+            else if (placed[chunk.hash] < chunk.offset) {
+                // Повтор чанка внутри этого же файла - уже записан выше
+                ok = readAt(hOut, placed[chunk.hash], buffer.data(), chunk.length);
+            }
+            else {
+                ok = readAt(sources[reuse[i].filename], reuse[i].offset, buffer.data(), chunk.length);
+            }
+
+            LARGE_INTEGER position;
+            position.QuadPart = static_cast<LONGLONG>(chunk.offset);
+            DWORD written = 0;
+            ok = ok && SetFilePointerEx(hOut, position, NULL, FILE_BEGIN)
+                && WriteFile(hOut, buffer.data(), chunk.length, &written, NULL) && written == chunk.length;
+        }
+
+        for (auto it = sources.begin(); it != sources.end(); ++it) {
+            if (it->second != INVALID_HANDLE_VALUE) {
+                CloseHandle(it->second);
+            }
+        }
+        if (hOut != INVALID_HANDLE_VALUE) {
+            CloseHandle(hOut);
+        }
+
+        if (!ok || !installFile(tempPath, filename)) {
+            DeleteFileA(tempPath.c_str());
+            string error = "ERROR: Chunked upload failed\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            logMessage("Chunked upload failed: " + filename, LOG_WARNING);
+            return;
+        }
+
+        long long newSize = 0;
+        unsigned long long newMtime = 0;
+        if (getFileStat(exePath + "\\" + serverDirectory + "\\" + filename, newSize, newMtime)) {
+            chunkIndex.setRecipe(filename, newSize, newMtime, chunks);
+        }
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        string confirm = "UPLOAD_COMPLETE: " + to_string(fileSize) + " bytes (" + to_string(transferred) + " transferred)\n";
+        send(clientSocket, confirm.c_str(), confirm.length(), 0);
+
+        logMessage("Chunked file received: " + filename + " (" + formatFileSize(fileSize) + ", "
+            + formatFileSize(transferred) + " transferred in " + to_string(duration.count()) + " ms)");
+    }
+
+    // CDCGET <name>: сервер отдает список чанков, клиент отвечает, каких у него нет
+    // (WANT <k> и номера), и получает только их подряд
+    void sendFileChunked(SOCKET clientSocket, const string& filename) {
+        vector<CdcChunk> chunks;
+        long long fileSize = 0;
+        unsigned long long mtime = 0;
+        if (!isSafeFilename(filename) || !ensureRecipe(filename, chunks, fileSize, mtime)) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+        HANDLE hFile = CreateFileA(fullPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        long long currentSize = 0;
+        unsigned long long currentMtime = 0;
+        if (hFile == INVALID_HANDLE_VALUE || !getFileStat(fullPath, currentSize, currentMtime)
+            || currentSize != fileSize || currentMtime != mtime) {
+            if (hFile != INVALID_HANDLE_VALUE) {
+                CloseHandle(hFile);
+            }
+            string error = "ERROR: File is being modified\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string recipe = "RECIPE " + to_string(fileSize) + " " + to_string(chunks.size()) + "\n";
+        for (size_t i = 0; i < chunks.size(); i++) {
+            recipe += chunks[i].hash + " " + to_string(chunks[i].length) + "\n";
+        }
+        if (!sendAll(clientSocket, recipe.c_str(), recipe.length())) {
+            CloseHandle(hFile);
+            return;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        SocketReader reader(clientSocket);
+        string wantLine;
+        string indexLine;
+        long long wantCount = -1;
+        if (!reader.readLine(wantLine) || wantLine.find("WANT ") != 0 || !reader.readLine(indexLine, 64 * 1024 * 1024)) {
+            CloseHandle(hFile);
+            logMessage("Chunked download cancelled: " + filename, LOG_WARNING);
+            return;
+        }
+        wantCount = atoll(wantLine.c_str() + 5);
+
+        auto startTime = chrono::steady_clock::now();
+
+        stringstream indices(indexLine);
+        vector<char> buffer(FastCdc::MAX_SIZE);
+        long long sentBytes = 0;
+        long long index = 0;
+        long long sentChunks = 0;
+        while (sentChunks < wantCount && indices >> index) {
+            if (index < 0 || index >= static_cast<long long>(chunks.size())) {
+                break;
+            }
+            const CdcChunk& chunk = chunks[static_cast<size_t>(index)];
+            if (!readAt(hFile, chunk.offset, buffer.data(), chunk.length)
+                || !sendAll(clientSocket, buffer.data(), chunk.length)) {
+                break;
+            }
+            sentBytes += chunk.length;
+            sentChunks++;
+        }
+        CloseHandle(hFile);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Chunked file sent: " + filename + " (" + to_string(sentChunks) + "/" + to_string(chunks.size())
+            + " chunks, " + formatFileSize(sentBytes) + " of " + formatFileSize(fileSize) + " in "
+            + to_string(duration.count()) + " ms)");
+    }
+
+    // DELTAGET <blockSize> <count> <basisSize> <name>: клиент присылает сигнатуры блоков
+    // своей старой копии, сервер отвечает дельтой своего файла относительно нее
+    void sendFileDelta(SOCKET clientSocket, const string& args) {
+        stringstream ss(args);
+        long long blockSize = 0;
+        long long count = -1;
+        long long basisSize = -1;
+        ss >> blockSize >> count >> basisSize;
+        string filename;
+        getline(ss >> ws, filename);
+
+        if (blockSize < 512 || blockSize > 1024 * 1024 || basisSize < 0 || basisSize > RsyncDelta::MAX_BASIS_SIZE
+            || count != (basisSize + blockSize - 1) / blockSize || !isSafeFilename(filename)) {
+            string error = "ERROR: Usage: DELTAGET <blockSize> <count> <basisSize> <name>\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string hash;
+        long long fileSize = 0;
+        if (!getFileHash(filename, hash, fileSize)) {
+            string error = "ERROR: File not found\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        SocketReader reader(clientSocket);
+        vector<BlockSignature> signatures;
+        if (!RsyncDelta::readSignatures(reader, static_cast<size_t>(count), static_cast<size_t>(blockSize), basisSize, signatures)) {
+            logMessage("Delta download cancelled: " + filename, LOG_WARNING);
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+        SocketWriter writer(clientSocket);
+        long long literalBytes = 0;
+        if (!RsyncDelta::sendDelta(fullPath, hash, static_cast<size_t>(blockSize), signatures, writer, fileSize, literalBytes)) {
+            logMessage("Delta download failed: " + filename, LOG_WARNING);
+            return;
+        }
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Delta sent: " + filename + " (" + formatFileSize(fileSize) + ", "
+            + formatFileSize(literalBytes) + " literal in " + to_string(duration.count()) + " ms)");
+    }
+
+    // DELTAPUT <size> <name>: сервер отдает сигнатуры своей копии (SIGS <blockSize> <count> <basisSize>),
+    // клиент присылает дельту, новый файл собирается во временном файле и проверяется по BLAKE3
+    void receiveFileDelta(SOCKET clientSocket, const string& args) {
+        stringstream ss(args);
+        long long fileSize = -1;
+        ss >> fileSize;
+        string filename;
+        getline(ss >> ws, filename);
+
+        if (fileSize < 0 || !isSafeFilename(filename)) {
+            string error = "ERROR: Usage: DELTAPUT <size> <name>\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            return;
+        }
+
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+        long long basisSize = 0;
+        unsigned long long basisMtime = 0;
+        if (!getFileStat(fullPath, basisSize, basisMtime)) {
+            basisSize = 0;
+        }
+
+        // Блок подбирается под новый размер, если старой копии нет
+        size_t blockSize = RsyncDelta::chooseBlockSize(basisSize > 0 ? basisSize : fileSize);
+        vector<BlockSignature> signatures;
+        if (basisSize > 0 && !RsyncDelta::computeSignatures(fullPath, blockSize, signatures)) {
+            signatures.clear();
+        }
+        basisSize = 0;
+        for (size_t i = 0; i < signatures.size(); i++) {
+            basisSize += signatures[i].length;
+        }
+
+        logMessage("Receiving delta: " + filename + " (" + to_string(signatures.size()) + " blocks of "
+            + formatFileSize(static_cast<long long>(blockSize)) + ")");
+
+        SocketWriter writer(clientSocket);
+        if (!writer.write("SIGS " + to_string(blockSize) + " " + to_string(signatures.size()) + " " + to_string(basisSize) + "\n")
+            || !RsyncDelta::writeSignatures(writer, signatures)) {
+            return;
+        }
+
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+        auto startTime = chrono::steady_clock::now();
+
+        SocketReader reader(clientSocket);
+        string tempPath = newTempFilePath();
+        long long receivedSize = 0;
+        long long literalBytes = 0;
+        bool ok = RsyncDelta::applyDelta(reader, fullPath, blockSize, tempPath, receivedSize, literalBytes)
+            && receivedSize == fileSize;
+
+        if (!ok || !installFile(tempPath, filename)) {
+            DeleteFileA(tempPath.c_str());
+            string error = "ERROR: Delta upload failed\n";
+            send(clientSocket, error.c_str(), error.length(), 0);
+            logMessage("Delta upload failed: " + filename, LOG_WARNING);
+            return;
+        }
+        chunkIndex.removeFile(filename);
+
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+
+        string confirm = "UPLOAD_COMPLETE: " + to_string(fileSize) + " bytes (" + to_string(literalBytes) + " transferred)\n";
+        send(clientSocket, confirm.c_str(), confirm.length(), 0);
+
+        logMessage("Delta received: " + filename + " (" + formatFileSize(fileSize) + ", "
+            + formatFileSize(literalBytes) + " literal in " + to_string(duration.count()) + " ms)");
+    }
+
+    struct PrefetchSlot {
+        string filename;
+        long long size;
+        vector<char> data;
+        int state;          // 0 - читается, 1 - в памяти, 2 - нет файла, 3 - большой, отдается с диска
+    };
+
+    // Список файлов для MGET: маска с * и ? по путям каталога в памяти ("docs/*.txt";
+    // * захватывает и '/'). Файлы, начинающиеся с точки, не отдаем
+    void findMatchingFiles(const string& pattern, vector<string>& names) {
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        for (size_t i = 0; i < files->entries.size(); i++) {
+            const string& filename = files->entries[i].name;
+            if (filename[0] != '.' && matchGlob(pattern.c_str(), filename.c_str())) {
+                names.push_back(filename);
+            }
+        }
+    }
+
+    // MGET <маска> или MGET без аргументов (после READY клиент присылает имена по одному
+    // в строке, пустая строка - конец списка). Ответ: для каждого файла "FILE <size> <name>\n"
+    // и данные или "MISSING <name>\n", в конце "END <files> <bytes>\n". Файлы читаются
+    // заранее несколькими потоками, отправка идет в порядке списка
+    void sendMultipleFiles(SOCKET clientSocket, const string& pattern) {
+        vector<string> names;
+        if (!pattern.empty()) {
+            findMatchingFiles(pattern, names);
+        }
+        else {
+            string readyMsg = "READY\n";
+            send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+
+            DWORD timeout = 30000;
+            setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+            // Список нужен целиком (по слоту на файл), поэтому он ограничен и по числу имен, и по размеру
+            const size_t MAX_NAMES = 100000;
+            const size_t MAX_LIST_BYTES = 16 * 1024 * 1024;
+            SocketReader reader(clientSocket);
+            string line;
+            size_t listBytes = 0;
+            while (reader.readLine(line, 4096) && !line.empty()) {
+                listBytes += line.length() + 1;
+                if (names.size() >= MAX_NAMES || listBytes > MAX_LIST_BYTES) {
+                    string error = "ERROR: File list too long (limit " + to_string(MAX_NAMES) + " names, "
+                        + formatFileSize(static_cast<long long>(MAX_LIST_BYTES)) + ")\n";
+                    send(clientSocket, error.c_str(), error.length(), 0);
+                    logMessage("Batch download refused: file list too long", LOG_WARNING);
+                    return;
+                }
+                names.push_back(line);
+            }
         }
 
-        return "";
-    }
-
-    void handleClient(SOCKET clientSocket, sockaddr_in clientAddr) {
-        char ipstr[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(clientAddr.sin_addr), ipstr, sizeof(ipstr));
+        logMessage("Batch download: " + to_string(names.size()) + " files");
+        auto startTime = chrono::steady_clock::now();
 
-        logMessage("Client connected from: " + string(ipstr));
+        const size_t WINDOW = 64;
+        const long long SMALL_FILE = 1024 * 1024;
 
-        DWORD sendTimeout = 30000;
-        DWORD recvTimeout = 30000;
-        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, (char*)&sendTimeout, sizeof(sendTimeout));
-        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&recvTimeout, sizeof(recvTimeout));
+        vector<PrefetchSlot> slots(names.size());
+        mutex slotMutex;
+        condition_variable slotReady;
+        condition_variable slotFreed;
+        size_t sendIndex = 0;
+        atomic<size_t> nextIndex(0);
+        atomic<bool> cancelled(false);
 
-        bool stayConnected = true;
+        auto reader = [&]() {
+            while (!cancelled) {
+                size_t index = nextIndex.fetch_add(1);
+                if (index >= slots.size()) {
+                    break;
+                }
+                {
+                    // Вперед отправителя читаем не больше WINDOW файлов
+                    unique_lock<mutex> lock(slotMutex);
+                    slotFreed.wait(lock, [&]() { return cancelled || index < sendIndex + WINDOW; });
+                }
 
-        while (stayConnected && running) {
-            string command = readCommand(clientSocket);
+                PrefetchSlot slot;
+                slot.filename = names[index];
+                slot.size = 0;
+                slot.state = 2;
 
-            if (!command.empty()) {
-                if (command == "LIST") {
-                    sendFileListAndClose(clientSocket);
-                    stayConnected = false;
-                }
-                else if (command.find("GET ") == 0) {
-                    // НОВАЯ команда - чистые данные без заголовков
-                    string filename = command.substr(4);
-                    sendFileClean(clientSocket, filename);
-                    stayConnected = false;
-                }
-                else if (command.find("DOWNLOAD ") == 0) {
-                    // СОВМЕСТИМОСТЬ - тоже чистые данные
-                    string filename = command.substr(9);
-                    sendFileClean(clientSocket, filename);
-                    stayConnected = false;
-                }
-                else if (command.find("INFO ") == 0) {
-                    // Получить информацию о файле (размер)
-                    string filename = command.substr(5);
-                    sendFileInfo(clientSocket, filename);
-                    stayConnected = false;
-                }
-                else if (command.find("UPLOAD ") == 0) {
-                    string filename = command.substr(7);
-                    receiveFile(clientSocket, filename);
-                    stayConnected = false;
-                }
-                else if (command == "PING" || command == "TEST") {
-                    string response = "PONG\n";
-                    send(clientSocket, response.c_str(), response.length(), 0);
-                    stayConnected = false;
-                }
-                else if (command == "EXIT" || command == "QUIT" || command == "DISCONNECT") {
-                    logMessage("Client requested disconnect");
-                    stayConnected = false;
-                    string response = "GOODBYE\n";
-                    send(clientSocket, response.c_str(), response.length(), 0);
+                string fullPath = exePath + "\\" + serverDirectory + "\\" + slot.filename;
+                HANDLE hFile = isSafeFilename(slot.filename) && slot.filename[0] != '.'
+                    ? CreateFileA(fullPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL)
+                    : INVALID_HANDLE_VALUE;
+                LARGE_INTEGER fileSize;
+                if (hFile != INVALID_HANDLE_VALUE && GetFileSizeEx(hFile, &fileSize)) {
+                    slot.size = fileSize.QuadPart;
+                    slot.state = 3;
+                    if (slot.size <= SMALL_FILE) {
+                        slot.data.resize(static_cast<size_t>(slot.size));
+                        DWORD bytesRead = 0;
+                        if (slot.size == 0 || (ReadFile(hFile, slot.data.data(), static_cast<DWORD>(slot.size), &bytesRead, NULL)
+                            && bytesRead == slot.size)) {
+                            slot.state = 1;
+                        }
+                        else {
+                            slot.data.clear();
+                        }
+                    }
                 }
-                else {
-                    string response = "ERROR: Unknown command\n";
-                    send(clientSocket, response.c_str(), response.length(), 0);
-                    stayConnected = false;
+                if (hFile != INVALID_HANDLE_VALUE) {
+                    CloseHandle(hFile);
                 }
+
+                lock_guard<mutex> lock(slotMutex);
+                slots[index] = move(slot);
+                slotReady.notify_all();
             }
-            else if (command == "DISCONNECT") {
-                stayConnected = false;
-            }
-            else {
-                Sleep(10);
-            }
-        }
+        };
 
-        Sleep(50);
-        closesocket(clientSocket);
-        logMessage("Client disconnected: " + string(ipstr));
-    }
+        unsigned int threadCount = thread::hardware_concurrency();
+        threadCount = threadCount < 2 ? 2 : (threadCount > 8 ? 8 : threadCount);
+        if (threadCount > slots.size()) {
+            threadCount = static_cast<unsigned int>(slots.size());
+        }
+        vector<thread> readers;
+        for (unsigned int i = 0; i < threadCount; i++) {
+            readers.push_back(thread(reader));
+        }
 
-    void sendFileListAndClose(SOCKET clientSocket) {
-        string fullServerPath = exePath + "\\" + serverDirectory;
+        SocketWriter writer(clientSocket, 256 * 1024);
+        long long sentFiles = 0;
+        long long sentBytes = 0;
+        vector<char> buffer;
+        bool ok = true;
 
-        stringstream fileList;
-        fileList << "FILES ON SERVER\n";
-        fileList << "===============\n\n";
+        for (size_t i = 0; ok && i < slots.size(); i++) {
+            PrefetchSlot slot;
+            {
+                unique_lock<mutex> lock(slotMutex);
+                slotReady.wait(lock, [&]() { return slots[i].state != 0; });
+                slot = move(slots[i]);
+                slots[i].state = 2;
+                sendIndex = i + 1;
+                slotFreed.notify_all();
+            }
 
-        WIN32_FIND_DATAA findFileData;
-        string searchPath = fullServerPath + "\\*";
-        HANDLE hFind = FindFirstFileA(searchPath.c_str(), &findFileData);
+            if (slot.state == 2) {
+                ok = writer.write("MISSING " + slot.filename + "\n");
+                continue;
+            }
 
-        if (hFind == INVALID_HANDLE_VALUE) {
-            fileList << "No files available.\n";
-            string response = fileList.str();
-            send(clientSocket, response.c_str(), response.length(), 0);
-            return;
+            ok = writer.write("FILE " + to_string(slot.size) + " " + slot.filename + "\n");
+            if (slot.state == 1) {
+                ok = ok && writer.write(slot.data.data(), slot.data.size());
+            }
+            else {
+                // Большой файл идет прямо с диска; если он стал короче, поток обрывается -
+                // клиент увидит неполный файл, а не сдвинутую разметку
+                string fullPath = exePath + "\\" + serverDirectory + "\\" + slot.filename;
+                ifstream file(fullPath, ios::binary);
+                buffer.resize(1024 * 1024);
+                long long remaining = slot.size;
+                while (ok && remaining > 0) {
+                    size_t n = remaining < static_cast<long long>(buffer.size()) ? static_cast<size_t>(remaining) : buffer.size();
+                    file.read(buffer.data(), n);
+                    ok = static_cast<size_t>(file.gcount()) == n && writer.write(buffer.data(), n);
+                    remaining -= n;
+                }
+            }
+            sentFiles++;
+            sentBytes += slot.size;
         }
 
-        int fileCount = 0;
-        long long totalSize = 0;
-        vector<pair<string, long long>> files;
+        if (ok) {
+            writer.write("END " + to_string(sentFiles) + " " + to_string(sentBytes) + "\n");
+            writer.flush();
+        }
 
-        do {
-            if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                string filename = findFileData.cFileName;
-                long long fileSize = (static_cast<long long>(findFileData.nFileSizeHigh) << 32) | findFileData.nFileSizeLow;
-                files.push_back(make_pair(filename, fileSize));
-                fileCount++;
-                totalSize += fileSize;
-            }
-        } while (FindNextFileA(hFind, &findFileData) != 0);
+        {
+            lock_guard<mutex> lock(slotMutex);
+            cancelled = true;
+            slotFreed.notify_all();
+        }
+        for (size_t i = 0; i < readers.size(); i++) {
+            readers[i].join();
+        }
 
-        FindClose(hFind);
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Batch sent: " + to_string(sentFiles) + "/" + to_string(names.size()) + " files, "
+            + formatFileSize(sentBytes) + " in " + to_string(duration.count()) + " ms");
+    }
 
-        if (fileCount > 0) {
-            sort(files.begin(), files.end());
+    struct BulkJob {
+        string filename;
+        vector<char> data;
+        string tempPath;    // большой файл парсер уже записал во временный файл
+    };
 
-            fileList << "Total: " << fileCount << " files (" << formatFileSize(totalSize) << ")\n";
-            fileList << "Directory: " << fullServerPath << "\n";
-            fileList << "------------------------------\n";
+    // Запись одного файла из пакета; имя пока не появляется - ссылки и метаданные ставятся пачкой
+    bool storeBulkFile(const BulkJob& job, string& hash) {
+        string tempPath = job.tempPath;
+        if (tempPath.empty()) {
+            uint8_t digest[Blake3::OUT_LEN];
+            Blake3::hashBuffer(reinterpret_cast<const uint8_t*>(job.data.data()), job.data.size(), digest);
+            hash = Blake3::toHex(digest);
+            if (blobStore && blobStore->pinBlob(hash, static_cast<long long>(job.data.size()))) {
+                return true;
+            }
 
-            for (int i = 0; i < files.size(); i++) {
-                fileList << setw(2) << (i + 1) << ". "
-                    << setw(25) << left << files[i].first
-                    << " [" << setw(8) << right << formatFileSize(files[i].second) << "]\n";
+            tempPath = blobStore ? blobStore->newTempPath() : newTempFilePath();
+            HANDLE hFile = CreateFileA(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            DWORD written = 0;
+            bool ok = job.data.empty()
+                || (WriteFile(hFile, job.data.data(), static_cast<DWORD>(job.data.size()), &written, NULL) && written == job.data.size());
+            CloseHandle(hFile);
+            if (!ok) {
+                DeleteFileA(tempPath.c_str());
+                return false;
             }
         }
-        else {
-            fileList << "No files available.\n";
+        else if (!Blake3::hashFile(tempPath, hash)) {
+            DeleteFileA(tempPath.c_str());
+            return false;
         }
 
-        fileList << "===============\n";
-
-        string fileListStr = fileList.str();
-        send(clientSocket, fileListStr.c_str(), fileListStr.length(), 0);
+        if (blobStore) {
+            return blobStore->commitBlob(tempPath, hash);
+        }
 
-        logMessage("File list sent (" + to_string(fileListStr.length()) + " bytes)");
+        string fullPath = exePath + "\\" + serverDirectory + "\\" + job.filename;
+        PathTree::createParentDirectories(exePath + "\\" + serverDirectory, job.filename);
+        if (!MoveFileExA(tempPath.c_str(), fullPath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileA(tempPath.c_str());
+            return false;
+        }
+        return true;
     }
 
-    void sendFileInfo(SOCKET clientSocket, const string& filename) {
-        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+    // BULKPUT: после READY клиент шлет поток "FILE <size> <name>\n" + данные, в конце "END\n".
+    // Поток соединения только разбирает поток, файлы пишет пул потоков; ссылки на блобы,
+    // кеш хешей и индекс чанков обновляются пачками по BATCH файлов
+    void receiveBulk(SOCKET clientSocket) {
+        const long long SMALL_FILE = 1024 * 1024;
+        const long long MAX_QUEUED = 64 * 1024 * 1024;
+        const size_t BATCH = 512;
 
-        ifstream file(fullPath, ios::binary | ios::ate);
-        if (!file) {
-            string error = "ERROR: File not found\n";
-            send(clientSocket, error.c_str(), error.length(), 0);
-            return;
-        }
+        logMessage("Receiving bulk upload");
 
-        streamsize fileSize = file.tellg();
-        file.close();
+        string readyMsg = "READY\n";
+        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
 
-        // Проверяем, существует ли файл для получения даты
-        WIN32_FIND_DATAA findData;
-        string findPath = exePath + "\\" + serverDirectory + "\\" + filename;
-        HANDLE hFind = FindFirstFileA(findPath.c_str(), &findData);
+        DWORD timeout = 30000;
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
 
-        stringstream info;
-        info << "FILE INFO: " << filename << "\n";
-        info << "Size: " << formatFileSize(fileSize) << " (" << fileSize << " bytes)\n";
+        auto startTime = chrono::steady_clock::now();
 
-        if (hFind != INVALID_HANDLE_VALUE) {
-            FILETIME ftCreate = findData.ftCreationTime;
-            FILETIME ftAccess = findData.ftLastAccessTime;
-            FILETIME ftWrite = findData.ftLastWriteTime;
-
-            SYSTEMTIME stUTC, stLocal;
-            FileTimeToSystemTime(&ftWrite, &stUTC);
-            SystemTimeToTzSpecificLocalTime(NULL, &stUTC, &stLocal);
-
-            info << "Modified: " << setfill('0')
-                << setw(2) << stLocal.wDay << "."
-                << setw(2) << stLocal.wMonth << "."
-                << stLocal.wYear << " "
-                << setw(2) << stLocal.wHour << ":"
-                << setw(2) << stLocal.wMinute << ":"
-                << setw(2) << stLocal.wSecond << "\n";
+        deque<BulkJob> jobs;
+        mutex jobMutex;
+        condition_variable jobReady;
+        condition_variable jobTaken;
+        long long queuedBytes = 0;
+        bool finished = false;
 
-            FindClose(hFind);
-        }
+        vector<pair<string, string>> pending;
+        mutex pendingMutex;
+        atomic<long long> storedFiles(0);
+        atomic<long long> failedFiles(0);
 
-        info << "===============\n";
+        auto applyBatch = [&](const vector<pair<string, string>>& batch) {
+            if (batch.empty()) {
+                return;
+            }
+            vector<pair<string, string>> linked;
+            if (blobStore) {
+                vector<char> ok;
+                blobStore->linkAll(batch, ok);
+                for (size_t i = 0; i < batch.size(); i++) {
+                    if (ok[i]) {
+                        linked.push_back(batch[i]);
+                    }
+                }
+                failedFiles += static_cast<long long>(batch.size() - linked.size());
+            }
+            else {
+                linked = batch;
+            }
 
-        string infoStr = info.str();
-        send(clientSocket, infoStr.c_str(), infoStr.length(), 0);
+            vector<string> names;
+            for (size_t i = 0; i < linked.size(); i++) {
+                names.push_back(linked[i].first);
+            }
+            chunkIndex.removeFiles(names);
+            rememberFileHashes(linked);
+            catalog->refresh(names);
+            storedFiles += static_cast<long long>(linked.size());
+        };
 
-        logMessage("Sent file info for: " + filename + " (" + to_string(fileSize) + " bytes)");
-    }
+        auto writerThread = [&]() {
+            while (true) {
+                BulkJob job;
+                {
+                    unique_lock<mutex> lock(jobMutex);
+                    jobReady.wait(lock, [&]() { return !jobs.empty() || finished; });
+                    if (jobs.empty()) {
+                        break;
+                    }
+                    job = move(jobs.front());
+                    jobs.pop_front();
+                    queuedBytes -= static_cast<long long>(job.data.size());
+                    jobTaken.notify_all();
+                }
 
-    void sendFileClean(SOCKET clientSocket, const string& filename) {
-        // ОТПРАВЛЯЕМ ТОЛЬКО ЧИСТЫЕ ДАННЫЕ ФАЙЛА - БЕЗ ЗАГОЛОВКОВ!
-        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+                string hash;
+                if (!storeBulkFile(job, hash)) {
+                    failedFiles++;
+                    continue;
+                }
 
-        logMessage("Sending CLEAN file: " + filename);
+                vector<pair<string, string>> batch;
+                {
+                    lock_guard<mutex> lock(pendingMutex);
+                    pending.push_back(make_pair(job.filename, hash));
+                    if (pending.size() >= BATCH) {
+                        batch.swap(pending);
+                    }
+                }
+                applyBatch(batch);
+            }
+        };
 
-        ifstream file(fullPath, ios::binary | ios::ate);
-        if (!file) {
-            string error = "ERROR: File not found\n";
-            send(clientSocket, error.c_str(), error.length(), 0);
-            return;
+        unsigned int threadCount = thread::hardware_concurrency();
+        threadCount = threadCount < 2 ? 2 : (threadCount > 8 ? 8 : threadCount);
+        vector<thread> writers;
+        for (unsigned int i = 0; i < threadCount; i++) {
+            writers.push_back(thread(writerThread));
         }
 
-        streamsize fileSize = file.tellg();
-        file.seekg(0, ios::beg);
-
-        logMessage("File size: " + to_string(fileSize) + " bytes");
+        SocketReader reader(clientSocket, 256 * 1024);
+        vector<char> buffer(1024 * 1024);
+        string line;
+        long long receivedFiles = 0;
+        long long receivedBytes = 0;
+        bool complete = false;
 
-        // ВАЖНО: НЕ отправляем заголовок SIZE: !!!
-        // Просто сразу начинаем отправлять данные файла
+        while (reader.readLine(line, 4096)) {
+            if (line == "END") {
+                complete = true;
+                break;
+            }
 
-        // Отправляем файл
-        const int BUFFER_SIZE = 65536;
-        char buffer[BUFFER_SIZE];
-        streamsize totalSent = 0;
+            size_t space = line.find(' ', 5);
+            if (line.find("FILE ") != 0 || space == string::npos) {
+                break;
+            }
+            long long fileSize = atoll(line.c_str() + 5);
+            if (fileSize < 0) {
+                break;
+            }
 
-        auto startTime = chrono::steady_clock::now();
+            BulkJob job;
+            job.filename = line.substr(space + 1);
+            bool valid = isSafeFilename(job.filename) && job.filename[0] != '.';
+            bool ok = true;
 
-        while (!file.eof()) {
-            file.read(buffer, BUFFER_SIZE);
-            streamsize bytesRead = file.gcount();
-            if (bytesRead > 0) {
-                int sent = send(clientSocket, buffer, bytesRead, 0);
-                if (sent == SOCKET_ERROR) {
-                    logMessage("Send error: " + to_string(WSAGetLastError()));
-                    break;
+            if (valid && fileSize <= SMALL_FILE) {
+                job.data.resize(static_cast<size_t>(fileSize));
+                ok = fileSize == 0 || reader.readExact(job.data.data(), job.data.size());
+            }
+            else {
+                // Большие файлы пишутся сразу на диск, недопустимые имена пропускаются
+                ofstream out;
+                if (valid) {
+                    job.tempPath = blobStore ? blobStore->newTempPath() : newTempFilePath();
+                    out.open(job.tempPath, ios::binary | ios::trunc);
                 }
-                totalSent += sent;
-
-                // Логируем прогресс для больших файлов
-                if (fileSize > 1024 * 1024) { // Для файлов > 1MB
-                    int percent = static_cast<int>((totalSent * 100) / fileSize);
-                    if (percent % 10 == 0) {
-                        logMessage("Sending: " + to_string(percent) + "%");
+                long long remaining = fileSize;
+                while (ok && remaining > 0) {
+                    size_t n = remaining < static_cast<long long>(buffer.size()) ? static_cast<size_t>(remaining) : buffer.size();
+                    ok = reader.readExact(buffer.data(), n);
+                    if (ok && valid) {
+                        out.write(buffer.data(), n);
                     }
+                    remaining -= n;
                 }
+                if (valid) {
+                    out.close();
+                    if (!ok || !out) {
+                        DeleteFileA(job.tempPath.c_str());
+                        valid = false;
+                    }
+                }
+            }
+
+            if (!ok) {
+                break;
+            }
+            receivedFiles++;
+            receivedBytes += fileSize;
+            if (!valid) {
+                failedFiles++;
+                continue;
             }
+
+            unique_lock<mutex> lock(jobMutex);
+            jobTaken.wait(lock, [&]() { return queuedBytes == 0 || queuedBytes + static_cast<long long>(job.data.size()) <= MAX_QUEUED; });
+            queuedBytes += static_cast<long long>(job.data.size());
+            jobs.push_back(move(job));
+            jobReady.notify_one();
         }
 
-        file.close();
+        {
+            lock_guard<mutex> lock(jobMutex);
+            finished = true;
+            jobReady.notify_all();
+        }
+        for (size_t i = 0; i < writers.size(); i++) {
+            writers[i].join();
+        }
+        applyBatch(pending);
 
-        auto endTime = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
 
-        logMessage("File sent CLEAN: " + filename + " (" + to_string(totalSent) + " bytes in "
-            + to_string(duration.count()) + " ms)");
+        string response = complete
+            ? "BULK_COMPLETE: " + to_string(storedFiles.load()) + " files, " + to_string(receivedBytes) + " bytes ("
+                + to_string(failedFiles.load()) + " failed)\n"
+            : "ERROR: Bulk upload interrupted (" + to_string(storedFiles.load()) + " files stored)\n";
+        send(clientSocket, response.c_str(), response.length(), 0);
+
+        logMessage("Bulk upload " + string(complete ? "received" : "interrupted") + ": " + to_string(storedFiles.load())
+            + "/" + to_string(receivedFiles) + " files, " + formatFileSize(receivedBytes) + " in "
+            + to_string(duration.count()) + " ms");
     }
 
-    void receiveFile(SOCKET clientSocket, const string& filename) {
-        string fullPath = exePath + "\\" + serverDirectory + "\\" + filename;
+    // Каталог и хеши из сохраненных метаданных; если сохранения нет - обычное сканирование
+    bool loadMetadata() {
+        auto startTime = chrono::steady_clock::now();
 
-        logMessage("Receiving file: " + filename);
+        vector<CatalogEntry> entries;
+        vector<CatalogEntry> directories;
+        map<string, HashCacheEntry> hashes;
+        if (!metadataStore->load(entries, directories, hashes, metadataDirectoryMtime, metadataSavedAt)) {
+            catalog->rescan();
+            return false;
+        }
 
-        // Отправляем готовность
-        string readyMsg = "READY\n";
-        send(clientSocket, readyMsg.c_str(), readyMsg.length(), 0);
+        size_t fileCount = entries.size();
+        size_t directoryCount = directories.size();
+        size_t hashCount = hashes.size();
+        catalog->load(entries, directories);
+        {
+            lock_guard<mutex> lock(hashCacheMutex);
+            hashCache.swap(hashes);
+        }
+        savedCatalogVersion = catalog->snapshot()->version;
+        savedHashGeneration = hashCacheGeneration.load();
 
-        ofstream file(fullPath, ios::binary);
-        if (!file) {
-            string error = "ERROR: Cannot create file\n";
-            send(clientSocket, error.c_str(), error.length(), 0);
-            return;
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Metadata loaded: " + to_string(fileCount) + " files in " + to_string(directoryCount + 1) + " directories, "
+            + to_string(hashCount) + " hashes (" + to_string(duration.count()) + " ms)");
+        return true;
+    }
+
+    // Время изменения каталога (getFileStat каталоги не принимает)
+    bool getDirectoryMtime(const string& fullPath, unsigned long long& mtime) {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA(fullPath.c_str(), GetFileExInfoStandard, &data)
+            || !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            return false;
         }
+        mtime = fileTimeToUInt64(data.ftLastWriteTime);
+        return true;
+    }
 
-        const int BUFFER_SIZE = 65536;
-        char buffer[BUFFER_SIZE];
-        int bytesReceived;
-        long long totalBytes = 0;
+    void saveMetadata() {
+        lock_guard<mutex> lock(metadataMutex);
 
-        DWORD timeout = 30000;
-        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        // Время каталога и момент сохранения берутся до снимка: все, что изменится позже,
+        // даст более новое время каталога и его перечитывание при следующем запуске
+        unsigned long long directoryMtime = 0;
+        getDirectoryMtime(exePath + "\\" + serverDirectory, directoryMtime);
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        unsigned long long savedAt = fileTimeToUInt64(now);
+
+        unsigned long long generation = hashCacheGeneration;
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        map<string, HashCacheEntry> hashes;
+        {
+            lock_guard<mutex> cacheLock(hashCacheMutex);
+            hashes = hashCache;
+        }
+
+        if (metadataStore->save(*files, hashes, directoryMtime, savedAt)) {
+            savedCatalogVersion = files->version;
+            savedHashGeneration = generation;
+        }
+    }
+
+    // Сверка загруженных метаданных с диском в фоне. Время изменения каталога меняется
+    // при создании, удалении и переименовании имен прямо в нем; если оно то же и было
+    // заметно раньше сохранения (уведомления успели дойти), каталог не перечитывается.
+    // Прямое содержимое изменившегося каталога сравнивается с деревом путей снимка
+    void reconcileMetadata() {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
 
         auto startTime = chrono::steady_clock::now();
+        if (!metadataLoaded) {
+            catalog->rescan();
+            auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+            logMessage("Catalog rescanned: " + to_string(catalog->snapshot()->entries.size()) + " files ("
+                + to_string(duration.count()) + " ms)");
+            saveMetadata();
+            return;
+        }
 
-        while (true) {
-            bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-            if (bytesReceived > 0) {
-                file.write(buffer, bytesReceived);
-                totalBytes += bytesReceived;
+        const unsigned long long SETTLE_TIME = 2ull * 10000000;     // 2 секунды в единицах FILETIME
+        string fullServerPath = exePath + "\\" + serverDirectory;
+        shared_ptr<const CatalogSnapshot> files = catalog->snapshot();
+        const PathTree& tree = files->tree();
+
+        vector<string> changed;
+        for (size_t i = 0; i <= files->directories.size(); i++) {
+            string path = i == 0 ? "" : files->directories[i - 1].name;
+            unsigned long long savedMtime = i == 0 ? metadataDirectoryMtime : files->directories[i - 1].mtime;
+            unsigned long long mtime = 0;
+            if (getDirectoryMtime(path.empty() ? fullServerPath : fullServerPath + "\\" + path, mtime)
+                && (mtime != savedMtime || mtime + SETTLE_TIME >= metadataSavedAt)) {
+                changed.push_back(path);
             }
-            else if (bytesReceived == 0) {
-                break;
+        }
+
+        if (changed.empty()) {
+            logMessage("Catalog is up to date with disk");
+            return;
+        }
+
+        // Файлы изменившихся каталогов перечитываются все, подкаталоги - только новые и исчезнувшие
+        vector<string> names;
+        for (size_t i = 0; i < changed.size(); i++) {
+            string prefix = changed[i].empty() ? "" : changed[i] + "/";
+            set<string> onDisk;
+            WIN32_FIND_DATAA findFileData;
+            HANDLE hFind = FindFirstFileA((fullServerPath + "\\" + prefix + "*").c_str(), &findFileData);
+            if (hFind != INVALID_HANDLE_VALUE) {
+                do {
+                    string name = findFileData.cFileName;
+                    if (name == "." || name == "..") {
+                        continue;
+                    }
+                    onDisk.insert(name);
+                    if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || files->findDirectory(prefix + name) == NULL) {
+                        names.push_back(prefix + name);
+                    }
+                } while (FindNextFileA(hFind, &findFileData) != 0);
+                FindClose(hFind);
             }
-            else {
-                int error = WSAGetLastError();
-                if (error == WSAETIMEDOUT) {
-                    break;
+
+            int node = tree.find(changed[i]);
+            for (uint32_t j = 0; node >= 0 && j < tree.childCount(node); j++) {
+                const string& name = tree.name(tree.child(node, j));
+                if (!onDisk.count(name)) {
+                    names.push_back(prefix + name);
                 }
-                logMessage("Receive error: " + to_string(error));
-                break;
             }
         }
+        catalog->refresh(names);
 
-        file.close();
-
-        auto endTime = chrono::steady_clock::now();
-        auto duration = chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
-
-        string confirm = "UPLOAD_COMPLETE: " + to_string(totalBytes) + " bytes\n";
-        send(clientSocket, confirm.c_str(), confirm.length(), 0);
+        auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime);
+        logMessage("Catalog reconciled: " + to_string(changed.size()) + " changed directories, " + to_string(names.size())
+            + " names checked (" + to_string(duration.count()) + " ms)");
+        saveMetadata();
+    }
 
-        logMessage("File received: " + filename + " (" + to_string(totalBytes) + " bytes in "
-            + to_string(duration.count()) + " ms)");
+    // Периодическое сохранение, если с прошлого раза что-то изменилось
+    void metadataSaverLoop() {
+        int seconds = 0;
+        while (running) {
+            Sleep(1000);
+            if (++seconds < 30) {
+                continue;
+            }
+            seconds = 0;
+            if (catalog->snapshot()->version != savedCatalogVersion || hashCacheGeneration != savedHashGeneration) {
+                saveMetadata();
+            }
+        }
     }
 
     void start() {
+        // Снимок уже есть (из метаданных или сканирования в конструкторе) - сверка идет в фоне
+        catalog->start(false);
+        thread reconciler(&FileServer::reconcileMetadata, this);
+        reconciler.detach();
+        thread saver(&FileServer::metadataSaverLoop, this);
+        saver.detach();
+
         logMessage("Server is ready and waiting for connections...");
 
+        thread indexer(&FileServer::indexExistingFiles, this);
+        indexer.detach();
+
         while (running) {
             sockaddr_in clientAddr;
             int clientAddrSize = sizeof(clientAddr);
 
             SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientAddrSize);
             if (clientSocket != INVALID_SOCKET) {
-                thread clientThread(&FileServer::handleClient, this, clientSocket, clientAddr);
+                thread clientThread(&FileServer::handleClient, this, clientSocket, clientAddr, chrono::steady_clock::now());
                 clientThread.detach();
             }
             else {
@@ -545,35 +6570,151 @@ public:
         }
     }
 
+    // Счетчики в текстовом формате Prometheus: GET /metrics на 127.0.0.1:<metricsPort>
+    bool startMetricsExporter(int metricsPort) {
+        metricsSocket = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<u_short>(metricsPort));
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (metricsSocket == INVALID_SOCKET || bind(metricsSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR
+            || listen(metricsSocket, 16) == SOCKET_ERROR) {
+            cerr << "Metrics exporter failed on port " << metricsPort << ": " << WSAGetLastError() << endl;
+            if (metricsSocket != INVALID_SOCKET) {
+                closesocket(metricsSocket);
+                metricsSocket = INVALID_SOCKET;
+            }
+            return false;
+        }
+
+        thread exporter(&FileServer::metricsLoop, this);
+        exporter.detach();
+        logMessage("Prometheus metrics on http://127.0.0.1:" + to_string(metricsPort) + "/metrics");
+        return true;
+    }
+
+    void metricsLoop() {
+        while (running) {
+            SOCKET client = accept(metricsSocket, NULL, NULL);
+            if (client == INVALID_SOCKET) {
+                Sleep(10);
+                continue;
+            }
+
+            DWORD timeout = 2000;
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+            SocketReader reader(client);
+            string requestLine;
+            string header;
+            bool ok = reader.readLine(requestLine, 8192);
+            while (ok && reader.readLine(header, 8192) && !header.empty()) {
+            }
+
+            string status = "200 OK";
+            string body;
+            if (requestLine.find("GET /metrics ") == 0 || requestLine == "GET /metrics") {
+                body = metrics->formatPrometheus();
+            }
+            else {
+                status = "404 Not Found";
+                body = "Not found\n";
+            }
+            string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+            sendAll(client, response.c_str(), response.length());
+            shutdown(client, SD_SEND);
+            closesocket(client);
+        }
+    }
+
     void stop() {
+        if (running) {
+            saveMetadata();
+        }
         running = false;
+        catalog->stop();
 
         if (serverSocket != INVALID_SOCKET) {
             closesocket(serverSocket);
             serverSocket = INVALID_SOCKET;
         }
+        if (metricsSocket != INVALID_SOCKET) {
+            closesocket(metricsSocket);
+            metricsSocket = INVALID_SOCKET;
+        }
 
         WSACleanup();
         logMessage("Server stopped");
     }
 
+    void setQuiet(bool value) {
+        quiet = value;
+    }
+
     ~FileServer() {
         stop();
     }
 };
 
-int main() {
+// FILE_SERVER_NO_MAIN - сервер подключается в другую программу (file bench) как библиотека
+#ifndef FILE_SERVER_NO_MAIN
+
+int main(int argc, char* argv[]) {
     int port = 8888;
     string directory = "server_files";
+    bool dedupStorage = false;
+    int metricsPort = 0;
+    int logLevel = LOG_INFO;
+    bool logJson = false;
+    int logRate = 2000;
+    double traceRate = 0;
+    string portInput;
+    bool portGiven = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            portInput = argv[++i];
+            portGiven = true;
+        }
+        else if (arg == "--dir" && i + 1 < argc) {
+            directory = argv[++i];
+        }
+        else if (arg == "--dedup") {
+            dedupStorage = true;
+        }
+        else if (arg == "--metrics-port" && i + 1 < argc) {
+            metricsPort = atoi(argv[++i]);
+        }
+        else if (arg == "--log-level" && i + 1 < argc && AsyncLogger::parseLevel(argv[i + 1]) >= 0) {
+            logLevel = AsyncLogger::parseLevel(argv[++i]);
+        }
+        else if (arg == "--log-json") {
+            logJson = true;
+        }
+        else if (arg == "--log-rate" && i + 1 < argc) {
+            logRate = atoi(argv[++i]);
+        }
+        else if (arg == "--trace-rate" && i + 1 < argc) {
+            traceRate = atof(argv[++i]);
+        }
+        else {
+            cout << "Usage: server [--port N] [--dir NAME] [--dedup] [--metrics-port N]" << endl;
+            cout << "              [--log-level debug|info|warning|error] [--log-json] [--log-rate N] [--trace-rate 0..1]" << endl;
+            return 1;
+        }
+    }
 
     cout << "=========================================" << endl;
     cout << "       CLEAN FILE SERVER v3.0" << endl;
     cout << "=========================================" << endl;
 
 
-    cout << "Enter server port [8888]: ";
-    string portInput;
-    getline(cin, portInput);
+    if (!portGiven) {
+        cout << "Enter server port [8888]: ";
+        getline(cin, portInput);
+    }
     if (!portInput.empty()) {
         try {
             port = stoi(portInput);
@@ -584,8 +6725,15 @@ int main() {
         }
     }
 
-    FileServer server(port, directory);
+    FileServer server(port, directory, dedupStorage);
+    server.setLogOptions(logLevel, logJson, logRate);
+    server.setTraceRate(traceRate);
+    server.saveTraceOnBreak();
+    if (metricsPort > 0) {
+        server.startMetricsExporter(metricsPort);
+    }
     server.start();
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file